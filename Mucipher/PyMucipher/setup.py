@@ -17,6 +17,6 @@ setup(name                  = "pymucipher",
       # http://mail.python.org/pipermail/distutils-sig/2005-November/005387.html
       options               = {'build_ext':{'swig_opts':'-c++'}}, 
       ext_modules           = [ 
-          Extension("_mucipherc", ["../aes.cpp", "../hexdigest.cpp", "../md5.cpp", "../sha.cpp", "../sha256.cpp", "../wraphelp.cpp", "mucipher.i"], swig_opts=["-c++"])
+          Extension("_mucipherc", ["../aes.cpp", "../cpu.cpp", "../hexdigest.cpp", "../md5.cpp", "../sha.cpp", "../sha256.cpp", "../wraphelp.cpp", "mucipher.i"], swig_opts=["-c++"])
       ],
 )
@@ -58,6 +58,7 @@
 */
 
 #include "mucipher.h"
+#include "cpu.h"
 
 typedef uint32 u32;
 typedef unsigned char u8;
@@ -443,16 +444,103 @@ static void aes_decrypt(void *ctx_arg, u8 *out, const u8 *in)
 	u32_out (out + 12, b0[3]);
 }
 
+/* AES-NI: the same rounds done by the CPU, without the tables.
+   On these little-endian CPUs, E_KEY and D_KEY hold the round keys in the byte
+   order the instructions expect. */
 
-static char tabs_genned = 0;
+#ifdef MUCIPHER_X86
+#define HAVE_AESNI 1
+#include <wmmintrin.h>
+
+__attribute__((target("aes,sse2")))
+static void aesni_encrypt(const struct aes_ctx *ctx, u8 *out, const u8 *in, int blocks)
+{
+	const int rounds = ctx->key_length / 4 + 6;
+	__m128i k[15];
+	int i;
+
+	for (i = 0; i <= rounds; ++i)
+		k[i] = _mm_loadu_si128((const __m128i *)(E_KEY + 4 * i));
+
+	for (; blocks > 0; --blocks, in += 16, out += 16) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), k[0]);
+		for (i = 1; i < rounds; ++i)
+			b = _mm_aesenc_si128(b, k[i]);
+		b = _mm_aesenclast_si128(b, k[rounds]);
+		_mm_storeu_si128((__m128i *)out, b);
+	}
+}
+
+__attribute__((target("aes,sse2")))
+static void aesni_decrypt(const struct aes_ctx *ctx, u8 *out, const u8 *in, int blocks)
+{
+	const int rounds = ctx->key_length / 4 + 6;
+	__m128i k[15];
+	int i;
+
+	/* D_KEY holds the inverse mixed round keys, E_KEY the first and the last ones */
+	k[0] = _mm_loadu_si128((const __m128i *)(E_KEY + 4 * rounds));
+	for (i = 1; i < rounds; ++i)
+		k[i] = _mm_loadu_si128((const __m128i *)(D_KEY + 4 * (rounds - i)));
+	k[rounds] = _mm_loadu_si128((const __m128i *)E_KEY);
+
+	for (; blocks > 0; --blocks, in += 16, out += 16) {
+		__m128i b = _mm_xor_si128(_mm_loadu_si128((const __m128i *)in), k[0]);
+		for (i = 1; i < rounds; ++i)
+			b = _mm_aesdec_si128(b, k[i]);
+		b = _mm_aesdeclast_si128(b, k[rounds]);
+		_mm_storeu_si128((__m128i *)out, b);
+	}
+}
+#endif /* MUCIPHER_X86 */
+
+/* Check AES-NI against the FIPS-197 examples before using it. */
+int aesNiCheck(void)
+{
+#ifdef HAVE_AESNI
+	static const u8 plain[16] = {
+		0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77,
+		0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff };
+	static const u8 cipher128[16] = {
+		0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30,
+		0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a };
+	static const u8 cipher256[16] = {
+		0x8e, 0xa2, 0xb7, 0xca, 0x51, 0x67, 0x45, 0xbf,
+		0xea, 0xfc, 0x49, 0x90, 0x4b, 0x49, 0x60, 0x89 };
+	struct aes_ctx ctx;
+	u8 key[32], out[16], back[16];
+	int i;
+
+	for (i = 0; i < 32; ++i)
+		key[i] = i;
+
+	aes_set_key(&ctx, key, 16);
+	aesni_encrypt(&ctx, out, plain, 1);
+	aesni_decrypt(&ctx, back, out, 1);
+	if (memcmp(out, cipher128, 16) || memcmp(back, plain, 16))
+		return 0;
+
+	aes_set_key(&ctx, key, 32);
+	aesni_encrypt(&ctx, out, plain, 1);
+	aesni_decrypt(&ctx, back, out, 1);
+	return !memcmp(out, cipher256, 16) && !memcmp(back, plain, 16);
+#else
+	return 0;
+#endif /* HAVE_AESNI */
+}
+
+void aesGenTables(void) {
+	gen_tabs();
+}
+
+const char* cipherBackend(void) {
+	return aesNiSelected() ? "aes-ni" : "generic";
+}
 
 void cipherKeySHA256(struct aes_ctx* ctx, char* key, int len) {
 	unsigned char digest[32];
 	
-	if(! tabs_genned) {
-		gen_tabs();
-		tabs_genned = 1;
-	}
+	cipherSelectBackends();
 	
 	sha256Block((unsigned char*)key, len, digest);
 	aes_set_key(ctx, digest, 32);
@@ -461,10 +549,7 @@ void cipherKeySHA256(struct aes_ctx* ctx, char* key, int len) {
 void cipherKeyMD5(struct aes_ctx* ctx, char* key, int len) {
 	unsigned char digest[16];
 	
-	if(! tabs_genned) {
-		gen_tabs();
-		tabs_genned = 1;
-	}
+	cipherSelectBackends();
 	
 	md5Block((unsigned char*)key, len, digest);
 	aes_set_key(ctx, digest, 16);
@@ -475,6 +560,14 @@ void blockCipher(struct aes_ctx* ctx, unsigned char* dataIn, int length, unsigne
 	unsigned char* block = dataIn;
 	unsigned int i = 0;
 	
+#ifdef HAVE_AESNI
+	if(aesNiSelected()) {
+		aesni_encrypt(ctx, dataOut, block, length / 16);
+		block += length / 16 * 16;
+		dataOut += length / 16 * 16;
+	}
+	else
+#endif
 	for(i = 0; static_cast<int>(i) < length / 16; i++) {
 		aes_encrypt(ctx, dataOut, block);
 		block += 16;
@@ -490,6 +583,11 @@ void blockCipher(struct aes_ctx* ctx, unsigned char* dataIn, int length, unsigne
 		for(; i < 16; i++)
 			pad[i] = rand()%256;
 		
+#ifdef HAVE_AESNI
+		if(aesNiSelected())
+			aesni_encrypt(ctx, dataOut, pad, 1);
+		else
+#endif
 		aes_encrypt(ctx, dataOut, pad);
 	}
 }
@@ -499,6 +597,13 @@ void blockDecipher(struct aes_ctx* ctx, unsigned char* dataIn, int length, unsig
 	
 	length = CIPHER_BLOCK(length);
 	
+#ifdef HAVE_AESNI
+	if(aesNiSelected()) {
+		aesni_decrypt(ctx, dataOut, dataIn, length / 16);
+		return;
+	}
+#endif
+	
 	for(i = 0; static_cast<int>(i) < length / 16; i++) {
 		aes_decrypt(ctx, dataOut, dataIn);
 		dataIn += 16;
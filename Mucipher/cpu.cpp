@@ -0,0 +1,102 @@
+/* Mucipher - Cryptograhic library for Museek
+ *
+ * Copyright (C) 2003-2004 Hyriand <hyriand@thegraveyard.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "mucipher.h"
+#include "cpu.h"
+
+#ifdef MUCIPHER_X86
+#include <cpuid.h>
+
+#define CPU_SSSE3	(1 << 9)	/* leaf 1, ecx */
+#define CPU_SSE41	(1 << 19)	/* leaf 1, ecx */
+#define CPU_AES		(1 << 25)	/* leaf 1, ecx */
+#define CPU_SHA		(1 << 29)	/* leaf 7, ebx */
+#endif /* MUCIPHER_X86 */
+
+#ifndef WIN32
+#include <pthread.h>
+static pthread_once_t backends_once = PTHREAD_ONCE_INIT;
+#else
+static int backends_selected = 0;
+#endif /* WIN32 */
+
+static int aes_ni = 0;
+static int sha1_ni = 0;
+static int sha256_ni = 0;
+static int force_generic = 0;
+
+static void select_backends(void) {
+	int has_aes = 0, has_sha = 0;
+
+#ifdef MUCIPHER_X86
+	unsigned int eax, ebx, ecx = 0, edx;
+
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		has_aes = (ecx & CPU_AES) != 0;
+		/* The SHA code also shuffles and blends bytes */
+		has_sha = (ecx & CPU_SSSE3) && (ecx & CPU_SSE41);
+	}
+	if(has_sha && __get_cpuid_max(0, 0) >= 7) {
+		__cpuid_count(7, 0, eax, ebx, ecx, edx);
+		has_sha = (ebx & CPU_SHA) != 0;
+	}
+	else
+		has_sha = 0;
+#endif /* MUCIPHER_X86 */
+
+	aesGenTables();
+	aes_ni = has_aes && aesNiCheck();
+	sha1_ni = has_sha && sha1NiCheck();
+	sha256_ni = has_sha && sha256NiCheck();
+}
+
+void cipherSelectBackends(void) {
+#ifndef WIN32
+	pthread_once(&backends_once, select_backends);
+#else
+	if(! backends_selected) {
+		select_backends();
+		backends_selected = 1;
+	}
+#endif /* WIN32 */
+}
+
+void cipherForceGeneric(int generic) {
+	cipherSelectBackends();
+	force_generic = generic;
+}
+
+int aesNiSelected(void) {
+	cipherSelectBackends();
+	return aes_ni && ! force_generic;
+}
+
+int sha1NiSelected(void) {
+	cipherSelectBackends();
+	return sha1_ni && ! force_generic;
+}
+
+int sha256NiSelected(void) {
+	cipherSelectBackends();
+	return sha256_ni && ! force_generic;
+}
+
+const char* hashBackend(void) {
+	return (sha1NiSelected() && sha256NiSelected()) ? "sha-ni" : "generic";
+}
@@ -0,0 +1,47 @@
+/* Mucipher - Cryptograhic library for Museek
+ *
+ * Copyright (C) 2003-2004 Hyriand <hyriand@thegraveyard.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef __MUCIPHER_CPU_H__
+#define __MUCIPHER_CPU_H__
+
+/* The x86 instructions are used with gcc >= 4.8 and clang, which can
+   compile them in functions of their own and tell what the CPU has. */
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 8) || defined(__clang__))
+#define MUCIPHER_X86 1
+#endif
+
+/* Are the accelerated versions used? (the CPU has them and they give the
+   known answers) Selected once, see cipherSelectBackends(). */
+int aesNiSelected(void);
+int sha1NiSelected(void);
+int sha256NiSelected(void);
+
+/* Use the generic versions even where faster ones were selected, or not.
+   For the tests and benchmarks: not to be called while hashing. */
+void cipherForceGeneric(int generic);
+
+/* Done once by the selection: build the AES tables, and check the
+   accelerated versions against the FIPS known answers. */
+void aesGenTables(void);
+int aesNiCheck(void);
+int sha1NiCheck(void);
+int sha256NiCheck(void);
+
+#endif /* __MUCIPHER_CPU_H__ */
@@ -21,8 +21,9 @@ static const char rcsid[] = "$Id: md5.c,v 1.4 2003/12/17 07:39:14 wcc Exp $";
 
 #include "mucipher.h"
 
-/* Any 32-bit or wider integer data type will do */
-typedef unsigned long MD5_u32plus;
+/* Any 32-bit or wider integer data type will do. Exactly 32 bits lets
+   little-endian CPUs read the input words directly. */
+typedef uint32 MD5_u32plus;
 
 typedef struct {
 	MD5_u32plus lo, hi;
@@ -58,7 +59,7 @@ typedef struct {
  * memory accesses is just an optimization.  Nothing will break if it
  * doesn't work.
  */
-#if defined(__i386__) || defined(__vax__)
+#if defined(__i386__) || defined(__x86_64__) || defined(__vax__)
 #define SET(n) \
 	(*(MD5_u32plus *)&ptr[(n) * 4])
 #define GET(n) \
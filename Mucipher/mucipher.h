@@ -26,6 +26,9 @@ void shaBlock(unsigned char *dataIn, int len, unsigned char hashout[20]);
 void sha256Block(unsigned char *dataIn, int len, unsigned char hashout[32]);
 void md5Block(unsigned char *dataIn, int len, unsigned char hashout[16]);
 
+/* Streaming SHA-1, for data hashed as it comes. */
+#include "sha.h"
+
 struct aes_ctx {
 	int key_length;
 	uint32 E[60];
@@ -48,4 +51,12 @@ void _blockDecipher(CipherContext *ctx, char *str, int len, char **s, int *slen)
 
 void hexDigest(unsigned char *digest, int length, char* digestOut);
 
+/* Check the CPU and select the implementations. Done once (thread safe),
+   on first use if it isn't called before. */
+void cipherSelectBackends(void);
+
+/* Implementations used on this CPU: "aes-ni" or "generic", "sha-ni" or "generic". */
+const char* cipherBackend(void);
+const char* hashBackend(void);
+
 #endif /* __MUCIPHER_H__ */
@@ -35,8 +35,13 @@
  * ***** END LICENSE BLOCK ***** */
 
 #include "sha.h"
+#include "cpu.h"
+#include <string.h>
 
 static void shaHashBlock(SHA_CTX *ctx);
+#ifdef MUCIPHER_X86
+static void shaNiHashBlocks(unsigned int H[5], const unsigned char *data, int blocks);
+#endif
 
 void shaInit(SHA_CTX *ctx) {
   int i;
@@ -58,11 +63,36 @@ void shaInit(SHA_CTX *ctx) {
 
 
 void shaUpdate(SHA_CTX *ctx, unsigned char *dataIn, int len) {
-  int i;
+  int i = 0;
+
+  /* Whole blocks are loaded into W at once, or hashed by the CPU
+   */
+#ifdef MUCIPHER_X86
+  if (ctx->lenW == 0 && len >= 64 && sha1NiSelected()) {
+    int blocks = len / 64;
+    shaNiHashBlocks(ctx->H, dataIn, blocks);
+    i = blocks * 64;
+    ctx->sizeLo += (unsigned int)i << 3;
+    ctx->sizeHi += ((unsigned int)i >> 29) + (ctx->sizeLo < ((unsigned int)i << 3));
+  }
+#endif
+  if (ctx->lenW == 0) {
+    for (; len - i >= 64; i += 64) {
+      int t;
+      for (t = 0; t < 16; t++)
+        ctx->W[t] = ((unsigned int)dataIn[i + t * 4] << 24) |
+                    ((unsigned int)dataIn[i + t * 4 + 1] << 16) |
+                    ((unsigned int)dataIn[i + t * 4 + 2] << 8) |
+                    (unsigned int)dataIn[i + t * 4 + 3];
+      shaHashBlock(ctx);
+      ctx->sizeLo += 512;
+      ctx->sizeHi += (ctx->sizeLo < 512);
+    }
+  }
 
-  /* Read the data into W and process blocks as they get full
+  /* Read the rest into W and process blocks as they get full
    */
-  for (i = 0; i < len; i++) {
+  for (; i < len; i++) {
     ctx->W[ctx->lenW / 4] <<= 8;
     ctx->W[ctx->lenW / 4] |= (unsigned long)dataIn[i];
     if ((++ctx->lenW) % 64 == 0) {
@@ -119,15 +149,36 @@ void shaBlock(unsigned char *dataIn, int len, unsigned char hashout[20]) {
 }
 
 
-#define SHA_ROTL(X,n) ((((X) << (n)) | ((X) >> (32-(n)))) & 0xffffffffL)
+/* X must be 32 bits wide (unsigned int) */
+#define SHA_ROTL(X,n) (((X) << (n)) | ((X) >> (32-(n))))
+
+/* The message schedule is kept in a rolling window of 16 words */
+#define SHA_W(t) (W[(t) & 15] = SHA_ROTL(W[((t) + 13) & 15] ^ W[((t) + 8) & 15] ^ W[((t) + 2) & 15] ^ W[(t) & 15], 1))
+
+#define SHA_F1(B,C,D) ((((C) ^ (D)) & (B)) ^ (D))
+#define SHA_F2(B,C,D) ((B) ^ (C) ^ (D))
+#define SHA_F3(B,C,D) (((B) & (C)) | ((D) & ((B) | (C))))
+
+#define SHA_ROUND(A,B,C,D,E,f,k,w) \
+  E += SHA_ROTL(A, 5) + f(B, C, D) + (w) + (k); \
+  B = SHA_ROTL(B, 30);
+
+#define SHA_ROUNDS5(t,f,k,w) \
+  SHA_ROUND(A, B, C, D, E, f, k, w(t)) \
+  SHA_ROUND(E, A, B, C, D, f, k, w(t + 1)) \
+  SHA_ROUND(D, E, A, B, C, f, k, w(t + 2)) \
+  SHA_ROUND(C, D, E, A, B, f, k, w(t + 3)) \
+  SHA_ROUND(B, C, D, E, A, f, k, w(t + 4))
+
+#define SHA_W0(t) W[t]
 
 static void shaHashBlock(SHA_CTX *ctx) {
+  unsigned int A,B,C,D,E;
+  unsigned int W[16];
   int t;
-  unsigned long A,B,C,D,E,TEMP;
 
-  for (t = 16; t <= 79; t++)
-    ctx->W[t] =
-      SHA_ROTL(ctx->W[t-3] ^ ctx->W[t-8] ^ ctx->W[t-14] ^ ctx->W[t-16], 1);
+  for (t = 0; t < 16; t++)
+    W[t] = ctx->W[t];
 
   A = ctx->H[0];
   B = ctx->H[1];
@@ -135,22 +186,29 @@ static void shaHashBlock(SHA_CTX *ctx) {
   D = ctx->H[3];
   E = ctx->H[4];
 
-  for (t = 0; t <= 19; t++) {
-    TEMP = (SHA_ROTL(A,5) + (((C^D)&B)^D)     + E + ctx->W[t] + 0x5a827999L) & 0xffffffffL;
-    E = D; D = C; C = SHA_ROTL(B, 30); B = A; A = TEMP;
-  }
-  for (t = 20; t <= 39; t++) {
-    TEMP = (SHA_ROTL(A,5) + (B^C^D)           + E + ctx->W[t] + 0x6ed9eba1L) & 0xffffffffL;
-    E = D; D = C; C = SHA_ROTL(B, 30); B = A; A = TEMP;
-  }
-  for (t = 40; t <= 59; t++) {
-    TEMP = (SHA_ROTL(A,5) + ((B&C)|(D&(B|C))) + E + ctx->W[t] + 0x8f1bbcdcL) & 0xffffffffL;
-    E = D; D = C; C = SHA_ROTL(B, 30); B = A; A = TEMP;
-  }
-  for (t = 60; t <= 79; t++) {
-    TEMP = (SHA_ROTL(A,5) + (B^C^D)           + E + ctx->W[t] + 0xca62c1d6L) & 0xffffffffL;
-    E = D; D = C; C = SHA_ROTL(B, 30); B = A; A = TEMP;
-  }
+  SHA_ROUNDS5(0, SHA_F1, 0x5a827999U, SHA_W0)
+  SHA_ROUNDS5(5, SHA_F1, 0x5a827999U, SHA_W0)
+  SHA_ROUNDS5(10, SHA_F1, 0x5a827999U, SHA_W0)
+  SHA_ROUND(A, B, C, D, E, SHA_F1, 0x5a827999U, W[15])
+  SHA_ROUND(E, A, B, C, D, SHA_F1, 0x5a827999U, SHA_W(16))
+  SHA_ROUND(D, E, A, B, C, SHA_F1, 0x5a827999U, SHA_W(17))
+  SHA_ROUND(C, D, E, A, B, SHA_F1, 0x5a827999U, SHA_W(18))
+  SHA_ROUND(B, C, D, E, A, SHA_F1, 0x5a827999U, SHA_W(19))
+
+  SHA_ROUNDS5(20, SHA_F2, 0x6ed9eba1U, SHA_W)
+  SHA_ROUNDS5(25, SHA_F2, 0x6ed9eba1U, SHA_W)
+  SHA_ROUNDS5(30, SHA_F2, 0x6ed9eba1U, SHA_W)
+  SHA_ROUNDS5(35, SHA_F2, 0x6ed9eba1U, SHA_W)
+
+  SHA_ROUNDS5(40, SHA_F3, 0x8f1bbcdcU, SHA_W)
+  SHA_ROUNDS5(45, SHA_F3, 0x8f1bbcdcU, SHA_W)
+  SHA_ROUNDS5(50, SHA_F3, 0x8f1bbcdcU, SHA_W)
+  SHA_ROUNDS5(55, SHA_F3, 0x8f1bbcdcU, SHA_W)
+
+  SHA_ROUNDS5(60, SHA_F2, 0xca62c1d6U, SHA_W)
+  SHA_ROUNDS5(65, SHA_F2, 0xca62c1d6U, SHA_W)
+  SHA_ROUNDS5(70, SHA_F2, 0xca62c1d6U, SHA_W)
+  SHA_ROUNDS5(75, SHA_F2, 0xca62c1d6U, SHA_W)
 
   ctx->H[0] += A;
   ctx->H[1] += B;
@@ -159,3 +217,87 @@ static void shaHashBlock(SHA_CTX *ctx) {
   ctx->H[4] += E;
 }
 
+
+#ifdef MUCIPHER_X86
+#include <immintrin.h>
+
+/* One group of 4 rounds: g is the group (0-19), the message words of the
+   group are in M[g % 4] and the next groups are computed as we go. */
+#define SHA_NI_GROUP(g) \
+  if ((g) % 2 == 0) { \
+    E0 = _mm_sha1nexte_epu32(E0, M[(g) % 4]); \
+    E1 = ABCD; \
+  } else { \
+    E1 = _mm_sha1nexte_epu32(E1, M[(g) % 4]); \
+    E0 = ABCD; \
+  } \
+  if ((g) >= 3 && (g) <= 18) \
+    M[((g) + 1) % 4] = _mm_sha1msg2_epu32(M[((g) + 1) % 4], M[(g) % 4]); \
+  ABCD = _mm_sha1rnds4_epu32(ABCD, ((g) % 2 == 0) ? E0 : E1, (g) / 5); \
+  if ((g) >= 1 && (g) <= 16) \
+    M[((g) + 3) % 4] = _mm_sha1msg1_epu32(M[((g) + 3) % 4], M[(g) % 4]); \
+  if ((g) >= 2 && (g) <= 17) \
+    M[((g) + 2) % 4] = _mm_xor_si128(M[((g) + 2) % 4], M[(g) % 4]);
+
+/* Hash whole blocks with the SHA instructions */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void shaNiHashBlocks(unsigned int H[5], const unsigned char *data, int blocks) {
+  const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+  __m128i ABCD, E0, E1, ABCD_SAVE, E0_SAVE;
+  __m128i M[4];
+  int t;
+
+  ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)H), 0x1b);
+  E0 = _mm_set_epi32(H[4], 0, 0, 0);
+
+  for (; blocks > 0; --blocks, data += 64) {
+    ABCD_SAVE = ABCD;
+    E0_SAVE = E0;
+
+    for (t = 0; t < 4; t++)
+      M[t] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(data + t * 16)), mask);
+
+    /* The first group adds E, the others get it from the rounds before */
+    E0 = _mm_add_epi32(E0, M[0]);
+    E1 = ABCD;
+    ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);
+
+    SHA_NI_GROUP(1)  SHA_NI_GROUP(2)  SHA_NI_GROUP(3)  SHA_NI_GROUP(4)
+    SHA_NI_GROUP(5)  SHA_NI_GROUP(6)  SHA_NI_GROUP(7)  SHA_NI_GROUP(8)
+    SHA_NI_GROUP(9)  SHA_NI_GROUP(10) SHA_NI_GROUP(11) SHA_NI_GROUP(12)
+    SHA_NI_GROUP(13) SHA_NI_GROUP(14) SHA_NI_GROUP(15) SHA_NI_GROUP(16)
+    SHA_NI_GROUP(17) SHA_NI_GROUP(18) SHA_NI_GROUP(19)
+
+    E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+    ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+  }
+
+  _mm_storeu_si128((__m128i *)H, _mm_shuffle_epi32(ABCD, 0x1b));
+  H[4] = _mm_extract_epi32(E0, 3);
+}
+#endif /* MUCIPHER_X86 */
+
+/* Does SHA-NI give the known answer? */
+int sha1NiCheck(void) {
+#ifdef MUCIPHER_X86
+  /* FIPS 180-2 example: SHA-1 of "abc", as one padded block */
+  static const unsigned char expected[20] = {
+    0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+    0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d };
+  unsigned char block[64];
+  unsigned int H[5] = { 0x67452301U, 0xefcdab89U, 0x98badcfeU, 0x10325476U, 0xc3d2e1f0U };
+  int i;
+
+  memset(block, 0, sizeof(block));
+  block[0] = 'a'; block[1] = 'b'; block[2] = 'c'; block[3] = 0x80;
+  block[63] = 24;
+  shaNiHashBlocks(H, block, 1);
+
+  for (i = 0; i < 20; i++)
+    if ((unsigned char)(H[i / 4] >> (24 - (i % 4) * 8)) != expected[i])
+      return 0;
+  return 1;
+#else
+  return 0;
+#endif
+}
@@ -34,6 +34,9 @@
  *
  * ***** END LICENSE BLOCK ***** */
 
+#ifndef __MUCIPHER_SHA_H__
+#define __MUCIPHER_SHA_H__
+
 typedef struct {
   unsigned int H[5];
   unsigned int W[80];
@@ -47,3 +50,4 @@ void shaUpdate(SHA_CTX *ctx, unsigned char *dataIn, int len);
 void shaFinal(SHA_CTX *ctx, unsigned char hashout[20]);
 void shaBlock(unsigned char *dataIn, int len, unsigned char hashout[20]);
 
+#endif /* __MUCIPHER_SHA_H__ */
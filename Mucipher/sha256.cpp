@@ -18,6 +18,7 @@
  */
 
 #include "mucipher.h"
+#include "cpu.h"
 
 #define SHA256_DIGEST_SIZE	32
 #define SHA256_HMAC_BLOCK_SIZE	64
@@ -238,6 +239,106 @@ static void sha256_transform(uint32 *state, const unsigned char *input)
 	memset(W, 0, 64 * sizeof(uint32));
 }
 
+#ifdef MUCIPHER_X86
+#include <immintrin.h>
+
+static const uint32 sha256_K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* One group of 4 rounds: g is the group (0-15), its message words are in
+   M[g % 4] and the next groups are computed as we go. */
+#define SHA256_NI_GROUP(g) \
+	MSG = _mm_add_epi32(M[(g) % 4], _mm_loadu_si128((const __m128i *)&sha256_K[(g) * 4])); \
+	STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG); \
+	if ((g) >= 3 && (g) <= 14) { \
+		TMP = _mm_alignr_epi8(M[(g) % 4], M[((g) + 3) % 4], 4); \
+		M[((g) + 1) % 4] = _mm_add_epi32(M[((g) + 1) % 4], TMP); \
+		M[((g) + 1) % 4] = _mm_sha256msg2_epu32(M[((g) + 1) % 4], M[(g) % 4]); \
+	} \
+	MSG = _mm_shuffle_epi32(MSG, 0x0e); \
+	STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, MSG); \
+	if ((g) >= 1 && (g) <= 12) \
+		M[((g) + 3) % 4] = _mm_sha256msg1_epu32(M[((g) + 3) % 4], M[(g) % 4]);
+
+/* Hash whole blocks with the SHA instructions */
+__attribute__((target("sha,sse4.1,ssse3")))
+static void sha256_ni_transform(uint32 *state, const unsigned char *input, unsigned int blocks)
+{
+	const __m128i mask = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i STATE0, STATE1, MSG, TMP, ABEF_SAVE, CDGH_SAVE;
+	__m128i M[4];
+	int t;
+
+	/* The instructions want the state as ABEF and CDGH */
+	TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[0]), 0xb1);
+	STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)&state[4]), 0x1b);
+	STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xf0);
+
+	for (; blocks > 0; --blocks, input += 64) {
+		ABEF_SAVE = STATE0;
+		CDGH_SAVE = STATE1;
+
+		for (t = 0; t < 4; t++)
+			M[t] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + t * 16)), mask);
+
+		SHA256_NI_GROUP(0)  SHA256_NI_GROUP(1)  SHA256_NI_GROUP(2)  SHA256_NI_GROUP(3)
+		SHA256_NI_GROUP(4)  SHA256_NI_GROUP(5)  SHA256_NI_GROUP(6)  SHA256_NI_GROUP(7)
+		SHA256_NI_GROUP(8)  SHA256_NI_GROUP(9)  SHA256_NI_GROUP(10) SHA256_NI_GROUP(11)
+		SHA256_NI_GROUP(12) SHA256_NI_GROUP(13) SHA256_NI_GROUP(14) SHA256_NI_GROUP(15)
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1b);
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xb1);
+	_mm_storeu_si128((__m128i *)&state[0], _mm_blend_epi16(TMP, STATE1, 0xf0));
+	_mm_storeu_si128((__m128i *)&state[4], _mm_alignr_epi8(STATE1, TMP, 8));
+}
+#endif /* MUCIPHER_X86 */
+
+/* Does SHA-NI give the known answer? */
+int sha256NiCheck(void)
+{
+#ifdef MUCIPHER_X86
+	/* FIPS 180-2 example: SHA-256 of "abc", as one padded block */
+	static const uint32 expected[8] = {
+		0xba7816bf, 0x8f01cfea, 0x414140de, 0x5dae2223,
+		0xb00361a3, 0x96177a9c, 0xb410ff61, 0xf20015ad };
+	unsigned char block[64];
+	uint32 state[8] = { H0, H1, H2, H3, H4, H5, H6, H7 };
+
+	memset(block, 0, sizeof(block));
+	block[0] = 'a'; block[1] = 'b'; block[2] = 'c'; block[3] = 0x80;
+	block[63] = 24;
+	sha256_ni_transform(state, block, 1);
+	return memcmp(state, expected, sizeof(expected)) == 0;
+#else
+	return 0;
+#endif
+}
+
+static void sha256_blocks(uint32 *state, const unsigned char *input, unsigned int blocks)
+{
+#ifdef MUCIPHER_X86
+	if (sha256NiSelected()) {
+		sha256_ni_transform(state, input, blocks);
+		return;
+	}
+#endif
+	for (; blocks > 0; --blocks, input += 64)
+		sha256_transform(state, input);
+}
+
 static void sha256_init(void *ctx)
 {
 	struct sha256_ctx *sctx = static_cast<struct sha256_ctx *>(ctx);
@@ -272,10 +373,13 @@ static void sha256_update(void *ctx, const unsigned char *data, unsigned int len
 	/* Transform as many times as possible. */
 	if (len >= part_len) {
 		memcpy(&sctx->buf[index], data, part_len);
-		sha256_transform(sctx->state, sctx->buf);
+		sha256_blocks(sctx->state, sctx->buf, 1);
 
-		for (i = part_len; i + 63 < len; i += 64)
-			sha256_transform(sctx->state, &data[i]);
+		i = part_len;
+		if (len - i >= 64) {
+			sha256_blocks(sctx->state, &data[i], (len - i) / 64);
+			i += (len - i) / 64 * 64;
+		}
 		index = 0;
 	} else {
 		i = 0;
@@ -19,49 +19,148 @@
  */
 
 #include "nnlog.h"
-#include <stdarg.h>
 #include <stdio.h>
-#include <algorithm>
 
 NewNet::Log NewNet::log;
 
+/* What the call sites first reached by other threads point to until the
+   thread that logs interns them: enabled, so that it gets the chance. */
+static const std::string unresolvedName;
+static const bool unresolvedEnabled = true;
+
+NewNet::Log::Log() : m_AllEnabled(false)
+{
+#ifndef WIN32
+  m_Thread = pthread_self();
+#endif // WIN32
+}
+
+/**
+  * Is the caller the thread that may log?
+  */
+bool
+NewNet::Log::ownThread() const
+{
+#ifndef WIN32
+  return pthread_equal(pthread_self(), m_Thread);
+#else
+  return true;
+#endif // WIN32
+}
+
+NewNet::Log::Domain::Domain(const char * name) : m_Raw(name)
+{
+  // Interning from another thread would race with the reactor's messages
+  if(! log.ownThread())
+  {
+    m_Name = &unresolvedName;
+    m_Enabled = &unresolvedEnabled;
+    return;
+  }
+
+  resolve();
+}
+
+bool
+NewNet::Log::Domain::resolved() const
+{
+  return m_Name != &unresolvedName;
+}
+
+/**
+  * Point to the state of the domain (from the thread that logs only)
+  */
+void
+NewNet::Log::Domain::resolve() const
+{
+  DomainMap::iterator it = log.intern(m_Raw);
+  m_Name = &it->first;
+  m_Enabled = &it->second.active;
+}
+
+/**
+  * Find a domain, adding it if it's new. Entries of the map are never
+  * removed so that the Domain instances can point to them.
+  */
+NewNet::Log::DomainMap::iterator
+NewNet::Log::intern(const std::string & domain)
+{
+  DomainMap::iterator it = m_Domains.find(domain);
+  if(it == m_Domains.end())
+  {
+    DomainState state;
+    state.enabled = false;
+    state.active = m_AllEnabled;
+    it = m_Domains.insert(DomainMap::value_type(domain, state)).first;
+  }
+  return it;
+}
+
+/**
+  * Recompute which domains are printed
+  */
+void NewNet::Log::update()
+{
+  DomainMap::iterator it, end = m_Domains.end();
+  for(it = m_Domains.begin(); it != end; ++it)
+    it->second.active = m_AllEnabled || it->second.enabled;
+}
+
 void NewNet::Log::operator()(const std::string & domain, const char * fmt, ...)
 {
-  bool enabled = std::find(m_EnabledDomains.begin(), m_EnabledDomains.end(), domain) != m_EnabledDomains.end();
-  if(! (enabled || m_AllEnabled))
+  if(! ownThread() || ! intern(domain)->second.active)
     return;
 
-  int size = 100;
-  char * p, * np;
-  if((p = (char *)malloc(size)) == 0)
+  va_list ap;
+  va_start(ap, fmt);
+  print(domain, fmt, ap);
+  va_end(ap);
+}
+
+void NewNet::Log::operator()(const Domain & domain, const char * fmt, ...)
+{
+  if(! domain.enabled() || ! ownThread())
     return;
+  if(! domain.resolved())
+  {
+    domain.resolve();
+    if(! domain.enabled())
+      return;
+  }
+
+  va_list ap;
+  va_start(ap, fmt);
+  print(domain.name(), fmt, ap);
+  va_end(ap);
+}
+
+/**
+  * Format the message in our buffer (which is kept between messages) and
+  * notify it.
+  */
+void NewNet::Log::print(const std::string & domain, const char * fmt, va_list ap)
+{
+  if(m_Buffer.empty())
+    m_Buffer.resize(256);
 
   while(1)
   {
-    va_list ap;
-    va_start(ap, fmt);
-    int n = vsnprintf(p, size, fmt, ap);
-    va_end(ap);
-    if(n > -1 && n < size)
+    va_list aq;
+    va_copy(aq, ap);
+    int n = vsnprintf(&m_Buffer[0], m_Buffer.size(), fmt, aq);
+    va_end(aq);
+    if(n < 0)
+      return;
+    if((size_t)n < m_Buffer.size())
     {
+      // The buffer may be reused if a callback logs something
       LogNotify notice;
       notice.domain = domain;
-      notice.message = p;
+      notice.message.assign(&m_Buffer[0], n);
       logEvent(&notice);
-      free(p);
       return;
     }
-    if(n > -1)
-      size = n + 1;
-    else
-      size *= 2;
-    if((np = (char *)realloc(p, size)) == 0)
-    {
-      free(p);
-      return;
-    }
-    else
-      p = np;
+    m_Buffer.resize(n + 1);
   }
 }
 
@@ -69,19 +168,16 @@ void NewNet::Log::enable(const std::string & domain)
 {
   if(domain == "ALL")
     m_AllEnabled = true;
-  else if(std::find(m_EnabledDomains.begin(), m_EnabledDomains.end(), domain) == m_EnabledDomains.end())
-    m_EnabledDomains.push_back(domain);
+  else
+    intern(domain)->second.enabled = true;
+  update();
 }
 
 void NewNet::Log::disable(const std::string & domain)
 {
   if(domain == "ALL")
-  {
     m_AllEnabled = false;
-    return;
-  }
-  std::vector<std::string>::iterator it;
-  it = std::find(m_EnabledDomains.begin(), m_EnabledDomains.end(), domain);
-  if(it != m_EnabledDomains.end())
-    m_EnabledDomains.erase(it);
+  else
+    intern(domain)->second.enabled = false;
+  update();
 }
@@ -21,29 +21,69 @@
 #ifndef NEWNET_LOG_H
 #define NEWNET_LOG_H
 
+#include <stdarg.h>
 #include <string>
+#include <map>
 #include <vector>
 #include <iostream>
 #include "nnevent.h"
+#ifndef WIN32
+# include <pthread.h>
+#endif // WIN32
 
 namespace NewNet
 {
   //! Controllable logging class
   /*! This class will let you output messages to the console in a controlled
       fashion. It works by enabling and disabling domains where events
-      can happen. */
+      can happen. Only the thread that created it (the reactor's) may log:
+      neither the domains nor the logEvent callbacks are thread safe, so
+      messages from other threads (disk I/O workers, resolver) are dropped.
+      Those threads report errors in their results instead. */
   class Log {
   public:
+    Log();
+
     typedef struct
     {
       std::string domain;
       std::string message;
     } LogNotify;
 
+    //! A message domain.
+    /*! Domains are interned the first time they're used. Each one is
+        given a flag telling if it is enabled, so that a disabled message
+        costs a single test. NNLOG keeps one per call site (name must
+        outlive it). A domain first used by another thread is interned by
+        the thread that logs, the first time it uses it. */
+    class Domain
+    {
+    public:
+      Domain(const char * name);
+
+      //! Name of the domain.
+      const std::string & name() const { return *m_Name; }
+      //! Are messages of this domain printed?
+      bool enabled() const { return *m_Enabled; }
+
+    private:
+      friend class Log;
+      bool resolved() const;
+      void resolve() const;
+
+      const char * m_Raw;
+      mutable const std::string * m_Name;
+      mutable const bool * m_Enabled;
+    };
+
     //! Print a message.
     /*! Print a message if the specified domain is enabled. */
     void operator() (const std::string & domain, const char*, ...);
 
+    //! Print a message.
+    /*! Print a message if the specified domain is enabled. */
+    void operator() (const Domain & domain, const char*, ...);
+
     //! Enable a message domain.
     /*! This will enable printing messages of that domain. A special
         case is 'ALL' in which case all messages will be printed. */
@@ -59,8 +99,25 @@ namespace NewNet
     NewNet::Event<const LogNotify *> logEvent;
 
   private:
+    struct DomainState
+    {
+      bool enabled;   // Explicitly enabled
+      bool active;    // Printed (enabled or 'ALL' is)
+    };
+    typedef std::map<std::string, DomainState> DomainMap;
+
+    DomainMap::iterator intern(const std::string & domain);
+    void update();
+    void print(const std::string & domain, const char * fmt, va_list ap);
+
+    bool ownThread() const;
+
     bool m_AllEnabled;
-    std::vector<std::string> m_EnabledDomains;
+    DomainMap m_Domains;
+    std::vector<char> m_Buffer;
+#ifndef WIN32
+    pthread_t m_Thread;
+#endif // WIN32
   };
 
   //! Console output class.
@@ -83,6 +140,14 @@ namespace NewNet
   extern Log log;
 }
 
-#define NNLOG NewNet::log
+/* Print a message in a domain: NNLOG("domain", "format", ...). The domain
+   is interned once per call site and the arguments are only evaluated when
+   it is enabled. Use NewNet::log to enable or disable domains. */
+#define NNLOG(domain, ...) \
+  do { \
+    static const NewNet::Log::Domain nnlog_domain(domain); \
+    if(nnlog_domain.enabled()) \
+      NewNet::log(nnlog_domain, __VA_ARGS__); \
+  } while(0)
 
 #endif // NEWNET_LOG_H
@@ -112,3 +112,16 @@ NewNet::RateLimiter::nextWindow()
 
   return 0;
 }
+
+ssize_t
+NewNet::RateLimiter::rate()
+{
+  flush();
+
+  ssize_t total = 0;
+  std::vector<RateData>::const_iterator it, end = m_Data->rateData.end();
+  for(it = m_Data->rateData.begin(); it != end; ++it)
+    total += (*it).second;
+
+  return total / MAX_HISTORY;
+}
@@ -73,6 +73,11 @@ namespace NewNet
         until the next opportunity. */
     long nextWindow();
 
+    //! Current transfer rate.
+    /*! Returns the average number of bytes per second that were fed to the
+        collector during the last few seconds. */
+    ssize_t rate();
+
   private:
     /* Flush old data from the vector */
     void flush();
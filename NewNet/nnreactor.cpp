@@ -19,6 +19,7 @@
  */
 
 #include "nnreactor.h"
+#include "nnresolver.h"
 #include "nnlog.h"
 #include "platform.h"
 #include "util.h"
@@ -59,11 +60,17 @@ NewNet::Reactor::Reactor()
     NNLOG("newnet.net.debug", "%i file descriptors available for museekd.", m_maxSocketNo);
 
     event_init();
+    // The timer always exists, it's only added when there's something to wait for
+    evtimer_set(&mEvTimeout, ::eventCallback, this);
 }
 
 #ifndef DOXYGEN_UNDOCUMENTED
 NewNet::Reactor::~Reactor()
 {
+  // Stop the resolver while its notifier can still be removed
+  m_Resolver = 0;
+  if(evtimer_pending(&mEvTimeout, 0))
+    evtimer_del(&mEvTimeout);
 #ifdef WIN32
   WSACleanup();
   delete (WSADATA *)m_WsaData;
@@ -218,8 +225,8 @@ NewNet::Reactor::prepareReactorData() {
         timeout.tv_usec = 0;
       }
 
-      evtimer_del(&mEvTimeout); // delete potentially existing previous timeout
-      evtimer_set(&mEvTimeout, ::eventCallback, this);
+      if(evtimer_pending(&mEvTimeout, 0))
+        evtimer_del(&mEvTimeout); // delete potentially existing previous timeout
       evtimer_add(&mEvTimeout, &timeout);
     }
 
@@ -254,7 +261,7 @@ NewNet::Reactor::eventCallback(int fd, short event, void *arg) {
               long downLimit = (! sock->downRateLimiter()) ? 0 : sock->downRateLimiter()->nextWindow();
 
               int state = 0;
-              if ((downLimit == 0) && (evData->ev_res & EV_READ))
+              if ((downLimit == 0) && (evData->ev_res & EV_READ) && !sock->receivePaused())
                 state |= NewNet::Socket::StateReceive;
               if ((upLimit == 0) && (evData->ev_res & EV_WRITE))
                 state |= NewNet::Socket::StateSend;
@@ -318,7 +325,9 @@ NewNet::Reactor::checkSockets(struct timeval & timeout, bool & timeout_set) {
         case NewNet::Socket::SocketConnected:
           /* Check if we're allowed to receive, and if not, when we might be. */
           n = (! sock->downRateLimiter()) ? 0 : sock->downRateLimiter()->nextWindow();
-          if(n == 0)
+          if(sock->receivePaused())
+            NNLOG("newnet.net.debug", "Receiving is paused on socket %i.", fd);
+          else if(n == 0)
             evFlags = EV_READ;
           else
           {
@@ -352,9 +361,20 @@ NewNet::Reactor::checkSockets(struct timeval & timeout, bool & timeout_set) {
         event_set(evData, fd, evFlags, ::eventCallback, this);
         event_add(evData, NULL);
       }
+      else if (sock->receivePaused() && event_initialized(evData))
+        event_del(evData); // Don't wake up for data we won't read
+
     }
 }
 
+NewNet::Resolver *
+NewNet::Reactor::resolver()
+{
+  if(! m_Resolver.isValid())
+    m_Resolver = new Resolver(this);
+  return m_Resolver;
+}
+
 void
 NewNet::Reactor::stop()
 {
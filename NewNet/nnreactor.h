@@ -50,6 +50,8 @@ inline void fixtime(struct timeval & timeout, long ms, bool & timeout_set)
 
 namespace NewNet
 {
+  class Resolver;
+
   //! Monitors sockets and timeouts. This is what drives your application.
   /*! The Reactor class provides your application with a main-loop. It
       monitors the sockets and waits for timeouts to occur. */
@@ -115,6 +117,11 @@ namespace NewNet
         and frees the RefPtr on the callback object. */
     void removeTimeout(Timeout::Callback * callback);
 
+    //! Return the host name resolver.
+    /*! Returns the resolver that delivers its results through this
+        reactor. It is created the first time it's needed. */
+    Resolver * resolver();
+
     //! Returns the maximum number of sockets that can be opened
     /*! On linux this is usually 1024 */
     int maxSocketNo();
@@ -148,6 +155,7 @@ namespace NewNet
     int m_maxSocketNo;
     int m_maxFD;
     std::vector<RefPtr<Socket> > m_Sockets;
+    RefPtr<Resolver> m_Resolver;
 
 #ifndef DOXYGEN_UNDOCUMENTED
     struct Timeouts;
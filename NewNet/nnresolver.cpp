@@ -0,0 +1,365 @@
+/*  NewNet - A networking framework in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+#include "nnresolver.h"
+#include "nnreactor.h"
+#include "nnlog.h"
+#ifndef WIN32
+# include <arpa/inet.h>
+#endif // WIN32
+
+NewNet::Resolver::Notifier::Notifier(Resolver * resolver, int fd) : m_Resolver(resolver)
+{
+  setDescriptor(fd);
+  setSocketState(SocketConnected);
+}
+
+/**
+  * Some lookups are done: empty the pipe and deliver them
+  */
+void
+NewNet::Resolver::Notifier::process()
+{
+#ifndef WIN32
+  if(readyState() & StateReceive)
+  {
+    char buf[64];
+    while(::read(descriptor(), buf, sizeof(buf)) > 0)
+      ;
+    m_Resolver->dispatch();
+  }
+#endif // WIN32
+}
+
+NewNet::Resolver::Resolver(Reactor * reactor) : m_Reactor(reactor)
+{
+#ifndef WIN32
+  m_Started = false;
+  m_Shared = 0;
+  m_Pipe = -1;
+#endif // WIN32
+}
+
+#ifndef DOXYGEN_UNDOCUMENTED
+NewNet::Resolver::~Resolver()
+{
+#ifndef WIN32
+  if(m_Notifier.isValid())
+  {
+    if(m_Notifier->reactor())
+      m_Notifier->reactor()->remove(m_Notifier);
+    ::close(m_Pipe);
+
+    // Don't wait for the worker: getaddrinfo may hang for a long while.
+    // It exits (and frees what we share) once its lookup is done.
+    pthread_mutex_lock(&m_Shared->mutex);
+    m_Shared->stopping = true;
+    pthread_cond_signal(&m_Shared->cond);
+    pthread_mutex_unlock(&m_Shared->mutex);
+    release(m_Shared);
+  }
+#endif // WIN32
+}
+#endif // DOXYGEN_UNDOCUMENTED
+
+bool
+NewNet::Resolver::parse(const std::string & host, struct in_addr & address)
+{
+#ifndef WIN32
+  return inet_pton(AF_INET, host.c_str(), &address) == 1;
+#else
+  unsigned long addr = inet_addr(host.c_str());
+  if((addr == INADDR_NONE) && (host != "255.255.255.255"))
+    return false;
+  address.s_addr = addr;
+  return true;
+#endif // WIN32
+}
+
+void
+NewNet::Resolver::lookup(const std::string & host, Result & result)
+{
+  result.host = host;
+  result.found = false;
+  memset(&result.address, 0, sizeof(result.address));
+
+  if(parse(host, result.address))
+  {
+    result.found = true;
+    return;
+  }
+
+#ifndef WIN32
+  struct addrinfo hints, * info = 0;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_STREAM;
+  if(getaddrinfo(host.c_str(), 0, &hints, &info) == 0 && info)
+  {
+    result.address = ((struct sockaddr_in *)info->ai_addr)->sin_addr;
+    result.found = true;
+  }
+  if(info)
+    freeaddrinfo(info);
+#else
+  struct hostent * h = gethostbyname(host.c_str());
+  if(h)
+  {
+    memcpy(&result.address.s_addr, *(h->h_addr_list), sizeof(result.address.s_addr));
+    result.found = true;
+  }
+#endif // WIN32
+}
+
+void
+NewNet::Resolver::resolve(const std::string & host, ResolvedEvent::Callback * callback)
+{
+  RefPtr<ResolvedEvent::Callback> ref(callback);
+
+  Result result;
+  result.host = host;
+  result.found = false;
+  if(parse(host, result.address))
+  {
+    result.found = true;
+    (*callback)(&result);
+    return;
+  }
+  if(cached(host, result))
+  {
+    (*callback)(&result);
+    return;
+  }
+
+  // Somebody is already waiting for this one
+  std::map<std::string, std::vector<RefPtr<ResolvedEvent::Callback> > >::iterator it = m_Pending.find(host);
+  if(it != m_Pending.end())
+  {
+    it->second.push_back(callback);
+    return;
+  }
+
+#ifndef WIN32
+  if(! m_Started)
+    start();
+  if(m_Notifier.isValid())
+  {
+    NNLOG("newnet.net.debug", "Resolving host '%s' in the background.", host.c_str());
+    m_Pending[host].push_back(callback);
+    pthread_mutex_lock(&m_Shared->mutex);
+    m_Shared->queue.push_back(host);
+    pthread_cond_signal(&m_Shared->cond);
+    pthread_mutex_unlock(&m_Shared->mutex);
+    return;
+  }
+#endif // WIN32
+
+  NNLOG("newnet.net.debug", "Resolving host '%s'.", host.c_str());
+  lookup(host, result);
+  store(result);
+  (*callback)(&result);
+}
+
+bool
+NewNet::Resolver::cached(const std::string & host, Result & result)
+{
+  std::map<std::string, CacheEntry>::iterator it = m_Cache.find(host);
+  if(it == m_Cache.end())
+    return false;
+  if(it->second.expires <= time(0))
+  {
+    m_Cache.erase(it);
+    return false;
+  }
+  result.found = it->second.found;
+  result.address = it->second.address;
+  return true;
+}
+
+/**
+  * Remember a result. When the cache is full, expired entries go first.
+  */
+void
+NewNet::Resolver::store(const Result & result)
+{
+  time_t now = time(0);
+  if(m_Cache.size() >= RESOLVER_CACHE_MAX)
+  {
+    std::map<std::string, CacheEntry>::iterator it = m_Cache.begin();
+    while(it != m_Cache.end())
+    {
+      if(it->second.expires <= now)
+        m_Cache.erase(it++);
+      else
+        ++it;
+    }
+    if(m_Cache.size() >= RESOLVER_CACHE_MAX)
+      m_Cache.erase(m_Cache.begin());
+  }
+
+  CacheEntry & entry = m_Cache[result.host];
+  entry.found = result.found;
+  entry.address = result.address;
+  entry.expires = now + (result.found ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+}
+
+/**
+  * Invoke the callbacks waiting for a host
+  */
+void
+NewNet::Resolver::complete(const Result & result)
+{
+  std::map<std::string, std::vector<RefPtr<ResolvedEvent::Callback> > >::iterator it = m_Pending.find(result.host);
+  if(it == m_Pending.end())
+    return;
+
+  // The callbacks may resolve the same host again
+  std::vector<RefPtr<ResolvedEvent::Callback> > callbacks;
+  callbacks.swap(it->second);
+  m_Pending.erase(it);
+
+  std::vector<RefPtr<ResolvedEvent::Callback> >::iterator cit;
+  for(cit = callbacks.begin(); cit != callbacks.end(); ++cit)
+    (**cit)(&result);
+}
+
+/**
+  * Deliver the results of the worker (in the reactor)
+  */
+void
+NewNet::Resolver::dispatch()
+{
+#ifndef WIN32
+  std::deque<Result> done;
+  pthread_mutex_lock(&m_Shared->mutex);
+  done.swap(m_Shared->done);
+  pthread_mutex_unlock(&m_Shared->mutex);
+
+  std::deque<Result>::iterator it;
+  for(it = done.begin(); it != done.end(); ++it)
+  {
+    store(*it);
+    complete(*it);
+  }
+#endif // WIN32
+}
+
+#ifndef WIN32
+/**
+  * Start the worker (the first time a name needs to be looked up)
+  */
+bool
+NewNet::Resolver::start()
+{
+  m_Started = true;
+
+  int fds[2];
+  if(pipe(fds) == -1)
+  {
+    NNLOG("newnet.net.warn", "Couldn't create the resolver pipe (error %i), host names will be resolved in the reactor.", errno);
+    return false;
+  }
+  fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+  fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+
+  Shared * shared = new Shared;
+  pthread_mutex_init(&shared->mutex, 0);
+  pthread_cond_init(&shared->cond, 0);
+  shared->stopping = false;
+  shared->pipe = fds[1];
+  shared->refs = 2;
+
+  pthread_t thread;
+  if(pthread_create(&thread, 0, &Resolver::worker, shared) != 0)
+  {
+    NNLOG("newnet.net.warn", "Couldn't start the resolver thread, host names will be resolved in the reactor.");
+    ::close(fds[0]);
+    shared->refs = 1;
+    release(shared);
+    return false;
+  }
+  pthread_detach(thread);
+
+  m_Shared = shared;
+  m_Pipe = fds[0];
+  m_Notifier = new Notifier(this, m_Pipe);
+  m_Reactor->add(m_Notifier);
+  return true;
+}
+
+/**
+  * Let go of the shared state, freeing it if the other side already has
+  */
+void
+NewNet::Resolver::release(Shared * shared)
+{
+  pthread_mutex_lock(&shared->mutex);
+  bool last = (--shared->refs == 0);
+  pthread_mutex_unlock(&shared->mutex);
+  if(! last)
+    return;
+
+  ::close(shared->pipe);
+  pthread_cond_destroy(&shared->cond);
+  pthread_mutex_destroy(&shared->mutex);
+  delete shared;
+}
+
+/**
+  * Look up the queued hosts and wake up the reactor when there are results
+  */
+void *
+NewNet::Resolver::worker(void * data)
+{
+  Shared * shared = (Shared *)data;
+
+  pthread_mutex_lock(&shared->mutex);
+  while(1)
+  {
+    while(shared->queue.empty() && ! shared->stopping)
+      pthread_cond_wait(&shared->cond, &shared->mutex);
+    if(shared->stopping)
+      break;
+
+    std::string host = shared->queue.front();
+    shared->queue.pop_front();
+    pthread_mutex_unlock(&shared->mutex);
+
+    Result result;
+    lookup(host, result);
+
+    pthread_mutex_lock(&shared->mutex);
+    // Nobody reads the pipe anymore
+    if(shared->stopping)
+      break;
+    // If there were results already, the reactor has been woken up
+    bool wake = shared->done.empty();
+    shared->done.push_back(result);
+    if(wake)
+    {
+      char c = 0;
+      if(::write(shared->pipe, &c, 1) == -1) {}
+    }
+  }
+  pthread_mutex_unlock(&shared->mutex);
+
+  release(shared);
+  return 0;
+}
+#endif // WIN32
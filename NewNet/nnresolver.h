@@ -0,0 +1,157 @@
+/*  NewNet - A networking framework in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+#ifndef NEWNET_RESOLVER_H
+#define NEWNET_RESOLVER_H
+
+#include "nnobject.h"
+#include "nnrefptr.h"
+#include "nnsocket.h"
+#include "nnevent.h"
+#include "platform.h"
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <time.h>
+#ifndef WIN32
+# include <pthread.h>
+#endif // WIN32
+
+/* Seconds a resolved host is remembered. */
+#define RESOLVER_TTL 300
+/* Seconds a host that couldn't be resolved is remembered. */
+#define RESOLVER_NEGATIVE_TTL 30
+/* Maximum number of remembered hosts. */
+#define RESOLVER_CACHE_MAX 256
+
+namespace NewNet
+{
+  class Reactor;
+
+  //! Host name resolver.
+  /*! Turns host names into IPv4 addresses without blocking the reactor.
+      Numeric addresses are parsed right away, names are looked up by a
+      worker thread and the result is delivered through the reactor.
+      Results are cached for a little while. */
+  class Resolver : public Object
+  {
+  public:
+    //! Result of a lookup.
+    typedef struct
+    {
+      std::string host;
+      bool found;
+      struct in_addr address;
+    } Result;
+
+    //! Convenience definition for lookup callbacks.
+    typedef Event<const Result *> ResolvedEvent;
+
+    //! Create a resolver.
+    /*! The resolver delivers the results of the worker through the
+        specified reactor. */
+    Resolver(Reactor * reactor);
+
+#ifndef DOXYGEN_UNDOCUMENTED
+    ~Resolver();
+#endif // DOXYGEN_UNDOCUMENTED
+
+    //! Parse a numeric address.
+    /*! Returns true if host is a dotted-quad IPv4 address. */
+    static bool parse(const std::string & host, struct in_addr & address);
+
+    //! Resolve a host right now.
+    /*! Blocks until the host is resolved. Use resolve() from the reactor. */
+    static void lookup(const std::string & host, Result & result);
+
+    //! Resolve a host.
+    /*! The callback is invoked with the result. This happens right away if
+        the host is a numeric address or has been resolved recently.
+        Note: stores a RefPtr to the callback until it's invoked. */
+    void resolve(const std::string & host, ResolvedEvent::Callback * callback);
+
+    //! Resolve a host.
+    /*! Same as above, but invokes the method of the specified object. */
+    template<class ObjectType, typename MethodType>
+    void resolve(const std::string & host, ObjectType * object, MethodType method)
+    {
+      resolve(host, ResolvedEvent::bind(object, method));
+    }
+
+  private:
+#ifndef DOXYGEN_UNDOCUMENTED
+    /* Reads the wake-up pipe in the reactor. */
+    class Notifier : public Socket
+    {
+    public:
+      Notifier(Resolver * resolver, int fd);
+      void process();
+
+    private:
+      Resolver * m_Resolver;
+    };
+
+    struct CacheEntry
+    {
+      bool found;
+      struct in_addr address;
+      time_t expires;
+    };
+
+#ifndef WIN32
+    /* What the worker shares with the resolver. The last of the two to let
+       go of it frees it: the resolver doesn't wait for a hung lookup. */
+    struct Shared
+    {
+      pthread_mutex_t mutex;
+      pthread_cond_t cond;
+      std::deque<std::string> queue;  // Hosts to look up
+      std::deque<Result> done;        // Results not delivered yet
+      bool stopping;                  // Should the worker exit?
+      int pipe;                       // Written to when there are results
+      int refs;
+    };
+
+    static void release(Shared * shared);
+#endif // WIN32
+
+    bool cached(const std::string & host, Result & result);
+    void store(const Result & result);
+    void complete(const Result & result);
+    void dispatch();
+#ifndef WIN32
+    bool start();
+    static void * worker(void * data);
+#endif // WIN32
+
+    Reactor * m_Reactor;
+    std::map<std::string, CacheEntry> m_Cache;
+    std::map<std::string, std::vector<RefPtr<ResolvedEvent::Callback> > > m_Pending;
+#ifndef WIN32
+    bool m_Started;
+    Shared * m_Shared;
+    int m_Pipe;
+    RefPtr<Notifier> m_Notifier;
+#endif // WIN32
+#endif // DOXYGEN_UNDOCUMENTED
+  };
+}
+
+#endif // NEWNET_RESOLVER_H
@@ -24,6 +24,33 @@
 #include "util.h"
 #include <iostream>
 
+#ifndef WIN32
+/* The descriptor kept to accept (and drop) a connection when we run out of
+   them. It mustn't leak into the processes we start. */
+static int
+openSpareFD()
+{
+#ifdef O_CLOEXEC
+  return ::open("/dev/null", O_RDONLY | O_CLOEXEC);
+#else
+  int fd = ::open("/dev/null", O_RDONLY);
+  if(fd != -1)
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+  return fd;
+#endif // O_CLOEXEC
+}
+#endif // WIN32
+
+#ifndef DOXYGEN_UNDOCUMENTED
+NewNet::ServerSocket::~ServerSocket()
+{
+#ifndef WIN32
+  if(m_SpareFD != -1)
+    ::close(m_SpareFD);
+#endif // WIN32
+}
+#endif // DOXYGEN_UNDOCUMENTED
+
 void
 NewNet::ServerSocket::disconnect()
 {
@@ -33,29 +60,112 @@ NewNet::ServerSocket::disconnect()
     return;
   }
 
+#ifndef WIN32
+  if(m_SpareFD != -1)
+  {
+    ::close(m_SpareFD);
+    m_SpareFD = -1;
+  }
+#endif // WIN32
+
   closesocket(descriptor());
   setSocketState(SocketDisconnected);
   disconnectedEvent(this);
 }
 
+/**
+  * Accept a client, non blocking. Where accept4() is available, this saves
+  * the calls setting the flags.
+  */
+int
+NewNet::ServerSocket::acceptClient()
+{
+#if defined(__linux__) && defined(SOCK_NONBLOCK) && defined(SOCK_CLOEXEC)
+  static bool haveAccept4 = true;
+  if(haveAccept4)
+  {
+    int client = ::accept4(descriptor(), 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if((client != -1) || (errno != ENOSYS))
+      return client;
+    haveAccept4 = false;
+  }
+#endif
+
+  int client = ::accept(descriptor(), 0, 0);
+  if((client != -1) && !setnonblocking(client))
+    NNLOG("newnet.net.warn", "Couldn't set socket %i to non blocking (errno: %i)", client, errno);
+  return client;
+}
+
+/**
+  * We're out of descriptors: release the spare one to accept the client
+  * and close it right away. Otherwise it would keep waking us up.
+  */
+bool
+NewNet::ServerSocket::dropClient()
+{
+#ifndef WIN32
+  if(m_SpareFD == -1)
+    return false;
+
+  ::close(m_SpareFD);
+  int client = ::accept(descriptor(), 0, 0);
+  if(client != -1)
+  {
+    closesocket(client);
+    ++m_Dropped;
+    NNLOG("newnet.net.warn", "Out of descriptors, dropped a connection on socket %i (%lu dropped so far).", descriptor(), m_Dropped);
+  }
+  m_SpareFD = openSpareFD();
+  return client != -1;
+#else
+  return false;
+#endif // WIN32
+}
+
 void
 NewNet::ServerSocket::process()
 {
-  if (readyState() & StateReceive)
+  if(! (readyState() & StateReceive))
+    return;
+
+#ifndef WIN32
+  if(m_SpareFD == -1)
+    m_SpareFD = openSpareFD();
+#endif // WIN32
+
+  for(int i = 0; i < NEWNET_ACCEPT_BATCH; ++i)
   {
-    int client = ::accept(descriptor(), 0, 0);
+    int client = acceptClient();
 
     if(client == -1)
     {
-      if ((WSAGetLastError() == EAGAIN) || (WSAGetLastError() == EMFILE))
+      int error = WSAGetLastError();
+      if((error == EMFILE) || (error == ENFILE))
+      {
+        if(dropClient())
+          continue;
         setReadyState(readyState() & ~StateReceive);
-      else
+        return;
+      }
+      if(error == ECONNABORTED)
+      {
+        ++m_Dropped;
+        continue;
+      }
+      if(error == EINTR)
+        continue;
+      if((error != EAGAIN) && (error != EWOULDBLOCK))
         NNLOG("newnet.net.warn", "Ignoring error '%i' in ServerSocket::accept().", errno);
+      setReadyState(readyState() & ~StateReceive);
+      return;
     }
-    else {
-      if (!setnonblocking(client))
-        NNLOG("newnet.net.warn", "Couldn't set socket %i to non blocking (errno: %i)", client, errno);
-      acceptedEvent(client);
-    }
+
+    ++m_Accepted;
+    acceptedEvent(client);
+
+    // One of the callbacks may have closed us
+    if(socketState() != SocketListening)
+      return;
   }
 }
@@ -25,6 +25,11 @@
 #include "nnevent.h"
 #include <string>
 
+/* Default length of the queue of pending connections. */
+#define NEWNET_LISTEN_BACKLOG 128
+/* Maximum number of connections accepted each time the reactor wakes us up. */
+#define NEWNET_ACCEPT_BATCH 64
+
 namespace NewNet
 {
   //! Base class for network server sockets.
@@ -38,8 +43,40 @@ namespace NewNet
     //! Create an empty server socket.
     /*! This will create an empty server socket. The server socket starts in
         an uninitialized state without a descriptor. */
-    ServerSocket() : Socket()
+    ServerSocket() : Socket(), m_Backlog(NEWNET_LISTEN_BACKLOG), m_SpareFD(-1),
+                     m_Accepted(0), m_Dropped(0)
+    {
+    }
+
+#ifndef DOXYGEN_UNDOCUMENTED
+    ~ServerSocket();
+#endif // DOXYGEN_UNDOCUMENTED
+
+    //! Return the length of the queue of pending connections.
+    int backlog() const
+    {
+      return m_Backlog;
+    }
+
+    //! Set the length of the queue of pending connections.
+    /*! Takes effect the next time the socket starts listening. */
+    void setBacklog(int backlog)
     {
+      m_Backlog = backlog;
+    }
+
+    //! Return the number of connections accepted.
+    unsigned long accepted() const
+    {
+      return m_Accepted;
+    }
+
+    //! Return the number of connections closed right after being accepted.
+    /*! This happens when we run out of descriptors or when the client gave
+        up before we accepted it. */
+    unsigned long dropped() const
+    {
+      return m_Dropped;
     }
 
     //! Disconnect the server socket.
@@ -48,7 +85,8 @@ namespace NewNet
 
     //! Process network events.
     /*! Gets called by the reactor detects a new connection attempt on the
-        server socket. When that happens, accept() is called. */
+        server socket. When that happens, the pending connections are
+        accepted (up to NEWNET_ACCEPT_BATCH of them). */
     virtual void process();
 
     //! Emitted when the socket can't start listening.
@@ -65,6 +103,15 @@ namespace NewNet
     //! Emitted when the server socket has been closed.
     /*! Emitted when the server socket has been closed. */
     Event<ServerSocket *> disconnectedEvent;
+
+  private:
+    int acceptClient();
+    bool dropClient();
+
+    int m_Backlog;
+    int m_SpareFD;            // Released to accept (and close) clients when we're out of descriptors
+    unsigned long m_Accepted;
+    unsigned long m_Dropped;
   };
 }
 
@@ -83,7 +83,7 @@ namespace NewNet
         uninitialized, has no pending events, no error and no data waiting. */
     Socket() : m_Reactor(0), m_FD(-1), m_SocketState(SocketUninitialized),
               m_ReadyState(0), m_SocketError(ErrorNoError),
-              m_DataWaiting(false)
+              m_DataWaiting(false), m_ReceivePaused(false)
     {
         m_EventData = new struct event;
         m_EventData->ev_flags = 0; // This event has not been initialized
@@ -180,6 +180,23 @@ namespace NewNet
       m_DataWaiting = dataWaiting;
     }
 
+    //! Return wether receiving is paused.
+    /*! Called by the reactor to determine wether it should watch the
+        socket for incoming data. */
+    bool receivePaused() const
+    {
+      return m_ReceivePaused;
+    }
+
+    //! Pause or resume receiving.
+    /*! While paused, the reactor doesn't read from the socket, so that the
+        data piles up in the kernel buffers and the peer slows down. Used
+        when the received data can't be processed fast enough. */
+    void setReceivePaused(bool paused)
+    {
+      m_ReceivePaused = paused;
+    }
+
     //! Return the current download rate limiter.
     /*! Return the current download rate limiter. */
     RateLimiter * downRateLimiter()
@@ -235,6 +252,7 @@ namespace NewNet
     int m_ReadyState;
     SocketError m_SocketError;
     bool m_DataWaiting;
+    bool m_ReceivePaused;
     RefPtr<RateLimiter> m_DownRateLimiter, m_UpRateLimiter;
     struct event * m_EventData;
   };
@@ -31,12 +31,39 @@ NewNet::TcpClientSocket::connect(const std::string & host, unsigned int port)
   assert((descriptor() == -1) || (socketState() == SocketUninitialized));
 
   setSocketState(SocketConnecting);
+  setDescriptor(-1);
+  m_Host = host;
+  m_Port = port;
+  m_Resolving = true;
 
-  NNLOG("newnet.net.debug", "Resolving host '%s'.", host.c_str());
-  struct hostent *h = gethostbyname(host.c_str());
-  if(! h)
+  // Add a connection timeout (resolving the host is part of it)
+  if (reactor()) {
+    m_ConnectionTimeout = reactor()->addTimeout(120000, this, &TcpClientSocket::onConnectionTimeout);
+    reactor()->resolver()->resolve(host, this, &TcpClientSocket::onResolved);
+  }
+  else {
+    Resolver::Result result;
+    Resolver::lookup(host, result);
+    onResolved(&result);
+  }
+}
+
+void
+NewNet::TcpClientSocket::onResolved(const Resolver::Result * result)
+{
+  // We may have given up while the host was being resolved
+  if(! m_Resolving || (socketState() != SocketConnecting))
+    return;
+  m_Resolving = false;
+
+  const std::string & host = m_Host;
+  unsigned int port = m_Port;
+
+  if(! result->found)
   {
     NNLOG("newnet.net.warn", "Cannot resolve host '%s'.", host.c_str());
+    if (reactor())
+      reactor()->removeTimeout(m_ConnectionTimeout);
     setSocketError(ErrorCannotResolve);
     cannotConnectEvent(this);
     return;
@@ -45,7 +72,7 @@ NewNet::TcpClientSocket::connect(const std::string & host, unsigned int port)
   struct sockaddr_in address;
   memset(&address, 0, sizeof(address));
   address.sin_family = AF_INET;
-  memcpy(&(address.sin_addr.s_addr), *(h->h_addr_list), sizeof(address.sin_addr.s_addr));
+  address.sin_addr = result->address;
   address.sin_port = htons(port);
 
   NNLOG("newnet.net.debug", "Connecting to host '%s:%u'.", host.c_str(), port);
@@ -58,18 +85,13 @@ NewNet::TcpClientSocket::connect(const std::string & host, unsigned int port)
   if(s < 0)
     {
       NNLOG("newnet.net.warn", "Cannot connect to host '%s:%u', error: %i.", host.c_str(), port, WSAGetLastError());
+      if (reactor())
+        reactor()->removeTimeout(m_ConnectionTimeout);
       setSocketError(ErrorCannotConnect);
       cannotConnectEvent(this);
       return;
     }
 
-  // Add a connection timeout
-  if (reactor()) {
-    m_ConnectionTimeout = reactor()->addTimeout(120000, this, &TcpClientSocket::onConnectionTimeout);
-  }
-
-  connectedEvent.connect(this, &TcpClientSocket::onConnected);
-
   if(::connect(s, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) == 0)
   {
     // When using non blocking socket (most of the time), we don't get here.
@@ -81,13 +103,38 @@ NewNet::TcpClientSocket::connect(const std::string & host, unsigned int port)
   {
     // When using non blocking socket (most of the time), we don't get here.
     NNLOG("newnet.net.warn", "Cannot connect to host '%s:%u', error: %i.", host.c_str(), port, WSAGetLastError());
+    if (reactor())
+      reactor()->removeTimeout(m_ConnectionTimeout);
     setSocketError(ErrorCannotConnect);
     cannotConnectEvent(this);
   }
 }
 
+void
+NewNet::TcpClientSocket::disconnect(bool invoke)
+{
+  if(m_Resolving)
+  {
+    // There's no descriptor yet
+    m_Resolving = false;
+    if (reactor())
+      reactor()->removeTimeout(m_ConnectionTimeout);
+    setSocketState(SocketDisconnected);
+    if (invoke)
+      disconnectedEvent(this);
+    return;
+  }
+
+  ClientSocket::disconnect(invoke);
+}
+
 void
 NewNet::TcpClientSocket::onConnectionTimeout(long) {
+    if (m_Resolving) {
+      NNLOG("newnet.net.warn", "Timed out while resolving host '%s'.", m_Host.c_str());
+      m_Resolving = false;
+      setSocketError(ErrorCannotResolve);
+    }
     cannotConnectEvent(this);
 }
 
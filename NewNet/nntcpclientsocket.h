@@ -22,6 +22,7 @@
 #define NEWNET_TCPCLIENTSOCKET_H
 
 #include "nnclientsocket.h"
+#include "nnresolver.h"
 #include <string>
 
 namespace NewNet
@@ -35,20 +36,33 @@ namespace NewNet
     //! Create a new unconnected TCP/IP client socket.
     /*! This creates a new, unconnected TCP/IP client socket. Call connect()
         to connect the client socket to a remote host. */
-    TcpClientSocket() : ClientSocket()
+    TcpClientSocket() : ClientSocket(), m_Port(0), m_Resolving(false)
     {
+      // First of the callbacks: the timeout is gone before anyone hears of the connection
+      connectedEvent.connect(this, &TcpClientSocket::onConnected);
     }
 
     //! Connect to a remote host.
-    /*! Creates a new descriptor and tries to connect it to the specified
-        port on the specified host. */
+    /*! Resolves the host and tries to connect a new descriptor to the
+        specified port on it. If the socket is in a reactor, host names are
+        resolved in the background and the socket stays in the connecting
+        state (without a descriptor) meanwhile. */
     void connect(const std::string & host, unsigned int port);
 
+    //! Disconnect the socket.
+    /*! Also gives up on the host being resolved. */
+    virtual void disconnect(bool invoke = true);
+
     void onConnectionTimeout(long);
 
     void onConnected(ClientSocket *);
 
   private:
+    void onResolved(const Resolver::Result * result);
+
+    std::string m_Host;
+    unsigned int m_Port;
+    bool m_Resolving;
     NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_ConnectionTimeout;
   };
 }
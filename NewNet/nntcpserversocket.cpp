@@ -55,6 +55,16 @@ NewNet::TcpServerSocket::listen(const std::string & host, unsigned int port)
   sockopt_t socket_option = 1;
   setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &socket_option, sizeof(int));
 
+  if(m_ReusePort)
+  {
+#ifdef SO_REUSEPORT
+    if(setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &socket_option, sizeof(int)) != 0)
+      NNLOG("newnet.net.warn", "Couldn't share port %u (errno: %i).", port, errno);
+#else
+    NNLOG("newnet.net.warn", "Sharing port %u isn't supported here.", port);
+#endif // SO_REUSEPORT
+  }
+
   if(bind(sock, (struct sockaddr *)&address, sizeof(struct sockaddr_in)) != 0)
   {
     NNLOG("newnet.net.warn", "Cannot bind to '%s:%u', error: %i.", host.c_str(), port, errno);
@@ -64,7 +74,7 @@ NewNet::TcpServerSocket::listen(const std::string & host, unsigned int port)
     return;
   }
 
-  if (::listen(sock, 3) != 0)
+  if (::listen(sock, backlog()) != 0)
   {
     NNLOG("newnet.net.warn", "Cannot listen on '%s:%u', error: %i.", host.c_str(), port, errno);
     closesocket(sock);
@@ -34,10 +34,19 @@ namespace NewNet
     //! Create a TCP/IP server socket.
     /*! Creates a TCP/IP server socket. The socket isn't yet bound to
         anything, so call listen() to activate the server socket. */
-    TcpServerSocket() : ServerSocket(), m_ListenPort(0)
+    TcpServerSocket() : ServerSocket(), m_ListenPort(0), m_ReusePort(false)
     {
     }
 
+    //! Share the port with other sockets.
+    /*! If set before listen(), several server sockets (that all set it)
+        can listen on the same port. The system spreads the incoming
+        connections between them. */
+    void setReusePort(bool reusePort)
+    {
+      m_ReusePort = reusePort;
+    }
+
     //! Listen on a port on the specified host.
     /*! Starts listening on a port on the specified host. */
     void listen(const std::string & host, unsigned int port);
@@ -59,6 +68,7 @@ namespace NewNet
 
   private:
     unsigned int m_ListenPort;
+    bool m_ReusePort;
   };
 }
 
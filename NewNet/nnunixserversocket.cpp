@@ -56,7 +56,7 @@ NewNet::UnixServerSocket::listen(const std::string & path)
     return;
   }
 
-  if (::listen(sock, 3) != 0)
+  if (::listen(sock, backlog()) != 0)
   {
     NNLOG("newnet.net.warn", "Cannot listen on unix socket '%s', error: %i.", path.c_str(), errno);
     closesocket(sock);
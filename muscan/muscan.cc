@@ -79,8 +79,8 @@ int main(int argc, char **argv) {
 	}
 	
 	if (Scanner_Verbosity >= 2){
-	    NNLOG.logEvent.connect(new NewNet::ConsoleOutput);
-    	NNLOG.enable("ALL");
+	    NewNet::log.logEvent.connect(new NewNet::ConsoleOutput);
+    	NewNet::log.enable("ALL");
     }
 	
 	Muconf config(config_file);
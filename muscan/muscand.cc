@@ -64,8 +64,8 @@ FAMHandler::FAMHandler(const string& config_file, bool doBuddy, bool doReload)
 	FAMCONNECTION_GETFD(&fc) = -1;
 
 	if (Scanner_Verbosity >= 2){
-	    NNLOG.logEvent.connect(new NewNet::ConsoleOutput);
-    	NNLOG.enable("ALL");
+	    NewNet::log.logEvent.connect(new NewNet::ConsoleOutput);
+    	NewNet::log.enable("ALL");
     }
  
 	m_doReload = doReload;
@@ -26,29 +26,164 @@
 #include "configmanager.h"
 #include <Muhelp/string_ext.hh>
 #include <NewNet/nnpath.h>
+#include "mutypes.h"
 #include <errno.h>
+#include <cstring>
+
+/**
+  * Upper case name of a character set, UTF8 spelled UTF-8
+  */
+static std::string
+normalizeCodeset(const std::string & codeset)
+{
+  std::string name = toupper(codeset);
+  if(name.compare(0, 4, "UTF8") == 0)
+    name.insert(3, "-");
+  return name;
+}
+
+/**
+  * Does the character set encode ASCII characters as ASCII (one byte each, same values)?
+  */
+static bool
+isAsciiCompatible(const std::string & codeset)
+{
+  static const char * prefixes[] = { "UTF-8", "ASCII", "US-ASCII", "ANSI_X3.4", "ISO-8859", "ISO8859", "ISO_8859",
+                                     "LATIN", "CP125", "WINDOWS-125", "KOI8", "EUC", "GBK", "GB2312", "GB18030",
+                                     "BIG5", "TIS-620", 0 };
+  for(const char ** prefix = prefixes; *prefix; ++prefix)
+  {
+    if(codeset.compare(0, strlen(*prefix), *prefix) == 0)
+      return true;
+  }
+  return false;
+}
+
+/* Bytes whose high bit is set in a 64 bits word. */
+#define CODESET_HIGH_BITS 0x8080808080808080ULL
+
+/**
+  * Is the string pure ASCII? Checks 8 bytes at a time.
+  */
+static bool
+isAscii(const std::string & str)
+{
+  const unsigned char * p = (const unsigned char *) str.data();
+  size_t n = str.size();
+  for(; n >= 8; p += 8, n -= 8)
+  {
+    uint64 word;
+    memcpy(&word, p, 8);
+    if(word & CODESET_HIGH_BITS)
+      return false;
+  }
+  for(; n > 0; ++p, --n)
+  {
+    if(*p & 0x80)
+      return false;
+  }
+  return true;
+}
+
+/**
+  * Is the string valid UTF-8 (no overlong forms, surrogates or code points above U+10FFFF)?
+  * Runs of ASCII are skipped 8 bytes at a time.
+  */
+static bool
+isUtf8(const std::string & str)
+{
+  const unsigned char * s = (const unsigned char *) str.data();
+  size_t i = 0, n = str.size();
+  while(i < n)
+  {
+    if(n - i >= 8)
+    {
+      uint64 word;
+      memcpy(&word, s + i, 8);
+      if(! (word & CODESET_HIGH_BITS))
+      {
+        i += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = s[i];
+    if(c < 0x80)
+    {
+      ++i;
+      continue;
+    }
+
+    size_t len;
+    uint32 cp, min;
+    if((c & 0xe0) == 0xc0)
+    {
+      len = 2; cp = c & 0x1f; min = 0x80;
+    }
+    else if((c & 0xf0) == 0xe0)
+    {
+      len = 3; cp = c & 0x0f; min = 0x800;
+    }
+    else if((c & 0xf8) == 0xf0)
+    {
+      len = 4; cp = c & 0x07; min = 0x10000;
+    }
+    else
+      return false;
+
+    if(n - i < len)
+      return false;
+    for(size_t k = 1; k < len; ++k)
+    {
+      unsigned char cc = s[i + k];
+      if((cc & 0xc0) != 0x80)
+        return false;
+      cp = (cp << 6) | (cc & 0x3f);
+    }
+    if((cp < min) || (cp > 0x10ffff) || ((cp >= 0xd800) && (cp <= 0xdfff)))
+      return false;
+    i += len;
+  }
+  return true;
+}
 
 Museek::CodesetManager::CodesetManager(Museekd * museekd) : m_Museekd(museekd)
 {
+  m_NetToUtf8 = m_Utf8ToNet = m_FSToNet = m_NetToFS = m_FSToUtf8 = m_Utf8ToFS = 0;
+  museekd->config()->keySetEvent.connect(this, &CodesetManager::onConfigKeySet);
+  museekd->config()->keyRemovedEvent.connect(this, &CodesetManager::onConfigKeyRemoved);
 }
 
 Museek::CodesetManager::~CodesetManager()
 {
   /* Free all the stored iconv contexts. */
-  std::map<std::pair<std::string, std::string>, iconv_t>::iterator it, end = m_Contexts.end();
-  for(it = m_Contexts.begin(); it != end; ++it)
-    iconv_close((*it).second);
+  std::map<std::pair<std::string, std::string>, Converter>::iterator it, end = m_Converters.end();
+  for(it = m_Converters.begin(); it != end; ++it)
+    iconv_close((*it).second.context);
 }
 
 std::string
 Museek::CodesetManager::convert(const std::string & from, const std::string & to, const std::string & str)
+{
+  return convert(getConverter(from, to), str);
+}
+
+std::string
+Museek::CodesetManager::convert(Converter * converter, const std::string & str)
 {
   /* No point in trying to convert an empty string. */
   if(str.empty())
     return str;
 
+  /* Nothing would change: ASCII between ASCII compatible character sets,
+     or valid UTF-8 to UTF-8. */
+  if(converter->ascii && isAscii(str))
+    return str;
+  if(converter->utf8 && isUtf8(str))
+    return str;
+
   /* Get our iconv conversion context. */
-  iconv_t context = getContext(from, to);
+  iconv_t context = converter->context;
   /* Guess and allocate a buffer. str.size() * 4 should be enough to hold a
      converted string to any character set, even UTF32. */
   size_t buf_len = str.size() * 4 + 1;
@@ -143,34 +278,57 @@ Museek::CodesetManager::toRoom(const std::string & room, const std::string & str
     return convert("UTF-8", getNetworkCodeset("encoding.rooms", room), str);
 }
 
+/**
+  * Converters of a peer, picked once
+  */
+const Museek::CodesetManager::PeerConverters &
+Museek::CodesetManager::getPeerConverters(const std::string & peer)
+{
+  std::map<std::string, PeerConverters>::iterator it = m_PeerConverters.find(peer);
+  if(it != m_PeerConverters.end())
+    return (*it).second;
+
+  // We hear from lots of peers: don't remember them all
+  if(m_PeerConverters.size() >= CODESET_PEERS_MAX)
+    m_PeerConverters.clear();
+
+  std::string codeset = getNetworkCodeset("encoding.users", peer);
+  PeerConverters & converters = m_PeerConverters[peer];
+  converters.fromPeer = getConverter(codeset, "UTF-8");
+  converters.toPeer = getConverter("UTF-8", codeset);
+  return converters;
+}
+
 std::string
 Museek::CodesetManager::fromPeer(const std::string & peer, const std::string & str)
 {
-  return convert(getNetworkCodeset("encoding.users", peer), "UTF-8", str);
+  return convert(getPeerConverters(peer).fromPeer, str);
 }
 
 std::string
 Museek::CodesetManager::toPeer(const std::string & peer, const std::string & str)
 {
-    return convert("UTF-8", getNetworkCodeset("encoding.users", peer), str);
+  return convert(getPeerConverters(peer).toPeer, str);
 }
 
 std::string
 Museek::CodesetManager::fromFSToNet(const std::string & str, bool slashes)
 {
-    std::string strToConvert = str;
+    if (! m_FSToNet)
+        m_FSToNet = getConverter(getNetworkCodeset("encoding", "filesystem"), getNetworkCodeset("encoding", "network"));
     if (slashes)
-        strToConvert = str_replace(str, NewNet::Path::separator(), '\\');
-    return convert(getNetworkCodeset("encoding", "filesystem"), getNetworkCodeset("encoding", "network"), strToConvert);
+        return convert(m_FSToNet, str_replace(str, NewNet::Path::separator(), '\\'));
+    return convert(m_FSToNet, str);
 }
 
 std::string
 Museek::CodesetManager::fromNetToFS(const std::string & str, bool slashes)
 {
-    std::string strToConvert = str;
+    if (! m_NetToFS)
+        m_NetToFS = getConverter(getNetworkCodeset("encoding", "network"), getNetworkCodeset("encoding", "filesystem"));
     if (slashes)
-        strToConvert = str_replace(str, '\\', NewNet::Path::separator());
-    return convert(getNetworkCodeset("encoding", "network"), getNetworkCodeset("encoding", "filesystem"), strToConvert);
+        return convert(m_NetToFS, str_replace(str, '\\', NewNet::Path::separator()));
+    return convert(m_NetToFS, str);
 }
 
 std::string
@@ -194,61 +352,98 @@ Museek::CodesetManager::fromPeerToFS(const std::string & peer, const std::string
 std::string
 Museek::CodesetManager::fromUtf8ToFS(const std::string & str, bool slashes)
 {
-    std::string strToConvert = str;
+    if (! m_Utf8ToFS)
+        m_Utf8ToFS = getConverter("UTF-8", getNetworkCodeset("encoding", "filesystem"));
     if (slashes)
-        strToConvert = str_replace(str, '\\', NewNet::Path::separator());
-    return fromUtf8(getNetworkCodeset("encoding", "filesystem"), strToConvert);
+        return convert(m_Utf8ToFS, str_replace(str, '\\', NewNet::Path::separator()));
+    return convert(m_Utf8ToFS, str);
 }
 
 std::string
 Museek::CodesetManager::fromFsToUtf8(const std::string & str, bool slashes)
 {
-    std::string strToConvert = str;
+    if (! m_FSToUtf8)
+        m_FSToUtf8 = getConverter(getNetworkCodeset("encoding", "filesystem"), "UTF-8");
     if (slashes)
-        strToConvert = str_replace(str, NewNet::Path::separator(), '\\');
-    return toUtf8(getNetworkCodeset("encoding", "filesystem"), strToConvert);
+        return convert(m_FSToUtf8, str_replace(str, NewNet::Path::separator(), '\\'));
+    return convert(m_FSToUtf8, str);
 }
 
 std::string
 Museek::CodesetManager::fromNet(const std::string & str)
 {
-    return convert(getNetworkCodeset("encoding", "network"), "UTF-8", str);
+    if (! m_NetToUtf8)
+        m_NetToUtf8 = getConverter(getNetworkCodeset("encoding", "network"), "UTF-8");
+    return convert(m_NetToUtf8, str);
 }
 
 std::string
 Museek::CodesetManager::toNet(const std::string & str)
 {
-    return convert("UTF-8", getNetworkCodeset("encoding", "network"), str);
+    if (! m_Utf8ToNet)
+        m_Utf8ToNet = getConverter("UTF-8", getNetworkCodeset("encoding", "network"));
+    return convert(m_Utf8ToNet, str);
 }
 
 std::string
 Museek::CodesetManager::fromUtf8ToNet(const std::string & str)
 {
-    return fromUtf8(getNetworkCodeset("encoding", "network"), str);
+    return toNet(str);
 }
 
 std::string
 Museek::CodesetManager::fromNetToUtf8(const std::string & str)
 {
-    return toUtf8(getNetworkCodeset("encoding", "network"), str);
+    return fromNet(str);
 }
 
-iconv_t
-Museek::CodesetManager::getContext(const std::string & from, const std::string & to)
+Museek::CodesetManager::Converter *
+Museek::CodesetManager::getConverter(const std::string & from, const std::string & to)
 {
-  // This is the context store key.
+  // This is the converter store key.
   std::pair<std::string, std::string> key(from, to);
-  // Check if we've already constructed this iconv context.
-  std::map<std::pair<std::string, std::string>, iconv_t>::iterator it;
-  it = m_Contexts.find(key);
-  if(it != m_Contexts.end())
-    return (*it).second;
+  // Check if we've already constructed this converter.
+  std::map<std::pair<std::string, std::string>, Converter>::iterator it;
+  it = m_Converters.find(key);
+  if(it != m_Converters.end())
+    return &(*it).second;
 
   // Create the iconv context for this conversion.
   iconv_t context = iconv_open(to.c_str(), from.c_str());
   // Currently, we don't handle invalid contexts very well.
   assert(context != (iconv_t)-1);
-  // Store the context for future use.
-  m_Contexts[key] = context;
-  return context;
+
+  // Store the converter for future use.
+  Converter & converter = m_Converters[key];
+  converter.context = context;
+  std::string fromName(normalizeCodeset(from)), toName(normalizeCodeset(to));
+  converter.ascii = isAsciiCompatible(fromName) && isAsciiCompatible(toName);
+  converter.utf8 = (fromName == "UTF-8") && (toName == "UTF-8");
+  return &converter;
+}
+
+void
+Museek::CodesetManager::resetConverters()
+{
+  m_NetToUtf8 = m_Utf8ToNet = m_FSToNet = m_NetToFS = m_FSToUtf8 = m_Utf8ToFS = 0;
+  // Peers without a character set of their own use the network one
+  m_PeerConverters.clear();
+}
+
+void
+Museek::CodesetManager::onConfigKeySet(const ConfigManager::ChangeNotify * data)
+{
+  if(data->domain == "encoding")
+    resetConverters();
+  else if(data->domain == "encoding.users")
+    m_PeerConverters.erase(data->key);
+}
+
+void
+Museek::CodesetManager::onConfigKeyRemoved(const ConfigManager::RemoveNotify * data)
+{
+  if(data->domain == "encoding")
+    resetConverters();
+  else if(data->domain == "encoding.users")
+    m_PeerConverters.erase(data->key);
 }
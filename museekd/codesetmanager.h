@@ -23,10 +23,14 @@
 
 #include <NewNet/nnobject.h>
 #include <NewNet/nnweakrefptr.h>
+#include "configmanager.h"
 #include <string>
 #include <map>
 #include <iconv.h>
 
+/* Maximum number of peers whose converters are remembered. */
+#define CODESET_PEERS_MAX 4096
+
 namespace Museek
 {
   class Museekd;
@@ -96,15 +100,42 @@ namespace Museek
     std::string fromNetToUtf8(const std::string & str);
 
   private:
+    /* A conversion from a character set to another. */
+    struct Converter
+    {
+      iconv_t context;  // Iconv context (opened when first needed)
+      bool ascii;       // Both sides encode ASCII as ASCII
+      bool utf8;        // Both sides are UTF-8
+    };
+
+    /* The converters from and to a peer's character set. */
+    struct PeerConverters
+    {
+      Converter * fromPeer, * toPeer;
+    };
+
     /* Get the character set for an object from the configuration */
     std::string getNetworkCodeset(const std::string & domain, const std::string & key) const;
-    /* Get an iconv conversion context from character set 'from' to 'to'. */
-    iconv_t getContext(const std::string & from, const std::string & to);
+    /* Get the converter from character set 'from' to 'to'. */
+    Converter * getConverter(const std::string & from, const std::string & to);
+    /* Get (and remember) the converters of a peer. */
+    const PeerConverters & getPeerConverters(const std::string & peer);
+    /* Convert 'str', without iconv when it wouldn't change anything. */
+    std::string convert(Converter * converter, const std::string & str);
+    /* Forget the converters picked for the configured character sets. */
+    void resetConverters();
+
+    void onConfigKeySet(const ConfigManager::ChangeNotify * data);
+    void onConfigKeyRemoved(const ConfigManager::RemoveNotify * data);
 
     /* Weak reference to museekd instance. */
     NewNet::WeakRefPtr<Museekd> m_Museekd;
-    /* Iconv context cache. */
-    std::map<std::pair<std::string, std::string>, iconv_t> m_Contexts;
+    /* Converter cache (by character sets). */
+    std::map<std::pair<std::string, std::string>, Converter> m_Converters;
+    /* Converters picked for the network and filesystem character sets (0 until needed). */
+    Converter * m_NetToUtf8, * m_Utf8ToNet, * m_FSToNet, * m_NetToFS, * m_FSToUtf8, * m_Utf8ToFS;
+    /* Converters picked for each peer. */
+    std::map<std::string, PeerConverters> m_PeerConverters;
   };
 }
 
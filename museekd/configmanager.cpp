@@ -22,18 +22,31 @@
 # include "config.h"
 #endif // HAVE_CONFIG_H
 #include "configmanager.h"
+#include "museekd.h"
+#include "diskio.h"
 #include <NewNet/nnlog.h>
+#include <NewNet/nnreactor.h>
 #include <libxml/parser.h>
 #include <libxml/tree.h>
 #include <cstring>
+#include <cstdio>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-Museek::ConfigManager::ConfigManager() : m_AutoSave(true)
+Museek::ConfigManager::ConfigManager(Museekd * museekd) : m_Museekd(museekd), m_AutoSave(true), m_Dirty(false)
 {
   /* Check if the libxml we linked against when ConfigManager was compiled
      is compatible with the libxml version we're linked against at runtime. */
   LIBXML_TEST_VERSION;
 }
 
+Museek::ConfigManager::~ConfigManager()
+{
+  if(m_SaveTimeout.isValid() && m_Museekd.isValid())
+    museekd()->reactor()->removeTimeout(m_SaveTimeout);
+}
+
 bool
 Museek::ConfigManager::load(const std::string & path)
 {
@@ -123,58 +136,244 @@ Museek::ConfigManager::load(const std::string & path)
   return true;
 }
 
-bool
-Museek::ConfigManager::save(const std::string & path) const
+/**
+  * Append text to an XML document, escaping what has to be
+  */
+static void
+appendEscaped(std::string & out, const std::string & text, bool attribute)
 {
-  // Check if we know where to save the configuration.
-  if(path.empty() && m_Path.empty())
+  std::string::const_iterator it, end = text.end();
+  for(it = text.begin(); it != end; ++it)
   {
-    NNLOG("museekd.config.warn", "No path to save configuration to specified.");
-    return false;
+    unsigned char c = *it;
+    switch(c)
+    {
+      case '&': out += "&amp;"; break;
+      case '<': out += "&lt;"; break;
+      case '>': out += "&gt;"; break;
+      case '"':
+        if(attribute)
+          out += "&quot;";
+        else
+          out += c;
+        break;
+      case '\n':
+      case '\t':
+        if(attribute)
+        {
+          char x[8];
+          snprintf(x, 8, "&#%u;", c);
+          out += x;
+        }
+        else
+          out += c;
+        break;
+      default:
+        if(c < 0x20)
+        {
+          // Like libxml, keep other control characters as references
+          char x[8];
+          snprintf(x, 8, "&#%u;", c);
+          out += x;
+        }
+        else
+          out += c;
+    }
   }
+}
 
-  NNLOG("museekd.config.config.debug", "Saving configuration to '%s'.", path.empty() ? m_Path.c_str() : path.c_str());
-
-  // Build the xml document.
-  xmlDocPtr doc = xmlNewDoc((const xmlChar *)"1.0");
-  // Create and set the root node (<museekd>).
-  xmlNodePtr rootNode = xmlNewNode(NULL, (const xmlChar *)"museekd");
-  xmlDocSetRootElement(doc, rootNode);
+/**
+  * Write the configuration as a stream instead of building a tree first
+  */
+std::string
+Museek::ConfigManager::serialize() const
+{
+  std::string out("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<museekd>\n");
 
   // Iterate over the domains.
   Config::const_iterator it, end = m_Config.end();
   for(it = m_Config.begin(); it != end; ++it)
   {
-    // Create a <domain> element for this domain.
-    xmlNodePtr domainNode = xmlNewChild(rootNode, NULL, (const xmlChar *)"domain", NULL);
-    // Set the id property of the domain element.
-    xmlNewProp(domainNode, (const xmlChar *)"id", (const xmlChar *)(*it).first.c_str());
+    out += "  <domain id=\"";
+    appendEscaped(out, (*it).first, true);
+    out += "\">\n";
     // Iterate over the domain's keys.
     Domain::const_iterator it2, end2 = (*it).second.end();
     for(it2 = (*it).second.begin(); it2 != end2; ++it2)
     {
-      xmlNodePtr keyNode;
-      /* If the key has a value, create a new key node with the appropriate
-         value. */
-      if(! (*it2).second.empty())
-        keyNode = xmlNewChild(domainNode, NULL, (const xmlChar *)"key", (const xmlChar *)(*it2).second.c_str());
+      out += "    <key id=\"";
+      appendEscaped(out, (*it2).first, true);
+      // A key without value is an empty element.
+      if((*it2).second.empty())
+        out += "\"/>\n";
       else
-        keyNode = xmlNewChild(domainNode, NULL, (const xmlChar *)"key", NULL);
-      // Set the key's id property.
-      xmlNewProp(keyNode, (const xmlChar *)"id", (const xmlChar *)(*it2).first.c_str());
+      {
+        out += "\">";
+        appendEscaped(out, (*it2).second, false);
+        out += "</key>\n";
+      }
     }
+    out += "  </domain>\n";
+  }
+
+  out += "</museekd>\n";
+  return out;
+}
+
+/**
+  * Give the file we've written (and synced) the permissions of the one it replaces, then replace it
+  */
+static bool
+replaceFile(const std::string & from, const std::string & to)
+{
+  struct stat st;
+  if(stat(to.c_str(), &st) == 0)
+    chmod(from.c_str(), st.st_mode & 07777);
+#ifdef WIN32
+  unlink(to.c_str());
+#endif // WIN32
+  return rename(from.c_str(), to.c_str()) == 0;
+}
+
+/**
+  * Make the rename of a file of this directory durable
+  */
+static void
+syncDirectory(const std::string & path)
+{
+#ifndef WIN32
+  std::string::size_type ix = path.find_last_of('/');
+  std::string dir = (ix == std::string::npos) ? std::string(".") : path.substr(0, ix ? ix : 1);
+  int fd = open(dir.c_str(), O_RDONLY);
+  if(fd == -1)
+    return;
+  fsync(fd);
+  close(fd);
+#endif // WIN32
+}
+
+bool
+Museek::ConfigManager::save(const std::string & path) const
+{
+  // Check if we know where to save the configuration.
+  if(path.empty() && m_Path.empty())
+  {
+    NNLOG("museekd.config.warn", "No path to save configuration to specified.");
+    return false;
   }
 
-  // Save the xml document.
-  xmlSaveFormatFileEnc(path.empty() ? m_Path.c_str() : path.c_str(), doc, "UTF-8", 1);
+  const std::string & target = path.empty() ? m_Path : path;
+  NNLOG("museekd.config.config.debug", "Saving configuration to '%s'.", target.c_str());
 
-  // Clean up.
-  xmlFreeDoc(doc);
-  xmlCleanupParser();
+  // Write a temporary file and put it in place: the configuration is never half written.
+  std::string data(serialize());
+  std::string temp(target + ".tmp");
+  FILE * file = fopen(temp.c_str(), "wb");
+  if(! file)
+  {
+    NNLOG("museekd.config.warn", "Could not write configuration file '%s'.", temp.c_str());
+    return false;
+  }
+  // It must be on the disk before it replaces the old one
+  bool written = (fwrite(data.data(), 1, data.size(), file) == data.size()) && (fflush(file) == 0);
+#ifndef WIN32
+  written = written && (fsync(fileno(file)) == 0);
+#endif // WIN32
+  written = (fclose(file) == 0) && written;
+  if(! written || ! replaceFile(temp, target))
+  {
+    NNLOG("museekd.config.warn", "Could not save configuration to '%s'.", target.c_str());
+    unlink(temp.c_str());
+    return false;
+  }
+  syncDirectory(target);
 
   return true;
 }
 
+/**
+  * Something has changed: save it in a little while, with whatever changes by then
+  */
+void
+Museek::ConfigManager::scheduleSave()
+{
+  m_Dirty = true;
+  // Wait for the save in progress: it will start another one
+  if(m_SaveTimeout.isValid() || m_SaveFile || m_Path.empty() || ! m_Museekd.isValid())
+    return;
+  m_SaveTimeout = museekd()->reactor()->addTimeout(CONFIG_SAVE_DELAY, this, &ConfigManager::onSaveTimeout);
+}
+
+/**
+  * Hand the configuration to the disk I/O workers
+  */
+void
+Museek::ConfigManager::onSaveTimeout(long)
+{
+  if(! m_Dirty)
+    return;
+  m_Dirty = false;
+
+  NNLOG("museekd.config.config.debug", "Saving configuration to '%s' in the background.", m_Path.c_str());
+
+  // Not the same temporary file as save(): flush() may write it while this one is still being written
+  m_SaveFile = new AsyncFile(museekd()->diskIO(), m_Path + ".new", true);
+  if(! m_SaveFile->isOpen() || ! m_SaveFile->truncate(0))
+  {
+    NNLOG("museekd.config.warn", "Could not write configuration file '%s.new', saving it now.", m_Path.c_str());
+    m_SaveFile->close();
+    m_SaveFile = 0;
+    save();
+    return;
+  }
+
+  std::string data(serialize());
+  m_SaveFile->closedEvent.connect(this, &ConfigManager::onSaveClosed);
+  m_SaveFile->append((const unsigned char *) data.data(), data.size());
+  // It must be on the disk before it replaces the old one
+  m_SaveFile->sync();
+  m_SaveFile->close();
+}
+
+/**
+  * The configuration has been written: put it in place
+  */
+void
+Museek::ConfigManager::onSaveClosed(AsyncFile * file)
+{
+  // flush() may have given up on it
+  if(file != m_SaveFile)
+    return;
+  m_SaveFile = 0;
+
+  std::string temp(m_Path + ".new");
+  if(file->failed() || ! replaceFile(temp, m_Path))
+  {
+    NNLOG("museekd.config.warn", "Could not save configuration to '%s' (error %i).", m_Path.c_str(), file->error());
+    unlink(temp.c_str());
+    m_Dirty = true;
+  }
+
+  // Save what has changed meanwhile
+  if(m_Dirty)
+    scheduleSave();
+}
+
+void
+Museek::ConfigManager::flush()
+{
+  if(m_SaveTimeout.isValid() && m_Museekd.isValid())
+    museekd()->reactor()->removeTimeout(m_SaveTimeout);
+
+  // The save in progress won't be put in place: the reactor doesn't run anymore
+  if(m_Dirty || m_SaveFile)
+  {
+    m_Dirty = false;
+    m_SaveFile = 0;
+    save();
+  }
+}
+
 /**
   * Update config.xml
   */
@@ -215,45 +414,61 @@ Museek::ConfigManager::get(const std::string & domain, const std::string & key,
 }
 
 unsigned int
-Museek::ConfigManager::getUint(const std::string & domain, const std::string & key, unsigned int defaultValue) const
+Museek::ConfigManager::parse(const std::string & value, unsigned int defaultValue)
 {
-  // Get the string value from the configuration.
-  std::string value(get(domain, key));
   if(value.empty())
     return defaultValue; // No such value, return the default value.
   return atol(value.c_str()); // Convert the string to an unsigned integer value.
 }
 
 int
-Museek::ConfigManager::getInt(const std::string & domain, const std::string & key, int defaultValue) const
+Museek::ConfigManager::parse(const std::string & value, int defaultValue)
 {
-  // Get the string value from the configuration.
-  std::string value(get(domain, key));
   if(value.empty())
     return defaultValue; // No such value, return the default value.
   return atol(value.c_str()); // Convert the string to a signed integer value.
 }
 
 double
-Museek::ConfigManager::getDouble(const std::string & domain, const std::string & key, double defaultValue) const
+Museek::ConfigManager::parse(const std::string & value, double defaultValue)
 {
-  // Get the string value from the configuration.
-  std::string value(get(domain, key));
   if(value.empty())
     return defaultValue; // No such value, return the default value.
   return strtod(value.c_str(), 0); // Convert the string to a double value.
 }
 
 bool
-Museek::ConfigManager::getBool(const std::string & domain, const std::string & key, bool defaultValue) const
+Museek::ConfigManager::parse(const std::string & value, bool defaultValue)
 {
-  // Get the string value from the configuration.
-  std::string value(get(domain, key));
   if(value.empty())
     return defaultValue; // No such value, return the default value.
   return value == "true"; // If the value is 'true' return true, false otherwise.
 }
 
+unsigned int
+Museek::ConfigManager::getUint(const std::string & domain, const std::string & key, unsigned int defaultValue) const
+{
+  return parse(get(domain, key), defaultValue);
+}
+
+int
+Museek::ConfigManager::getInt(const std::string & domain, const std::string & key, int defaultValue) const
+{
+  return parse(get(domain, key), defaultValue);
+}
+
+double
+Museek::ConfigManager::getDouble(const std::string & domain, const std::string & key, double defaultValue) const
+{
+  return parse(get(domain, key), defaultValue);
+}
+
+bool
+Museek::ConfigManager::getBool(const std::string & domain, const std::string & key, bool defaultValue) const
+{
+  return parse(get(domain, key), defaultValue);
+}
+
 void
 Museek::ConfigManager::set(const std::string & domain, const std::string & key, const std::string & value)
 {
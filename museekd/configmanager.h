@@ -23,11 +23,19 @@
 
 #include <NewNet/nnobject.h>
 #include <NewNet/nnevent.h>
+#include <NewNet/nnrefptr.h>
+#include <NewNet/nnweakrefptr.h>
 #include <string>
 #include <map>
 
+/* Time (ms) given to changes to pile up before the configuration is saved. */
+#define CONFIG_SAVE_DELAY 2000
+
 namespace Museek
 {
+  class Museekd;
+  class AsyncFile;
+
   class ConfigManager : public NewNet::Object
   {
   public:
@@ -48,15 +56,24 @@ namespace Museek
       std::string domain, key;
     };
 
-    ConfigManager();
+    ConfigManager(Museekd * museekd);
+    ~ConfigManager();
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
 
     /* Load configuration from given path. */
     bool load(const std::string & path);
     /* Save configuration to given path (or overwrite existing configuration
        if path == std::string(). */
     bool save(const std::string & path = std::string()) const;
+    /* Save the changes not saved yet now (blocking), e.g. before exiting. */
+    void flush();
+    /* Path to the last loaded configuration file. */
+    const std::string & path() const { return m_Path; }
 
-    /* Control wether changes are automatically saved. */
+    /* Control wether changes are automatically saved. Changes are saved by
+       the disk I/O workers, CONFIG_SAVE_DELAY after the first one. */
     void setAutoSave(bool autoSave)
     {
       m_AutoSave = autoSave;
@@ -94,6 +111,12 @@ namespace Museek
     /* Check if a key exists in the specified domain. */
     bool hasKey(const std::string & domain, const std::string & key) const;
 
+    /* Convert a string value (the default value is used if it's empty). */
+    static unsigned int parse(const std::string & value, unsigned int defaultValue);
+    static int parse(const std::string & value, int defaultValue);
+    static double parse(const std::string & value, double defaultValue);
+    static bool parse(const std::string & value, bool defaultValue);
+
     /* Get an immutable reference to the configuration data. */
     const Config & data() const
     {
@@ -116,23 +139,79 @@ namespace Museek
        the configuration. */
     NewNet::Event<const RemoveNotify *> keyRemovedEvent;
 
+    /* A value that is read often (T is unsigned int, int, double or bool).
+       It's parsed when the setting starts following its key and each time
+       the key is set or removed, so reading it costs nothing. */
+    template<typename T> class Setting : public NewNet::Object
+    {
+    public:
+      Setting() : m_Value(), m_Default()
+      {
+      }
+
+      /* Follow the value of this key of the configuration. */
+      void follow(ConfigManager * config, const std::string & domain, const std::string & key, T defaultValue)
+      {
+        m_Domain = domain;
+        m_Key = key;
+        m_Default = defaultValue;
+        m_Value = parse(config->get(domain, key), defaultValue);
+        config->keySetEvent.connect(this, &Setting::onKeySet);
+        config->keyRemovedEvent.connect(this, &Setting::onKeyRemoved);
+      }
+
+      /* The current value. */
+      T value() const
+      {
+        return m_Value;
+      }
+
+    private:
+      void onKeySet(const ChangeNotify * data)
+      {
+        if((data->key == m_Key) && (data->domain == m_Domain))
+          m_Value = parse(data->value, m_Default);
+      }
+
+      void onKeyRemoved(const RemoveNotify * data)
+      {
+        if((data->key == m_Key) && (data->domain == m_Domain))
+          m_Value = m_Default;
+      }
+
+      std::string m_Domain, m_Key;
+      T m_Value, m_Default;
+    };
+
   protected:
     /* Save configuration is auto-save is enabled. */
-    void doAutoSave() const
+    void doAutoSave()
     {
       if(m_AutoSave)
-        save();
+        scheduleSave();
     }
 
   private:
+    /* The configuration as an XML document. */
+    std::string serialize() const;
+    void scheduleSave();
+    void onSaveTimeout(long);
+    void onSaveClosed(AsyncFile * file);
+
     /* Helper function to easily emit a key set event. */
     void emitKeySetEvent(const std::string & key, const std::string & domain, const std::string & value);
 
     /* Update config.xml */
     void updateConfigFile();
 
+    NewNet::WeakRefPtr<Museekd> m_Museekd;
     /* Wether auto-save is enabled. */
     bool m_AutoSave;
+    /* Are there changes that no save has picked up yet? */
+    bool m_Dirty;
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_SaveTimeout;
+    /* The file being written by the disk I/O workers (renamed when it's done). */
+    NewNet::RefPtr<AsyncFile> m_SaveFile;
     /* Path to the last loaded configuration file. */
     std::string m_Path;
     /* The configuration data. */
@@ -0,0 +1,993 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "diskio.h"
+#include "museekd.h"
+#include "configmanager.h"
+#include <NewNet/nnreactor.h>
+#include <NewNet/nnlog.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#ifndef WIN32
+#include <unistd.h>
+#else
+#include <io.h>
+#endif // WIN32
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/statvfs.h>
+#endif // __linux__
+
+/* Maximum number of workers. */
+#define DISKIO_MAX_THREADS 16
+/* Writes kept in memory end on a multiple of this. */
+#define WRITE_ALIGN (64 * 1024)
+/* Disk space left free when preallocating files. */
+#define ALLOCATE_RESERVE (64 * 1024 * 1024)
+/* Buffer used to copy when the kernel can't do it for us. */
+#define COPY_BUFFER (1024 * 1024)
+
+Museek::AsyncFile::AsyncFile(DiskIO * diskIO, const std::string & path, bool write) : m_DiskIO(diskIO), m_Path(path)
+{
+    m_Size = 0;
+    m_Error = 0;
+    m_Pending = 0;
+    m_ReadWanted = false;
+    m_ReadOffset = 0;
+    m_ReadSize = 0;
+    m_InFlight = false;
+    m_Closing = false;
+    m_Written = 0;
+    m_WriteEnd = 0;
+    m_WriteBehind = 0;
+    m_Flushing = false;
+    m_SyncWanted = false;
+    m_AllocateSize = 0;
+    m_Fingerprint = 0;
+
+    if (write)
+        m_FD = ::open(path.c_str(), O_WRONLY | O_CREAT, 0666);
+    else
+        m_FD = ::open(path.c_str(), O_RDONLY);
+
+    if (m_FD == -1) {
+        m_Error = errno;
+        return;
+    }
+
+    struct stat st;
+    if (fstat(m_FD, &st) == 0)
+        m_Size = st.st_size;
+    m_Written = m_Size;
+    m_WriteEnd = m_Size;
+}
+
+Museek::AsyncFile::~AsyncFile()
+{
+    // Nothing is in flight: the workers hold a reference while they're busy with us
+    if (m_FD != -1)
+        ::close(m_FD);
+    delete m_Fingerprint;
+}
+
+/**
+  * Append some data at the end of the file
+  */
+void
+Museek::AsyncFile::append(const unsigned char * data, size_t n)
+{
+    if (m_FD == -1 || m_Closing || n == 0)
+        return;
+
+    m_Writes.insert(m_Writes.end(), data, data + n);
+    m_Pending += n;
+    m_WriteEnd += n;
+    if (m_WriteEnd > m_Size)
+        m_Size = m_WriteEnd;
+    submit();
+}
+
+/**
+  * Write the next appended data at the given offset instead of the end of the file
+  */
+bool
+Museek::AsyncFile::setWritePosition(uint64 offset)
+{
+    if (m_FD == -1 || m_Pending)
+        return false;
+
+    m_WriteEnd = offset;
+    if (m_WriteEnd > m_Size)
+        m_Size = m_WriteEnd;
+    return true;
+}
+
+/**
+  * Keep appended data in memory until there's that many bytes to write
+  */
+void
+Museek::AsyncFile::setWriteBehind(size_t bytes)
+{
+    m_WriteBehind = bytes;
+    submit();
+}
+
+/**
+  * Write the data kept in memory now
+  */
+void
+Museek::AsyncFile::flush()
+{
+    if (m_Writes.empty())
+        return;
+
+    m_Flushing = true;
+    submit();
+}
+
+/**
+  * Write what's appended so far, then flush it to the disk
+  */
+void
+Museek::AsyncFile::sync()
+{
+    if (m_FD == -1 || m_Closing)
+        return;
+
+    m_SyncWanted = true;
+    submit();
+}
+
+/**
+  * Reserve disk space for a file that will grow to the given size
+  */
+void
+Museek::AsyncFile::preallocate(uint64 size)
+{
+    if (m_FD == -1 || m_Closing || size <= m_Size)
+        return;
+
+    m_AllocateSize = size;
+    submit();
+}
+
+/**
+  * Cut the file to the given size. Only possible when nothing is waiting to be written.
+  */
+bool
+Museek::AsyncFile::truncate(uint64 size)
+{
+    if (m_FD == -1 || m_InFlight || m_Pending || size > m_Size)
+        return false;
+
+    if (ftruncate(m_FD, size) == -1) {
+        m_Error = errno;
+        return false;
+    }
+
+    m_Size = m_Written = m_WriteEnd = size;
+    return true;
+}
+
+/**
+  * Hash what's written (or read) from now on, after what the fingerprint already covers
+  */
+void
+Museek::AsyncFile::setFingerprint(const Fingerprint & fingerprint)
+{
+    if (m_InFlight)
+        return; // The workers may be using the current one
+
+    delete m_Fingerprint;
+    m_Fingerprint = new Fingerprint(fingerprint);
+    m_Fingerprinted = fingerprint;
+}
+
+/**
+  * The data isn't sequential anymore: forget about the fingerprint
+  */
+void
+Museek::AsyncFile::stopFingerprinting()
+{
+    if (!m_Fingerprint)
+        return;
+
+    NNLOG("museekd.debug", "Not fingerprinting '%s' anymore.", m_Path.c_str());
+    delete m_Fingerprint;
+    m_Fingerprint = 0;
+}
+
+/**
+  * Read n bytes from offset. readEvent will be emitted when it's done.
+  */
+void
+Museek::AsyncFile::read(uint64 offset, size_t n)
+{
+    if (m_FD == -1 || m_Closing)
+        return;
+
+    m_ReadWanted = true;
+    m_ReadOffset = offset;
+    m_ReadSize = n;
+    submit();
+}
+
+/**
+  * Close the file once every request is done
+  */
+void
+Museek::AsyncFile::close()
+{
+    if (m_Closing)
+        return;
+
+    m_Closing = true;
+    submit();
+}
+
+/**
+  * Is there any request not done yet?
+  */
+bool
+Museek::AsyncFile::busy() const
+{
+    return m_InFlight || !m_Writes.empty() || m_ReadWanted || m_SyncWanted || (m_Closing && m_FD != -1);
+}
+
+/**
+  * Hand the next request to the workers if none is being processed
+  */
+void
+Museek::AsyncFile::submit()
+{
+    if (m_InFlight || !m_DiskIO.isValid())
+        return;
+
+    DiskRequest * request;
+    if (m_AllocateSize) {
+        request = new DiskRequest;
+        request->op = DiskRequest::Allocate;
+        request->offset = m_Size;
+        request->size = m_AllocateSize - m_Size;
+        m_AllocateSize = 0;
+    }
+    else if (!m_Writes.empty() && (m_Writes.size() >= m_WriteBehind || m_Closing || m_Flushing || m_SyncWanted)) {
+        // Everything appended since the last write is written at once
+        request = new DiskRequest;
+        request->op = DiskRequest::Write;
+        request->offset = m_WriteEnd - m_Pending;
+        request->data.swap(m_Writes);
+        if (m_WriteBehind && !m_Closing && !m_Flushing && !m_SyncWanted) {
+            // End the write on an aligned offset, keep the rest for the next one
+            uint64 end = (request->offset + request->data.size()) / WRITE_ALIGN * WRITE_ALIGN;
+            if (end > request->offset) {
+                size_t n = end - request->offset;
+                m_Writes.assign(request->data.begin() + n, request->data.end());
+                request->data.resize(n);
+            }
+        }
+        m_Flushing = false;
+    }
+    else if (m_ReadWanted) {
+        request = new DiskRequest;
+        request->op = DiskRequest::Read;
+        request->offset = m_ReadOffset;
+        request->size = m_ReadSize;
+        m_ReadWanted = false;
+    }
+    else if (m_SyncWanted) {
+        request = new DiskRequest;
+        request->op = DiskRequest::Sync;
+        m_SyncWanted = false;
+    }
+    else if (m_Closing && m_FD != -1) {
+        request = new DiskRequest;
+        request->op = DiskRequest::Close;
+    }
+    else
+        return;
+
+    request->fd = m_FD;
+    if (m_Fingerprint && (request->op == DiskRequest::Write || request->op == DiskRequest::Read)) {
+        if (request->offset == m_Fingerprint->size())
+            request->fingerprint = m_Fingerprint;
+        else
+            stopFingerprinting();
+    }
+    if (request->op == DiskRequest::Close)
+        m_FD = -1; // The workers own it now
+    m_InFlight = true;
+    m_DiskIO->submit(this, request);
+}
+
+/**
+  * A worker has done our request (called from the reactor)
+  */
+void
+Museek::AsyncFile::completed(DiskRequest * request)
+{
+    m_InFlight = false;
+
+    switch (request->op) {
+        case DiskRequest::Write:
+            m_Pending -= request->data.size();
+            if (request->result != -1)
+                m_Written += request->result;
+            else {
+                if (!m_Error)
+                    m_Error = request->error;
+                NNLOG("museekd.down.warn", "Couldn't write to '%s' (error %i).", m_Path.c_str(), request->error);
+                // Nothing more will be written
+                m_Pending = 0;
+                m_Writes.clear();
+            }
+            if (request->fingerprint) {
+                if (request->result == -1)
+                    stopFingerprinting();
+                else
+                    m_Fingerprinted = *m_Fingerprint;
+            }
+            submit();
+            writtenEvent(this);
+            break;
+
+        case DiskRequest::Read:
+            if (request->result == -1) {
+                if (!m_Error)
+                    m_Error = request->error;
+                NNLOG("museekd.up.warn", "Couldn't read from '%s' (error %i).", m_Path.c_str(), request->error);
+                m_Data.clear();
+            }
+            else {
+                m_Data.swap(request->data);
+                m_Data.resize(request->result);
+            }
+            if (request->fingerprint) {
+                if (request->result == -1)
+                    stopFingerprinting();
+                else
+                    m_Fingerprinted = *m_Fingerprint;
+            }
+            submit();
+            readEvent(this);
+            break;
+
+        case DiskRequest::Allocate:
+            if (request->result == -1)
+                NNLOG("museekd.down.debug", "Didn't preallocate '%s' (error %i).", m_Path.c_str(), request->error);
+            submit();
+            break;
+
+        case DiskRequest::Sync:
+            if (request->result == -1) {
+                if (!m_Error)
+                    m_Error = request->error;
+                NNLOG("museekd.warn", "Couldn't sync '%s' (error %i).", m_Path.c_str(), request->error);
+            }
+            submit();
+            break;
+
+        case DiskRequest::Close:
+            closedEvent(this);
+            break;
+
+        default: ;
+    }
+}
+
+
+Museek::FileMove::FileMove(DiskIO * diskIO, const std::string & source, const std::string & destination) :
+                    m_DiskIO(diskIO), m_Source(source), m_Destination(destination)
+{
+    m_Step = Renaming;
+    m_SourceFD = -1;
+    m_DestFD = -1;
+    m_Size = 0;
+    m_Copied = 0;
+    m_Error = 0;
+}
+
+Museek::FileMove::~FileMove()
+{
+    // Nothing is in flight: the workers hold a reference while they're busy with us
+    if (m_SourceFD != -1)
+        ::close(m_SourceFD);
+    if (m_DestFD != -1)
+        ::close(m_DestFD);
+}
+
+/**
+  * Start moving the file: try to rename it first
+  */
+void
+Museek::FileMove::start()
+{
+    DiskRequest * req = request(DiskRequest::Rename);
+    req->path = m_Source;
+    req->destination = m_Destination;
+    submit(req);
+}
+
+Museek::DiskRequest *
+Museek::FileMove::request(DiskRequest::Operation op)
+{
+    DiskRequest * req = new DiskRequest;
+    req->op = op;
+    return req;
+}
+
+void
+Museek::FileMove::submit(DiskRequest * request)
+{
+    if (!m_DiskIO.isValid()) {
+        delete request;
+        return;
+    }
+    m_DiskIO->submit(this, request);
+}
+
+/**
+  * Copy the next extent, or close the files when everything has been copied
+  */
+void
+Museek::FileMove::copyNext()
+{
+    if (m_Copied < m_Size) {
+        DiskRequest * req = request(DiskRequest::Copy);
+        req->fd = m_SourceFD;
+        req->destFD = m_DestFD;
+        req->offset = m_Copied;
+        req->size = (m_Size - m_Copied > FILEMOVE_EXTENT) ? FILEMOVE_EXTENT : m_Size - m_Copied;
+        submit(req);
+        return;
+    }
+
+    // The destination is closed first: it may report a delayed write error
+    m_Step = Closing;
+    DiskRequest * req = request(DiskRequest::Close);
+    req->fd = m_DestFD;
+    m_DestFD = -1;
+    submit(req);
+}
+
+/**
+  * A worker has done our request (called from the reactor)
+  */
+void
+Museek::FileMove::completed(DiskRequest * request)
+{
+    switch (request->op) {
+        case DiskRequest::Rename:
+            if (request->result == 0) {
+                finish();
+                return;
+            }
+            if (request->error != EXDEV) {
+                NNLOG("museekd.down.warn", "Renaming '%s' to '%s' failed (error %i).", m_Source.c_str(), m_Destination.c_str(), request->error);
+                fail(request->error);
+                return;
+            }
+
+            // Different filesystems: we'll have to copy the file.
+            NNLOG("museekd.down.warn", "Having incomplete and download directory on different partitions is a bad idea!");
+            m_Step = Copying;
+            m_SourceFD = ::open(m_Source.c_str(), O_RDONLY);
+            if (m_SourceFD == -1) {
+                NNLOG("museekd.down.warn", "Couldn't open '%s' for reading.", m_Source.c_str());
+                fail(errno);
+                return;
+            }
+            m_DestFD = ::open(m_Destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+            if (m_DestFD == -1) {
+                NNLOG("museekd.down.warn", "Couldn't open '%s' for writing.", m_Destination.c_str());
+                fail(errno);
+                return;
+            }
+            struct stat st;
+            if (fstat(m_SourceFD, &st) == 0)
+                m_Size = st.st_size;
+            copyNext();
+            break;
+
+        case DiskRequest::Copy:
+            if (request->result <= 0) {
+                NNLOG("museekd.down.warn", "Couldn't copy '%s' to '%s'.", m_Source.c_str(), m_Destination.c_str());
+                fail(request->result == 0 ? EIO : request->error);
+                return;
+            }
+            m_Copied += request->result;
+            progressEvent(this);
+            copyNext();
+            break;
+
+        case DiskRequest::Close:
+            if (request->result == -1) {
+                NNLOG("museekd.down.warn", "Couldn't write to '%s'.", m_Destination.c_str());
+                fail(request->error);
+                return;
+            }
+            if (m_SourceFD != -1) {
+                DiskRequest * req = this->request(DiskRequest::Close);
+                req->fd = m_SourceFD;
+                m_SourceFD = -1;
+                submit(req);
+                return;
+            }
+
+            // Everything went ok. Remove the source file.
+            m_Step = Removing;
+            {
+                DiskRequest * req = this->request(DiskRequest::Unlink);
+                req->path = m_Source;
+                submit(req);
+            }
+            break;
+
+        case DiskRequest::Unlink:
+            if (request->result == -1)
+                NNLOG("museekd.down.warn", "Couldn't remove '%s'.", m_Source.c_str());
+            finish();
+            break;
+
+        default: ;
+    }
+}
+
+/**
+  * The move has failed. Don't leave half a copy behind.
+  */
+void
+Museek::FileMove::fail(int error)
+{
+    m_Error = error ? error : EIO;
+
+    if (m_SourceFD != -1) {
+        ::close(m_SourceFD);
+        m_SourceFD = -1;
+    }
+    if (m_Step != Renaming) {
+        if (m_DestFD != -1) {
+            ::close(m_DestFD);
+            m_DestFD = -1;
+        }
+        NNLOG("museekd.down.debug", "Removing '%s'.", m_Destination.c_str());
+        remove(m_Destination.c_str());
+    }
+
+    finish();
+}
+
+void
+Museek::FileMove::finish()
+{
+    m_Step = Done;
+    doneEvent(this);
+}
+
+
+Museek::DiskIO::Notifier::Notifier(DiskIO * diskIO, int fd) : m_DiskIO(diskIO)
+{
+    setDescriptor(fd);
+    setSocketState(SocketConnected);
+}
+
+/**
+  * Some requests are done: empty the pipe and complete them
+  */
+void
+Museek::DiskIO::Notifier::process()
+{
+#ifndef WIN32
+    if (readyState() & StateReceive) {
+        char buf[256];
+        while (::read(descriptor(), buf, sizeof(buf)) > 0)
+            ;
+        if (m_DiskIO.isValid())
+            m_DiskIO->dispatch();
+    }
+#endif // WIN32
+}
+
+
+Museek::DiskIO::DiskIO(Museekd * museekd) : m_Museekd(museekd)
+{
+    m_Started = false;
+#ifndef WIN32
+    pthread_mutex_init(&m_Mutex, 0);
+    pthread_cond_init(&m_Cond, 0);
+    m_Stopping = false;
+    m_Pipe[0] = m_Pipe[1] = -1;
+#endif // WIN32
+}
+
+Museek::DiskIO::~DiskIO()
+{
+#ifndef WIN32
+    // Let the workers finish what they have been given and stop them
+    pthread_mutex_lock(&m_Mutex);
+    m_Stopping = true;
+    pthread_cond_broadcast(&m_Cond);
+    pthread_mutex_unlock(&m_Mutex);
+
+    std::vector<pthread_t>::iterator it;
+    for (it = m_Threads.begin(); it != m_Threads.end(); ++it)
+        pthread_join(*it, 0);
+
+    if (m_Notifier.isValid() && m_Notifier->reactor())
+        m_Notifier->reactor()->remove(m_Notifier);
+    if (m_Pipe[0] != -1) {
+        ::close(m_Pipe[0]);
+        ::close(m_Pipe[1]);
+    }
+
+    pthread_cond_destroy(&m_Cond);
+    pthread_mutex_destroy(&m_Mutex);
+#endif // WIN32
+
+    while (!m_Done.empty()) {
+        delete m_Done.front();
+        m_Done.pop_front();
+    }
+
+    if (m_DispatchTimeout.isValid() && m_Museekd.isValid())
+        museekd()->reactor()->removeTimeout(m_DispatchTimeout);
+
+    NNLOG("museekd.debug", "Disk I/O destroyed");
+}
+
+/**
+  * Start the workers (the first time a request is made, the configuration is loaded by then)
+  */
+void
+Museek::DiskIO::start()
+{
+    m_Started = true;
+
+#ifndef WIN32
+    uint threads = museekd()->config()->getUint("transfers", "disk_threads", 2);
+    if (threads > DISKIO_MAX_THREADS)
+        threads = DISKIO_MAX_THREADS;
+    if (threads == 0)
+        return;
+
+    if (pipe(m_Pipe) == -1) {
+        NNLOG("museekd.warn", "Couldn't create the disk I/O pipe (error %i), disk access will block.", errno);
+        m_Pipe[0] = m_Pipe[1] = -1;
+        return;
+    }
+    fcntl(m_Pipe[0], F_SETFL, fcntl(m_Pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(m_Pipe[1], F_SETFL, fcntl(m_Pipe[1], F_GETFL) | O_NONBLOCK);
+
+    m_Notifier = new Notifier(this, m_Pipe[0]);
+    museekd()->reactor()->add(m_Notifier);
+
+    for (uint i = 0; i < threads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, &DiskIO::worker, this) == 0)
+            m_Threads.push_back(thread);
+    }
+
+    NNLOG("museekd.debug", "Started %u disk I/O workers.", m_Threads.size());
+#endif // WIN32
+}
+
+/**
+  * Run the request in a worker (or right now if there aren't any)
+  */
+void
+Museek::DiskIO::submit(DiskJob * job, DiskRequest * request)
+{
+    if (!m_Started)
+        start();
+
+    m_Busy[request] = job;
+
+#ifndef WIN32
+    if (!m_Threads.empty()) {
+        pthread_mutex_lock(&m_Mutex);
+        m_Queue.push_back(request);
+        pthread_cond_signal(&m_Cond);
+        pthread_mutex_unlock(&m_Mutex);
+        return;
+    }
+#endif // WIN32
+
+    // No workers: do it now but complete it later, as the workers would
+    perform(request);
+    m_Done.push_back(request);
+    if (!m_DispatchTimeout.isValid())
+        m_DispatchTimeout = museekd()->reactor()->addTimeout(0, this, &DiskIO::onDispatchTimeout);
+}
+
+void
+Museek::DiskIO::onDispatchTimeout(long)
+{
+    // Still valid while it runs: the requests made by the completions need another one
+    m_DispatchTimeout = 0;
+    dispatch();
+}
+
+/**
+  * Complete the requests done by the workers (called from the reactor)
+  */
+void
+Museek::DiskIO::dispatch()
+{
+    std::deque<DiskRequest *> done;
+#ifndef WIN32
+    pthread_mutex_lock(&m_Mutex);
+#endif // WIN32
+    done.swap(m_Done);
+#ifndef WIN32
+    pthread_mutex_unlock(&m_Mutex);
+#endif // WIN32
+
+    while (!done.empty()) {
+        DiskRequest * request = done.front();
+        done.pop_front();
+
+        std::map<DiskRequest *, NewNet::RefPtr<DiskJob> >::iterator it = m_Busy.find(request);
+        if (it != m_Busy.end()) {
+            // Keep the job alive while it handles the completion
+            NewNet::RefPtr<DiskJob> job = it->second;
+            m_Busy.erase(it);
+            job->completed(request);
+        }
+        delete request;
+    }
+}
+
+/**
+  * Do the actual disk access. May be called from any thread.
+  */
+void
+Museek::DiskIO::perform(DiskRequest * request)
+{
+    switch (request->op) {
+        case DiskRequest::Write: {
+            size_t written = 0;
+            while (written < request->data.size()) {
+#ifndef WIN32
+                ssize_t n = pwrite(request->fd, &request->data[written], request->data.size() - written, request->offset + written);
+#else
+                ssize_t n = -1;
+                if (lseek(request->fd, request->offset + written, SEEK_SET) != -1)
+                    n = ::write(request->fd, &request->data[written], request->data.size() - written);
+#endif // WIN32
+                if (n == -1 && errno == EINTR)
+                    continue;
+                if (n <= 0) {
+                    request->result = -1;
+                    request->error = (n == 0) ? ENOSPC : errno;
+                    return;
+                }
+                written += n;
+            }
+            request->result = written;
+            if (request->fingerprint && written > 0)
+                request->fingerprint->update(&request->data[0], written);
+            break;
+        }
+
+        case DiskRequest::Read: {
+            request->data.resize(request->size);
+            // There's no byte to point to
+            if (request->size == 0) {
+                request->result = 0;
+                break;
+            }
+            ssize_t n;
+            do {
+#ifndef WIN32
+                n = pread(request->fd, &request->data[0], request->size, request->offset);
+#else
+                n = -1;
+                if (lseek(request->fd, request->offset, SEEK_SET) != -1)
+                    n = ::read(request->fd, &request->data[0], request->size);
+#endif // WIN32
+            } while (n == -1 && errno == EINTR);
+            request->result = n;
+            if (n == -1)
+                request->error = errno;
+            else if (request->fingerprint)
+                request->fingerprint->update(&request->data[0], n);
+            break;
+        }
+
+        case DiskRequest::Sync:
+#ifndef WIN32
+            request->result = fsync(request->fd);
+#else
+            request->result = _commit(request->fd);
+#endif // WIN32
+            if (request->result == -1)
+                request->error = errno;
+            break;
+
+        case DiskRequest::Close:
+            request->result = ::close(request->fd);
+            if (request->result == -1)
+                request->error = errno;
+            break;
+
+        case DiskRequest::Copy:
+            request->result = copy(request);
+            break;
+
+        case DiskRequest::Allocate: {
+            request->result = -1;
+            request->error = ENOSYS;
+#if defined(__linux__) && defined(FALLOC_FL_KEEP_SIZE)
+            // Only when there's enough room left. The size of the file isn't changed:
+            // it still tells how much has been written.
+            struct statvfs st;
+            if (fstatvfs(request->fd, &st) == -1)
+                request->error = errno;
+            else if ((uint64)st.f_bavail * st.f_frsize < request->size + ALLOCATE_RESERVE)
+                request->error = ENOSPC;
+            else {
+                request->result = fallocate(request->fd, FALLOC_FL_KEEP_SIZE, request->offset, request->size);
+                if (request->result == -1)
+                    request->error = errno;
+            }
+#endif // __linux__ && FALLOC_FL_KEEP_SIZE
+            break;
+        }
+
+        case DiskRequest::Rename:
+#ifdef WIN32
+            // On Win32, rename doesn't overwrite an existing file automatically.
+            remove(request->destination.c_str());
+#endif // WIN32
+            request->result = rename(request->path.c_str(), request->destination.c_str());
+            if (request->result == -1)
+                request->error = errno;
+            break;
+
+        case DiskRequest::Unlink:
+            request->result = remove(request->path.c_str());
+            if (request->result == -1)
+                request->error = errno;
+            break;
+    }
+}
+
+/**
+  * Copy an extent from a file to another. Let the kernel do it when it can.
+  * Returns the number of bytes copied (less than asked at the end of the file), -1 on error.
+  */
+ssize_t
+Museek::DiskIO::copy(DiskRequest * request)
+{
+    size_t copied = 0;
+
+#if defined(__linux__) && defined(SYS_copy_file_range)
+    // No data goes through user space, and some filesystems copy it without even reading it
+    while (copied < request->size) {
+        loff_t in = request->offset + copied, out = in;
+        ssize_t n = syscall(SYS_copy_file_range, request->fd, &in, request->destFD, &out, request->size - copied, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            return copied;
+        if (n == -1) {
+            if (copied == 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL || errno == EOPNOTSUPP))
+                break; // Not supported here, try something else
+            request->error = errno;
+            return copied ? (ssize_t)copied : -1;
+        }
+        copied += n;
+    }
+    if (copied == request->size)
+        return copied;
+#endif // __linux__ && SYS_copy_file_range
+
+#ifdef __linux__
+    // sendfile writes at the current position of the destination
+    if (lseek(request->destFD, request->offset, SEEK_SET) != -1) {
+        off_t in = request->offset;
+        while (copied < request->size) {
+            ssize_t n = sendfile(request->destFD, request->fd, &in, request->size - copied);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n == 0)
+                return copied;
+            if (n == -1) {
+                if (copied == 0 && (errno == EINVAL || errno == ENOSYS))
+                    break; // Not supported here, copy it ourself
+                request->error = errno;
+                return copied ? (ssize_t)copied : -1;
+            }
+            copied += n;
+        }
+        if (copied == request->size)
+            return copied;
+    }
+#endif // __linux__
+
+    while (copied < request->size) {
+        DiskRequest chunk;
+        chunk.op = DiskRequest::Read;
+        chunk.fd = request->fd;
+        chunk.offset = request->offset + copied;
+        chunk.size = (request->size - copied > COPY_BUFFER) ? COPY_BUFFER : request->size - copied;
+        perform(&chunk);
+        if (chunk.result <= 0) {
+            request->error = chunk.error;
+            return copied ? (ssize_t)copied : chunk.result;
+        }
+
+        chunk.op = DiskRequest::Write;
+        chunk.fd = request->destFD;
+        chunk.data.resize(chunk.result);
+        perform(&chunk);
+        if (chunk.result == -1) {
+            request->error = chunk.error;
+            return -1;
+        }
+        copied += chunk.result;
+    }
+
+    return copied;
+}
+
+#ifndef WIN32
+void *
+Museek::DiskIO::worker(void * data)
+{
+    static_cast<DiskIO *>(data)->work();
+    return 0;
+}
+
+/**
+  * Worker loop: take a request, do it, tell the reactor
+  */
+void
+Museek::DiskIO::work()
+{
+    pthread_mutex_lock(&m_Mutex);
+    while (true) {
+        while (m_Queue.empty() && !m_Stopping)
+            pthread_cond_wait(&m_Cond, &m_Mutex);
+        if (m_Queue.empty())
+            break; // Stopping and nothing left to do
+
+        DiskRequest * request = m_Queue.front();
+        m_Queue.pop_front();
+        pthread_mutex_unlock(&m_Mutex);
+
+        perform(request);
+
+        pthread_mutex_lock(&m_Mutex);
+        m_Done.push_back(request);
+        // If the pipe is full, the reactor has been woken up already
+        char c = 0;
+        if (::write(m_Pipe[1], &c, 1) == -1) {}
+    }
+    pthread_mutex_unlock(&m_Mutex);
+}
+#endif // WIN32
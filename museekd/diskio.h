@@ -0,0 +1,300 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_DISKIO_H
+#define MUSEEK_DISKIO_H
+
+#include <NewNet/nnobject.h>
+#include <NewNet/nnweakrefptr.h>
+#include <NewNet/nnrefptr.h>
+#include <NewNet/nnevent.h>
+#include <NewNet/nnsocket.h>
+#include "mutypes.h"
+#include "fingerprint.h"
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+#ifndef WIN32
+#include <pthread.h>
+#endif // WIN32
+
+/* Size of the extents copied by a single request when moving a file. */
+#define FILEMOVE_EXTENT (64 * 1024 * 1024)
+
+namespace Museek
+{
+  class Museekd;
+  class DiskIO;
+
+  /* An operation handed to the disk I/O workers.
+     Workers only touch this structure, never a NewNet object. */
+  struct DiskRequest
+  {
+    typedef enum
+    {
+      Read,
+      Write,
+      Close,
+      Copy,
+      Rename,
+      Unlink,
+      Allocate,
+      Sync
+    } Operation;
+
+    DiskRequest() : op(Read), fd(-1), destFD(-1), offset(0), size(0), fingerprint(0), result(0), error(0) {}
+
+    Operation           op;
+    int                 fd;
+    int                 destFD;   // Copy: where to copy to (at the same offset)
+    uint64              offset;
+    std::vector<char>   data;     // Data to write, or data read
+    uint64              size;     // How many bytes to read, copy or allocate
+    std::string         path;     // Rename, Unlink: the file
+    std::string         destination; // Rename: the new path
+    Fingerprint *       fingerprint; // Read, Write: hash the data there (0 if none)
+    ssize_t             result;   // Bytes read, written or copied, -1 on error
+    int                 error;    // errno if result is -1
+  };
+
+  /* Something waiting for its disk requests to be done. It stays alive
+     until its last request is done, even if nobody references it anymore. */
+  class DiskJob : public NewNet::Object
+  {
+  protected:
+    friend class DiskIO;
+
+    /* A worker has done the request (called from the reactor). */
+    virtual void completed(DiskRequest * request) = 0;
+  };
+
+  /* A file read and written by the disk I/O workers. Requests on a file are
+     done one at a time, in the order they were made. Completion events are
+     emitted from the reactor. */
+  class AsyncFile : public DiskJob
+  {
+  public:
+    /* Open the file for reading, or for appending data. */
+    AsyncFile(DiskIO * diskIO, const std::string & path, bool write);
+    ~AsyncFile();
+
+    /* Could the file be opened? */
+    bool isOpen() const { return m_FD != -1; }
+    /* Size of the file, including the data waiting to be written. */
+    uint64 size() const { return m_Size; }
+    /* Has a read or write failed? */
+    bool failed() const { return m_Error != 0; }
+    int error() const { return m_Error; }
+
+    /* Append some data at the end of the file (or at the write position). */
+    void append(const unsigned char * data, size_t n);
+    /* Write the next appended data at the given offset. Only possible when nothing is waiting to be written. */
+    bool setWritePosition(uint64 offset);
+    /* Number of bytes waiting to be written. */
+    size_t pending() const { return m_Pending; }
+    /* Number of bytes actually written in the file. */
+    uint64 written() const { return m_Written; }
+    /* Keep appended data in memory until there's that many bytes to write,
+       then write it in large aligned blocks (0 writes as soon as possible). */
+    size_t writeBehind() const { return m_WriteBehind; }
+    void setWriteBehind(size_t bytes);
+    /* Write the data kept in memory now. */
+    void flush();
+    /* Write everything appended so far and wait for it to reach the disk
+       (fsync) before doing the next request. */
+    void sync();
+    /* Reserve the disk space for a file that will grow to the given size,
+       if there's enough free space. The size of the file doesn't change. */
+    void preallocate(uint64 size);
+    /* Cut the file to the given size. Only possible when nothing is waiting to be written. */
+    bool truncate(uint64 size);
+
+    /* Hash the data as it's written (or read) by the workers, carrying on
+       from this fingerprint which must cover the file up to the write (or
+       next read) position. Stops as soon as the data isn't sequential. */
+    void setFingerprint(const Fingerprint & fingerprint);
+    bool fingerprinting() const { return m_Fingerprint != 0; }
+    /* Fingerprint of the data written (or read) so far. */
+    const Fingerprint & fingerprint() const { return m_Fingerprinted; }
+
+    /* Read n bytes from offset. readEvent is emitted when it's done. */
+    void read(uint64 offset, size_t n);
+    /* Data returned by the last read (empty at the end of the file). */
+    const std::vector<char> & data() const { return m_Data; }
+
+    /* Close the file once every request is done. */
+    void close();
+    /* Is there any request not done yet? */
+    bool busy() const;
+
+    /* Some data was written. */
+    NewNet::Event<AsyncFile *> writtenEvent;
+    /* The read is done. */
+    NewNet::Event<AsyncFile *> readEvent;
+    /* The file was closed, everything has been written (or has failed). */
+    NewNet::Event<AsyncFile *> closedEvent;
+
+  protected:
+    void completed(DiskRequest * request);
+
+  private:
+    void submit();
+    void stopFingerprinting();
+
+    NewNet::WeakRefPtr<DiskIO>          m_DiskIO;       // Ref to the disk I/O workers
+    std::string                         m_Path;         // Path of the file
+    int                                 m_FD;           // File descriptor (-1 when closed)
+    uint64                              m_Size;         // Size of the file
+    int                                 m_Error;        // errno of the first failed request
+    std::vector<char>                   m_Writes;       // Appended data not handed to the workers yet
+    size_t                              m_Pending;      // Appended data not written yet
+    uint64                              m_Written;      // Size of the data actually in the file
+    uint64                              m_WriteEnd;     // Where the appended data ends
+    size_t                              m_WriteBehind;  // Appended data to keep before writing
+    bool                                m_Flushing;     // Should the data kept be written anyway?
+    bool                                m_SyncWanted;   // Should the file be synced once written?
+    uint64                              m_AllocateSize; // Size to preallocate (0 if none)
+    bool                                m_ReadWanted;   // Is a read waiting to be handed to the workers?
+    uint64                              m_ReadOffset;   // Where to read
+    size_t                              m_ReadSize;     // How many bytes to read
+    std::vector<char>                   m_Data;         // Result of the last read
+    bool                                m_InFlight;     // Is a request being processed by a worker?
+    bool                                m_Closing;      // Should the file be closed when everything is done?
+    Fingerprint *                       m_Fingerprint;  // Hash of the content, updated by the workers (0 if none)
+    Fingerprint                         m_Fingerprinted; // Copy of it taken when no request is in flight
+  };
+
+  /* Moves a file in the background. The file is renamed if possible,
+     otherwise it's copied by large extents (copy_file_range or sendfile
+     when available) and then removed. */
+  class FileMove : public DiskJob
+  {
+  public:
+    FileMove(DiskIO * diskIO, const std::string & source, const std::string & destination);
+    ~FileMove();
+
+    /* Start moving the file. doneEvent is emitted when it's done. */
+    void start();
+
+    const std::string & source() const { return m_Source; }
+    const std::string & destination() const { return m_Destination; }
+    /* Is the file copied (source and destination on different filesystems)? */
+    bool copying() const { return m_Step != Renaming; }
+    /* Size of the file and number of bytes copied so far. */
+    uint64 size() const { return m_Size; }
+    uint64 copied() const { return m_Copied; }
+    /* Has the move failed? */
+    bool failed() const { return m_Error != 0; }
+    int error() const { return m_Error; }
+
+    /* An extent has been copied. */
+    NewNet::Event<FileMove *> progressEvent;
+    /* The file has been moved (or the move has failed). */
+    NewNet::Event<FileMove *> doneEvent;
+
+  protected:
+    void completed(DiskRequest * request);
+
+  private:
+    typedef enum
+    {
+      Renaming,
+      Copying,
+      Closing,
+      Removing,
+      Done
+    } Step;
+
+    DiskRequest * request(DiskRequest::Operation op);
+    void submit(DiskRequest * request);
+    void copyNext();
+    void fail(int error);
+    void finish();
+
+    NewNet::WeakRefPtr<DiskIO>          m_DiskIO;       // Ref to the disk I/O workers
+    std::string                         m_Source;       // The file to move
+    std::string                         m_Destination;  // Where to move it
+    Step                                m_Step;         // What are we doing?
+    int                                 m_SourceFD;     // Copying: the source file (-1 when closed)
+    int                                 m_DestFD;       // Copying: the destination file (-1 when closed)
+    uint64                              m_Size;         // Size of the file
+    uint64                              m_Copied;       // Bytes copied so far
+    int                                 m_Error;        // errno if the move failed
+  };
+
+  /* Runs the disk requests in a small pool of worker threads (see
+     transfers/disk_threads) so that a slow disk never stalls the sockets.
+     Workers wake the reactor up through a pipe when a request is done.
+     Without threads (0 workers or Windows), requests are run from the
+     reactor but still completed asynchronously. */
+  class DiskIO : public NewNet::Object
+  {
+  public:
+    DiskIO(Museekd * museekd);
+    ~DiskIO();
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
+
+  private:
+    friend class AsyncFile;
+    friend class FileMove;
+
+    /* Wakes the reactor up when the workers have done something. */
+    class Notifier : public NewNet::Socket
+    {
+    public:
+      Notifier(DiskIO * diskIO, int fd);
+      void process();
+
+    private:
+      NewNet::WeakRefPtr<DiskIO> m_DiskIO;
+    };
+
+    void start();
+    void submit(DiskJob * job, DiskRequest * request);
+    void dispatch();
+    void onDispatchTimeout(long);
+    static void perform(DiskRequest * request);
+    static ssize_t copy(DiskRequest * request);
+#ifndef WIN32
+    static void * worker(void * data);
+    void work();
+#endif // WIN32
+
+    NewNet::WeakRefPtr<Museekd>         m_Museekd;      // Ref to the museekd
+    bool                                m_Started;      // Have we read the configuration and started the workers?
+    std::map<DiskRequest *, NewNet::RefPtr<DiskJob> > m_Busy; // Requests not completed yet and their job
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_DispatchTimeout; // Completion of requests run without workers
+    std::deque<DiskRequest *>           m_Done;         // Requests done, waiting for the reactor (protected by m_Mutex)
+#ifndef WIN32
+    std::vector<pthread_t>              m_Threads;      // The workers
+    pthread_mutex_t                     m_Mutex;        // Protects the queues and m_Stopping
+    pthread_cond_t                      m_Cond;         // Signaled when a request is queued or when stopping
+    std::deque<DiskRequest *>           m_Queue;        // Requests waiting for a worker
+    bool                                m_Stopping;     // Should the workers exit?
+    int                                 m_Pipe[2];      // Workers write to m_Pipe[1] when a request is done
+    NewNet::RefPtr<Notifier>            m_Notifier;     // Reads m_Pipe[0] in the reactor
+#endif // WIN32
+  };
+}
+
+#endif // MUSEEK_DISKIO_H
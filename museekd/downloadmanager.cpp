@@ -29,11 +29,34 @@
 #include "peermanager.h"
 #include "downloadsocket.h"
 #include "ifacemanager.h"
+#include "diskio.h"
+#include "swarm.h"
 #include <NewNet/nnreactor.h>
 #include <NewNet/nnpath.h>
 #include <NewNet/util.h>
 #include "util.h"
 #include <sstream>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif // WIN32
+
+/* Delay before writing the download changes to the journal (ms).
+   Changes happening meanwhile are written (and synced) together. */
+#define JOURNAL_DELAY 2000
+/* The downloads file is written again when the journal has more records
+   than this and than there are downloads. */
+#define JOURNAL_MIN_RECORDS 1024
+
+/* Journal record types. */
+#define JOURNAL_PUT 1
+#define JOURNAL_DELETE 2
+#define JOURNAL_POSITION 3
+#define JOURNAL_FINGERPRINT 4
+
+/* Files (and users per file) remembered from search results as swarm sources. */
+#define SOURCES_MAX_FILES 10000
+#define SOURCES_MAX_USERS 16
 
 /**
   * Constructor
@@ -48,9 +71,14 @@ Museek::Download::Download(Museek::Museekd * museekd, const std::string & user,
     m_User = user;
     m_Enqueued = false;
     m_RemotePath = remotePath;
+    m_RemoteKey = museekd->paths()->acquire(remotePath, '\\');
     m_LocalDir = localDir;
     m_Size = 0;
     m_Position = 0;
+    m_ResumePosition = 0;
+    m_ResumeKnown = false;
+    m_FingerprintKnown = false;
+    m_IncompleteExists = false;
 
     m_Rate = 0;
     m_Ticket = 0;
@@ -68,6 +96,7 @@ Museek::Download::~Download()
 {
   NNLOG("museekd.down.debug", "Download destroyed.");
   museekd()->downloads()->downloadRemovedEvent(this);
+  museekd()->paths()->release(m_RemoteKey);
 }
 
 /**
@@ -77,16 +106,7 @@ Museek::Download::~Download()
 std::string
 Museek::Download::filename() const
 {
-    if(m_Filename != std::string())
-        return m_Filename;
-
-    std::string::size_type ix = m_RemotePath.find_last_of('\\');
-    if(ix == std::string::npos)
-        m_Filename = m_RemotePath;
-    else
-        m_Filename = m_RemotePath.substr(ix + 1);
-
-    return m_Filename;
+    return m_RemoteKey.name;
 }
 
 /**
@@ -202,10 +222,53 @@ Museek::Download::setPositionFromIncompleteFile()
         position = ifs.tellg();
         ifs.seekg (0, std::ios_base::beg);
     }
+    setIncompleteExists(!ifs.fail());
     ifs.close();
+
+    // What lies after the data we know has been written can't be trusted
+    if (m_ResumeKnown && m_ResumePosition < position)
+        position = m_ResumePosition;
+
     setPosition(position);
 }
 
+/**
+  * Remember whether the incomplete file exists, so that storing the download doesn't look for it
+  */
+void
+Museek::Download::setIncompleteExists(bool exists)
+{
+    if (m_IncompleteExists == exists)
+        return;
+
+    m_IncompleteExists = exists;
+    m_Museekd->downloads()->onDownloadIncompleteChanged(this);
+}
+
+/**
+  * Remember how much of the incomplete file has been written
+  */
+void
+Museek::Download::setResumePosition(uint64 position)
+{
+    if (m_ResumeKnown && m_ResumePosition == position)
+        return;
+
+    m_ResumePosition = position;
+    m_ResumeKnown = true;
+    m_Museekd->downloads()->onDownloadResumePositionChanged(this);
+}
+
+/**
+  * Remember the hash of the incomplete file (journaled with the resume position)
+  */
+void
+Museek::Download::setFingerprint(const Fingerprint & fingerprint)
+{
+    m_Fingerprint = fingerprint;
+    m_FingerprintKnown = true;
+}
+
 /**
   * Called when some data has been received from the peer
   */
@@ -242,6 +305,29 @@ Museek::Download::received(uint bytes)
 	}
 }
 
+/**
+  * Set the ticket identifying this download
+  */
+void
+Museek::Download::setTicket(uint ticket) {
+    uint previous = m_Ticket;
+    m_Ticket = ticket;
+    if (previous != ticket)
+        m_Museekd->downloads()->onDownloadTicketChanged(this, previous);
+}
+
+/**
+  * Have we asked the peer to enqueue this download?
+  */
+void
+Museek::Download::setEnqueued(bool e) {
+    if (m_Enqueued == e)
+        return;
+
+    m_Enqueued = e;
+    m_Museekd->downloads()->reindex(this);
+}
+
 /**
   * Set the place in queue for this download
   */
@@ -278,7 +364,7 @@ Museek::Download::setState(TrState state)
         m_Museekd->downloads()->checkDownloads();
 
     if (changed && (state == TS_Finished)) {
-        if (previous != TS_Transferring)
+        if (previous != TS_Transferring && previous != TS_Finalizing)
             m_Museekd->ifaces()->sendStatusMessage(true, std::string("Download already finished: '") + destinationPath() + std::string("' from ") + user());
         else
             m_Museekd->ifaces()->sendStatusMessage(true, std::string("Download finished: '") + destinationPath() + std::string("' from ") + user());
@@ -374,13 +460,123 @@ Museek::Download::initiate(PeerSocket * socket) {
 
     museekd()->downloads()->setTransferReplyCallback(socket->transferReplyReceivedEvent.connect(museekd()->downloads(), &DownloadManager::onPeerTransferReplyReceived));
 
-	std::string path = museekd()->codeset()->toPeer(user(), m_RemotePath);
+	std::string path = museekd()->codeset()->toPeer(user(), remotePath());
 	if(! path.empty()) {
 		PTransferRequest msg(m_Ticket, museekd()->codeset()->toPeer(socket->user(), path), m_Size);
         socket->sendMessage(msg.make_network_packet());
 	}
 }
 
+/**
+  * The download is complete : move the file from incomplete to complete dir in the background
+  */
+void
+Museek::Download::finish()
+{
+    if (m_Mover.isValid())
+        return; // Already moving it
+
+    setState(TS_Finalizing);
+
+    m_Mover = new FileMove(museekd()->diskIO(), incompletePath(), destinationPath(true));
+    m_Mover->progressEvent.connect(this, &Download::onMoveProgress);
+    m_Mover->doneEvent.connect(this, &Download::onMoveDone);
+    m_Mover->start();
+}
+
+/**
+  * The file is being copied to another partition, an extent is done
+  */
+void
+Museek::Download::onMoveProgress(FileMove * mover)
+{
+    if (mover->copied() <= FILEMOVE_EXTENT) // First extent
+        m_Museekd->ifaces()->sendStatusMessage(true, std::string("Finalizing download: '") + destinationPath() + std::string("' (copying to another partition)"));
+
+    NNLOG("museekd.down.debug", "Finalizing %s: %llu/%llu bytes copied.", mover->destination().c_str(), mover->copied(), mover->size());
+}
+
+/**
+  * The file has been moved to the download directory (or not)
+  */
+void
+Museek::Download::onMoveDone(FileMove * mover)
+{
+    // Keep ourself alive: we may be removed when finished
+    NewNet::RefPtr<Download> self(this);
+
+    m_Mover = 0;
+
+    if (mover->failed()) {
+        NNLOG("museekd.down.warn", "Couldn't move '%s' to '%s' (error %i).", mover->source().c_str(), mover->destination().c_str(), mover->error());
+        m_Error = "Couldn't move the file";
+        setState(TS_LocalError);
+        return;
+    }
+
+    // Ok, we're done.
+    setIncompleteExists(false);
+    setState(TS_Finished);
+}
+
+/**
+  * Some data has reached the incomplete file: we can resume from there
+  */
+void
+Museek::Download::onIncompleteFileWritten(AsyncFile * file)
+{
+    // The swarm knows which parts of the file are written
+    if (m_Swarm.isValid())
+        return;
+
+    if (file->failed())
+        return;
+
+    if (file->fingerprinting())
+        setFingerprint(file->fingerprint());
+    setResumePosition(file->written());
+}
+
+/**
+  * Everything has been written to the incomplete file, we can finish the download
+  */
+void
+Museek::Download::onIncompleteFileClosed(AsyncFile * file)
+{
+    // Aborted or removed while the file was being closed?
+    if (m_State != TS_Transferring)
+        return;
+
+    if (file->failed()) {
+        NNLOG("museekd.down.warn", "Couldn't write '%s' to disk.", incompletePath().c_str());
+        setState(TS_LocalError);
+        return;
+    }
+
+    if (m_FingerprintKnown && m_Fingerprint.size() == m_Size)
+        NNLOG("museekd.down.debug", "SHA-1 of %s: %s", remotePath().c_str(), m_Fingerprint.digest().c_str());
+
+    finish();
+}
+
+/**
+  * Join (or leave) a swarm
+  */
+void
+Museek::Download::setSwarm(Swarm * swarm)
+{
+    m_Swarm = swarm;
+}
+
+/**
+  * Sources added by a swarm only live as long as it does
+  */
+bool
+Museek::Download::transient() const
+{
+    return m_Swarm.isValid() && m_Swarm->primary() != this;
+}
+
 /**
   * Init timeout is finished
   */
@@ -404,8 +600,10 @@ Museek::DownloadManager::DownloadManager(Museekd * museekd) : m_Museekd(museekd)
     museekd->config()->keyRemovedEvent.connect(this, &DownloadManager::onConfigKeyRemoved);
 
     m_AllowUpdate = false;
-    m_AllowSave = true;
     m_PendingDownloadsSave = false;
+    m_Journaling = false;
+    m_JournalRecords = 0;
+    m_Seq = 0;
     m_Limiter = new NewNet::RateLimiter();
     m_Limiter->setLimit(-1);
 }
@@ -413,6 +611,8 @@ Museek::DownloadManager::DownloadManager(Museekd * museekd) : m_Museekd(museekd)
 Museek::DownloadManager::~DownloadManager()
 {
     NNLOG("museekd.down.debug", "Download Manager destroyed");
+    // The downloads go with us: a swarm mustn't remove its sources from what's left of the indexes
+    downloadRemovedEvent.clear();
 }
 
 /**
@@ -591,6 +791,8 @@ void Museek::DownloadManager::onDownloadAdded(Download * download) {
             download->state() == TS_Initiating ||
             download->state() == TS_Connecting)
         addInitiating(download);
+
+    reindex(download);
 }
 
 /**
@@ -614,6 +816,160 @@ void Museek::DownloadManager::onDownloadUpdated(Download * download) {
         if (download == isInitiatingFrom(download->user()))
             removeInitiating(download->user());
     }
+
+    reindex(download);
+    journal(download);
+}
+
+/**
+  * Does this download need a peer socket (to be enqueued or to know if the user is online)?
+  */
+bool Museek::DownloadManager::isWaiting(Download * download) {
+    return (download->state() == TS_QueuedRemotely && !download->enqueued()) || download->state() == TS_Offline;
+}
+
+/**
+  * Add this download to the indexes
+  */
+void Museek::DownloadManager::index(Download * download) {
+    if (m_Entries.find(download) != m_Entries.end())
+        return;
+
+    Entry entry;
+    entry.seq = ++m_Seq;
+    entry.waiting = false;
+    entry.journaledState = download->state();
+    entry.journaledSize = download->size();
+    entry.recordState = download->state();
+    entry.recordSize = download->size();
+    m_Entries[download] = entry;
+    if (!download->transient())
+        journal(download->user(), download->remotePath(), false);
+
+    UserDownloads & user = m_Users[download->user()];
+    user.paths[download->remotePathKey()] = download;
+    user.tickets[download->ticket()] = download;
+
+    reindex(download);
+}
+
+/**
+  * Remove this download from the indexes
+  */
+void Museek::DownloadManager::unindex(Download * download) {
+    std::map<Download *, Entry>::iterator it = m_Entries.find(download);
+    if (it == m_Entries.end())
+        return;
+
+    std::map<std::string, UserDownloads>::iterator uit = m_Users.find(download->user());
+    if (uit != m_Users.end()) {
+        UserDownloads & user = uit->second;
+        std::map<PathTable::Path, Download *>::iterator pit = user.paths.find(download->remotePathKey());
+        if (pit != user.paths.end() && pit->second == download)
+            user.paths.erase(pit);
+        std::map<uint, Download *>::iterator tit = user.tickets.find(download->ticket());
+        if (tit != user.tickets.end() && tit->second == download)
+            user.tickets.erase(tit);
+        user.waiting.erase(it->second.seq);
+
+        if (user.waiting.empty())
+            m_WaitingUsers.erase(uit->first);
+        if (user.paths.empty())
+            m_Users.erase(uit);
+    }
+
+    m_Entries.erase(it);
+}
+
+/**
+  * The ticket of this download has changed
+  */
+void Museek::DownloadManager::onDownloadTicketChanged(Download * download, uint previous) {
+    if (m_Entries.find(download) == m_Entries.end())
+        return; // Not indexed yet
+
+    UserDownloads & user = m_Users[download->user()];
+    std::map<uint, Download *>::iterator it = user.tickets.find(previous);
+    if (it != user.tickets.end() && it->second == download)
+        user.tickets.erase(it);
+    user.tickets[download->ticket()] = download;
+}
+
+/**
+  * The resume position of this download has changed
+  */
+void Museek::DownloadManager::onDownloadResumePositionChanged(Download * download) {
+    if (!m_Journaling)
+        return;
+
+    m_JournalPositions.insert(std::pair<std::string, std::string>(download->user(), download->remotePath()));
+    if (!m_JournalTimeout.isValid())
+        m_JournalTimeout = museekd()->reactor()->addTimeout(JOURNAL_DELAY, this, &DownloadManager::onJournalTimeout);
+}
+
+/**
+  * The incomplete path of this download is stored only while the file exists
+  */
+void Museek::DownloadManager::onDownloadIncompleteChanged(Download * download) {
+    std::map<Download *, Entry>::iterator it = m_Entries.find(download);
+    if (it == m_Entries.end() || download->transient())
+        return;
+
+    it->second.record.clear();
+    journal(download->user(), download->remotePath(), false);
+}
+
+/**
+  * Put the download in (or out of) the waiting list of its user
+  */
+void Museek::DownloadManager::reindex(Download * download) {
+    std::map<Download *, Entry>::iterator it = m_Entries.find(download);
+    if (it == m_Entries.end())
+        return; // Not indexed yet
+
+    bool waiting = isWaiting(download);
+    if (waiting == it->second.waiting)
+        return;
+
+    it->second.waiting = waiting;
+    UserDownloads & user = m_Users[download->user()];
+    if (waiting) {
+        user.waiting[it->second.seq] = download;
+        m_WaitingUsers.insert(download->user());
+    }
+    else {
+        user.waiting.erase(it->second.seq);
+        if (user.waiting.empty())
+            m_WaitingUsers.erase(download->user());
+    }
+}
+
+/**
+  * Downloads from this user needing a peer socket, in adding order
+  */
+std::vector<NewNet::RefPtr<Museek::Download> > Museek::DownloadManager::waitingFrom(const std::string & user) {
+    std::vector<NewNet::RefPtr<Download> > result;
+    std::map<std::string, UserDownloads>::const_iterator uit = m_Users.find(user);
+    if (uit != m_Users.end()) {
+        std::map<uint64, Download *>::const_iterator it;
+        for (it = uit->second.waiting.begin(); it != uit->second.waiting.end(); ++it)
+            result.push_back(it->second);
+    }
+    return result;
+}
+
+/**
+  * Every download from this user
+  */
+std::vector<NewNet::RefPtr<Museek::Download> > Museek::DownloadManager::downloadsFrom(const std::string & user) {
+    std::vector<NewNet::RefPtr<Download> > result;
+    std::map<std::string, UserDownloads>::const_iterator uit = m_Users.find(user);
+    if (uit != m_Users.end()) {
+        std::map<PathTable::Path, Download *>::const_iterator it;
+        for (it = uit->second.paths.begin(); it != uit->second.paths.end(); ++it)
+            result.push_back(it->second);
+    }
+    return result;
 }
 
 /**
@@ -686,17 +1042,12 @@ void Museek::DownloadManager::checkDownloads() {
     if (m_AllowUpdate) {
         NNLOG("museekd.down.debug", "Checking if there are some downloads to start");
 
-        std::vector<NewNet::RefPtr<Download> >::iterator it = m_Downloads.begin();
-        Download * download;
-        for(; it != m_Downloads.end(); ++it) {
-            download = *it;
-            if ((download->state() == TS_QueuedRemotely && !download->enqueued()) || download->state() == TS_Offline) {
-                // We will have something to do with this user: ask a peersocket
-                museekd()->peers()->peerSocket(download->user());
-            }
-        }
-
-        saveDownloads();
+        // We will have something to do with these users: ask a peersocket.
+        // Iterate over a copy as asking a peer socket may change the waiting users.
+        std::set<std::string> users = m_WaitingUsers;
+        std::set<std::string>::const_iterator it;
+        for(it = users.begin(); it != users.end(); ++it)
+            museekd()->peers()->peerSocket(*it);
     }
 }
 
@@ -771,6 +1122,7 @@ Museek::DownloadManager::add(const std::string & user, const std::string & path,
         else
             download->setTicket(ticket);
         m_Downloads.push_back(download);
+        index(download);
         NNLOG("museekd.down.debug", "Created new download entry, user=%s, path=%s, ticket=%u.", user.c_str(), path.c_str(), download->ticket());
         downloadAddedEvent(download);
     }
@@ -785,7 +1137,8 @@ Museek::DownloadManager::add(const std::string & user, const std::string & path,
         (download->state() != TS_Initiating) &&
         (download->state() != TS_Negotiating) &&
         (download->state() != TS_Waiting) &&
-        (download->state() != TS_Transferring)) {
+        (download->state() != TS_Transferring) &&
+        (download->state() != TS_Finalizing)) {
 
         download->setEnqueued(false); // Ensure we're gonna enqueue it even if it has already been done previously (useful when we want to retry)
         download->setState(TS_QueuedRemotely);
@@ -810,11 +1163,12 @@ Museek::DownloadManager::add(const std::string & user, const std::string & path,
 Museek::Download *
 Museek::DownloadManager::findDownload(const std::string & user, const std::string & path)
 {
-    // Iterate over m_Downloads until we find a match.
-    std::vector<NewNet::RefPtr<Download> >::iterator it, end = m_Downloads.end();
-    for(it = m_Downloads.begin(); it != end; ++it) {
-        if(((*it)->user() == user) && ((*it)->remotePath() == path))
-            return *it;
+    std::map<std::string, UserDownloads>::const_iterator uit = m_Users.find(user);
+    PathTable::Path key;
+    if(uit != m_Users.end() && museekd()->paths()->find(path, '\\', key)) {
+        std::map<PathTable::Path, Download *>::const_iterator it = uit->second.paths.find(key);
+        if(it != uit->second.paths.end())
+            return it->second;
     }
 
     NNLOG("museekd.down.debug", "Download %s not found", path.c_str());
@@ -827,11 +1181,11 @@ Museek::DownloadManager::findDownload(const std::string & user, const std::strin
 Museek::Download *
 Museek::DownloadManager::findDownload(const std::string & user, uint ticket)
 {
-    // Iterate over m_Downloads until we find a match.
-    std::vector<NewNet::RefPtr<Download> >::iterator it, end = m_Downloads.end();
-    for(it = m_Downloads.begin(); it != end; ++it) {
-        if(((*it)->user() == user) && ((*it)->ticket() == ticket))
-            return *it;
+    std::map<std::string, UserDownloads>::const_iterator uit = m_Users.find(user);
+    if(uit != m_Users.end()) {
+        std::map<uint, Download *>::const_iterator it = uit->second.tickets.find(ticket);
+        if(it != uit->second.tickets.end())
+            return it->second;
     }
 
     NNLOG("museekd.down.debug", "Download with ticket %d not found", ticket);
@@ -851,7 +1205,7 @@ Museek::DownloadManager::abort(const std::string & user, const std::string & pat
 
     download->setSocket(0);
     download->setEnqueued(false);
-    if(download->state() != TS_Finished)
+    if(download->state() != TS_Finished && download->state() != TS_Finalizing)
         download->setState(TS_Aborted);
 }
 
@@ -866,13 +1220,16 @@ Museek::DownloadManager::remove(const std::string & user, const std::string & pa
     if(! download)
         return;
 
+    bool transient = download->transient();
     abort(user, path);
+    unindex(download);
     std::vector<NewNet::RefPtr<Download> >::iterator it;
     it = std::find(m_Downloads.begin(), m_Downloads.end(), download);
     if (it != m_Downloads.end())
         m_Downloads.erase(it);
 
-    saveDownloads();
+    if (!transient)
+        journal(user, path, true);
 }
 
 /**
@@ -906,7 +1263,7 @@ Museek::DownloadManager::onServerLoggedInStateChanged(bool loggedIn)
         // Server connection was severed. As are our chances to connect to a peer.
         std::vector<NewNet::RefPtr<Download> >::iterator it, end = m_Downloads.end();
         for(it = m_Downloads.begin(); it != end; ++it) {
-            if ( ((*it) != isDownloadingFrom((*it)->user())) && ((*it)->state() != TS_Finished) && ((*it)->state() != TS_Aborted) && ((*it)->state() != TS_Offline) ) {
+            if ( ((*it) != isDownloadingFrom((*it)->user())) && ((*it)->state() != TS_Finished) && ((*it)->state() != TS_Finalizing) && ((*it)->state() != TS_Aborted) && ((*it)->state() != TS_Offline) ) {
                 (*it)->setState(TS_Offline);
                 (*it)->setEnqueued(false);
             }
@@ -958,20 +1315,22 @@ void Museek::DownloadManager::onPeerSocketReady(PeerSocket * socket) {
     std::string username = socket->user();
 
     // Check if we have any downloads with status user offline for this user.
-    std::vector<NewNet::RefPtr<Download> >::iterator dit, dend = m_Downloads.end();
-    for(dit = m_Downloads.begin(); dit != dend; ++dit) {
-        if (((*dit)->user() == username) && ((*dit)->state() == TS_Offline))
+    std::vector<NewNet::RefPtr<Download> > waiting = waitingFrom(username);
+    std::vector<NewNet::RefPtr<Download> >::iterator dit, dend = waiting.end();
+    for(dit = waiting.begin(); dit != dend; ++dit) {
+        if ((*dit)->state() == TS_Offline)
             (*dit)->setState(TS_QueuedRemotely);
     }
 
     // See if we can send some pending folder contents requests for this user
     askPendingFolderContents(socket);
 
-	std::vector<NewNet::RefPtr<Download> >::iterator it = m_Downloads.begin();
+	waiting = waitingFrom(username);
+	std::vector<NewNet::RefPtr<Download> >::iterator it = waiting.begin();
 	Download * download;
-	for(; it != m_Downloads.end(); ++it) {
+	for(; it != waiting.end(); ++it) {
 	    download = *it;
-	    if (download->user() == socket->user() && download->state() == TS_QueuedRemotely && !download->enqueued()) {
+	    if (download->state() == TS_QueuedRemotely && !download->enqueued()) {
             if (!isDownloadingFrom(download->user())) {
                 NNLOG("museekd.down.debug", "Starting download %s", download->remotePath().c_str());
                 // Starting from 157, there's no need to send a PTransferRequest. Enqueuing the file is sufficient
@@ -1012,20 +1371,20 @@ Museek::DownloadManager::onPeerSocketUnavailable(std::string user)
   */
 void Museek::DownloadManager::onPeerOffline(std::string user) {
     // Set downloads to offline
-    std::vector<NewNet::RefPtr<Download> >::iterator it, end = m_Downloads.end();
-    for(it = m_Downloads.begin(); it != end; ++it) {
-        if ((*it)->user() == user) {
-            (*it)->setEnqueued(false);
-            if((*it)->state() != TS_Finished
-                && (*it)->state() != TS_RemoteError
-                && (*it)->state() != TS_LocalError
-                && (*it)->state() != TS_Transferring
-                && (*it)->state() != TS_ConnectionClosed
-                && (*it)->state() != TS_CannotConnect
-                && (*it)->state() != TS_Aborted
-                && (*it)->state() != TS_Offline)
-                (*it)->setState(TS_Offline);
-        }
+    std::vector<NewNet::RefPtr<Download> > downloads = downloadsFrom(user);
+    std::vector<NewNet::RefPtr<Download> >::iterator it, end = downloads.end();
+    for(it = downloads.begin(); it != end; ++it) {
+        (*it)->setEnqueued(false);
+        if((*it)->state() != TS_Finished
+            && (*it)->state() != TS_Finalizing
+            && (*it)->state() != TS_RemoteError
+            && (*it)->state() != TS_LocalError
+            && (*it)->state() != TS_Transferring
+            && (*it)->state() != TS_ConnectionClosed
+            && (*it)->state() != TS_CannotConnect
+            && (*it)->state() != TS_Aborted
+            && (*it)->state() != TS_Offline)
+            (*it)->setState(TS_Offline);
     }
 
     // Erase the pending enqueuing requests
@@ -1060,6 +1419,100 @@ bool Museek::DownloadManager::hasFreeSlots() {
     return (m_Downloading.size() < museekd()->downSlots()) || ( museekd()->downSlots() == 0);
 }
 
+/**
+  * Remember the big files this user shares: they can be downloaded from several users at once.
+  * The paths should be encoded with utf8 encoding. Separator should be the network one (backslash).
+  */
+void
+Museek::DownloadManager::addSources(const std::string & user, const Folder & files)
+{
+    Folder::const_iterator it;
+    for (it = files.begin(); it != files.end(); ++it) {
+        if (it->second.size < 2 * SWARM_MIN_RANGE)
+            continue;
+
+        std::string::size_type ix = it->first.find_last_of('\\');
+        std::string filename = (ix == std::string::npos) ? it->first : it->first.substr(ix + 1);
+        std::pair<std::string, uint64> key(filename, it->second.size);
+
+        std::map<std::pair<std::string, uint64>, std::map<std::string, std::string> >::iterator sit = m_Sources.find(key);
+        if (sit == m_Sources.end()) {
+            // Forget the oldest file if we know too many
+            if (m_SourcesOrder.size() >= SOURCES_MAX_FILES) {
+                m_Sources.erase(m_SourcesOrder.front());
+                m_SourcesOrder.pop_front();
+            }
+            m_SourcesOrder.push_back(key);
+            sit = m_Sources.insert(std::make_pair(key, std::map<std::string, std::string>())).first;
+        }
+        if (sit->second.size() < SOURCES_MAX_USERS || sit->second.find(user) != sit->second.end())
+            sit->second[user] = it->first;
+    }
+}
+
+/**
+  * The download has started: if other users share the same file (same name
+  * and size), download it from them too (see swarm.h).
+  */
+void
+Museek::DownloadManager::startSwarm(Download * download)
+{
+    if (download->swarm() || !museekd()->config()->getBool("transfers", "swarm", false))
+        return;
+
+    uint64 size = download->size();
+    if (download->position() >= size || size - download->position() < 2 * SWARM_MIN_RANGE)
+        return;
+
+    std::map<std::pair<std::string, uint64>, std::map<std::string, std::string> >::const_iterator sit;
+    sit = m_Sources.find(std::pair<std::string, uint64>(download->filename(), size));
+    if (sit == m_Sources.end())
+        return;
+
+    // Every part should be worth it, the primary download included
+    uint64 parts = (size - download->position()) / SWARM_MIN_RANGE;
+    uint maxSources = museekd()->config()->getUint("transfers", "swarm_sources", 4);
+    if (parts > maxSources)
+        parts = maxSources;
+
+    std::vector<std::pair<std::string, std::string> > sources;
+    std::map<std::string, std::string>::const_iterator it;
+    for (it = sit->second.begin(); it != sit->second.end() && sources.size() + 1 < parts; ++it) {
+        if (it->first == download->user() || museekd()->isBanned(it->first) || museekd()->isIgnored(it->first))
+            continue;
+        if (findDownload(it->first, it->second))
+            continue; // Already downloading it from this user
+        sources.push_back(*it);
+    }
+    if (sources.empty())
+        return;
+
+    NewNet::RefPtr<Swarm> swarm = new Swarm(museekd(), download);
+    download->setSwarm(swarm);
+
+    std::vector<Download *> members;
+    std::vector<std::pair<std::string, std::string> >::const_iterator mit;
+    for (mit = sources.begin(); mit != sources.end(); ++mit) {
+        Download * member = new Download(museekd(), mit->first, mit->second, download->localDir());
+        member->setSwarm(swarm);
+        member->setTicket(museekd()->token());
+        member->setSize(size);
+        member->setIncompletePath(download->incompletePath());
+        m_Downloads.push_back(member);
+        index(member);
+        downloadAddedEvent(member);
+        members.push_back(member);
+    }
+    swarm->start(members);
+
+    std::vector<Download *>::const_iterator dit;
+    for (dit = members.begin(); dit != members.end(); ++dit) {
+        (*dit)->setEnqueued(false);
+        (*dit)->setState(TS_QueuedRemotely);
+    }
+    checkDownloads();
+}
+
 /**
   * Called when some key of the config has been changed
   */
@@ -1070,6 +1523,8 @@ Museek::DownloadManager::onConfigKeySet(const Museek::ConfigManager::ChangeNotif
         checkDownloads();
     if(data->domain == "transfers" && data->key == "download_rate")
         updateRates();
+    if((data->domain == "transfers" && (data->key == "download-dir" || data->key == "incomplete-dir")) || data->domain == "encoding")
+        forgetDownloadRecords();
 }
 
 /**
@@ -1082,163 +1537,605 @@ Museek::DownloadManager::onConfigKeyRemoved(const Museek::ConfigManager::RemoveN
         checkDownloads();
     if(data->domain == "transfers" && data->key == "download_rate")
         updateRates();
+    if((data->domain == "transfers" && (data->key == "download-dir" || data->key == "incomplete-dir")) || data->domain == "encoding")
+        forgetDownloadRecords();
 }
 
 /**
   * Loads the downloads stored in the config file
   */
 void Museek::DownloadManager::loadDownloads() {
-    m_AllowUpdate = false; // We don't want downloads to be saved until we have finished to load them
+    m_AllowUpdate = false; // We don't want downloads to be enqueued until we have finished to load them
+    m_Journaling = false; // Nor journaled: they're already stored
     // Open config file
     std::string path = museekd()->config()->get("transfers", "downloads");
     std::ifstream file(path.c_str(), std::fstream::in | std::fstream::binary);
 
-	if(file.fail() || !file.is_open()) {
+	if(file.fail() || !file.is_open())
 		NNLOG("museekd.config.warn", "Cannot load downloads (%s).", path.c_str());
-        file.close();
-		return;
-	}
-
-    uint32 n;
-    if (!read_int(&file, &n)) {
-		NNLOG("museekd.down.warn", "Cannot load number of downloads.");
-        file.close();
-		return;
+	else {
+        uint32 n;
+        if (read_int(&file, &n) == -1)
+            NNLOG("museekd.down.warn", "Cannot load number of downloads.");
+        else {
+            NNLOG("museekd.down.debug", "Loading %d downloads", n);
+
+            while(n && readDownload(&file))
+                n--;
+            if (n)
+                NNLOG("museekd.config.warn", "Cannot load downloads. Bailing out");
+            // Followed by the resume positions (older files don't have them)
+            else if (read_int(&file, &n) != -1) {
+                while(n && readResumePosition(&file))
+                    n--;
+                if (n)
+                    NNLOG("museekd.config.warn", "Cannot load the resume positions of the downloads.");
+                // And the fingerprints
+                else if (read_int(&file, &n) != -1) {
+                    while(n && readFingerprint(&file))
+                        n--;
+                    if (n)
+                        NNLOG("museekd.config.warn", "Cannot load the fingerprints of the downloads.");
+                }
+            }
+        }
     }
+	file.close();
 
-	NNLOG("museekd.down.debug", "Loading %d downloads", n);
+    // Replay the changes made since the downloads file was written
+    bool complete = true;
+    m_JournalRecords = 0;
+    std::string journalPath = path + ".journal";
+    std::ifstream journal(journalPath.c_str(), std::fstream::in | std::fstream::binary);
+    if(!journal.fail() && journal.is_open()) {
+        uint32 op;
+        while(read_int(&journal, &op) != -1) {
+            if (op == JOURNAL_PUT)
+                complete = readDownload(&journal);
+            else if (op == JOURNAL_DELETE) {
+                std::string user, remotePath;
+                complete = (read_str(&journal, user) != -1) && (read_str(&journal, remotePath) != -1);
+                if (complete)
+                    remove(user, remotePath);
+            }
+            else if (op == JOURNAL_POSITION)
+                complete = readResumePosition(&journal);
+            else if (op == JOURNAL_FINGERPRINT)
+                complete = readFingerprint(&journal);
+            else
+                complete = false;
 
-	while(n) {
-		uint32 state;
-		uint64 size;
-		std::string user, path, localpath, temppath;
-		if(!read_int(&file, &state) ||
-		   !read_str(&file, user) ||
-		   !read_off(&file, &size) ||
-		   !read_str(&file, path) ||
-		   !read_str(&file, localpath) ||
-		   !read_str(&file, temppath)) {
-			NNLOG("museekd.config.warn", "Cannot load downloads. Bailing out");
-            file.close();
-			return;
-		}
-		if (!path.empty()) {
-            NNLOG("museekd.down.debug", "Loading download: %s from %s (size: %lld)", path.c_str(), user.c_str(), size);
-            size_t posB = localpath.find_last_of(NewNet::Path::separator());
-            add(user, path, localpath.substr(0, posB));
-            Download * dl = findDownload(user, path);
-            if (dl) {
-                if(state == 0)
-                    dl->setState(TS_Aborted);
-                else if (state == 2)
-                    dl->setState(TS_Finished);
-                else // The only expected value at this point is 1.
-                    dl->setState(TS_Offline); // We're not sure the peer is connected
-                dl->setSize(size);
-                dl->setIncompletePath(temppath);
-
-                dl->setPositionFromIncompleteFile();
+            if (!complete) {
+                NNLOG("museekd.config.warn", "Downloads journal is truncated or corrupted, ignoring the end of it.");
+                break;
             }
-		}
-		else
-		    NNLOG("museekd.config.warn", "Couldn't load a corrupted download: %s from %s (size: %lld)", path.c_str(), user.c_str(), size);
+            m_JournalRecords++;
+        }
+        NNLOG("museekd.down.debug", "Replayed %u download changes", m_JournalRecords);
+    }
+    journal.close();
+
+	m_Journaling = true;
+	// Don't append after a broken record: store everything again
+	if (!complete)
+		saveDownloads();
 
-		n--;
-	}
-	file.close();
 	m_AllowUpdate = true; // We have finished: now try to enqueue downloads
 	checkDownloads();
 }
 
 /**
-  * Stores the download in the config file
+  * Read a download from the downloads file (or journal) and add it.
+  * Returns false if the download couldn't be read.
   */
-void Museek::DownloadManager::saveDownloads() {
-    if (m_AllowSave) {
-        m_AllowSave = false;
-        // Open config file
-        std::string path = museekd()->config()->get("transfers", "downloads");
-        std::string pathTemp(path + ".tmp");
-        std::remove(pathTemp.c_str()); // Remove the temp file if it already exists
-
-        std::ofstream file(pathTemp.c_str(), std::ofstream::binary | std::ofstream::app | std::ofstream::ate);
-
-        if(file.fail() || !file.is_open()) {
-            NNLOG("museekd.config.warn", "Cannot save downloads (%s). Trying again later", path.c_str());
-            m_AllowSave = true;
-            return;
-        }
+bool Museek::DownloadManager::readDownload(std::ifstream * file) {
+    uint32 state;
+    uint64 size;
+    std::string user, path, localpath, temppath;
+    if(read_int(file, &state) == -1 ||
+       read_str(file, user) == -1 ||
+       read_off(file, &size) == -1 ||
+       read_str(file, path) == -1 ||
+       read_str(file, localpath) == -1 ||
+       read_str(file, temppath) == -1)
+        return false;
+
+    if (path.empty()) {
+        NNLOG("museekd.config.warn", "Couldn't load a corrupted download: %s from %s (size: %lld)", path.c_str(), user.c_str(), size);
+        return true;
+    }
 
-        uint32 transfers = downloads().size();
+    NNLOG("museekd.down.debug", "Loading download: %s from %s (size: %lld)", path.c_str(), user.c_str(), size);
+    size_t posB = localpath.find_last_of(NewNet::Path::separator());
+    add(user, path, localpath.substr(0, posB));
+    Download * dl = findDownload(user, path);
+    if (dl) {
+        dl->setLocalDir(localpath.substr(0, posB));
+        if(state == 0)
+            dl->setState(TS_Aborted);
+        else if (state == 2)
+            dl->setState(TS_Finished);
+        else // The only expected value at this point is 1.
+            dl->setState(TS_Offline); // We're not sure the peer is connected
+        dl->setSize(size);
+        dl->setIncompletePath(temppath);
+
+        dl->setPositionFromIncompleteFile();
+
+        // We were moving it when we stopped: start again
+        if (state == 1 && dl->size() > 0 && dl->position() >= dl->size())
+            dl->finish();
+    }
 
-        NNLOG("museekd.down.debug", "Saving %d downloads", transfers);
+    return true;
+}
 
-        if(!write_int(&file, transfers) == -1) {
-            NNLOG("museekd.config.warn", "Cannot save downloads number, trying again later.");
-            file.close();
-            m_AllowSave = true;
-            return;
-        }
+/**
+  * Write the given download in the downloads file (or journal).
+  * Returns false if something went wrong.
+  */
+bool Museek::DownloadManager::writeDownload(std::ostream * file, Download * download) {
+    uint32 state;
+    switch(download->state()) {
+    case TS_Finished:
+        state = 2;
+        break;
+    case TS_Aborted:
+        state = 0;
+        break;
+    default:
+        state = 1;
+        break;
+    }
 
-        std::vector<NewNet::RefPtr<Download> >::const_iterator it;
-        for(it = downloads().begin(); it != downloads().end(); ++it) {
-            if (m_PendingDownloadsSave)
-                break; // If we have another save request, stop saving and restart from scratch
+    // The incomplete path is useless if we haven't started the download
+    std::string tmpPath;
+    if (download->incompleteExists())
+        tmpPath = museekd()->codeset()->fromFsToUtf8(download->incompletePath(), false);
+
+    return write_int(file, state) != -1 &&
+           write_str(file, download->user()) != -1 &&
+           write_off(file, download->size()) != -1 &&
+           write_str(file, download->remotePath()) != -1 &&
+           write_str(file, museekd()->codeset()->fromFsToUtf8(download->destinationPath(), false)) != -1 &&
+           write_str(file, tmpPath) != -1;
+}
 
-            uint32 state;
-            switch((*it)->state()) {
-            case TS_Finished:
-                state = 2;
-                break;
-            case TS_Aborted:
-                state = 0;
-                break;
-            default:
-                state = 1;
-                break;
-            }
+/**
+  * Write the given download as it was last written if it hasn't changed since.
+  * Returns false if something went wrong.
+  */
+bool Museek::DownloadManager::writeDownloadRecord(std::ostream * file, Download * download) {
+    std::map<Download *, Entry>::iterator it = m_Entries.find(download);
+    if (it == m_Entries.end())
+        return writeDownload(file, download);
+
+    Entry & entry = it->second;
+    if (entry.record.empty() || entry.recordState != download->state() || entry.recordSize != download->size()) {
+        std::ostringstream record;
+        if (!writeDownload(&record, download))
+            return false;
+        entry.record = record.str();
+        entry.recordState = download->state();
+        entry.recordSize = download->size();
+    }
 
-            // The incomplete path is useless if we haven't started the download
-            std::string tmpPath = museekd()->codeset()->fromFsToUtf8((*it)->incompletePath(), false);
-            std::ifstream incompleteTest( tmpPath.c_str() );
-            if (incompleteTest.fail())
-                tmpPath = std::string();
-            incompleteTest.close();
-
-            if(!write_int(&file, state) ||
-               write_str(&file, (*it)->user()) == -1 ||
-               !write_off(&file, (*it)->size()) ||
-               write_str(&file, (*it)->remotePath()) == -1 ||
-               write_str(&file, museekd()->codeset()->fromFsToUtf8((*it)->destinationPath(), false)) == -1 ||
-               write_str(&file, tmpPath) == -1) {
-                NNLOG("museekd.config.warn", "Cannot save downloads, trying again later.");
-                file.close();
-                m_AllowSave = true;
-                return;
-            }
+    file->write(entry.record.data(), entry.record.size());
+    return !file->fail();
+}
+
+/**
+  * The paths of the downloads depend on the configuration: write them all again next time
+  */
+void Museek::DownloadManager::forgetDownloadRecords() {
+    std::map<Download *, Entry>::iterator it;
+    for (it = m_Entries.begin(); it != m_Entries.end(); ++it)
+        it->second.record.clear();
+}
+
+/**
+  * Read the resume position of a download from the downloads file (or journal).
+  * Returns false if it couldn't be read.
+  */
+bool Museek::DownloadManager::readResumePosition(std::ifstream * file) {
+    std::string user, path;
+    uint64 position;
+    if(read_str(file, user) == -1 ||
+       read_str(file, path) == -1 ||
+       read_off(file, &position) == -1)
+        return false;
+
+    Download * dl = findDownload(user, path);
+    if (dl) {
+        dl->setResumePosition(position);
+        dl->setPositionFromIncompleteFile();
+    }
+
+    return true;
+}
+
+/**
+  * Write the resume position of the given download in the downloads file (or journal).
+  * Returns false if something went wrong.
+  */
+bool Museek::DownloadManager::writeResumePosition(std::ostream * file, Download * download) {
+    return write_str(file, download->user()) != -1 &&
+           write_str(file, download->remotePath()) != -1 &&
+           write_off(file, download->resumePosition()) != -1;
+}
+
+/**
+  * Read the fingerprint of an incomplete file from the downloads file (or journal).
+  * Returns false if it couldn't be read.
+  */
+bool Museek::DownloadManager::readFingerprint(std::ifstream * file) {
+    std::string user, path, state;
+    if(read_str(file, user) == -1 ||
+       read_str(file, path) == -1 ||
+       read_str(file, state) == -1)
+        return false;
+
+    Download * dl = findDownload(user, path);
+    Fingerprint fingerprint;
+    if (dl && fingerprint.setState(state))
+        dl->setFingerprint(fingerprint);
+
+    return true;
+}
+
+/**
+  * Write the fingerprint of the incomplete file of the given download in the downloads file (or journal).
+  * Returns false if something went wrong.
+  */
+bool Museek::DownloadManager::writeFingerprint(std::ostream * file, Download * download) {
+    return write_str(file, download->user()) != -1 &&
+           write_str(file, download->remotePath()) != -1 &&
+           write_str(file, download->fingerprint().state()) != -1;
+}
+
+/**
+  * Is the fingerprint of the download worth storing (does it cover what we'll resume from)?
+  */
+bool Museek::DownloadManager::hasFingerprint(Download * download) {
+    return download->fingerprintKnown() && download->resumeKnown() && !download->transient()
+        && download->fingerprint().size() == download->resumePosition();
+}
+
+/**
+  * Make sure what has been written to this file has reached the disk
+  */
+static void syncFile(const std::string & path) {
+#ifndef WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd != -1) {
+        fsync(fd);
+        ::close(fd);
+    }
+#endif // WIN32
+}
+
+/**
+  * Remember that this download has changed (or has been removed) and should be journaled
+  */
+void Museek::DownloadManager::journal(const std::string & user, const std::string & path, bool removed) {
+    if (!m_Journaling)
+        return;
+
+    m_JournalPending[std::pair<std::string, std::string>(user, path)] = removed;
+    if (!m_JournalTimeout.isValid())
+        m_JournalTimeout = museekd()->reactor()->addTimeout(JOURNAL_DELAY, this, &DownloadManager::onJournalTimeout);
+}
+
+/**
+  * Journal this download if what we store about it has changed
+  */
+void Museek::DownloadManager::journal(Download * download) {
+    std::map<Download *, Entry>::iterator it = m_Entries.find(download);
+    if (it == m_Entries.end() || download->transient())
+        return;
+
+    if (it->second.journaledState == download->state() && it->second.journaledSize == download->size())
+        return;
+
+    it->second.journaledState = download->state();
+    it->second.journaledSize = download->size();
+    journal(download->user(), download->remotePath(), false);
+}
+
+void Museek::DownloadManager::onJournalTimeout(long) {
+    flushJournal();
+}
+
+/**
+  * Hand the pending changes to the disk I/O workers, appended to the journal all at once.
+  * When the journal becomes bigger than the downloads list, store the downloads again.
+  */
+void Museek::DownloadManager::flushJournal() {
+    if (m_JournalTimeout.isValid())
+        museekd()->reactor()->removeTimeout(m_JournalTimeout);
+
+    if (m_JournalPending.empty() && m_JournalPositions.empty())
+        return;
+
+    // The journal is emptied once the downloads file being written is in place: wait for it
+    if (m_SaveFile)
+        return;
+
+    std::string path = museekd()->config()->get("transfers", "downloads");
+    if (path.empty()) {
+        m_JournalPending.clear();
+        m_JournalPositions.clear();
+        return;
+    }
+    path += ".journal";
+
+    if (m_JournalFile && m_JournalFile->failed()) {
+        NNLOG("museekd.config.warn", "Cannot write downloads journal, storing every download.");
+        m_JournalFile->close();
+        m_JournalFile = 0;
+        saveDownloads();
+        return;
+    }
+    if (!m_JournalFile) {
+        m_JournalFile = new AsyncFile(museekd()->diskIO(), path, true);
+        if (!m_JournalFile->isOpen()) {
+            NNLOG("museekd.config.warn", "Cannot write downloads journal (%s).", path.c_str());
+            m_JournalFile = 0;
+            saveDownloads();
+            return;
         }
+        m_JournalFile->writtenEvent.connect(this, &DownloadManager::onJournalWritten);
+    }
 
-        file.close();
-
-        if (!m_PendingDownloadsSave) {
-        #ifdef WIN32
-            // On Win32, rename doesn't overwrite an existing file automatically.
-            remove(path.c_str());
-        #endif // WIN32
-            // Rename the temp file to the correct path.
-            if(rename(pathTemp.c_str(), path.c_str()) == -1) {
-                // Something happened. But nobody knows what.
-                NNLOG("museekd.config.warn", "Renaming downloads config file failed for unknown reason.");
-            }
+    std::ostringstream file;
+    std::map<std::pair<std::string, std::string>, bool>::const_iterator it;
+    for (it = m_JournalPending.begin(); it != m_JournalPending.end(); ++it) {
+        if (it->second) {
+            write_int(&file, JOURNAL_DELETE);
+            write_str(&file, it->first.first);
+            write_str(&file, it->first.second);
+        }
+        else {
+            Download * download = findDownload(it->first.first, it->first.second);
+            if (!download)
+                continue;
+            write_int(&file, JOURNAL_PUT);
+            writeDownloadRecord(&file, download);
+        }
+        m_JournalRecords++;
+    }
+    std::set<std::pair<std::string, std::string> >::const_iterator pit;
+    for (pit = m_JournalPositions.begin(); pit != m_JournalPositions.end(); ++pit) {
+        Download * download = findDownload(pit->first, pit->second);
+        if (!download)
+            continue;
+        write_int(&file, JOURNAL_POSITION);
+        writeResumePosition(&file, download);
+        m_JournalRecords++;
+        if (hasFingerprint(download)) {
+            write_int(&file, JOURNAL_FINGERPRINT);
+            writeFingerprint(&file, download);
+            m_JournalRecords++;
         }
+    }
 
-        // OK, we've finished. See if someone asked to save while we were saving (if true, we have to save now)
-        m_AllowSave = true;
-        if (m_PendingDownloadsSave)
-            saveDownloads();
+    std::string data(file.str());
+    m_JournalFile->append((const unsigned char *) data.data(), data.size());
+    m_JournalFile->sync();
+
+    NNLOG("museekd.down.debug", "Journaled %d download changes and %d resume positions", m_JournalPending.size(), m_JournalPositions.size());
+    m_JournalPending.clear();
+    m_JournalPositions.clear();
+
+    if (m_JournalRecords > JOURNAL_MIN_RECORDS && m_JournalRecords > m_Downloads.size())
+        saveDownloads();
+}
+
+/**
+  * Some records reached the journal: if they couldn't, store every download instead
+  */
+void Museek::DownloadManager::onJournalWritten(AsyncFile * file) {
+    if (file != m_JournalFile || !file->failed())
+        return;
+
+    NNLOG("museekd.config.warn", "Cannot write downloads journal, storing every download.");
+    m_JournalFile->close();
+    m_JournalFile = 0;
+    saveDownloads();
+}
+
+/**
+  * Write every download, its resume position and its fingerprint.
+  * Returns false if something went wrong.
+  */
+bool Museek::DownloadManager::writeDownloads(std::ostream * file) {
+    // Swarm sources aren't stored
+    uint32 transfers = 0;
+    std::vector<NewNet::RefPtr<Download> >::const_iterator it;
+    for(it = downloads().begin(); it != downloads().end(); ++it) {
+        if (!(*it)->transient())
+            transfers++;
     }
-    else {
+
+    NNLOG("museekd.down.debug", "Saving %d downloads", transfers);
+
+    bool ok = write_int(file, transfers) != -1;
+    for(it = downloads().begin(); ok && it != downloads().end(); ++it) {
+        if (!(*it)->transient())
+            ok = writeDownloadRecord(file, *it);
+    }
+
+    // Then the resume positions we know
+    uint32 positions = 0;
+    for(it = downloads().begin(); it != downloads().end(); ++it) {
+        if ((*it)->resumeKnown() && !(*it)->transient())
+            positions++;
+    }
+    ok = ok && write_int(file, positions) != -1;
+    for(it = downloads().begin(); ok && it != downloads().end(); ++it) {
+        if ((*it)->resumeKnown() && !(*it)->transient())
+            ok = writeResumePosition(file, *it);
+    }
+    // And the fingerprints of the incomplete files
+    uint32 fingerprints = 0;
+    for(it = downloads().begin(); it != downloads().end(); ++it) {
+        if (hasFingerprint(*it))
+            fingerprints++;
+    }
+    ok = ok && write_int(file, fingerprints) != -1;
+    for(it = downloads().begin(); ok && it != downloads().end(); ++it) {
+        if (hasFingerprint(*it))
+            ok = writeFingerprint(file, *it);
+    }
+
+    return ok;
+}
+
+/**
+  * Stores every download in the config file and empties the journal.
+  * The disk I/O workers write it: the journal takes the changes made meanwhile once it's in place.
+  */
+void Museek::DownloadManager::saveDownloads() {
+    if (m_SaveFile) {
         NNLOG("museekd.down.debug", "Delaying downloads saving");
         m_PendingDownloadsSave = true;
+        return;
+    }
+    m_PendingDownloadsSave = false;
+
+    std::string path = museekd()->config()->get("transfers", "downloads");
+    if (path.empty())
+        return;
+
+    // Not the same temporary file as saveDownloadsNow(): flush() may write it while this one is still being written
+    m_SaveFile = new AsyncFile(museekd()->diskIO(), path + ".new", true);
+    if (!m_SaveFile->isOpen() || !m_SaveFile->truncate(0)) {
+        NNLOG("museekd.config.warn", "Cannot save downloads (%s). Trying again later", path.c_str());
+        m_SaveFile->close();
+        m_SaveFile = 0;
+        return;
+    }
+    m_SavePath = path;
+
+    // Everything will be in the file: nothing left to journal (unless it can't be written)
+    if (m_JournalTimeout.isValid())
+        museekd()->reactor()->removeTimeout(m_JournalTimeout);
+    m_SavingPending.clear();
+    m_SavingPositions.clear();
+    m_SavingPending.swap(m_JournalPending);
+    m_SavingPositions.swap(m_JournalPositions);
+
+    // The journal will be removed once the file is in place: nothing more goes in it
+    if (m_JournalFile) {
+        m_JournalFile->close();
+        m_JournalFile = 0;
     }
+
+    std::ostringstream file;
+    writeDownloads(&file);
+    std::string data(file.str());
+
+    m_SaveFile->closedEvent.connect(this, &DownloadManager::onDownloadsSaved);
+    m_SaveFile->append((const unsigned char *) data.data(), data.size());
+    // It must be on the disk before it replaces the old one
+    m_SaveFile->sync();
+    m_SaveFile->close();
+}
+
+/**
+  * The downloads file has been written: put it in place and empty the journal
+  */
+void Museek::DownloadManager::onDownloadsSaved(AsyncFile * file) {
+    // flush() may have given up on it
+    if (file != m_SaveFile)
+        return;
+    m_SaveFile = 0;
+
+    std::string pathTemp(m_SavePath + ".new");
+#ifdef WIN32
+    // On Win32, rename doesn't overwrite an existing file automatically.
+    if (!file->failed())
+        remove(m_SavePath.c_str());
+#endif // WIN32
+    if (file->failed() || rename(pathTemp.c_str(), m_SavePath.c_str()) == -1) {
+        NNLOG("museekd.config.warn", "Cannot save downloads (%s, error %i), journaling the changes instead.", m_SavePath.c_str(), file->error());
+        std::remove(pathTemp.c_str());
+        // Whatever changed again meanwhile is newer
+        m_JournalPending.insert(m_SavingPending.begin(), m_SavingPending.end());
+        m_JournalPositions.insert(m_SavingPositions.begin(), m_SavingPositions.end());
+    }
+    else {
+        // The journal is now included in the downloads file
+        std::remove((m_SavePath + ".journal").c_str());
+        m_JournalRecords = 0;
+    }
+    m_SavingPending.clear();
+    m_SavingPositions.clear();
+
+    // See if someone asked to save while we were saving, or journal what has changed meanwhile
+    if (m_PendingDownloadsSave)
+        saveDownloads();
+    else
+        flushJournal();
+}
+
+/**
+  * Stores every download in the config file right now, without the workers
+  */
+void Museek::DownloadManager::saveDownloadsNow() {
+    std::string path = museekd()->config()->get("transfers", "downloads");
+    if (path.empty())
+        return;
+    std::string pathTemp(path + ".tmp");
+    std::remove(pathTemp.c_str()); // Remove the temp file if it already exists
+
+    std::ofstream file(pathTemp.c_str(), std::ofstream::binary | std::ofstream::app | std::ofstream::ate);
+    if(file.fail() || !file.is_open()) {
+        NNLOG("museekd.config.warn", "Cannot save downloads (%s).", path.c_str());
+        return;
+    }
+
+    bool ok = writeDownloads(&file);
+    file.close();
+    if (!ok || file.fail()) {
+        NNLOG("museekd.config.warn", "Cannot save downloads (%s).", path.c_str());
+        std::remove(pathTemp.c_str());
+        return;
+    }
+
+    syncFile(pathTemp);
+#ifdef WIN32
+    // On Win32, rename doesn't overwrite an existing file automatically.
+    remove(path.c_str());
+#endif // WIN32
+    // Rename the temp file to the correct path.
+    if(rename(pathTemp.c_str(), path.c_str()) == -1) {
+        // Something happened. But nobody knows what.
+        NNLOG("museekd.config.warn", "Renaming downloads config file failed for unknown reason.");
+        return;
+    }
+    // The journal is now included in the downloads file
+    std::remove((path + ".journal").c_str());
+    m_JournalRecords = 0;
+}
+
+/**
+  * The reactor doesn't run anymore: the workers won't complete what they are writing.
+  * If anything isn't stored yet, store every download now.
+  */
+void Museek::DownloadManager::flush() {
+    if (m_JournalTimeout.isValid())
+        museekd()->reactor()->removeTimeout(m_JournalTimeout);
+
+    bool writing = m_SaveFile || (m_JournalFile && (m_JournalFile->busy() || m_JournalFile->failed()));
+    if (!writing && m_JournalPending.empty() && m_JournalPositions.empty())
+        return;
+
+    m_SaveFile = 0;
+    m_JournalFile = 0;
+    m_JournalPending.clear();
+    m_JournalPositions.clear();
+    m_SavingPending.clear();
+    m_SavingPositions.clear();
+    saveDownloadsNow();
 }
@@ -26,7 +26,12 @@
 #include <NewNet/nnrefptr.h>
 #include <NewNet/nnevent.h>
 #include "configmanager.h"
+#include "fingerprint.h"
+#include "pathtable.h"
 #include "mutypes.h"
+#include <deque>
+#include <iosfwd>
+#include <set>
 
 /* Forward declarations. */
 class SGetStatus;
@@ -44,6 +49,9 @@ namespace Museek
   class PeerSocket;
   class TicketSocket;
   class DownloadSocket;
+  class AsyncFile;
+  class FileMove;
+  class Swarm;
 
   /* Definition of the download structure. */
   class DownloadManager;
@@ -61,12 +69,14 @@ namespace Museek
     void setSocket(DownloadSocket * socket);
 
     uint ticket() const { return m_Ticket; }
-    void setTicket(uint ticket) { m_Ticket = ticket; }
+    void setTicket(uint ticket);
     const std::string & user() const { return m_User; }
     bool enqueued() const { return m_Enqueued;}
-    void setEnqueued(bool e) { m_Enqueued = e; }
+    void setEnqueued(bool e);
 
     const std::string & remotePath() const { return m_RemotePath; }
+    /* The remote path as stored in museekd's path table (cheap to compare). */
+    const PathTable::Path & remotePathKey() const { return m_RemoteKey; }
     const std::string & localDir() const { return m_LocalDir; }
     void setLocalDir(const std::string & localDir) { m_LocalDir = localDir; }
     std::string filename() const;
@@ -79,6 +89,17 @@ namespace Museek
     uint64 position() const { return m_Position; }
     void setPosition(uint64 position);
     void setPositionFromIncompleteFile();
+    /* Does the incomplete file exist (created when downloading, or found when resuming)? */
+    bool incompleteExists() const { return m_IncompleteExists; }
+    void setIncompleteExists(bool exists);
+    /* How much of the incomplete file is known to be written. */
+    uint64 resumePosition() const { return m_ResumePosition; }
+    bool resumeKnown() const { return m_ResumeKnown; }
+    void setResumePosition(uint64 position);
+    /* Fingerprint of the incomplete file, valid if it covers it up to the resume position. */
+    const Fingerprint & fingerprint() const { return m_Fingerprint; }
+    bool fingerprintKnown() const { return m_FingerprintKnown; }
+    void setFingerprint(const Fingerprint & fingerprint);
 
     void received(uint bytes);
 
@@ -96,7 +117,21 @@ namespace Museek
     void setInitTimeout(NewNet::WeakRefPtr<NewNet::Event<long>::Callback> ref) {m_InitTimeout = ref;};
     void initTimedOut(long);
 
+    /* Move the complete file to the download directory (in the background). */
+    void finish();
+    void onIncompleteFileWritten(AsyncFile * file);
+    void onIncompleteFileClosed(AsyncFile * file);
+
+    /* The swarm this download is part of (see swarm.h), if any. */
+    Swarm * swarm() const { return m_Swarm; }
+    void setSwarm(Swarm * swarm);
+    /* Is it a source added by a swarm (neither stored nor journaled)? */
+    bool transient() const;
+
   private:
+    void onMoveProgress(FileMove * mover);
+    void onMoveDone(FileMove * mover);
+
     NewNet::WeakRefPtr<Museekd>         m_Museekd; // Ref to the museekd
 
     NewNet::WeakRefPtr<DownloadSocket>  m_Socket; // Ref to the socket associated
@@ -106,12 +141,17 @@ namespace Museek
     bool                                m_Enqueued; // Have we already enqueued this download?
 
     std::string                         m_RemotePath; // Path of the file in user's shares
+    PathTable::Path                     m_RemoteKey; // The same, in museekd's path table
     std::string                         m_LocalDir; // Dir where we need to store downloaded file when finished
-    mutable std::string                 m_Filename; // Name of the file
     mutable std::string                 m_IncompletePath; // Complete path where to store the incomplete file
+    bool                                m_IncompleteExists; // Is there an incomplete file at m_IncompletePath?
 
     uint64                               m_Size; // Size of this file
     uint64                               m_Position; // Current position of this file
+    uint64                               m_ResumePosition; // Size of the data written in the incomplete file
+    bool                                 m_ResumeKnown; // Do we know m_ResumePosition (or should we trust the file size)?
+    Fingerprint                          m_Fingerprint; // Hash of the incomplete file as it was written
+    bool                                 m_FingerprintKnown; // Is m_Fingerprint set?
 
     TrState                             m_State; // Transfer state (see mutypes.h)
     std::string                         m_Error; // Error message if state = TR_Error
@@ -125,6 +165,8 @@ namespace Museek
 	uint                                m_Place; // The place in queue for this download
 
     NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_InitTimeout; // Used to avoir waiting too long in initiating mode
+    NewNet::RefPtr<FileMove>            m_Mover; // Moves the file to the download directory when finalizing
+    NewNet::RefPtr<Swarm>               m_Swarm; // The swarm we're part of
   };
 
   /* The download manager manages .. downloads. */
@@ -178,10 +220,31 @@ namespace Museek
 
     void onPeerTransferReplyReceived(const PTransferReply * message);
 
+    /* Remember which files this user shares (from a search result): they may be swarm sources. */
+    void addSources(const std::string & user, const Folder & files);
+    /* Download the rest of the file from other users too, if we know some sharing it. */
+    void startSwarm(Download * download);
+
+    /* The ticket of the given download has changed: update the indexes. */
+    void onDownloadTicketChanged(Download * download, uint previous);
+    /* The state or the enqueued flag of the given download has changed: update the indexes. */
+    void reindex(Download * download);
+    /* The resume position of the given download has changed: journal it. */
+    void onDownloadResumePositionChanged(Download * download);
+    /* The incomplete file of the given download has been created (or moved): journal it. */
+    void onDownloadIncompleteChanged(Download * download);
+
     void setTransferReplyCallback(NewNet::Event<const PTransferReply *>::Callback * cb) {m_TransferReplyCallback = cb;};
 
+    /* Load the downloads file, then replay the journal. */
     void loadDownloads();
+    /* Store every download in the downloads file and empty the journal
+       (written by the disk I/O workers). */
     void saveDownloads();
+    /* Hand the pending download changes to the journal now. */
+    void flushJournal();
+    /* Store what hasn't reached the disk yet, without the reactor (on exit). */
+    void flush();
 
     NewNet::RateLimiter * limiter() {return m_Limiter;}
 
@@ -196,6 +259,49 @@ namespace Museek
     NewNet::Event<Download *> downloadUpdatedEvent;
 
   private:
+    /* The downloads of a user. */
+    struct UserDownloads
+    {
+      std::map<PathTable::Path, Download *> paths; // By remote path
+      std::map<uint, Download *> tickets;         // By ticket
+      std::map<uint64, Download *> waiting;       // Downloads needing a peer socket (see isWaiting()), in adding order
+    };
+
+    /* What we know about an indexed download. */
+    struct Entry
+    {
+      uint64 seq;     // Adding order
+      bool waiting;   // Is it in the waiting list of its user?
+      TrState journaledState; // State and size as last journaled
+      uint64 journaledSize;
+      std::string record;     // The download as last written in the downloads file (or journal)
+      TrState recordState;    // State and size it was written with: empty or out of date, it's written again
+      uint64 recordSize;
+    };
+
+    void index(Download * download);
+    void unindex(Download * download);
+    static bool isWaiting(Download * download);
+    std::vector<NewNet::RefPtr<Download> > waitingFrom(const std::string & user);
+    std::vector<NewNet::RefPtr<Download> > downloadsFrom(const std::string & user);
+
+    bool readDownload(std::ifstream * file);
+    bool writeDownload(std::ostream * file, Download * download);
+    bool writeDownloadRecord(std::ostream * file, Download * download);
+    void forgetDownloadRecords();
+    bool readResumePosition(std::ifstream * file);
+    bool writeResumePosition(std::ostream * file, Download * download);
+    bool readFingerprint(std::ifstream * file);
+    bool writeFingerprint(std::ostream * file, Download * download);
+    static bool hasFingerprint(Download * download);
+    bool writeDownloads(std::ostream * file);
+    void saveDownloadsNow();
+    void onDownloadsSaved(AsyncFile * file);
+    void onJournalWritten(AsyncFile * file);
+    void journal(Download * download);
+    void journal(const std::string & user, const std::string & path, bool removed);
+    void onJournalTimeout(long);
+
     void addDownloading(Download * download);
     void removeDownloading(const std::string& user);
 
@@ -219,18 +325,33 @@ namespace Museek
 
     bool                                                    m_AllowUpdate;      // Set it to false if you don't want downloads
                                                                                 // to be enqueued and saved
-    bool                                                    m_AllowSave;        // Set it to false if you don't want downloads
-                                                                                // to be saved
-    bool                                                    m_PendingDownloadsSave; // Should we save downloads soon?
+    bool                                                    m_PendingDownloadsSave; // Should we save downloads again once saved?
+    NewNet::RefPtr<AsyncFile>                               m_SaveFile;         // Downloads file being written (0 if none)
+    std::string                                             m_SavePath;         // Where it goes once written
+    bool                                                    m_Journaling;       // Should download changes be journaled?
+    std::map<std::pair<std::string, std::string>, bool>     m_JournalPending;   // Changed (false) or removed (true) downloads to journal
+    std::set<std::pair<std::string, std::string> >          m_JournalPositions; // Downloads whose resume position should be journaled
+    uint                                                    m_JournalRecords;   // Number of records in the journal
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback>       m_JournalTimeout;   // Delayed journal writing
+    NewNet::RefPtr<AsyncFile>                               m_JournalFile;      // The journal, appended to (0 when closed)
+    std::map<std::pair<std::string, std::string>, bool>     m_SavingPending;    // Changes the downloads file being written covers
+    std::set<std::pair<std::string, std::string> >          m_SavingPositions;  // (journaled again if it can't be written)
     NewNet::RefPtr<NewNet::RateLimiter>                     m_Limiter;          // Rate limiter shared between downloads
     NewNet::WeakRefPtr<Museekd>                             m_Museekd;          // Ref to the museekd
     std::vector<NewNet::RefPtr<Download> >                  m_Downloads;        // List of all the downloads
+    std::map<std::string, UserDownloads>                    m_Users;            // Downloads of each user, indexed
+    std::map<Download *, Entry>                             m_Entries;          // Every indexed download
+    std::set<std::string>                                   m_WaitingUsers;     // Users having some download needing a peer socket
+    uint64                                                  m_Seq;              // Last sequence number given to a download
     std::map<std::string, NewNet::WeakRefPtr<Download> >    m_Initiating;       // List of all the downloads currently being initiated
     std::map<std::string, NewNet::WeakRefPtr<Download> >    m_Downloading;      // List of user we're currently uploading
     std::map<std::string, std::map<std::string, std::string> > m_ContentsAsked;    // List of the folder contents asked (waiting for the reply)
     std::map<std::string, std::map<std::string, std::string> > m_ContentsPending;    // List of the folder contents pending a user socket
     std::map<std::string, std::vector<std::string> >        m_PlacesPending;    // List of place requests pending a peer socket
     std::map<std::string, std::vector<std::string> >        m_EnqueuingPending; // List of enqueuing request pending a peer socket
+    std::map<std::pair<std::string, uint64>, std::map<std::string, std::string> >
+                                                            m_Sources;          // Users sharing a file (by name and size) and its path
+    std::deque<std::pair<std::string, uint64> >             m_SourcesOrder;     // Files of m_Sources, oldest first
     NewNet::WeakRefPtr<NewNet::Event<const PTransferReply *>::Callback>
                                                             m_TransferReplyCallback; // Callback to the transferreply event
   };
@@ -26,12 +26,20 @@
 #include "museekd.h"
 #include "configmanager.h"
 #include "ticketsocket.h"
-#include <errno.h>
+#include "diskio.h"
+#include "swarm.h"
 #include <NewNet/nnreactor.h>
 
+/* Stop reading from the socket when that many bytes (besides the write-behind buffer) are waiting to be written... */
+#define OUTPUT_HIGH_WATER (4 * 1024 * 1024)
+/* ...and read again when the disk caught up. */
+#define OUTPUT_LOW_WATER (1024 * 1024)
+
 Museek::DownloadSocket::DownloadSocket(Museek::Museekd * museekd, Museek::Download * download)
               : UserSocket(museekd, "F"), m_Download(download)
 {
+    m_Finishing = false;
+
     // Connect our data received event.
     dataReceivedEvent.connect(this, &DownloadSocket::onDataReceived);
     // Connect disconnected event.
@@ -42,8 +50,8 @@ Museek::DownloadSocket::DownloadSocket(Museek::Museekd * museekd, Museek::Downlo
 Museek::DownloadSocket::~DownloadSocket()
 {
     NNLOG("museekd.down.debug", "DownloadSocket destroyed");
-    if(m_Output.is_open())
-        m_Output.close();
+    if(m_Output.isValid())
+        m_Output->close();
 }
 
 /*
@@ -78,7 +86,8 @@ Museek::DownloadSocket::onConnected(NewNet::ClientSocket *)
     }
 
     // Open our incomplete file
-    openIncompleteFile();
+    if(! openIncompleteFile())
+        return;
 
     // Send the file position.
     uint64 pos = m_Download->position();
@@ -96,13 +105,37 @@ Museek::DownloadSocket::onDisconnected(ClientSocket *)
 {
 	NNLOG("museekd.down.debug", "DownloadSocket disconnected");
 
+    // The download will be finished when the incomplete file is closed
+    if(m_Finishing)
+        return;
+
+    if(m_Swarm.isValid()) {
+        // Let the swarm know when what we've received is on disk
+        if(m_Output.isValid()) {
+            m_Swarm->closing(m_Download, m_Output);
+            m_Output->close();
+            m_Output = 0;
+        }
+        if(m_Swarm->hasRange(m_Download))
+            m_Download->setState(TS_ConnectionClosed);
+        else if(m_Swarm->finished() && ! m_Download->swarm() && m_Download->state() == TS_Transferring) {
+            // The swarm was dissolved: download the rest alone
+            m_Download->setPositionFromIncompleteFile();
+            m_Download->setEnqueued(false);
+            m_Download->setState(TS_QueuedRemotely);
+        }
+        return;
+    }
+
 	if(m_Download->position() >= m_Download->size())
 		m_Download->setState(TS_Finished);
 	else
 		m_Download->setState(TS_ConnectionClosed);
 
-    if(m_Output.is_open())
-        m_Output.close();
+    if(m_Output.isValid()) {
+        m_Output->close();
+        m_Output = 0;
+    }
 }
 
 /*
@@ -151,7 +184,8 @@ Museek::DownloadSocket::onTransferTicketReceived(TicketSocket * socket)
         receiveBuffer() = socket->receiveBuffer();
 
         // Open our incomplete file
-        openIncompleteFile();
+        if(! openIncompleteFile())
+            return;
 
         // Send the file position.
         unsigned char buf[8];
@@ -172,19 +206,77 @@ Museek::DownloadSocket::onTransferTicketReceived(TicketSocket * socket)
 bool
 Museek::DownloadSocket::openIncompleteFile()
 {
+    // Part of a swarm but nothing left to fetch: see if the swarm has something else for us
+    Swarm * swarm = m_Download->swarm();
+    if(swarm && ! swarm->hasRange(m_Download)) {
+        m_Finishing = true;
+        stop();
+        swarm->idle(m_Download);
+        return false;
+    }
+
     // We received data, open the incomplete file if necessary.
     NNLOG("museekd.down.debug", "Downloading to: %s.", m_Download->incompletePath().c_str());
-    m_Output.open(m_Download->incompletePath().c_str(), std::ofstream::binary | std::ofstream::app | std::ofstream::ate);
-    if(! m_Output.is_open()) {
+    m_Output = new AsyncFile(museekd()->diskIO(), m_Download->incompletePath(), true);
+    if(! m_Output->isOpen()) {
         // Couldn't open the incomplete file. Bail out.
         NNLOG("museekd.down.warn", "Couldn't open '%s'.", m_Download->incompletePath().c_str());
+        m_Output = 0;
         stop();
         return false;
     }
+    m_Download->setIncompleteExists(true);
+    if(swarm && swarm->primary())
+        swarm->primary()->setIncompleteExists(true);
+    m_Output->writtenEvent.connect(this, &DownloadSocket::onOutputWritten);
+    Download * download = m_Download;
+    m_Output->writtenEvent.connect(download, &Download::onIncompleteFileWritten);
+
+    if(swarm) {
+        // Fetch our range, the swarm tracks what is written
+        m_Swarm = swarm;
+        uint64 position = m_Swarm->position(m_Download);
+        m_Output->setWritePosition(position);
+        m_Download->setPosition(position);
+        NNLOG("museekd.down.debug", "Swarming from %s at %llu.", m_Download->user().c_str(), position);
+        m_Output->setWriteBehind(museekd()->config()->getUint("transfers", "write_buffer", 1024) * 1024);
+        return true;
+    }
+
+    // Resume after the data we know has been written, not at EOF
+    uint64 position = m_Output->size();
+    if(m_Download->resumeKnown() && m_Download->resumePosition() < position) {
+        NNLOG("museekd.down.debug", "Cutting '%s' to %llu bytes.", m_Download->incompletePath().c_str(), m_Download->resumePosition());
+        if(m_Output->truncate(m_Download->resumePosition()))
+            position = m_Download->resumePosition();
+    }
+
+    // Hash the content as it's written: from scratch, or from what we hashed
+    // before if the file still ends with it
+    if(position == 0)
+        m_Output->setFingerprint(Fingerprint());
+    else if(m_Download->fingerprintKnown() && m_Download->fingerprint().size() == position) {
+        if(m_Download->fingerprint().checkTail(m_Download->incompletePath()))
+            m_Output->setFingerprint(m_Download->fingerprint());
+        else if(m_Output->truncate(0)) {
+            NNLOG("museekd.down.warn", "'%s' doesn't end with what was downloaded, starting again.", m_Download->incompletePath().c_str());
+            position = 0;
+            m_Output->setFingerprint(Fingerprint());
+        }
+    }
+    m_Download->setResumePosition(position);
+    m_Download->setPosition(position);
+    NNLOG("museekd.down.debug", "Set position to %llu (%llu).", m_Download->position(), m_Output->size());
 
-    // Set the position of the download to EOF
-    m_Download->setPosition(m_Output.tellp());
-    NNLOG("museekd.down.debug", "Set position to %llu (%llu).", m_Download->position(), (uint64)m_Output.tellp());
+    // Reserve the space for the whole file so that it doesn't get fragmented
+    if(museekd()->config()->getBool("transfers", "preallocate", true))
+        m_Output->preallocate(m_Download->size());
+    // And write it by large blocks
+    m_Output->setWriteBehind(museekd()->config()->getUint("transfers", "write_buffer", 1024) * 1024);
+
+    // Maybe other users share this file too
+    museekd()->downloads()->startSwarm(m_Download);
+    m_Swarm = m_Download->swarm();
 
     return true;
 }
@@ -201,8 +293,18 @@ Museek::DownloadSocket::onDataReceived(NewNet::ClientSocket * socket)
 
         m_DataTimeout = museekd()->reactor()->addTimeout(60000, this, &DownloadSocket::dataTimeout);
 
-        // Write buffer to disk.
-        m_Output.write((const char *)receiveBuffer().data(), receiveBuffer().count());
+        if(! m_Output.isValid()) {
+            stop();
+            return;
+        }
+
+        if(m_Swarm.isValid()) {
+            onSwarmDataReceived();
+            return;
+        }
+
+        // Hand the buffer to the disk I/O workers.
+        m_Output->append(receiveBuffer().data(), receiveBuffer().count());
         // Increase the download counter.
         m_Download->received(receiveBuffer().count());
         // Clear buffer.
@@ -211,99 +313,84 @@ Museek::DownloadSocket::onDataReceived(NewNet::ClientSocket * socket)
         // Finished?
         if(m_Download->position() >= m_Download->size()) {
             NNLOG("museekd.down.debug", "Download of %s from %s finished.", m_Download->remotePath().c_str(), m_Download->user().c_str());
-            // Close output.
-            m_Output.close();
-            // Rename / move file.
-            finish();
+            // Rename / move the file once everything is on disk.
+            Download * download = m_Download;
+            m_Output->closedEvent.connect(download, &Download::onIncompleteFileClosed);
+            m_Output->close();
+            m_Output = 0;
+            m_Finishing = true;
             // Disconnect.
             stop();
         }
-        else if(m_Output.fail()) {
+        else if(m_Output->failed()) {
             stop();
             return;
         }
+        else if(m_Output->pending() > m_Output->writeBehind() + OUTPUT_HIGH_WATER) {
+            // The disk can't keep up, let the data wait in the kernel buffers.
+            NNLOG("museekd.down.debug", "Pausing download of %s, %u bytes waiting to be written.", m_Download->remotePath().c_str(), m_Output->pending());
+            setReceivePaused(true);
+        }
     }
 }
 
 /*
-    Call it when the download is complete : move the file from incomplete to complete dir
+    Some data of our range has been received
 */
 void
-Museek::DownloadSocket::finish()
+Museek::DownloadSocket::onSwarmDataReceived()
 {
-    // Ok, we're done.
-    m_Download->setState(TS_Finished);
-
-    std::string destpath = m_Download->destinationPath(true);
-
-#ifdef WIN32
-    // On Win32, rename doesn't overwrite an existing file automatically.
-    remove(destpath.c_str());
-#endif // WIN32
-    // Rename the incomplete file to the destination path.
-    if(rename(m_Download->incompletePath().c_str(), destpath.c_str()) == -1) {
-        if(errno == EXDEV) {
-            /* Incomplete and destination path are on different partitions or
-             mount points. We'll have to copy it manually. */
-            NNLOG("museekd.down.warn", "Having incomplete and download directory on different partitions is a bad idea!");
-            // Open the input stream.
-            std::ifstream fin;
-            fin.open(m_Download->incompletePath().c_str(), std::fstream::in | std::fstream::binary);
-            if(! fin.is_open()) {
-                NNLOG("museekd.down.warn", "Couldn't open '%s' for reading.", m_Download->incompletePath().c_str());
-                return;
-            }
-            // Open the output stream.
-            std::ofstream fout;
-            fout.open(destpath.c_str(), std::fstream::out | std::fstream::binary | std::fstream::trunc);
-            if(! fout.is_open()) {
-                NNLOG("museekd.down.warn", "Couldn't open '%s' for writing.", destpath.c_str());
-                fin.close();
-                return;
-            }
-
-            char buffer[8192];
-            std::streamsize n;
-            bool ok = true;
-            do {
-                // Read some bytes.
-                n = fin.readsome(buffer, 8192);
-                if(fin.fail()) {
-                    // Problem...
-                    NNLOG("museekd.down.warn", "Couldn't read from '%s'.", m_Download->incompletePath().c_str());
-                    ok = false;
-                    break;
-                }
-
-                if(n) {
-                    // Write some bytes.
-                    fout.write(buffer, n);
-                    if(fout.fail()) {
-                        // Problem.
-                        NNLOG("museekd.down.warn", "Couldn't write to '%s'.", destpath.c_str());
-                        ok = false;
-                    }
-                }
-            } while(n > 0);
-
-            // Finished. Close the files.
-            fin.close();
-            fout.close();
-
-            if(ok) {
-                // Everything went ok. Remove the incomplete file.
-                if(remove(m_Download->incompletePath().c_str()) == -1)
-                    NNLOG("museekd.down.warn", "Couldn't remove '%s'.", m_Download->incompletePath().c_str());
-            }
-            else {
-                // Things went not ok. Delete the destination file.
-                NNLOG("museekd.down.debug", "Removing '%s'.", destpath.c_str());
-                remove(destpath.c_str());
-            }
-        }
-        else {
-            // Something happened. But nobody knows what.
-            NNLOG("museekd.down.warn", "Renaming '%s' to '%s' failed for unknown reason.", m_Download->incompletePath().c_str(), destpath.c_str());
+    if(m_Swarm->finished()) {
+        stop();
+        return;
+    }
+
+    // Only write what belongs to our range, the rest is checked by the swarm
+    bool done = false;
+    size_t n = m_Swarm->received(m_Download, receiveBuffer().data(), receiveBuffer().count(), done);
+    if(n > 0)
+        m_Output->append(receiveBuffer().data(), n);
+    m_Download->received(receiveBuffer().count());
+    receiveBuffer().clear();
+
+    if(done) {
+        NNLOG("museekd.down.debug", "Range of %s from %s done.", m_Download->remotePath().c_str(), m_Download->user().c_str());
+        m_Swarm->closing(m_Download, m_Output);
+        m_Output->close();
+        m_Output = 0;
+        m_Finishing = true;
+        stop();
+    }
+    else if(m_Output->failed())
+        stop();
+    else if(m_Output->pending() > m_Output->writeBehind() + OUTPUT_HIGH_WATER) {
+        NNLOG("museekd.down.debug", "Pausing download of %s, %u bytes waiting to be written.", m_Download->remotePath().c_str(), m_Output->pending());
+        setReceivePaused(true);
+    }
+}
+
+/*
+    Some data has been written to the incomplete file
+*/
+void
+Museek::DownloadSocket::onOutputWritten(AsyncFile * file)
+{
+    if(file != m_Output)
+        return;
+
+    if(file->failed()) {
+        NNLOG("museekd.down.warn", "Couldn't write to '%s'.", m_Download->incompletePath().c_str());
+        stop();
+    }
+    else if(receivePaused()) {
+        // The disk is making progress, don't time out while we wait for it.
+        if (m_DataTimeout.isValid())
+            museekd()->reactor()->removeTimeout(m_DataTimeout);
+        m_DataTimeout = museekd()->reactor()->addTimeout(60000, this, &DownloadSocket::dataTimeout);
+
+        if(file->pending() < file->writeBehind() + OUTPUT_LOW_WATER) {
+            NNLOG("museekd.down.debug", "Resuming download of %s.", m_Download->remotePath().c_str());
+            setReceivePaused(false);
         }
     }
 }
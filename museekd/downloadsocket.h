@@ -22,13 +22,14 @@
 #define MUSEEK_DOWNLOADSOCKET_H
 
 #include "usersocket.h"
-#include <fstream>
 
 namespace Museek
 {
   class Museekd;
   class Download;
   class TicketSocket;
+  class AsyncFile;
+  class Swarm;
 
   class DownloadSocket : public UserSocket
   {
@@ -47,11 +48,14 @@ namespace Museek
     void onCannotConnect(NewNet::ClientSocket * socket);
     void onTransferTicketReceived(TicketSocket * socket);
     void onDataReceived(NewNet::ClientSocket * socket);
-    void finish();
+    void onSwarmDataReceived();
+    void onOutputWritten(AsyncFile * file);
     void dataTimeout(long);
 
     NewNet::RefPtr<Download> m_Download;
-    std::ofstream m_Output;
+    NewNet::RefPtr<AsyncFile> m_Output; // The incomplete file, written by the disk I/O workers
+    bool m_Finishing; // Is the incomplete file being closed before the download is finished?
+    NewNet::RefPtr<Swarm> m_Swarm; // The swarm we're fetching a range for, if any
     NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_DataTimeout;
   };
 }
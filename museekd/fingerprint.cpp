@@ -0,0 +1,195 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "fingerprint.h"
+#include <fstream>
+#include <string.h>
+
+/* Version of the stored state. */
+#define FINGERPRINT_STATE_VERSION 1
+
+Museek::Fingerprint::Fingerprint()
+{
+    reset();
+}
+
+void
+Museek::Fingerprint::reset()
+{
+    shaInit(&m_Context);
+    m_Size = 0;
+    m_Tail.clear();
+    m_TailLength = 0;
+    memset(m_TailDigest, 0, sizeof(m_TailDigest));
+}
+
+/**
+  * Hash the next bytes and remember the last ones
+  */
+void
+Museek::Fingerprint::update(const char * data, size_t n)
+{
+    if (n == 0)
+        return;
+
+    shaUpdate(&m_Context, (unsigned char *) data, n);
+    m_Size += n;
+
+    if (n >= FINGERPRINT_TAIL)
+        m_Tail.assign(data + n - FINGERPRINT_TAIL, data + n);
+    else {
+        m_Tail.insert(m_Tail.end(), data, data + n);
+        if (m_Tail.size() > FINGERPRINT_TAIL)
+            m_Tail.erase(m_Tail.begin(), m_Tail.end() - FINGERPRINT_TAIL);
+    }
+}
+
+/**
+  * Hex SHA-1 of the content hashed so far. The running hash isn't touched.
+  */
+std::string
+Museek::Fingerprint::digest() const
+{
+    SHA_CTX context = m_Context;
+    unsigned char hash[20];
+    shaFinal(&context, hash);
+
+    char hex[41];
+    hexDigest(hash, 20, hex);
+    return std::string(hex, 40);
+}
+
+/**
+  * SHA-1 of the last bytes hashed
+  */
+void
+Museek::Fingerprint::tailDigest(unsigned char hashout[20], uint32 & length) const
+{
+    if (m_Tail.empty()) {
+        length = m_TailLength;
+        memcpy(hashout, m_TailDigest, 20);
+        return;
+    }
+
+    length = m_Tail.size();
+    shaBlock((unsigned char *) &m_Tail[0], length, hashout);
+}
+
+/**
+  * Check the bytes of the file before size() against the tail we hashed.
+  * This reads at most FINGERPRINT_TAIL bytes.
+  */
+bool
+Museek::Fingerprint::checkTail(const std::string & path) const
+{
+    unsigned char expected[20];
+    uint32 length;
+    tailDigest(expected, length);
+    if (length == 0)
+        return m_Size == 0;
+
+    std::ifstream file(path.c_str(), std::fstream::in | std::fstream::binary);
+    if (!file.is_open())
+        return false;
+
+    std::vector<char> data(length);
+    file.seekg(m_Size - length);
+    file.read(&data[0], length);
+    if (file.fail() || (uint32) file.gcount() != length)
+        return false;
+
+    unsigned char hash[20];
+    shaBlock((unsigned char *) &data[0], length, hash);
+    return memcmp(hash, expected, 20) == 0;
+}
+
+static void
+packInt(std::string & out, uint32 value)
+{
+    for (int i = 0; i < 4; ++i)
+        out += (char) ((value >> (i * 8)) & 0xff);
+}
+
+static uint32
+unpackInt(const std::string & in, size_t & pos)
+{
+    uint32 value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= ((uint32) (unsigned char) in[pos + i]) << (i * 8);
+    pos += 4;
+    return value;
+}
+
+/**
+  * The state of the running hash: what's needed to carry on hashing and to check the tail
+  */
+std::string
+Museek::Fingerprint::state() const
+{
+    std::string out;
+    out += (char) FINGERPRINT_STATE_VERSION;
+    packInt(out, m_Size & 0xffffffff);
+    packInt(out, m_Size >> 32);
+    for (int i = 0; i < 5; ++i)
+        packInt(out, m_Context.H[i]);
+    packInt(out, m_Context.sizeHi);
+    packInt(out, m_Context.sizeLo);
+    packInt(out, m_Context.lenW);
+    // Only the block being filled matters
+    for (int i = 0; i < 16; ++i)
+        packInt(out, m_Context.W[i]);
+
+    unsigned char tail[20];
+    uint32 length;
+    tailDigest(tail, length);
+    packInt(out, length);
+    out.append((const char *) tail, 20);
+    return out;
+}
+
+bool
+Museek::Fingerprint::setState(const std::string & state)
+{
+    if (state.size() != 1 + 4 * 27 + 20 || state[0] != FINGERPRINT_STATE_VERSION)
+        return false;
+
+    reset();
+    size_t pos = 1;
+    m_Size = unpackInt(state, pos);
+    m_Size |= ((uint64) unpackInt(state, pos)) << 32;
+    for (int i = 0; i < 5; ++i)
+        m_Context.H[i] = unpackInt(state, pos);
+    m_Context.sizeHi = unpackInt(state, pos);
+    m_Context.sizeLo = unpackInt(state, pos);
+    m_Context.lenW = unpackInt(state, pos);
+    for (int i = 0; i < 16; ++i)
+        m_Context.W[i] = unpackInt(state, pos);
+    m_TailLength = unpackInt(state, pos);
+    memcpy(m_TailDigest, state.data() + pos, 20);
+
+    if (m_Context.lenW < 0 || m_Context.lenW >= 64 || m_TailLength > FINGERPRINT_TAIL || m_TailLength > m_Size) {
+        reset();
+        return false;
+    }
+    return true;
+}
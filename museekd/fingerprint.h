@@ -0,0 +1,72 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_FINGERPRINT_H
+#define MUSEEK_FINGERPRINT_H
+
+#include <Mucipher/mucipher.h>
+#include "mutypes.h"
+#include <string>
+#include <vector>
+
+/* Bytes at the end of the hashed data checked when resuming. */
+#define FINGERPRINT_TAIL (16 * 1024)
+
+namespace Museek
+{
+  /* SHA-1 of the content of a file, computed as the data flows (written
+     by a download, read by an upload) so that the file is never read twice.
+     The state can be stored and restored to carry on after a restart.
+     The hash of the last bytes is kept too: checking it against the file
+     tells if the file still holds what was hashed. */
+  class Fingerprint
+  {
+  public:
+    Fingerprint();
+
+    /* Start again from an empty content. */
+    void reset();
+    /* Hash the next bytes of the content. */
+    void update(const char * data, size_t n);
+
+    /* Number of bytes hashed. */
+    uint64 size() const { return m_Size; }
+    /* Hex SHA-1 of the bytes hashed so far. */
+    std::string digest() const;
+
+    /* Does the file end with the bytes hashed last (at size())? */
+    bool checkTail(const std::string & path) const;
+
+    /* The state as a string of bytes, and back. */
+    std::string state() const;
+    bool setState(const std::string & state);
+
+  private:
+    void tailDigest(unsigned char hashout[20], uint32 & length) const;
+
+    SHA_CTX                             m_Context;      // The running SHA-1
+    uint64                              m_Size;         // Bytes hashed
+    std::vector<char>                   m_Tail;         // Last bytes hashed (at most FINGERPRINT_TAIL)
+    uint32                              m_TailLength;   // Restored state: length of the tail...
+    unsigned char                       m_TailDigest[20]; // ...and its SHA-1 (m_Tail is empty then)
+  };
+}
+
+#endif // MUSEEK_FINGERPRINT_H
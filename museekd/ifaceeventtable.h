@@ -72,6 +72,7 @@ MAP_MESSAGE(0x0508, IDownloadFolderTo, downloadFolderToEvent)
 MAP_MESSAGE(0x0505, ITransferAbort, abortTransferEvent)
 MAP_MESSAGE(0x0509, IUploadFolder, uploadFolderEvent)
 MAP_MESSAGE(0x0506, IUploadFile, uploadFileEvent)
+MAP_MESSAGE(0x050A, ITransferUpdateRate, transferUpdateRateEvent)
 
 MAP_MESSAGE(0x0600, IGetRecommendations, getRecommendationsEvent)
 MAP_MESSAGE(0x0601, IGetGlobalRecommendations, getGlobalRecommendationsEvent)
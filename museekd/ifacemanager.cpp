@@ -35,8 +35,11 @@
 #include <NewNet/nnunixfactorysocket.h>
 #include <NewNet/nntcpfactorysocket.h>
 #include <NewNet/nnlog.h>
+#include <NewNet/nnreactor.h>
+#include <NewNet/util.h>
 
 #include <fstream>
+#include <time.h>
 
 #define SEND_MESSAGE(SOCKET, MESSAGE) (SOCKET)->sendMessage(MESSAGE.make_network_packet())
 #define SEND_ALL(MESSAGE) \
@@ -55,14 +58,39 @@
       if((*it)->authenticated() && ((*it)->mask() & MASK)) \
         (*it)->sendMessage(buffer); \
   } while(0)
+/* MESSAGE is encrypted with the key of (*it): it's built once per key. */
 #define SEND_C_MASK(MASK, MESSAGE) \
   do { \
+    std::map<std::string, NewNet::Buffer> packets; \
     std::vector<NewNet::RefPtr<Museek::IfaceSocket> >::iterator it, end = m_Ifaces.end(); \
     for(it = m_Ifaces.begin(); it != end; ++it) \
-      if((*it)->authenticated() && ((*it)->mask() & MASK)) \
-        (*it)->sendMessage(MESSAGE.make_network_packet()); \
+      if((*it)->authenticated() && ((*it)->mask() & MASK)) { \
+        std::map<std::string, NewNet::Buffer>::iterator pit = packets.find((*it)->cipherKeyId()); \
+        if(pit == packets.end()) \
+          pit = packets.insert(std::pair<std::string, NewNet::Buffer>((*it)->cipherKeyId(), MESSAGE.make_network_packet())).first; \
+        (*it)->sendMessage(pit->second); \
+      } \
   } while(0)
 
+/* Bounds of the interval between two transfer deltas (in ms). */
+#define TRANSFER_RATE_MIN 100
+#define TRANSFER_RATE_MAX 60000
+/* Entries (transfers, users) sent to an interface per reactor iteration after its login. */
+#define LOGIN_CHUNK 200
+/* Removed transfers remembered to bring reconnecting interfaces up to date. */
+#define STATE_REMOVED_MAX 4096
+
+/* Steps of the login state stream. */
+enum
+{
+  STREAM_REMOVED,
+  STREAM_TRANSFERS,
+  STREAM_PEER_STATS,
+  STREAM_PEER_STATUS,
+  STREAM_SYNC,
+  STREAM_DONE
+};
+
 static char challengemap[] = "0123456789abcdef";
 static std::string challenge()
 {
@@ -76,8 +104,12 @@ Museek::IfaceManager::IfaceManager(Museekd * museekd) : m_Museekd(museekd)
 {
   m_AwayState = 0;
   m_ReceivedTimeDiff = false;
+  m_NextTransferId = 1;
+  m_StateEpoch = (time(0) ^ rand()) | 1;
+  m_StateSeq = 0;
+  m_StateHorizon = 0;
 
-  NNLOG.logEvent.connect(this, &IfaceManager::onLog);
+  NewNet::log.logEvent.connect(this, &IfaceManager::onLog);
 
   museekd->config()->keySetEvent.connect(this, &IfaceManager::onConfigKeySet);
   museekd->config()->keyRemovedEvent.connect(this, &IfaceManager::onConfigKeyRemoved);
@@ -341,6 +373,7 @@ Museek::IfaceManager::onIfaceAccepted(IfaceSocket * socket)
   socket->abortTransferEvent.connect(this, &IfaceManager::onIfaceAbortTransfer);
   socket->uploadFolderEvent.connect(this, &IfaceManager::onIfaceUploadFolder);
   socket->uploadFileEvent.connect(this, &IfaceManager::onIfaceUploadFile);
+  socket->transferUpdateRateEvent.connect(this, &IfaceManager::onIfaceTransferUpdateRate);
 
   // Send the login challenge
   socket->setChallenge(challenge());
@@ -438,10 +471,6 @@ Museek::IfaceManager::onIfaceLogin(const ILogin * message)
         SEND_MESSAGE(socket, IPrivRoomAlterableOperators(altOpIt->first, altOpIt->second));
       }
     }
-    if(socket->mask() & EM_TRANSFERS) {
-      SEND_MESSAGE(socket, ITransferState(&museekd()->downloads()->downloads()));
-      SEND_MESSAGE(socket, ITransferState(&museekd()->uploads()->uploads()));
-    }
     if(socket->mask() & EM_PRIVATE)
       flushPrivateMessages();
     if(socket->mask() & EM_CONFIG)
@@ -449,22 +478,174 @@ Museek::IfaceManager::onIfaceLogin(const ILogin * message)
     if(museekd()->server()->loggedIn())
       SEND_MESSAGE(message->ifaceSocket(), ISetStatus(m_AwayState));
 
-    if (socket->mask() & EM_USERINFO) {
-        // send peers stats
-        // copy the maps to avoid invalid iterator when they are modified elsewhere
-        std::map<std::string, UserData> userStats(*(museekd()->peers()->userStats()));
-        std::map<std::string, UserData>::const_iterator it = userStats.begin();
-        for(; it != userStats.end(); it++) {
-            SEND_MESSAGE(socket, IPeerStats(it->first, it->second));
-        }
+    // Transfers and peers can be many: they're sent in chunks
+    startLoginStream(socket, message->epoch, message->seq);
+  }
+}
+
+/**
+  * Start sending the transfers and the peers to a new interface. If it already knows
+  * the transfers up to a sequence number of this run, only the changes since are sent.
+  */
+void
+Museek::IfaceManager::startLoginStream(IfaceSocket * socket, uint32 epoch, uint32 seq)
+{
+  if(!(socket->mask() & (EM_TRANSFERS | EM_USERINFO | EM_SYNC)))
+    return;
 
-        std::map<std::string, uint32> userStatus(*(museekd()->peers()->userStatus()));
-        std::map<std::string, uint32>::const_iterator sit = userStatus.begin();
-        for(; sit != userStatus.end(); sit++) {
-            SEND_MESSAGE(socket, IPeerStatus(sit->first, sit->second));
+  LoginStream stream;
+  stream.socket = socket;
+  stream.step = STREAM_REMOVED;
+  stream.changes = (socket->mask() & EM_SYNC) && epoch == m_StateEpoch && seq >= m_StateHorizon && seq <= m_StateSeq;
+  stream.since = stream.changes ? seq : 0;
+  stream.removed = stream.since;
+  stream.removedUntil = m_StateSeq;
+  stream.cursor = 0;
+  m_LoginStreams.push_back(stream);
+
+  // Transfers that existed before us haven't been given an id yet
+  if(socket->mask() & EM_TRANSFERS) {
+    std::vector<NewNet::RefPtr<Download> >::const_iterator dit, dend = museekd()->downloads()->downloads().end();
+    for(dit = museekd()->downloads()->downloads().begin(); dit != dend; ++dit)
+      transferId(*dit, 0, false);
+    std::vector<NewNet::RefPtr<Upload> >::const_iterator uit, uend = museekd()->uploads()->uploads().end();
+    for(uit = museekd()->uploads()->uploads().begin(); uit != uend; ++uit)
+      transferId(0, *uit, false);
+  }
+
+  NNLOG("museekd.iface.debug", "Sending the %s state to the interface.", stream.changes ? "changes of the" : "whole");
+
+  if(!m_LoginStreamTimeout.isValid())
+    m_LoginStreamTimeout = museekd()->reactor()->addTimeout(0, this, &IfaceManager::onLoginStreamTimeout);
+}
+
+/**
+  * Send the next chunk of the login state. Returns false when it's all sent.
+  */
+bool
+Museek::IfaceManager::continueLoginStream(LoginStream & stream)
+{
+  IfaceSocket * socket = stream.socket;
+  if(!socket || socket->socketState() != NewNet::Socket::SocketConnected)
+    return false;
+
+  uint sent = 0;
+  while(stream.step != STREAM_DONE && sent < LOGIN_CHUNK) {
+    switch(stream.step) {
+    case STREAM_REMOVED:
+      if(stream.changes && (socket->mask() & EM_TRANSFERS)) {
+        // Ordered by sequence number: go on after the last removal sent
+        std::deque<RemovedTransfer>::const_iterator rit = m_RemovedTransfers.begin(), rend = m_RemovedTransfers.end();
+        while(rit != rend && rit->seq <= stream.removed)
+          ++rit;
+        for(; rit != rend && rit->seq <= stream.removedUntil && sent < LOGIN_CHUNK; ++rit, ++sent) {
+          SEND_MESSAGE(socket, ITransferRemove(rit->upload, rit->user, rit->path));
+          stream.removed = rit->seq;
+        }
+        if(rit != rend && rit->seq <= stream.removedUntil)
+          break;
+      }
+      stream.step = STREAM_TRANSFERS;
+      break;
+    case STREAM_TRANSFERS:
+      if(socket->mask() & EM_TRANSFERS) {
+        std::vector<NewNet::RefPtr<Download> > downloads;
+        std::vector<NewNet::RefPtr<Upload> > uploads;
+        std::map<uint32, TransferRef>::const_iterator it = m_Transfers.upper_bound(stream.cursor);
+        // Skipping unchanged transfers costs too: they count in the chunk
+        for(; it != m_Transfers.end() && sent < LOGIN_CHUNK; ++it, ++sent) {
+          stream.cursor = it->first;
+          if(stream.changes && it->second.seq <= stream.since)
+            continue;
+          if(it->second.download)
+            downloads.push_back(it->second.download);
+          else
+            uploads.push_back(it->second.upload);
         }
+        if(!downloads.empty())
+          SEND_MESSAGE(socket, ITransferState(&downloads));
+        if(!uploads.empty())
+          SEND_MESSAGE(socket, ITransferState(&uploads));
+        if(it != m_Transfers.end())
+          break;
+      }
+      stream.step = STREAM_PEER_STATS;
+      break;
+    case STREAM_PEER_STATS:
+      if(socket->mask() & EM_USERINFO) {
+        // Go on from the last user sent: the map may have changed since
+        std::map<std::string, UserData> * stats = museekd()->peers()->userStats();
+        std::map<std::string, UserData>::const_iterator it = stream.user.empty() ? stats->begin() : stats->upper_bound(stream.user);
+        for(; it != stats->end() && sent < LOGIN_CHUNK; ++it, ++sent) {
+          SEND_MESSAGE(socket, IPeerStats(it->first, it->second));
+          stream.user = it->first;
+        }
+        if(it != stats->end())
+          break;
+      }
+      stream.user.clear();
+      stream.step = STREAM_PEER_STATUS;
+      break;
+    case STREAM_PEER_STATUS:
+      if(socket->mask() & EM_USERINFO) {
+        std::map<std::string, uint32> * status = museekd()->peers()->userStatus();
+        std::map<std::string, uint32>::const_iterator it = stream.user.empty() ? status->begin() : status->upper_bound(stream.user);
+        for(; it != status->end() && sent < LOGIN_CHUNK; ++it, ++sent) {
+          SEND_MESSAGE(socket, IPeerStatus(it->first, it->second));
+          stream.user = it->first;
+        }
+        if(it != status->end())
+          break;
+      }
+      stream.step = STREAM_SYNC;
+      break;
+    case STREAM_SYNC:
+      // Later changes are sent as they happen
+      if(socket->mask() & EM_SYNC)
+        SEND_MESSAGE(socket, IStateSync(m_StateEpoch, m_StateSeq, !stream.changes));
+      stream.step = STREAM_DONE;
+      break;
     }
   }
+
+  return stream.step != STREAM_DONE;
+}
+
+/**
+  * Has the login stream of this interface gone past this transfer? Until it
+  * has, the interface gets the transfer from the stream, not as an update.
+  */
+bool
+Museek::IfaceManager::transferStreamed(IfaceSocket * socket, uint32 id) const
+{
+  std::vector<LoginStream>::const_iterator it, end = m_LoginStreams.end();
+  for(it = m_LoginStreams.begin(); it != end; ++it) {
+    if(it->socket != socket)
+      continue;
+    if(it->step < STREAM_TRANSFERS)
+      return false;
+    return it->step > STREAM_TRANSFERS || id <= it->cursor;
+  }
+  return true;
+}
+
+/**
+  * Send a chunk of their login state to each new interface.
+  */
+void
+Museek::IfaceManager::onLoginStreamTimeout(long)
+{
+  m_LoginStreamTimeout = 0;
+
+  for(uint i = 0; i < m_LoginStreams.size(); ) {
+    if(continueLoginStream(m_LoginStreams[i]))
+      ++i;
+    else
+      m_LoginStreams.erase(m_LoginStreams.begin() + i);
+  }
+
+  if(!m_LoginStreams.empty())
+    m_LoginStreamTimeout = museekd()->reactor()->addTimeout(0, this, &IfaceManager::onLoginStreamTimeout);
 }
 
 void
@@ -559,7 +740,7 @@ Museek::IfaceManager::onIfaceGetUserInfo(const IUserInfo * message)
   if (std::find(m_PendingInfoWaiting.begin(), m_PendingInfoWaiting.end(), message->user) == m_PendingInfoWaiting.end())
     m_PendingInfoWaiting.push_back(message->user);
 
-  museekd()->peers()->peerSocket(message->user);
+  museekd()->peers()->peerSocket(message->user, PeerSocket::Info);
 }
 
 void
@@ -576,7 +757,7 @@ Museek::IfaceManager::onIfaceGetUserShares(const IUserShares * message)
   if (std::find(m_PendingSharesWaiting.begin(), m_PendingSharesWaiting.end(), message->user) == m_PendingSharesWaiting.end())
     m_PendingSharesWaiting.push_back(message->user);
 
-  museekd()->peers()->peerSocket(message->user);
+  museekd()->peers()->peerSocket(message->user, PeerSocket::Browse);
 }
 
 void
@@ -898,6 +1079,30 @@ Museek::IfaceManager::onIfaceDownloadFolderTo(const IDownloadFolderTo * message)
     museekd()->downloads()->addFolder(message->user, message->folder, museekd()->codeset()->fromUtf8ToFS(message->localpath));
 }
 
+void
+Museek::IfaceManager::onIfaceTransferUpdateRate(const ITransferUpdateRate * message)
+{
+    IfaceSocket * socket = message->ifaceSocket();
+    uint32 interval = message->interval;
+    if(interval) {
+        if(interval < TRANSFER_RATE_MIN)
+            interval = TRANSFER_RATE_MIN;
+        else if(interval > TRANSFER_RATE_MAX)
+            interval = TRANSFER_RATE_MAX;
+    }
+
+    if(!interval) {
+        // Back to an update for each change: the ids are no longer used
+        socket->dirtyTransfers().clear();
+        socket->sentTransfers().clear();
+    }
+    else if(!socket->transferRate())
+        socket->transfersFlushed().tv_sec = socket->transfersFlushed().tv_usec = 0;
+    socket->setTransferRate(interval);
+
+    SEND_MESSAGE(socket, ITransferUpdateRate(interval));
+}
+
 void
 Museek::IfaceManager::onIfaceUpdateTransfer(const ITransferUpdate * message)
 {
@@ -1400,25 +1605,235 @@ Museek::IfaceManager::sendStatusMessage(bool type, std::string message)
 void
 Museek::IfaceManager::onDownloadUpdated(Download * download)
 {
-  SEND_MASK(EM_TRANSFERS, ITransferUpdate(download));
+  transferUpdated(download, 0);
 }
 
 void
 Museek::IfaceManager::onDownloadRemoved(Download * download)
 {
+  transferRemoved(download, false, download->user(), download->remotePath());
   SEND_MASK(EM_TRANSFERS, ITransferRemove(false, download->user(), download->remotePath()));
 }
 
 void
 Museek::IfaceManager::onUploadUpdated(Upload * upload)
 {
-  SEND_MASK(EM_TRANSFERS, ITransferUpdate(upload));
+  transferUpdated(0, upload);
 }
 
 void
 Museek::IfaceManager::onUploadRemoved(Upload * upload)
 {
-    SEND_MASK(EM_TRANSFERS, ITransferRemove(true, upload->user(), museekd()->codeset()->fromFsToUtf8(upload->localPath())));
+    std::string path = museekd()->codeset()->fromFsToUtf8(upload->localPath());
+    transferRemoved(upload, true, upload->user(), path);
+    SEND_MASK(EM_TRANSFERS, ITransferRemove(true, upload->user(), path));
+}
+
+/**
+  * Id of a transfer (given the first time). changed bumps the state sequence number.
+  */
+uint32
+Museek::IfaceManager::transferId(Download * download, Upload * upload, bool changed)
+{
+  NewNet::Object * transfer = download ? (NewNet::Object *) download : (NewNet::Object *) upload;
+  uint32 id;
+  std::map<NewNet::Object *, uint32>::iterator tit = m_TransferIds.find(transfer);
+  if(tit != m_TransferIds.end())
+    id = tit->second;
+  else {
+    id = m_NextTransferId++;
+    m_TransferIds[transfer] = id;
+    TransferRef ref;
+    ref.download = download;
+    ref.upload = upload;
+    ref.seq = 0;
+    m_Transfers[id] = ref;
+  }
+
+  if(changed)
+    m_Transfers[id].seq = ++m_StateSeq;
+  return id;
+}
+
+/**
+  * A transfer has changed: send it to the interfaces that want each update,
+  * mark it for the next delta of the others.
+  */
+void
+Museek::IfaceManager::transferUpdated(Download * download, Upload * upload)
+{
+  uint32 id = transferId(download, upload, true);
+
+  // The update is only packed if someone wants it
+  NewNet::Buffer buffer;
+  bool packed = false;
+  bool dirty = false;
+  std::vector<NewNet::RefPtr<IfaceSocket> >::iterator it, end = m_Ifaces.end();
+  for(it = m_Ifaces.begin(); it != end; ++it) {
+    if(!(*it)->authenticated() || !((*it)->mask() & EM_TRANSFERS))
+      continue;
+    // The login stream will send its whole state later
+    if(!transferStreamed(*it, id))
+      continue;
+    if((*it)->transferRate()) {
+      (*it)->dirtyTransfers().insert(id);
+      dirty = true;
+      continue;
+    }
+    if(!packed) {
+      if(download)
+        buffer = ITransferUpdate(download).make_network_packet();
+      else
+        buffer = ITransferUpdate(upload).make_network_packet();
+      packed = true;
+    }
+    (*it)->sendMessage(buffer);
+  }
+
+  if(dirty)
+    scheduleTransferDeltas();
+}
+
+/**
+  * A transfer is being removed: forget its id and its pending changes,
+  * remember the removal for the interfaces that will reconnect.
+  */
+void
+Museek::IfaceManager::transferRemoved(NewNet::Object * transfer, bool upload, const std::string & user, const std::string & path)
+{
+  std::map<NewNet::Object *, uint32>::iterator tit = m_TransferIds.find(transfer);
+  if(tit == m_TransferIds.end())
+    return;
+
+  uint32 id = tit->second;
+  m_TransferIds.erase(tit);
+  m_Transfers.erase(id);
+
+  RemovedTransfer removed;
+  removed.seq = ++m_StateSeq;
+  removed.upload = upload;
+  removed.user = user;
+  removed.path = path;
+  m_RemovedTransfers.push_back(removed);
+  if(m_RemovedTransfers.size() > STATE_REMOVED_MAX) {
+    m_StateHorizon = m_RemovedTransfers.front().seq;
+    m_RemovedTransfers.pop_front();
+  }
+
+  std::vector<NewNet::RefPtr<IfaceSocket> >::iterator it, end = m_Ifaces.end();
+  for(it = m_Ifaces.begin(); it != end; ++it) {
+    (*it)->dirtyTransfers().erase(id);
+    (*it)->sentTransfers().erase(id);
+  }
+}
+
+/**
+  * Send the fields of the transfers that changed since the last delta to an interface.
+  */
+void
+Museek::IfaceManager::flushTransferDelta(IfaceSocket * socket)
+{
+  ITransferDelta delta;
+
+  std::set<uint32>::const_iterator it, end = socket->dirtyTransfers().end();
+  for(it = socket->dirtyTransfers().begin(); it != end; ++it) {
+    std::map<uint32, TransferRef>::const_iterator tit = m_Transfers.find(*it);
+    if(tit == m_Transfers.end())
+      continue;
+
+    ITransferDelta::Entry entry;
+    entry.id = *it;
+    entry.download = tit->second.download;
+    entry.upload = tit->second.upload;
+    TransferFields & values = entry.values;
+    if(entry.download) {
+      values.place = entry.download->place();
+      values.state = entry.download->state();
+      values.error = entry.download->error();
+      values.position = entry.download->position();
+      values.size = entry.download->size();
+      values.rate = entry.download->rate();
+    }
+    else {
+      values.place = museekd()->uploads()->queueLength(entry.upload->user(), entry.upload->localPath());
+      values.state = entry.upload->state();
+      values.error = entry.upload->error();
+      values.position = entry.upload->position();
+      values.size = entry.upload->size();
+      values.rate = entry.upload->rate();
+    }
+
+    std::map<uint32, TransferFields>::iterator sit = socket->sentTransfers().find(*it);
+    if(sit == socket->sentTransfers().end()) {
+      entry.fields = TD_NEW | TD_ALL;
+      socket->sentTransfers()[*it] = values;
+    }
+    else {
+      TransferFields & sent = sit->second;
+      entry.fields = 0;
+      if(values.place != sent.place)
+        entry.fields |= TD_PLACE;
+      if(values.state != sent.state)
+        entry.fields |= TD_STATE;
+      if(values.error != sent.error)
+        entry.fields |= TD_ERROR;
+      if(values.position != sent.position)
+        entry.fields |= TD_POSITION;
+      if(values.size != sent.size)
+        entry.fields |= TD_SIZE;
+      if(values.rate != sent.rate)
+        entry.fields |= TD_RATE;
+      if(!entry.fields)
+        continue;
+      sent = values;
+    }
+    delta.entries.push_back(entry);
+  }
+
+  socket->dirtyTransfers().clear();
+  gettimeofday(&socket->transfersFlushed(), 0);
+
+  if(!delta.entries.empty())
+    SEND_MESSAGE(socket, delta);
+}
+
+/**
+  * Make sure the next delta will be sent in time.
+  */
+void
+Museek::IfaceManager::scheduleTransferDeltas()
+{
+  if(m_TransferDeltaTimeout.isValid())
+    return;
+  m_TransferDeltaTimeout = museekd()->reactor()->addTimeout(TRANSFER_RATE_MIN, this, &IfaceManager::onTransferDeltaTimeout);
+}
+
+/**
+  * Send their delta to the interfaces that waited long enough. Try again later if some are waiting.
+  */
+void
+Museek::IfaceManager::onTransferDeltaTimeout(long)
+{
+  m_TransferDeltaTimeout = 0;
+
+  struct timeval now;
+  gettimeofday(&now, 0);
+
+  long next = -1;
+  std::vector<NewNet::RefPtr<IfaceSocket> > ifaces(m_Ifaces); // Sending may disconnect one
+  std::vector<NewNet::RefPtr<IfaceSocket> >::iterator it, end = ifaces.end();
+  for(it = ifaces.begin(); it != end; ++it) {
+    if(!(*it)->transferRate() || (*it)->dirtyTransfers().empty())
+      continue;
+    long wait = (long) (*it)->transferRate() - difftime(now, (*it)->transfersFlushed());
+    if(wait <= 0)
+      flushTransferDelta(*it);
+    else if(next < 0 || wait < next)
+      next = wait;
+  }
+
+  if(next >= 0)
+    m_TransferDeltaTimeout = museekd()->reactor()->addTimeout(next, this, &IfaceManager::onTransferDeltaTimeout);
 }
 
 void
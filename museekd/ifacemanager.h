@@ -30,6 +30,7 @@
 #include <NewNet/nnweakrefptr.h>
 #include <NewNet/nnclientsocket.h>
 #include <NewNet/nnserversocket.h>
+#include <deque>
 
 namespace NewNet
 {
@@ -55,7 +56,8 @@ namespace Museek
       EM_USERSHARES = 16,
       EM_INTERESTS = 32,
       EM_CONFIG = 64,
-      EM_DEBUG = 128
+      EM_DEBUG = 128,
+      EM_SYNC = 256
     };
 
     IfaceManager(Museekd * museekd);
@@ -147,6 +149,7 @@ namespace Museek
     void onIfaceAbortTransfer(const ITransferAbort * message);
     void onIfaceUploadFile(const IUploadFile * message);
     void onIfaceUploadFolder(const IUploadFolder * message);
+    void onIfaceTransferUpdateRate(const ITransferUpdateRate * message);
 
     // Server event handlers:
     void onServerLoggedIn(const SLogin * message);
@@ -198,6 +201,31 @@ namespace Museek
     void onUploadUpdated(Upload * upload);
     void onUploadRemoved(Upload * upload);
 
+    // Login state, sent a chunk at a time:
+    struct LoginStream
+    {
+      NewNet::WeakRefPtr<IfaceSocket> socket;
+      uint step;                // What's being sent
+      bool changes;             // Only send the transfers changed since...
+      uint32 since;             // ...this sequence number
+      uint32 removed;           // Last removal sent (its sequence number)...
+      uint32 removedUntil;      // ...up to the last one before the stream (later ones are sent as they happen)
+      uint32 cursor;            // Last transfer id sent
+      std::string user;         // Last user whose stats or status were sent
+    };
+    void startLoginStream(IfaceSocket * socket, uint32 epoch, uint32 seq);
+    bool continueLoginStream(LoginStream & stream);
+    bool transferStreamed(IfaceSocket * socket, uint32 id) const;
+    void onLoginStreamTimeout(long);
+
+    // Transfer updates:
+    uint32 transferId(Download * download, Upload * upload, bool changed);
+    void transferUpdated(Download * download, Upload * upload);
+    void transferRemoved(NewNet::Object * transfer, bool upload, const std::string & user, const std::string & path);
+    void flushTransferDelta(IfaceSocket * socket);
+    void scheduleTransferDeltas();
+    void onTransferDeltaTimeout(long);
+
     NewNet::WeakRefPtr<Museekd> m_Museekd;
 
     std::map<std::string, NewNet::RefPtr<NewNet::Object> > m_Factories;
@@ -231,6 +259,33 @@ namespace Museek
       std::string message;
     };
     std::vector<PrivateMessage> m_PrivateMessages;
+
+    // Transfers known by the interfaces:
+    struct TransferRef
+    {
+      Download * download;
+      Upload * upload;
+      uint32 seq;               // State sequence number of its last change
+    };
+    struct RemovedTransfer
+    {
+      uint32 seq;
+      bool upload;
+      std::string user, path;
+    };
+    uint32 m_NextTransferId;
+    std::map<NewNet::Object *, uint32> m_TransferIds;
+    std::map<uint32, TransferRef> m_Transfers;
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_TransferDeltaTimeout;
+
+    // Versioned transfer state:
+    uint32 m_StateEpoch;        // Identifies this run of the daemon
+    uint32 m_StateSeq;          // Incremented for each transfer change
+    uint32 m_StateHorizon;      // Oldest sequence number we still know the changes since
+    std::deque<RemovedTransfer> m_RemovedTransfers;
+
+    std::vector<LoginStream> m_LoginStreams;
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_LoginStreamTimeout;
   };
 }
 
@@ -30,8 +30,29 @@
 namespace Museek
 {
 	class IfaceSocket;
+
+	/* The fields of a transfer that change, as sent to an interface. */
+	struct TransferFields
+	{
+		uint32 place;
+		uint32 state;
+		std::string error;
+		uint64 position;
+		uint64 size;
+		uint32 rate;
+	};
 }
 
+/* Fields present in an entry of ITransferDelta. */
+#define TD_NEW          1   // First entry for this id: the transfer is identified
+#define TD_PLACE        2
+#define TD_STATE        4
+#define TD_ERROR        8
+#define TD_POSITION     16
+#define TD_SIZE         32
+#define TD_RATE         64
+#define TD_ALL          (TD_PLACE | TD_STATE | TD_ERROR | TD_POSITION | TD_SIZE | TD_RATE)
+
 class IfaceMessage : public NetworkMessage {
 protected:
     void default_garbage_collector() { }
@@ -192,6 +213,10 @@ IFACEMESSAGE(ILogin, 0x0002)
 		0x10 -- Receive user shares messages
 		0x20 -- Receive interest and recommendation messages
 		0x40 -- Receive config messages
+		0x100 -- Keep the transfer state in sync (see IStateSync)
+	*if mask & 0x100*
+		uint epoch -- Epoch of the state the interface has (from IStateSync, 0 if none)
+		uint seq -- Sequence number of the state the interface has
 
 	bool ok -- Wether login was successful
 	string message -- In case of failure, what was the error:
@@ -213,10 +238,15 @@ IFACEMESSAGE(ILogin, 0x0002)
 		algorithm = unpack_string();
 		chresponse = unpack_string();
 		mask = unpack_int();
+		epoch = seq = 0;
+		if(mask & 0x100) {
+			epoch = unpack_int();
+			seq = unpack_int();
+		}
 	END_PARSE
 
 	bool ok;
-	uint32 mask;
+	uint32 mask, epoch, seq;
 	std::string algorithm, msg, chresponse;
 END
 
@@ -285,6 +315,33 @@ IFACEMESSAGE(ISetStatus, 0x0005)
 	uint32 status;
 END
 
+IFACEMESSAGE(IStateSync, 0x0006)
+/*
+	State sync -- The transfer state has been sent (only sent to interfaces
+	that logged in with the 0x100 mask)
+
+	*not sent*
+
+	uint epoch -- Identifies this run of the daemon
+	uint seq -- Sequence number of the state sent. Give both at the next
+	            login to only get the transfers that changed since.
+	bool whole -- Was the whole state sent? (if so, the transfers that
+	              weren't sent are gone)
+*/
+
+	IStateSync() {}
+	IStateSync(uint32 _e, uint32 _s, bool _w) : epoch(_e), seq(_s), whole(_w) {}
+
+	MAKE
+		pack(epoch);
+		pack(seq);
+		pack((uchar)(whole ? 1 : 0));
+	END_MAKE
+
+	uint32 epoch, seq;
+	bool whole;
+END
+
 IFACEMESSAGE(IStatusMessage, 0x0010)
 /*
 	Status Message -- Forward messages to the clients
@@ -1889,6 +1946,98 @@ IFACEMESSAGE(IUploadFile, 0x0506)
 	std::string user, path;
 END
 
+IFACEMESSAGE(ITransferUpdateRate, 0x050A)
+/*
+	Transfer update rate -- How often transfer updates are sent to this interface
+
+	uint interval -- Milliseconds between two ITransferDelta (0 == send an
+	                 ITransferUpdate for each change of a transfer, the default)
+
+	uint interval -- The interval that will be used
+*/
+	ITransferUpdateRate() : interval(0) {}
+	ITransferUpdateRate(uint32 _i) : interval(_i) {}
+
+	MAKE
+		pack(interval);
+	END_MAKE
+
+	PARSE
+		interval = unpack_int();
+	END_PARSE
+
+	uint32 interval;
+END
+
+IFACEMESSAGE(ITransferDelta, 0x050B)
+/*
+	Transfer delta -- The transfers that changed since the last delta (only
+	sent to interfaces that asked for it with ITransferUpdateRate)
+
+	*not sent*
+
+	uint numentries -- Number of transfers that changed
+	*repeat numentries*
+		uint id -- Identifier of the transfer (valid until it is removed)
+		uint fields -- Fields that follow (TD_* flags)
+		*if fields & TD_NEW*
+			bool upload -- Is it an upload?
+			string username -- User of the transfer
+			string path -- Path of the transfer
+		*if fields & TD_PLACE* uint place -- Place in queue
+		*if fields & TD_STATE* uint state -- State of the transfer
+		*if fields & TD_ERROR* string error -- Error of the transfer
+		*if fields & TD_POSITION* off position -- Position in the file
+		*if fields & TD_SIZE* off size -- Size of the file
+		*if fields & TD_RATE* uint rate -- Transfer rate
+*/
+	struct Entry
+	{
+		uint32 id;
+		uint32 fields;
+		const Museek::Download * download;
+		const Museek::Upload * upload;
+		Museek::TransferFields values;
+	};
+
+	ITransferDelta() {}
+
+	MAKE
+		pack((uint32)entries.size());
+		std::vector<Entry>::const_iterator it;
+		for(it = entries.begin(); it != entries.end(); ++it) {
+			pack(it->id);
+			pack(it->fields);
+			if(it->fields & TD_NEW) {
+				if(it->download) {
+					pack((uchar)0);
+					pack(it->download->user());
+					pack(it->download->remotePath());
+				}
+				else {
+					pack((uchar)1);
+					pack(it->upload->user());
+					pack(it->upload->localPath(), true);
+				}
+			}
+			if(it->fields & TD_PLACE)
+				pack(it->values.place);
+			if(it->fields & TD_STATE)
+				pack(it->values.state);
+			if(it->fields & TD_ERROR)
+				pack(it->values.error);
+			if(it->fields & TD_POSITION)
+				pack(it->values.position);
+			if(it->fields & TD_SIZE)
+				pack(it->values.size);
+			if(it->fields & TD_RATE)
+				pack(it->values.rate);
+		}
+	END_MAKE
+
+	std::vector<Entry> entries;
+END
+
 IFACEMESSAGE(IGetRecommendations, 0x0600)
 /*
 	Get Recommendations -- Refresh Recommendations list
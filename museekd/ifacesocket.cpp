@@ -24,8 +24,9 @@
 #include "ifacesocket.h"
 #include <NewNet/nnreactor.h>
 
-Museek::IfaceSocket::IfaceSocket() : NewNet::ClientSocket(), MessageProcessor(4), m_Authenticated(false)
+Museek::IfaceSocket::IfaceSocket() : NewNet::ClientSocket(), MessageProcessor(4), m_Authenticated(false), m_TransferRate(0)
 {
+  m_TransfersFlushed.tv_sec = m_TransfersFlushed.tv_usec = 0;
   m_CipherContext = new CipherContext();
   dataReceivedEvent.connect(this, &IfaceSocket::onDataReceived);
   messageReceivedEvent.connect(this, &IfaceSocket::onMessageReceived);
@@ -38,6 +39,17 @@ Museek::IfaceSocket::~IfaceSocket()
   free(m_CipherContext);
 }
 
+void
+Museek::IfaceSocket::setCipherKey(const std::string & key)
+{
+  cipherKeySHA256(m_CipherContext, (char *)key.data(), key.size());
+
+  // Hash the key schedule rather than keeping anything of the key itself
+  unsigned char digest[20];
+  shaBlock((unsigned char *)m_CipherContext->E, sizeof(m_CipherContext->E), digest);
+  m_CipherKeyId.assign((const char *)digest, sizeof(digest));
+}
+
 void
 Museek::IfaceSocket::sendMessage(const NewNet::Buffer & buffer)
 {
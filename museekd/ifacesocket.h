@@ -25,6 +25,8 @@
 #include "ifacemessages.h"
 #include <NewNet/nnclientsocket.h>
 #include <NewNet/nnrefptr.h>
+#include <map>
+#include <set>
 
 namespace NewNet
 {
@@ -66,9 +68,37 @@ namespace Museek
       m_Mask = mask;
     }
 
-    void setCipherKey(const std::string & key)
+    /* Milliseconds between two transfer deltas (0: no deltas, an update for each change). */
+    uint32 transferRate() const
     {
-      cipherKeySHA256(m_CipherContext, (char *)key.data(), key.size());
+      return m_TransferRate;
+    }
+    void setTransferRate(uint32 rate)
+    {
+      m_TransferRate = rate;
+    }
+
+    /* Transfers that changed since the last delta. */
+    std::set<uint32> & dirtyTransfers()
+    {
+      return m_DirtyTransfers;
+    }
+    /* The fields of the transfers as sent in the last deltas. */
+    std::map<uint32, TransferFields> & sentTransfers()
+    {
+      return m_SentTransfers;
+    }
+    /* When was the last delta sent? */
+    struct timeval & transfersFlushed()
+    {
+      return m_TransfersFlushed;
+    }
+
+    void setCipherKey(const std::string & key);
+    /* Fingerprint of the cipher key: sockets with the same one share encrypted messages. */
+    const std::string & cipherKeyId() const
+    {
+      return m_CipherKeyId;
     }
 
     CipherContext * cipherContext()
@@ -92,7 +122,12 @@ namespace Museek
     bool m_Authenticated;
     unsigned int m_Mask;
     std::string m_Challenge;
+    uint32 m_TransferRate;
+    std::set<uint32> m_DirtyTransfers;
+    std::map<uint32, TransferFields> m_SentTransfers;
+    struct timeval m_TransfersFlushed;
     CipherContext * m_CipherContext;
+    std::string m_CipherKeyId;
   };
 }
 
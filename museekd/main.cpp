@@ -26,6 +26,7 @@
 #include "ifacemanager.h"
 #include "downloadmanager.h"
 #include "uploadmanager.h"
+#include "uploadquotas.h"
 #include "util.h"
 #include <NewNet/nnreactor.h>
 #include <NewNet/nnlog.h>
@@ -58,10 +59,10 @@ int get_lock(void)
   return 1;
 }
 
-/* Our signal handler, stop the reactor if we receive a HUP or INT signal. */
+/* Our signal handler, stop the reactor if we receive an INT or TERM signal. */
 static void museekd_signal_handler(int signal)
 {
-    if (signal == SIGINT) {
+    if (signal == SIGINT || signal == SIGTERM) {
         NNLOG("museekd.debug", "Trapped signal %i. Stopping the reactor.", signal);
         museekd->reactor()->stop();
     }
@@ -78,13 +79,14 @@ static void museekd_signal_handler(int signal)
 #endif // WIN32
 
 
-  /* Reconnect signal handlers for HUP, ALRM and INT signals.
+  /* Reconnect signal handlers for HUP, ALRM, INT and TERM signals.
      Some Unix disconnect signals after each call */
 #ifndef WIN32
   ::signal(SIGHUP, &museekd_signal_handler);
   ::signal(SIGALRM, &museekd_signal_handler);
 #endif // WIN32
   ::signal(SIGINT, &museekd_signal_handler);
+  ::signal(SIGTERM, &museekd_signal_handler);
 }
 
 /* Timeout callback to connect to the server. Not really required, could
@@ -107,9 +109,9 @@ public:
     if(notice->domain == "museekd.debug")
     {
       if(museekd->config()->getBool(notice->domain, notice->key))
-        NNLOG.enable(notice->key);
+        NewNet::log.enable(notice->key);
       else
-        NNLOG.disable(notice->key);
+        NewNet::log.disable(notice->key);
     }
   }
 };
@@ -120,7 +122,7 @@ public:
   virtual void operator()(const Museek::ConfigManager::RemoveNotify * notice)
   {
     if(notice->domain == "museekd.debug")
-      NNLOG.disable(notice->key);
+      NewNet::log.disable(notice->key);
   }
 };
 
@@ -174,8 +176,8 @@ int main(int argc, char ** argv)
   }
 
   /* Enable various interesting logging domains. */
-  NNLOG.logEvent.connect(new NewNet::ConsoleOutput);
-  NNLOG.enable("ALL");
+  NewNet::log.logEvent.connect(new NewNet::ConsoleOutput);
+  NewNet::log.enable("ALL");
 
   /* Check size of off_t */
   if(sizeof(off_t) < 8)
@@ -198,25 +200,30 @@ int main(int argc, char ** argv)
 
   /* Disable the debug override. */
   if(!museekd->config()->getBool("museekd.debug", "ALL") && !fullDebug)
-    NNLOG.disable("ALL");
+    NewNet::log.disable("ALL");
 
   /* Load the shares database. */
   museekd->LoadShares();
   museekd->LoadDownloads();
+  museekd->uploads()->quotas()->load();
 
-  /* Connect signal handlers for HUP, ALRM and INT signals. */
+  /* Connect signal handlers for HUP, ALRM, INT and TERM signals.
+     Stopping the reactor lets us save what hasn't been saved yet. */
 #ifndef WIN32
   signal(SIGHUP, &museekd_signal_handler);
   signal(SIGALRM, &museekd_signal_handler);
 #endif // WIN32
   signal(SIGINT, &museekd_signal_handler);
+  signal(SIGTERM, &museekd_signal_handler);
 
   /* Add a timeout callback: Wait 5 seconds, then connect to the server. */
   museekd->reactor()->addTimeout(5000, new AutoConnectCallback);
 
   /* Start the reactor. This drives the daemon. */
   museekd->reactor()->run();
-  museekd->downloads()->saveDownloads();
+  museekd->config()->flush();
+  museekd->downloads()->flush();
+  museekd->uploads()->quotas()->save();
 
   return 0;
 }
@@ -30,12 +30,32 @@
 #include "peersocket.h"
 #include "downloadmanager.h"
 #include "uploadmanager.h"
+#include "uploadslotcontroller.h"
 #include "sharesdatabase.h"
 #include "searchmanager.h"
+#include "diskio.h"
 #include <NewNet/nnreactor.h>
+#include <Mucipher/mucipher.h>
 #include <fstream>
 
-Museek::Museekd::Museekd(NewNet::Reactor * reactor) : m_Reactor(reactor)
+/**
+  * The user list kept in a config domain
+  */
+static uint
+userListFlag(const std::string & domain)
+{
+  if(domain == "banned")
+    return Museek::Museekd::UserBanned;
+  if(domain == "ignored")
+    return Museek::Museekd::UserIgnored;
+  if(domain == "trusted")
+    return Museek::Museekd::UserTrusted;
+  if(domain == "buddies")
+    return Museek::Museekd::UserBuddied;
+  return 0;
+}
+
+Museek::Museekd::Museekd(NewNet::Reactor * reactor) : m_Reactor(reactor), m_Privileged(0)
 {
   /* Seed the random generator and fabricate our starting token. */
   srand(time(NULL));
@@ -48,7 +68,22 @@ Museek::Museekd::Museekd(NewNet::Reactor * reactor) : m_Reactor(reactor)
   }
 
   /* Instantiate the various components. Order can be important here. */
-  m_Config = new ConfigManager();
+  m_Config = new ConfigManager(this);
+  // Keep the user lists in sync (loading the configuration sets every key too)
+  m_Config->keySetEvent.connect(this, &Museekd::onConfigKeySet);
+  m_Config->keyRemovedEvent.connect(this, &Museekd::onConfigKeyRemoved);
+  // Settings read on the busy paths
+  m_OnlyBuddies.follow(m_Config, "transfers", "only_buddies", false);
+  m_HaveBuddyShares.follow(m_Config, "transfers", "have_buddy_shares", false);
+  m_TrustingUploads.follow(m_Config, "transfers", "trusting_uploads", false);
+  m_AutoClearDownloads.follow(m_Config, "transfers", "autoclear_finished_downloads", false);
+  m_AutoRetryDownloads.follow(m_Config, "transfers", "autoretry_downloads", false);
+  m_AutoClearUploads.follow(m_Config, "transfers", "autoclear_finished_uploads", false);
+  m_PrivilegeBuddies.follow(m_Config, "transfers", "privilege_buddies", false);
+  m_UploadSlots.follow(m_Config, "transfers", "upload_slots", 0);
+  m_DownloadSlots.follow(m_Config, "transfers", "download_slots", 0);
+  m_EnablePrivRoom.follow(m_Config, "priv_rooms", "enable_priv_room", false);
+  m_DiskIO = new DiskIO(this);
   m_Codeset = new CodesetManager(this);
   m_Server = new ServerManager(this);
   m_Peers = new PeerManager(this);
@@ -58,6 +93,8 @@ Museek::Museekd::Museekd(NewNet::Reactor * reactor) : m_Reactor(reactor)
   m_Shares = new SharesDatabase(this);
   m_BuddyShares = new SharesDatabase(this);
   m_Searches = new SearchManager(this);
+
+  NNLOG("museekd.debug", "Using %s AES and %s SHA.", cipherBackend(), hashBackend());
 }
 
 void Museek::Museekd::LoadShares() {
@@ -81,74 +118,111 @@ Museek::Museekd::~Museekd()
   NNLOG("museekd.debug", "museekd destroyed");
 }
 
-bool Museek::Museekd::isBanned(const std::string u) {
-    return config()->hasKey("banned", u);
+uint Museek::Museekd::userFlags(const std::string & user) const {
+    std::map<std::string, uint>::const_iterator it = m_UserFlags.find(user);
+    return (it != m_UserFlags.end()) ? it->second : 0;
 }
 
-bool Museek::Museekd::isIgnored(const std::string u) {
-    return config()->hasKey("ignored", u);
+bool Museek::Museekd::hasPrivileges(const std::string & user) {
+    uint flags = userFlags(user);
+    return (flags & UserPrivileged) || ((flags & UserBuddied) && privilegeBuddies());
 }
 
-bool Museek::Museekd::isTrusted(const std::string u) {
-    return config()->hasKey("trusted", u);
+void Museek::Museekd::setUserFlag(const std::string & user, uint flag, bool set) {
+    std::map<std::string, uint>::iterator it = m_UserFlags.find(user);
+    if (set) {
+        if (it == m_UserFlags.end())
+            it = m_UserFlags.insert(std::pair<std::string, uint>(user, 0)).first;
+        if ((flag == UserPrivileged) && !(it->second & UserPrivileged))
+            m_Privileged++;
+        it->second |= flag;
+    }
+    else if (it != m_UserFlags.end()) {
+        if ((flag == UserPrivileged) && (it->second & UserPrivileged))
+            m_Privileged--;
+        it->second &= ~flag;
+        // Users in no list aren't worth remembering
+        if (it->second == 0)
+            m_UserFlags.erase(it);
+    }
 }
 
-bool Museek::Museekd::isBuddied(const std::string u) {
-    return config()->hasKey("buddies", u);
+void Museek::Museekd::onConfigKeySet(const ConfigManager::ChangeNotify * data) {
+    uint flag = userListFlag(data->domain);
+    if (flag)
+        setUserFlag(data->key, flag, true);
 }
 
-bool Museek::Museekd::isPrivileged(const std::string u) {
-    return std::find(mPrivilegedUsers.begin(), mPrivilegedUsers.end(), u) != mPrivilegedUsers.end();
+void Museek::Museekd::onConfigKeyRemoved(const ConfigManager::RemoveNotify * data) {
+    uint flag = userListFlag(data->domain);
+    if (flag)
+        setUserFlag(data->key, flag, false);
 }
 
 bool Museek::Museekd::toBuddiesOnly() {
-    return config()->getBool("transfers", "only_buddies", false);
+    return m_OnlyBuddies.value();
 }
 
 bool Museek::Museekd::haveBuddyShares() {
-    return config()->getBool("transfers", "have_buddy_shares", false);
+    return m_HaveBuddyShares.value();
 }
 
 bool Museek::Museekd::trustingUploads() {
-    return config()->getBool("transfers", "trusting_uploads", false);
+    return m_TrustingUploads.value();
 }
 
 bool Museek::Museekd::autoClearFinishedDownloads() {
-    return config()->getBool("transfers", "autoclear_finished_downloads", false);
+    return m_AutoClearDownloads.value();
 }
 
 bool Museek::Museekd::autoRetryDownloads() {
-    return config()->getBool("transfers", "autoretry_downloads", false);
+    return m_AutoRetryDownloads.value();
 }
 
 bool Museek::Museekd::autoClearFinishedUploads() {
-    return config()->getBool("transfers", "autoclear_finished_uploads", false);
+    return m_AutoClearUploads.value();
 }
 
 bool Museek::Museekd::privilegeBuddies() {
-    return config()->getBool("transfers", "privilege_buddies", false);
+    return m_PrivilegeBuddies.value();
 }
 
 uint Museek::Museekd::upSlots() {
-    return config()->getUint("transfers", "upload_slots", 0);
+    if (m_Uploads->slotController()->enabled())
+        return m_Uploads->slotController()->slots();
+    return m_UploadSlots.value();
 }
 
 uint Museek::Museekd::downSlots() {
-    return config()->getUint("transfers", "download_slots", 0);
+    return m_DownloadSlots.value();
 }
 
 // Add this user to the list of privileged ones
 void Museek::Museekd::addPrivilegedUser(const std::string & user) {
     if (!isPrivileged(user)) {
-        mPrivilegedUsers.push_back(user);
-        NNLOG("museekd.debug", "%u privileged users", mPrivilegedUsers.size());
+        setUserFlag(user, UserPrivileged, true);
+        NNLOG("museekd.debug", "%u privileged users", m_Privileged);
+        m_Uploads->privilegesChanged(user);
     }
 }
 
 // Replace the privileged users list with this new one
 void Museek::Museekd::setPrivilegedUsers(const std::vector<std::string> & users) {
-    mPrivilegedUsers = users;
-    NNLOG("museekd.debug", "%u privileged users", mPrivilegedUsers.size());
+    std::map<std::string, uint>::iterator it = m_UserFlags.begin();
+    while (it != m_UserFlags.end()) {
+        it->second &= ~UserPrivileged;
+        if (it->second == 0)
+            m_UserFlags.erase(it++);
+        else
+            ++it;
+    }
+    m_Privileged = 0;
+
+    std::vector<std::string>::const_iterator uit;
+    for (uit = users.begin(); uit != users.end(); ++uit)
+        setUserFlag(*uit, UserPrivileged, true);
+    NNLOG("museekd.debug", "%u privileged users", m_Privileged);
+    m_Uploads->privilegesChanged();
 }
 
 void Museek::Museekd::sendSharedNumber() {
@@ -166,5 +240,5 @@ void Museek::Museekd::sendSharedNumber() {
 }
 
 bool Museek::Museekd::isEnabledPrivRoom() {
-    return config()->getBool("priv_rooms", "enable_priv_room", false);
+    return m_EnablePrivRoom.value();
 }
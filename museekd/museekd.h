@@ -27,7 +27,10 @@ namespace NewNet
 }
 
 #include "servermessages.h"
+#include "configmanager.h"
+#include "pathtable.h"
 #include <NewNet/nnrefptr.h>
+#include <map>
 
 namespace Museek
 {
@@ -41,10 +44,21 @@ namespace Museek
   class SharesDatabase;
   class SearchManager;
   class IfaceManager;
+  class DiskIO;
 
   class Museekd : public NewNet::Object
   {
   public:
+    /* The lists a user can be in. */
+    typedef enum
+    {
+      UserBanned = 1,
+      UserIgnored = 2,
+      UserTrusted = 4,
+      UserBuddied = 8,
+      UserPrivileged = 16
+    } UserFlag;
+
     Museekd(NewNet::Reactor * reactor = 0);
     ~Museekd();
 
@@ -120,14 +134,36 @@ namespace Museek
       return m_Searches;
     }
 
+    /* Return a pointer to the disk I/O workers. */
+    DiskIO * diskIO() const
+    {
+      return m_DiskIO;
+    }
+
+    /* Return a pointer to the paths shared by the shares and the transfers. */
+    PathTable * paths()
+    {
+      return &m_Paths;
+    }
+
+    const PathTable * paths() const
+    {
+      return &m_Paths;
+    }
+
     void LoadShares();
     void LoadDownloads();
 
-    bool isBanned(const std::string u);
-    bool isIgnored(const std::string u);
-    bool isTrusted(const std::string u);
-    bool isBuddied(const std::string u);
-    bool isPrivileged(const std::string u);
+    /* Is the user in these lists? One lookup answers for all of them. */
+    bool isBanned(const std::string & u) const { return userFlags(u) & UserBanned; }
+    bool isIgnored(const std::string & u) const { return userFlags(u) & UserIgnored; }
+    bool isTrusted(const std::string & u) const { return userFlags(u) & UserTrusted; }
+    bool isBuddied(const std::string & u) const { return userFlags(u) & UserBuddied; }
+    bool isPrivileged(const std::string & u) const { return userFlags(u) & UserPrivileged; }
+    /* Lists the user is in (UserFlag values). */
+    uint userFlags(const std::string & user) const;
+    /* Is the user privileged, or a buddy while buddies are privileged? */
+    bool hasPrivileges(const std::string & user);
     bool toBuddiesOnly();
     bool haveBuddyShares();
     bool trustingUploads();
@@ -143,8 +179,16 @@ namespace Museek
     bool isEnabledPrivRoom();
 
   private:
+    void setUserFlag(const std::string & user, uint flag, bool set);
+    void onConfigKeySet(const ConfigManager::ChangeNotify * data);
+    void onConfigKeyRemoved(const ConfigManager::RemoveNotify * data);
+
+    /* Destroyed last: the components release their paths. */
+    PathTable m_Paths;
+
     /* Our strong references to the various components. */
     NewNet::RefPtr<NewNet::Reactor> m_Reactor;
+    NewNet::RefPtr<DiskIO> m_DiskIO;
     NewNet::RefPtr<ConfigManager> m_Config;
     NewNet::RefPtr<CodesetManager> m_Codeset;
     NewNet::RefPtr<ServerManager> m_Server;
@@ -157,7 +201,14 @@ namespace Museek
 
     int m_Token;
 
-    std::vector<std::string> mPrivilegedUsers; // The list of privileged users
+    std::map<std::string, uint> m_UserFlags;  // Lists each user is in (banned, buddies... privileged)
+    uint m_Privileged;                        // Number of privileged users
+
+    /* Settings read often (see the accessors above). */
+    ConfigManager::Setting<bool> m_OnlyBuddies, m_HaveBuddyShares, m_TrustingUploads,
+                                 m_AutoClearDownloads, m_AutoRetryDownloads, m_AutoClearUploads,
+                                 m_PrivilegeBuddies, m_EnablePrivRoom;
+    ConfigManager::Setting<uint> m_UploadSlots, m_DownloadSlots;
   };
 }
 
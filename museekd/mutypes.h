@@ -57,7 +57,8 @@ enum _TrState {
   TS_Aborted,
   TS_RemoteError,
   TS_LocalError,
-  TS_QueuedLocally
+  TS_QueuedLocally,
+  TS_Finalizing
 };
 
 enum _BaseConnState {
@@ -0,0 +1,146 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "pathtable.h"
+#include <algorithm>
+#include <string.h>
+
+Museek::PathTable::PathTable()
+{
+    // ID 0 is for the paths without a folder: it is never released
+    Entry entry;
+    entry.id = 0;
+    entry.refs = 0;
+    m_Folders.push_back(m_Index.insert(Index::value_type(std::string(), entry)).first);
+}
+
+Museek::PathTable::Path
+Museek::PathTable::acquire(const std::string & path, char separator)
+{
+    Path result;
+    std::string::size_type ix = path.find_last_of(separator);
+    if (ix == std::string::npos) {
+        result.name = path;
+        return result;
+    }
+    result.name = path.substr(ix + 1);
+
+    std::string folder = path.substr(0, ix + 1);
+    Index::iterator it = m_Index.lower_bound(folder);
+    if ((it == m_Index.end()) || (it->first != folder)) {
+        Entry entry;
+        entry.refs = 0;
+        if (m_FreeIds.empty()) {
+            entry.id = m_Folders.size();
+            m_Folders.push_back(m_Index.end());
+        }
+        else {
+            entry.id = m_FreeIds.back();
+            m_FreeIds.pop_back();
+        }
+        it = m_Index.insert(it, Index::value_type(folder, entry));
+        m_Folders[entry.id] = it;
+    }
+
+    it->second.refs++;
+    result.folder = it->second.id;
+    return result;
+}
+
+void
+Museek::PathTable::acquire(const Path & path)
+{
+    if (path.folder != 0)
+        m_Folders[path.folder]->second.refs++;
+}
+
+/**
+  * Forget the folder when its last path is released
+  */
+void
+Museek::PathTable::release(const Path & path)
+{
+    if (path.folder == 0)
+        return;
+
+    Index::iterator it = m_Folders[path.folder];
+    if (--it->second.refs > 0)
+        return;
+
+    m_Folders[path.folder] = m_Index.end();
+    m_FreeIds.push_back(path.folder);
+    m_Index.erase(it);
+}
+
+bool
+Museek::PathTable::find(const std::string & path, char separator, Path & result) const
+{
+    std::string::size_type ix = path.find_last_of(separator);
+    if (ix == std::string::npos) {
+        result.folder = 0;
+        result.name = path;
+        return true;
+    }
+
+    Index::const_iterator it = m_Index.find(path.substr(0, ix + 1));
+    if (it == m_Index.end())
+        return false;
+
+    result.folder = it->second.id;
+    result.name = path.substr(ix + 1);
+    return true;
+}
+
+/**
+  * Compare the whole paths (like their strings would be) without joining them
+  */
+int
+Museek::PathTable::compare(const Path & a, const Path & b) const
+{
+    if (a.folder == b.folder)
+        return a.name.compare(b.name);
+
+    const std::string * partsA[2] = { &folder(a.folder), &a.name };
+    const std::string * partsB[2] = { &folder(b.folder), &b.name };
+    uint ia = 0, ib = 0;
+    std::string::size_type oa = 0, ob = 0;
+    while (true) {
+        while (ia < 2 && oa == partsA[ia]->size()) {
+            ++ia;
+            oa = 0;
+        }
+        while (ib < 2 && ob == partsB[ib]->size()) {
+            ++ib;
+            ob = 0;
+        }
+        if (ia == 2 || ib == 2)
+            return (ia == 2) ? ((ib == 2) ? 0 : -1) : 1;
+
+        std::string::size_type n = std::min(partsA[ia]->size() - oa, partsB[ib]->size() - ob);
+        int r = memcmp(partsA[ia]->data() + oa, partsB[ib]->data() + ob, n);
+        if (r != 0)
+            return (r < 0) ? -1 : 1;
+        oa += n;
+        ob += n;
+    }
+}
@@ -0,0 +1,91 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+
+#ifndef MUSEEK_PATHTABLE_H
+#define MUSEEK_PATHTABLE_H
+
+#include "mutypes.h"
+#include <map>
+#include <string>
+#include <vector>
+
+namespace Museek
+{
+  /* Paths stored as a folder ID and a basename. Each folder is stored once
+     for everyone (shares databases, uploads, downloads) and kept as long as
+     a path uses it: every acquired path must be released. */
+  class PathTable
+  {
+  public:
+    /* A path of the table. Comparing paths compares their folder IDs first
+       (see compare() for the order of their strings). */
+    struct Path
+    {
+      Path() : folder(0) {}
+
+      uint32 folder;                            // ID of the folder (0 if the path has none)
+      std::string name;                         // What follows the last separator
+
+      bool operator==(const Path & other) const { return folder == other.folder && name == other.name; }
+      bool operator!=(const Path & other) const { return ! (*this == other); }
+      bool operator<(const Path & other) const
+      {
+        return (folder < other.folder) || ((folder == other.folder) && (name < other.name));
+      }
+    };
+
+    PathTable();
+
+    /* Split the path after its last separator and store its folder. */
+    Path acquire(const std::string & path, char separator);
+    /* Take another reference on the folder of an acquired path. */
+    void acquire(const Path & path);
+    void release(const Path & path);
+
+    /* Look up a path without storing anything. Returns false if its folder
+       isn't in the table (then no acquired path can be equal to it). */
+    bool find(const std::string & path, char separator, Path & result) const;
+
+    /* The folder, ending with its separator (empty for ID 0). */
+    const std::string & folder(uint32 id) const { return m_Folders[id]->first; }
+    /* The whole path. */
+    std::string str(const Path & path) const { return folder(path.folder) + path.name; }
+    /* Compare the whole paths, like str(a).compare(str(b)) without building them. */
+    int compare(const Path & a, const Path & b) const;
+
+    /* Number of folders stored. */
+    uint32 folders() const { return m_Index.size() - 1; }
+
+  private:
+    struct Entry
+    {
+      uint32 id;                                // Position in m_Folders
+      uint32 refs;                              // Number of paths using it
+    };
+    typedef std::map<std::string, Entry> Index;
+
+    Index                               m_Index;        // The folders, by name
+    std::vector<Index::iterator>        m_Folders;      // The folders, by ID (m_Index.end() when free)
+    std::vector<uint32>                 m_FreeIds;      // IDs of released folders
+  };
+}
+
+#endif // MUSEEK_PATHTABLE_H
@@ -33,7 +33,7 @@
 #include <NewNet/util.h>
 #include <NewNet/nntcpserversocket.h>
 
-Museek::PeerManager::PeerManager(Museekd * museekd) : m_Museekd(museekd)
+Museek::PeerManager::PeerManager(Museekd * museekd) : m_Museekd(museekd), m_Admitted(0), m_Refused(0), m_Evicted(0)
 {
   museekd->config()->keySetEvent.connect(this, &PeerManager::onConfigKeySet);
   museekd->config()->keyRemovedEvent.connect(this, &PeerManager::onConfigKeyRemoved);
@@ -55,12 +55,40 @@ Museek::PeerManager::~PeerManager()
 void
 Museek::PeerManager::unlisten()
 {
-    if(m_Factory.isValid()) {
-        m_Factory->serverSocket()->disconnect();
-        if (m_Factory->serverSocket()->reactor())
-            m_Museekd->reactor()->remove(m_Factory->serverSocket());
-    }
+    if(m_Factory.isValid())
+        closeFactory(m_Factory);
     m_Factory = 0;
+
+    std::vector<NewNet::RefPtr<PeerFactory> >::iterator it;
+    for(it = m_ExtraFactories.begin(); it != m_ExtraFactories.end(); ++it)
+        closeFactory(*it);
+    m_ExtraFactories.clear();
+}
+
+/**
+  * Create a factory listening for peers (it still has to listen on a port)
+  */
+Museek::PeerManager::PeerFactory *
+Museek::PeerManager::makeFactory(int backlog, bool reusePort)
+{
+    PeerFactory * factory = new PeerFactory();
+    factory->clientAcceptedEvent.connect(this, &PeerManager::onClientAccepted);
+    factory->serverSocket()->setBacklog(backlog);
+    factory->serverSocket()->setReusePort(reusePort);
+    m_Museekd->reactor()->add(factory->serverSocket());
+    return factory;
+}
+
+void
+Museek::PeerManager::closeFactory(PeerFactory * factory)
+{
+    NewNet::TcpServerSocket * socket = factory->serverSocket();
+    if(socket->socketState() == NewNet::Socket::SocketListening) {
+        NNLOG("museekd.peers.debug", "Stopped listening on port %u: %lu connections accepted, %lu dropped.", socket->listenPort(), socket->accepted(), socket->dropped());
+        socket->disconnect();
+    }
+    if (socket->reactor())
+        m_Museekd->reactor()->remove(socket);
 }
 
 void
@@ -68,6 +96,8 @@ Museek::PeerManager::listen()
 {
   uint first = m_Museekd->config()->getUint("clients.bind", "first"),
        last =  m_Museekd->config()->getUint("clients.bind", "last");
+  uint listeners = m_Museekd->config()->getUint("clients.bind", "listeners", 1);
+  int backlog = m_Museekd->config()->getUint("clients.bind", "backlog", PEER_LISTEN_BACKLOG);
 
   if((first == 0) || (first > last))
   {
@@ -76,10 +106,15 @@ Museek::PeerManager::listen()
     return;
   }
 
+  if(listeners == 0)
+    listeners = 1;
+  else if(listeners > PEER_LISTENERS_MAX)
+    listeners = PEER_LISTENERS_MAX;
+
   if(m_Factory.isValid())
   {
     unsigned int port = m_Factory->serverSocket()->listenPort();
-    if((port >= first) && (port <= last))
+    if((port >= first) && (port <= last) && (m_ExtraFactories.size() + 1 == listeners))
       return;
     unlisten();
   }
@@ -88,15 +123,26 @@ Museek::PeerManager::listen()
   while(port <= last)
   {
     NNLOG("museekd.peers.debug", "Trying to bind to port %i...", port);
-    m_Factory = new PeerFactory();
-    m_Factory->clientAcceptedEvent.connect(this, &PeerManager::onClientAccepted);
-
-    m_Museekd->reactor()->add(m_Factory->serverSocket());
+    m_Factory = makeFactory(backlog, listeners > 1);
     m_Factory->serverSocket()->listen(port);
     if(m_Factory->serverSocket()->socketState() == NewNet::Socket::SocketListening)
     {
+      // Let the system spread the connections between several sockets
+      while(m_ExtraFactories.size() + 1 < listeners)
+      {
+        NewNet::RefPtr<PeerFactory> factory = makeFactory(backlog, true);
+        factory->serverSocket()->listen(port);
+        if(factory->serverSocket()->socketState() != NewNet::Socket::SocketListening)
+        {
+          NNLOG("museekd.peers.warn", "Couldn't add another socket listening on port %i.", port);
+          closeFactory(factory);
+          break;
+        }
+        m_ExtraFactories.push_back(factory);
+      }
+
       onServerLoggedInStateChanged(m_Museekd->server()->loggedIn());
-      NNLOG("museekd.peers.debug", "Listening for peers on port %i", port);
+      NNLOG("museekd.peers.debug", "Listening for peers on port %i (%u sockets)", port, (uint) m_ExtraFactories.size() + 1);
       return;
     }
     unlisten();
@@ -110,7 +156,7 @@ Museek::PeerManager::listen()
   * Returns a peersocket for the given user name.
   */
 void
-Museek::PeerManager::peerSocket(const std::string & user, bool force) {
+Museek::PeerManager::peerSocket(const std::string & user, PeerSocket::Purpose purpose) {
     NNLOG("museekd.peers.debug", "Asking a peersocket for %s", user.c_str());
 
     // Check if this user is already registered.
@@ -118,15 +164,15 @@ Museek::PeerManager::peerSocket(const std::string & user, bool force) {
     it = m_Peers.find(user);
     if(it == m_Peers.end() || !it->second) {
         // Nope, see if we can open a new peersocket
-        int maxSocket = museekd()->reactor()->maxSocketNo();
-        int currentSockets = museekd()->reactor()->currentSocketNo();
-
-        if (!force && (maxSocket > 0) && (currentSockets > (maxSocket - static_cast<int>(maxSocket*0.5)))) {
-            NNLOG("museekd.peers.warn", "Too many opened peer socket, cannot open a new one with low priority");
+        if (it == m_Peers.end() && !admit(user, purpose)) {
             peerSocketUnavailableEvent(user);
             return;
         }
 
+        std::map<std::string, PeerSocket::Purpose>::iterator wit = m_Wanted.find(user);
+        if (wit == m_Wanted.end() || wit->second < purpose)
+            m_Wanted[user] = purpose;
+
         // We can, register the user
         m_Peers[user] = 0;
 
@@ -152,8 +198,124 @@ Museek::PeerManager::peerSocket(const std::string & user, bool force) {
 
         }
     }
-    else
+    else {
+        it->second->addPurpose(purpose);
+        peerSocketActive(it->second);
         peerSocketReadyEvent((*it).second);
+    }
+}
+
+/**
+  * Is there room for a new peer socket? Search results only get one while
+  * less than PEER_BUDGET_LOW percent of the descriptors are used, other
+  * sockets up to PEER_BUDGET_HIGH. Above that, the socket replaces an idle
+  * one which is less valuable. Transfers are never refused, nor do they
+  * close another socket.
+  */
+bool
+Museek::PeerManager::admit(const std::string & user, PeerSocket::Purpose purpose) {
+    int maxSocket = museekd()->reactor()->maxSocketNo();
+    int currentSockets = museekd()->reactor()->currentSocketNo();
+
+    int budget = static_cast<int>(maxSocket * ((purpose == PeerSocket::Search ? PEER_BUDGET_LOW : PEER_BUDGET_HIGH) / 100.0));
+    if ((maxSocket <= 0) || (currentSockets < budget)) {
+        ++m_Admitted;
+        return true;
+    }
+
+    if (purpose == PeerSocket::Transfer) {
+        NNLOG("museekd.peers.warn", "Too many opened sockets (%i), opening one to %s anyway for a transfer.", currentSockets, user.c_str());
+        ++m_Admitted;
+        return true;
+    }
+
+    if (evict(purpose)) {
+        ++m_Admitted;
+        return true;
+    }
+
+    ++m_Refused;
+    NNLOG("museekd.peers.warn", "Too many opened sockets (%i), cannot open a peer socket to %s (%u refused, %u evicted so far).", currentSockets, user.c_str(), m_Refused, m_Evicted);
+    return false;
+}
+
+/**
+  * Close the least valuable of the peer sockets which have been idle for a
+  * while (the least recently used of them), if it is less valuable than
+  * purpose.
+  */
+bool
+Museek::PeerManager::evict(PeerSocket::Purpose purpose) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    PeerSocket * victim = 0;
+    std::list<std::string>::iterator it;
+    for (it = m_PeerUsers.begin(); it != m_PeerUsers.end(); ++it) {
+        // The others have been used more recently
+        if (difftime(now, m_PeerUse[*it].active) < PEER_IDLE_MIN)
+            break;
+
+        std::map<std::string, NewNet::WeakRefPtr<PeerSocket> >::iterator pit = m_Peers.find(*it);
+        if (pit == m_Peers.end() || !pit->second)
+            continue;
+        PeerSocket * socket = pit->second;
+        if ((socket->socketState() != NewNet::Socket::SocketConnected) || (socket->purpose() >= purpose))
+            continue;
+        // Still sending something (shares, folder contents...): it only looks idle
+        if (socket->dataWaiting())
+            continue;
+        if (*it == museekd()->server()->username())
+            continue;
+
+        if (!victim || (socket->purpose() < victim->purpose())) {
+            victim = socket;
+            if (victim->purpose() == PeerSocket::Search)
+                break;
+        }
+    }
+
+    if (!victim)
+        return false;
+
+    ++m_Evicted;
+    NNLOG("museekd.peers.debug", "Closing idle peer socket to %s to make room (%u evicted so far).", victim->user().c_str(), m_Evicted);
+    victim->disconnect();
+    return true;
+}
+
+/**
+  * The peer socket has been used: move it at the end of the LRU list
+  */
+void
+Museek::PeerManager::peerSocketActive(PeerSocket * socket) {
+    std::map<std::string, NewNet::WeakRefPtr<PeerSocket> >::iterator pit = m_Peers.find(socket->user());
+    if (pit == m_Peers.end() || pit->second != socket)
+        return;
+
+    std::map<std::string, PeerUse>::iterator it = m_PeerUse.find(socket->user());
+    if (it == m_PeerUse.end()) {
+        PeerUse & use = m_PeerUse[socket->user()];
+        use.position = m_PeerUsers.insert(m_PeerUsers.end(), socket->user());
+        gettimeofday(&use.active, 0);
+    }
+    else {
+        m_PeerUsers.splice(m_PeerUsers.end(), m_PeerUsers, it->second.position);
+        gettimeofday(&it->second.active, 0);
+    }
+}
+
+/**
+  * The user has no peer socket anymore
+  */
+void
+Museek::PeerManager::forget(const std::string & user) {
+    std::map<std::string, PeerUse>::iterator it = m_PeerUse.find(user);
+    if (it != m_PeerUse.end()) {
+        m_PeerUsers.erase(it->second.position);
+        m_PeerUse.erase(it);
+    }
+    m_Wanted.erase(user);
 }
 
 /**
@@ -195,6 +357,12 @@ void Museek::PeerManager::addPeerSocket(PeerSocket * socket) {
 
     // There shouldn't be several peer sockets for the same user. If that happens, keep only the last one.
     m_Peers[socket->user()] = socket;
+    std::map<std::string, PeerSocket::Purpose>::iterator wit = m_Wanted.find(socket->user());
+    if (wit != m_Wanted.end()) {
+        socket->addPurpose(wit->second);
+        m_Wanted.erase(wit);
+    }
+    peerSocketActive(socket);
     if (!isOurself || (isOurself && !m_Peers[socket->user()])) {
         // Don't watch for disconnection twice if we're trying to connect to ourself
         socket->cannotConnectEvent.connect(this, &PeerManager::onPeerCannotConnect);
@@ -215,8 +383,10 @@ void Museek::PeerManager::removePeerSocket(const std::string & user, bool discon
     if (it != m_Peers.end()) {
         if (disconnect && it->second)
             it->second->disconnect();
-        else // disconnect will call removePeerSocket later with disconnect = false
+        else { // disconnect will call removePeerSocket later with disconnect = false
             m_Peers.erase(it);
+            forget(user);
+        }
     }
 }
 
@@ -448,6 +618,54 @@ Museek::PeerManager::waitingPassiveConnection(UserSocket * socket) {
     }
 }
 
+/**
+  * Which way did we connect to the user lately?
+  */
+Museek::UserSocket::Route
+Museek::PeerManager::reachability(const std::string & user) {
+    std::map<std::string, Reachability>::iterator it = m_Routes.find(user);
+    if (it == m_Routes.end())
+        return UserSocket::RouteUnknown;
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+    if (difftime(now, it->second.when) > PEER_ROUTE_TTL) {
+        m_Routes.erase(it);
+        return UserSocket::RouteUnknown;
+    }
+    return it->second.route;
+}
+
+/**
+  * Remember which way we connected to the user (or forget it with RouteUnknown).
+  */
+void
+Museek::PeerManager::setReachability(const std::string & user, UserSocket::Route route) {
+    if (route == UserSocket::RouteUnknown) {
+        m_Routes.erase(user);
+        return;
+    }
+
+    struct timeval now;
+    gettimeofday(&now, 0);
+    if ((m_Routes.size() >= PEER_ROUTES_MAX) && (m_Routes.find(user) == m_Routes.end())) {
+        // Make room: forget the expired routes, or any one if none has expired
+        std::map<std::string, Reachability>::iterator it = m_Routes.begin();
+        while (it != m_Routes.end()) {
+            if (difftime(now, it->second.when) > PEER_ROUTE_TTL)
+                m_Routes.erase(it++);
+            else
+                ++it;
+        }
+        if (m_Routes.size() >= PEER_ROUTES_MAX)
+            m_Routes.erase(m_Routes.begin());
+    }
+
+    Reachability & reach = m_Routes[user];
+    reach.route = route;
+    reach.when = now;
+}
+
 /**
   * Unregister a usersocket that is no longer waiting for a response from a peer during a passive connection.
   */
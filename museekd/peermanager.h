@@ -28,6 +28,22 @@
 #include "configmanager.h"
 #include "servermessages.h"
 #include "peersocket.h"
+#include <list>
+
+/* Default length of the queue of peers waiting to be accepted (clients.bind/backlog). */
+#define PEER_LISTEN_BACKLOG 1024
+/* Maximum number of sockets listening for peers on the same port. */
+#define PEER_LISTENERS_MAX 8
+/* Share of the descriptors above which peer sockets for search results are refused (percent). */
+#define PEER_BUDGET_LOW 50
+/* Share of the descriptors above which other peer sockets have to replace an idle one (percent). */
+#define PEER_BUDGET_HIGH 85
+/* A peer socket that hasn't received anything for so long (ms) may be evicted. */
+#define PEER_IDLE_MIN 10000
+/* How long (ms) we remember which way we could connect to a user. */
+#define PEER_ROUTE_TTL 3600000
+/* Maximum number of users whose way of connecting is remembered. */
+#define PEER_ROUTES_MAX 4096
 
 namespace NewNet
 {
@@ -62,10 +78,19 @@ namespace Museek
     NewNet::Event<std::string> peerSocketUnavailableEvent;
     NewNet::Event<std::string> peerOfflineEvent;
 
-    /* Find or make a peer socket for the specified user. */
-    void peerSocket(const std::string & user, bool force = true);
+    /* Find or make a peer socket for the specified user. When we're short of
+       descriptors, idle sockets less valuable than this one are closed first;
+       if there aren't any, the socket may be refused (peerSocketUnavailableEvent). */
+    void peerSocket(const std::string & user, PeerSocket::Purpose purpose = PeerSocket::Transfer);
     void addPeerSocket(PeerSocket * socket);
     void removePeerSocket(const std::string & user, bool disconnect = false);
+    /* Something has been received on the socket: it's the most recently used. */
+    void peerSocketActive(PeerSocket * socket);
+
+    /* Admission statistics. */
+    uint admittedSockets() const { return m_Admitted; }
+    uint refusedSockets() const { return m_Refused; }
+    uint evictedSockets() const { return m_Evicted; }
 
     std::map<std::string, UserData> *userStats() {return &m_UserStats;};
     std::map<std::string, uint32> *userStatus() {return &m_UserStatus;};
@@ -74,6 +99,10 @@ namespace Museek
     void requestUserData(const std::string& user);
     void setUserStatus(const std::string& user, uint32 status);
 
+    /* Which way did we last connect to the user (RouteUnknown if we don't remember)? */
+    UserSocket::Route reachability(const std::string & user);
+    void setReachability(const std::string & user, UserSocket::Route route);
+
     void waitingPassiveConnection(UserSocket * socket);
     void removePassiveConnectionWaiting(uint token);
     void onFirewallPierced(HandshakeSocket * socket);
@@ -99,15 +128,42 @@ namespace Museek
     void onConnected(NewNet::ClientSocket * socket_);
 
     void createPeerSocket(const std::string&);
+    bool admit(const std::string & user, PeerSocket::Purpose purpose);
+    bool evict(PeerSocket::Purpose purpose);
+    void forget(const std::string & user);
+    PeerFactory * makeFactory(int backlog, bool reusePort);
+    void closeFactory(PeerFactory * factory);
 
     NewNet::WeakRefPtr<Museekd> m_Museekd;
     NewNet::RefPtr<PeerFactory> m_Factory;
+    std::vector<NewNet::RefPtr<PeerFactory> > m_ExtraFactories;   // More sockets listening on the same port (clients.bind/listeners)
 
     std::map<std::string, struct timeval >                  m_LastStatusTime;   // When did we ask for status of each user?
     std::map<std::string, NewNet::WeakRefPtr<PeerSocket> >  m_Peers;            // List of all the peer sockets
     std::map<std::string, UserData>                         m_UserStats;        // User stats
     std::map<std::string, uint32>                           m_UserStatus;       // User status
     std::map<uint, NewNet::RefPtr<UserSocket> >             m_PassiveConnects;  // Sockets trying to establish a passive connection
+
+    /* When a peer socket was last used, and its place in m_PeerUsers. */
+    struct PeerUse
+    {
+      std::list<std::string>::iterator position;
+      struct timeval active;
+    };
+    std::list<std::string>                                  m_PeerUsers;        // Users with a peer socket, least recently used first
+    std::map<std::string, PeerUse>                          m_PeerUse;          // Last use of each peer socket
+    std::map<std::string, PeerSocket::Purpose>              m_Wanted;           // Purpose of the peer sockets being made
+    uint                                                    m_Admitted;         // Peer sockets admitted...
+    uint                                                    m_Refused;          // ...refused...
+    uint                                                    m_Evicted;          // ...and closed to make room
+
+    /* The way we connected to a user, and when. */
+    struct Reachability
+    {
+      UserSocket::Route route;
+      struct timeval when;
+    };
+    std::map<std::string, Reachability>                     m_Routes;           // How we could connect to each user
   };
 }
 
@@ -42,12 +42,12 @@
 #include <NewNet/nnpath.h>
 #include <NewNet/nntcpserversocket.h>
 
-Museek::PeerSocket::PeerSocket(Museek::Museekd * museekd) : Museek::UserSocket(museekd, "P"), Museek::MessageProcessor(4)
+Museek::PeerSocket::PeerSocket(Museek::Museekd * museekd) : Museek::UserSocket(museekd, "P"), Museek::MessageProcessor(4), m_Purpose(Search)
 {
   connectMessageSignals();
 }
 
-Museek::PeerSocket::PeerSocket(Museek::HandshakeSocket * that) : Museek::UserSocket(that, "P"), Museek::MessageProcessor(4)
+Museek::PeerSocket::PeerSocket(Museek::HandshakeSocket * that) : Museek::UserSocket(that, "P"), Museek::MessageProcessor(4), m_Purpose(Search)
 {
   connectMessageSignals();
 
@@ -122,6 +122,8 @@ Museek::PeerSocket::onDataReceived(NewNet::ClientSocket * socket)
 void
 Museek::PeerSocket::onMessageReceived(const MessageData * data)
 {
+  museekd()->peers()->peerSocketActive(this);
+
   if (m_SearchResultsOnlyTimeout.isValid())
     museekd()->reactor()->removeTimeout(m_SearchResultsOnlyTimeout);
 
@@ -157,6 +159,7 @@ Museek::PeerSocket::onMessageReceived(const MessageData * data)
 void
 Museek::PeerSocket::onInfoRequested(const PInfoRequest *)
 {
+  addPurpose(Info);
   std::string text = museekd()->config()->get("userinfo", "text");
   std::string path = museekd()->config()->get("userinfo", "image");
   std::vector<uchar> imgdata;
@@ -183,6 +186,7 @@ Museek::PeerSocket::onInfoRequested(const PInfoRequest *)
 void
 Museek::PeerSocket::onSharesRequested(const PSharesRequest *)
 {
+    addPurpose(Browse);
     SharesDatabase* db;
     if (museekd()->isBuddied(user()))
         db = museekd()->buddyshares();
@@ -197,6 +201,7 @@ Museek::PeerSocket::onSharesRequested(const PSharesRequest *)
 
 void
 Museek::PeerSocket::onPlaceInQueueRequested(const PPlaceInQueueRequest * message) {
+    addPurpose(Transfer);
     size_t place = museekd()->uploads()->queueLength(user(), museekd()->codeset()->fromPeerToFS(user(), message->filename));
 
     PPlaceInQueueReply reply(message->filename, place);
@@ -205,6 +210,7 @@ Museek::PeerSocket::onPlaceInQueueRequested(const PPlaceInQueueRequest * message
 
 void
 Museek::PeerSocket::onPlaceInQueueReplyReceived(const PPlaceInQueueReply * message) {
+    addPurpose(Transfer);
     Download * download = museekd()->downloads()->findDownload(user(), museekd()->codeset()->fromPeer(user(), message->filename));
 
     if (download)
@@ -214,8 +220,9 @@ Museek::PeerSocket::onPlaceInQueueReplyReceived(const PPlaceInQueueReply * messa
 void
 Museek::PeerSocket::onUploadQueueNotificationReceived(const PUploadQueueNotification *)
 {
+  addPurpose(Transfer);
   std::string state = " is not a buddy";
-  if (museekd()->config()->hasKey("buddies", user()))
+  if (museekd()->isBuddied(user()))
     state = " is a buddy";
 
   std::string isbuddy = user() + state;
@@ -225,6 +232,7 @@ Museek::PeerSocket::onUploadQueueNotificationReceived(const PUploadQueueNotifica
 void
 Museek::PeerSocket::onTransferRequested(const PTransferRequest * request)
 {
+  addPurpose(Transfer);
   std::string reason;
   uint64 size = 0;
   bool allowed = false;
@@ -286,7 +294,8 @@ Museek::PeerSocket::onTransferRequested(const PTransferRequest * request)
         std::ifstream file(download->destinationPath().c_str(), std::fstream::in | std::fstream::binary);
         if(file.is_open()) {
             NNLOG("museekd.peers.debug", "%s has already been downloaded.", path.c_str());
-            download->setState(TS_Finished);
+            if (download->state() != TS_Finalizing) // Not completely moved yet
+                download->setState(TS_Finished);
             PDownloadReply reply(request->ticket, allowed, "Finished");
             sendMessage(reply.make_network_packet());
             file.close();
@@ -382,6 +391,7 @@ Museek::PeerSocket::onTransferRequested(const PTransferRequest * request)
 */
 void
 Museek::PeerSocket::onQueueDownloadRequested(const PQueueDownload * message) {
+    addPurpose(Transfer);
     std::string reason, goodPath;
 
     NNLOG("museekd.peers.debug", "request for queued upload %s %s", user().c_str(), message->filename.c_str());
@@ -410,6 +420,7 @@ Museek::PeerSocket::onQueueDownloadRequested(const PQueueDownload * message) {
 void
 Museek::PeerSocket::onQueueFailedReceived(const PQueueFailed * message)
 {
+    addPurpose(Transfer);
     std::string path = museekd()->codeset()->fromPeer(user(), message->filename);
     Download * download = museekd()->downloads()->findDownload(user(), path);
     if(download)
@@ -422,6 +433,7 @@ Museek::PeerSocket::onQueueFailedReceived(const PQueueFailed * message)
 void
 Museek::PeerSocket::onUploadFailedReceived(const PUploadFailed * message)
 {
+    addPurpose(Transfer);
     std::string path = museekd()->codeset()->fromPeer(user(), message->filename);
     Download * download = museekd()->downloads()->findDownload(user(), path);
     if(download && download->state() != TS_Aborted && download->state() != TS_LocalError)
@@ -431,6 +443,7 @@ Museek::PeerSocket::onUploadFailedReceived(const PUploadFailed * message)
 void
 Museek::PeerSocket::onFolderContentsRequested(const PFolderContentsRequest * message)
 {
+    addPurpose(Browse);
     if (! museekd()->isBanned(user())) {
         std::vector<std::string>::const_iterator it;
         Folders reply;
@@ -458,6 +471,7 @@ Museek::PeerSocket::onFolderContentsRequested(const PFolderContentsRequest * mes
 
 void
 Museek::PeerSocket::onFolderContentsReceived(const PFolderContentsReply * message) {
+    addPurpose(Browse);
     museekd()->downloads()->addFolderContents(user(), message->folders);
 }
 
@@ -35,10 +35,23 @@ namespace Museek
   class PeerSocket : public UserSocket, public MessageProcessor
   {
   public:
+    /* What the socket is used for, from the cheapest to keep to the most valuable. */
+    typedef enum
+    {
+      Search,       // Search results
+      Info,         // User info
+      Browse,       // Shares and folder contents
+      Transfer      // Queues and transfer negotiations
+    } Purpose;
+
     PeerSocket(Museekd * museekd);
     PeerSocket(HandshakeSocket * that);
     ~PeerSocket();
 
+    Purpose purpose() const { return m_Purpose; }
+    /* The socket is (also) used for this. Its purpose is the most valuable one. */
+    void addPurpose(Purpose purpose) { if (purpose > m_Purpose) m_Purpose = purpose; }
+
     void addSearchResultsOnlyTimeout(long length = 2000);
     void onSearchResultsOnly(long);
     void initiateOurself();
@@ -74,6 +87,7 @@ namespace Museek
 	NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_SearchResultsOnlyTimeout;
 	NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_SocketTimeout;
 	NewNet::WeakRefPtr<NewNet::Event<NewNet::ClientSocket *>::Callback> m_CannotConnectOurselfCallback; // Callback to the transferreply event
+    Purpose m_Purpose;
   };
 }
 
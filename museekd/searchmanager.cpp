@@ -28,6 +28,7 @@
 #include "peermanager.h"
 #include "sharesdatabase.h"
 #include "ifacemanager.h"
+#include "downloadmanager.h"
 #include <NewNet/nnreactor.h>
 #include <NewNet/util.h>
 
@@ -367,8 +368,9 @@ void Museek::SearchManager::sendSearchResults(const std::string & username, cons
         db->search(query, results);
 
         if (!results.empty()) {
+            contacted(username);
             m_PendingResults[username][token] = results;
-            museekd()->peers()->peerSocket(username, false);
+            museekd()->peers()->peerSocket(username, PeerSocket::Search);
         }
 	}
 }
@@ -430,21 +432,77 @@ void Museek::SearchManager::onPeerSocketReady(PeerSocket * socket) {
 
     std::map<std::string, std::map<uint, Folder> >::iterator pending = m_PendingResults.find(username);
     if (pending != m_PendingResults.end() && m_PendingResults[username].size()) {
-        NNLOG("museekd.peers.debug", "Sending search results to %s", username.c_str());
+        NNLOG("museekd.peers.debug", "Sending %u search results to %s", (uint) pending->second.size(), username.c_str());
 
+        // Everything pending goes out in one go
         std::map<uint, Folder>::const_iterator it;
-        for (it = m_PendingResults[username].begin(); it != m_PendingResults[username].end(); it++) {
+        for (it = pending->second.begin(); it != pending->second.end(); it++) {
             PSearchReply msg(it->first, username, it->second, transferSpeed(), (uint64) museekd()->uploads()->queueTotalLength(), museekd()->uploads()->hasFreeSlots());
             socket->sendMessage(msg.make_network_packet());
         }
 
         m_PendingResults.erase(pending);
 
-        // Disconnect the peer socket as it is probably no longer needed and we have a limit for opened socket
-        socket->addSearchResultsOnlyTimeout(2000);
+        // Disconnect the peer socket when it's no longer needed as we have a limit for opened sockets.
+        // Users who search us often will probably do it again soon: keep it open longer.
+        if (socket->purpose() == PeerSocket::Search)
+            socket->addSearchResultsOnlyTimeout(warmTimeout(username));
     }
 }
 
+/**
+  * We're sending results to a user: update how often that happens
+  */
+void Museek::SearchManager::contacted(const std::string & user) {
+    struct timeval now;
+    gettimeofday(&now, 0);
+
+    std::map<std::string, Contact>::iterator it = m_Contacts.find(user);
+    if (it == m_Contacts.end()) {
+        if (m_Contacts.size() >= SEARCH_CONTACTS_MAX) {
+            // Forget the users who haven't searched us for a while
+            std::map<std::string, Contact>::iterator cit = m_Contacts.begin();
+            while (cit != m_Contacts.end()) {
+                if (difftime(now, cit->second.last) > 10 * SEARCH_WARM_MAX)
+                    m_Contacts.erase(cit++);
+                else
+                    ++cit;
+            }
+            if (m_Contacts.size() >= SEARCH_CONTACTS_MAX)
+                m_Contacts.erase(m_Contacts.begin());
+        }
+        Contact & contact = m_Contacts[user];
+        contact.last = now;
+        contact.interval = 0;
+        contact.count = 1;
+        return;
+    }
+
+    Contact & contact = it->second;
+    double gap = difftime(now, contact.last);
+    contact.interval = (contact.count == 1) ? gap : (contact.interval * 3 + gap) / 4;
+    contact.last = now;
+    contact.count++;
+}
+
+/**
+  * How long should a socket we only sent search results on stay open?
+  * Twice the usual time between the searches of the user, so that the next
+  * results can probably reuse it.
+  */
+long Museek::SearchManager::warmTimeout(const std::string & user) const {
+    std::map<std::string, Contact>::const_iterator it = m_Contacts.find(user);
+    if (it == m_Contacts.end() || it->second.count < 2 || it->second.interval >= SEARCH_WARM_MAX)
+        return SEARCH_WARM_MIN;
+
+    long timeout = static_cast<long>(it->second.interval * 2);
+    if (timeout < SEARCH_WARM_MIN)
+        return SEARCH_WARM_MIN;
+    if (timeout > SEARCH_WARM_MAX)
+        return SEARCH_WARM_MAX;
+    return timeout;
+}
+
 /**
   * Our connection with our parent has been disconnected
   */
@@ -542,6 +600,7 @@ Museek::SearchManager::onPeerSocketUnavailable(std::string user)
 void
 Museek::SearchManager::searchReplyReceived(uint ticket, const std::string & user, bool slotfree, uint avgspeed, uint64 queuelen, const Folder & folders) {
     museekd()->ifaces()->onSearchReply(ticket, user, slotfree, avgspeed, (uint) queuelen, folders);
+    museekd()->downloads()->addSources(user, folders);
 }
 
 void
@@ -31,6 +31,13 @@
 #include "distributedsocket.h"
 #include "configmanager.h"
 
+/* A socket we sent search results on is closed after this long (ms) without other messages... */
+#define SEARCH_WARM_MIN 2000
+/* ...or up to this long for users who search us often. */
+#define SEARCH_WARM_MAX 60000
+/* Number of users whose searches are remembered to compute that. */
+#define SEARCH_CONTACTS_MAX 1024
+
 /* Forward declarations. */
 class SGetStatus;
 
@@ -105,6 +112,17 @@ namespace Museek
     void onConfigKeyRemoved(const ConfigManager::RemoveNotify * data);
     void onWishlistTimeout(long);
 
+    void contacted(const std::string & user);
+    long warmTimeout(const std::string & user) const;
+
+    /* How often a user gets results from us. */
+    struct Contact
+    {
+      struct timeval last;                      // Last results
+      double interval;                          // Average time between results (ms)
+      uint count;                               // Number of results
+    };
+
     NewNet::WeakRefPtr<Museekd>                 m_Museekd;          // Ref to the museekd
     std::string                                 m_ParentIp;         // The IP address of our parent
     std::string                                 m_BranchRoot;       // Parent of the branch we're in
@@ -119,6 +137,7 @@ namespace Museek
                                                 m_Children;         // List of all our children with their respective depth
     std::map<std::string, std::map<uint, Folder> >
                                                 m_PendingResults;   // Pending search results we'll have to send soon
+    std::map<std::string, Contact>              m_Contacts;         // Users we send results to
     std::map<std::string, time_t>               m_Wishlist;         // Wishlist items with the last time we searched for them
     NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_WishlistTimeout; // Wishlist timeout
   };
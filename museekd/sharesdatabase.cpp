@@ -26,6 +26,7 @@
 #include "museekd.h"
 #include "codesetmanager.h"
 #include "servermanager.h"
+#include "util.h"
 #include <Muhelp/string_ext.hh>
 #include <zlib.h>
 #include <string>
@@ -44,32 +45,98 @@ using std::vector;
 Museek::SharesDatabase::SharesDatabase(Museekd* museekd) : mMuseekd(museekd), mNumFolders(0), mNumFiles(0) {
 }
 
+Museek::SharesDatabase::~SharesDatabase() {
+	release_files();
+}
+
 void Museek::SharesDatabase::load(const string& db, bool add) {
  	NNLOG("museekd.shares.debug", "loading share database %s", db.c_str());
-	mShares.load(db);
-	update(add);
+	// Only the recoded copy is kept
+	DirEntry shares;
+	shares.load(db);
+	update(shares, add);
+
+	// The fingerprints are stored next to the database
+	if (!add) {
+		mFingerprintsPath = db + ".fingerprints";
+		load_fingerprints();
+	}
+}
+
+/**
+ * Load the fingerprints of the shared files. Later records replace earlier ones.
+ */
+void Museek::SharesDatabase::load_fingerprints() {
+	mFingerprints.clear();
+	std::ifstream file(mFingerprintsPath.c_str(), std::fstream::in | std::fstream::binary);
+	if (file.fail() || !file.is_open())
+		return;
+
+	string path, digest;
+	uint64 size;
+	while (read_str(&file, path) != -1 && read_off(&file, &size) != -1 && read_str(&file, digest) != -1) {
+		mFingerprints[path] = std::make_pair(size, digest);
+		path.clear();
+		digest.clear();
+	}
+	NNLOG("museekd.shares.debug", "Loaded %d fingerprints", mFingerprints.size());
+}
+
+/**
+ * The given path should be encoded with FS encoding.
+ */
+std::string Museek::SharesDatabase::fingerprint(const string& path, uint64 size) const {
+	map<string, std::pair<uint64, string> >::const_iterator it = mFingerprints.find(path);
+	if (it == mFingerprints.end() || it->second.first != size)
+		return string();
+	return it->second.second;
 }
 
-void Museek::SharesDatabase::update(bool add) {
-	recode(add);
+/**
+ * Remember the fingerprint of a file and append it to the fingerprints file.
+ * The given path should be encoded with FS encoding.
+ */
+void Museek::SharesDatabase::setFingerprint(const string& path, uint64 size, const string& digest) {
+	if (fingerprint(path, size) == digest)
+		return;
+
+	mFingerprints[path] = std::make_pair(size, digest);
+	NNLOG("museekd.shares.debug", "SHA-1 of %s: %s", path.c_str(), digest.c_str());
+
+	if (mFingerprintsPath.empty())
+		return;
+
+	std::ofstream file(mFingerprintsPath.c_str(), std::ofstream::binary | std::ofstream::app);
+	if (write_str(&file, path) == -1 || write_off(&file, size) == -1 || write_str(&file, digest) == -1)
+		NNLOG("museekd.shares.warn", "Cannot store fingerprints (%s).", mFingerprintsPath.c_str());
+}
+
+void Museek::SharesDatabase::update(const DirEntry& shares, bool add) {
+	// mFiles points into mRecoded
+	release_files();
+	recode(shares, add);
 	update_flat();
 	update_compressed();
 	update_word_maps();
 
 	mNumFolders = mRecoded.folders.size();
-	mNumFiles = mFlat.size();
+	mNumFiles = mFiles.size();
 
 	NNLOG("museekd.shares.debug", "Updated shares, mNumFolders=%i, mNumFiles=%i", mNumFolders, mNumFiles);
 
     mMuseekd->sendSharedNumber();
 }
 
-void Museek::SharesDatabase::recode(bool add) {
-	if (!add)
-        mRecoded.folders.clear();
+void Museek::SharesDatabase::recode(const DirEntry& shares, bool add) {
+	std::map<std::string, DirEntry*>::iterator dit;
+	if (!add) {
+		for(dit = mRecoded.folders.begin(); dit != mRecoded.folders.end(); ++dit)
+			delete (*dit).second;
+		mRecoded.folders.clear();
+	}
 
-	std::map<std::string, DirEntry*>::iterator it = mShares.folders.begin();
-	for(; it != mShares.folders.end(); ++it) {
+	std::map<std::string, DirEntry*>::const_iterator it = shares.folders.begin();
+	for(; it != shares.folders.end(); ++it) {
         std::string _redir = mMuseekd->codeset()->fromFSToNet((*it).first);
 		if(_redir.empty()) {
  			NNLOG("museekd.shares.warn", "Couldn't transcode '%s' to network encoding", (*it).first.c_str());
@@ -89,13 +156,55 @@ void Museek::SharesDatabase::recode(bool add) {
 
 		DirEntry* de = new DirEntry(_redir);
 		de->files = _refolder;
-		mRecoded.folders[_redir] = de;
+		dit = mRecoded.folders.find(_redir);
+		if (dit != mRecoded.folders.end()) {
+			delete (*dit).second;
+			(*dit).second = de;
+		}
+		else
+			mRecoded.folders[_redir] = de;
 	}
 }
 
+/**
+ * List every shared file, its path being interned. Each folder of mRecoded only holds files.
+ */
 void Museek::SharesDatabase::update_flat() {
-	mFlat.clear();
-	mRecoded.flatten(mFlat);
+	PathTable* paths = mMuseekd->paths();
+
+	std::map<std::string, DirEntry*>::const_iterator it = mRecoded.folders.begin();
+	for(; it != mRecoded.folders.end(); ++it) {
+		string folder = str_replace((*it).second->path, NewNet::Path::separator(), '\\') + "\\";
+		Folder::const_iterator fit = (*it).second->files.begin();
+		for(; fit != (*it).second->files.end(); ++fit) {
+			SharedFile file;
+			file.path = paths->acquire(folder + (*fit).first, '\\');
+			file.entry = &(*fit).second;
+			mFiles.push_back(file);
+		}
+	}
+
+	// In path order, so that searches keep the first results in that order
+	std::sort(mFiles.begin(), mFiles.end(), PathOrder(paths));
+
+	// Two folders may give the same network path: keep one of them
+	vector<SharedFile>::iterator last = mFiles.begin(), fit = mFiles.begin();
+	for(; fit != mFiles.end(); ++fit) {
+		if((fit != mFiles.begin()) && (fit->path == (last - 1)->path))
+			paths->release(fit->path);
+		else
+			*(last++) = *fit;
+	}
+	mFiles.erase(last, mFiles.end());
+}
+
+void Museek::SharesDatabase::release_files() {
+	if(mMuseekd.isValid()) {
+		vector<SharedFile>::const_iterator it = mFiles.begin();
+		for(; it != mFiles.end(); ++it)
+			mMuseekd->paths()->release(it->path);
+	}
+	mFiles.clear();
 }
 
 void Museek::SharesDatabase::update_compressed() {
@@ -128,7 +237,10 @@ void Museek::SharesDatabase::update_compressed() {
  * The given path should be encoded with net encoding. Separator should be the network one (backslash).
  */
 bool Museek::SharesDatabase::is_shared(const string& path) const {
-	return mFlat.find(path) != mFlat.end();
+	SharedFile file;
+	if(! mMuseekd->paths()->find(path, '\\', file.path))
+		return false;
+	return std::binary_search(mFiles.begin(), mFiles.end(), file, PathOrder(mMuseekd->paths()));
 }
 
 /**
@@ -136,10 +248,12 @@ bool Museek::SharesDatabase::is_shared(const string& path) const {
  * Do a case insensitive search in the base for a path corresponding to the given one.
  */
 std::string Museek::SharesDatabase::find_shared_nocase(const std::string& path) const {
-    Folder::const_iterator it;
-    for (it = mFlat.begin(); it != mFlat.end(); it++) {
-        if (tolower(it->first) == path)
-            return it->first;
+    const PathTable* paths = mMuseekd->paths();
+    vector<SharedFile>::const_iterator it;
+    for (it = mFiles.begin(); it != mFiles.end(); it++) {
+        std::string shared = paths->str(it->path);
+        if (tolower(shared) == path)
+            return shared;
     }
     return std::string();
 }
@@ -189,40 +303,50 @@ inline wchar_t mutate(wchar_t c, bool special = false) {
 	}
 }
 
+/**
+ * Append the words of the string (in network encoding) to the list.
+ */
+static void split_words(Museek::Museekd* museekd, const string& str, StringList& words) {
+	string entry = museekd->codeset()->fromNet(str), word;
+
+	string::const_iterator sit = entry.begin();
+	for(; sit != entry.end(); ++sit) {
+		wchar_t c = mutate(*sit);
+		if(c == ' ') {
+			if(! word.empty())
+				words.push_back(word);
+			word = string();
+		} else
+			word += c;
+	}
+
+	if(! word.empty())
+		words.push_back(word);
+}
+
 void Museek::SharesDatabase::update_word_maps() {
-	mCharMap.clear();
-
-	// Generate the search map (used for searching)
-	Folder::iterator fit = mFlat.begin();
-	for(; fit != mFlat.end(); ++fit) {
-		string entry = mMuseekd->codeset()->fromNet((*fit).first), word;
-
-		string::const_iterator sit = entry.begin();
-		for(; sit != entry.end(); ++sit) {
-			wchar_t c = mutate(*sit);
-			if(c == ' ') {
-				if(! word.empty()) {
-					mCharMap[word[0]][word][(*fit).first] = (*fit).second;
-				}
-				word = string();
-			} else
-				word += c;
+	mWords.clear();
+
+	// Generate the search map (used for searching). The files of a folder
+	// mostly follow each other in mFiles: its words are split once for them.
+	const PathTable* paths = mMuseekd->paths();
+	StringList folderWords, words;
+	for(uint32 i = 0; i < mFiles.size(); ++i) {
+		if((i == 0) || (mFiles[i].path.folder != mFiles[i - 1].path.folder)) {
+			folderWords.clear();
+			split_words(mMuseekd, paths->folder(mFiles[i].path.folder), folderWords);
 		}
 
-		if(! word.empty()) {
-			mCharMap[word[0]][word][(*fit).first] = (*fit).second;
-		}
-	}
-}
+		words = folderWords;
+		split_words(mMuseekd, mFiles[i].path.name, words);
 
-inline Folder Museek::SharesDatabase::fetch(const std::string& word) const {
-	map<wchar_t, Shares>::const_iterator it1 = mCharMap.find(word[0]);
-	if(it1 != mCharMap.end()) {
-		Shares::const_iterator it2 = (*it1).second.find(word);
-		if(it2 != (*it1).second.end())
-			return (*it2).second;
+		StringList::const_iterator wit = words.begin();
+		for(; wit != words.end(); ++wit) {
+			FileList& files = mWords[*wit];
+			if(files.empty() || (files.back() != i))
+				files.push_back(i);
+		}
 	}
-	return Folder();
 }
 
 /* this is the best I can do I think... */
@@ -241,7 +365,7 @@ void Museek::SharesDatabase::search(const string& _query, Folder& result) {
 	/* add a space to make sure we also get the last word */
 	query += (wchar_t)' ';
 
-	vector<Folder* > q_in; // foobar
+	vector<const FileList* > q_in; // foobar
 	StringList q_out; // -foobar
 	StringList q_part; // *foobar "foo bar"
 	bool quoted = false, was_quoted = false;
@@ -269,9 +393,9 @@ void Museek::SharesDatabase::search(const string& _query, Folder& result) {
 			}
 			else {
 				/* find files that match this word */
-				Folder* t = &mCharMap[word[0]][word];
-				if(! t->empty())
-					q_in.push_back(t);
+				map<string, FileList>::const_iterator wit = mWords.find(word);
+				if(wit != mWords.end())
+					q_in.push_back(&(*wit).second);
 				else
 					return;
 			}
@@ -286,42 +410,42 @@ void Museek::SharesDatabase::search(const string& _query, Folder& result) {
 		return;
 
     else if (!q_in.empty()) {
-        Folder* base = q_in[0];
-        vector<Folder* >::const_iterator first = q_in.begin()++;
-        Folder::const_iterator it = base->begin();
+        const PathTable* paths = mMuseekd->paths();
+        const FileList* base = q_in[0];
+        FileList::const_iterator it = base->begin();
         for(; it != base->end(); ++it) {
+            // The file must match every keyword
+            vector<const FileList* >::const_iterator ref = q_in.begin() + 1;
+            for(; ref != q_in.end(); ++ref)
+                if(! std::binary_search((*ref)->begin(), (*ref)->end(), *it))
+                    break;
+            if(ref != q_in.end())
+                continue;
+
+            string path = paths->str(mFiles[*it].path);
+
             // Did we already found this result?
-            if(result.find((*it).first) != result.end())
+            if(result.find(path) != result.end())
                 continue;
 
             // Don't add results that contains forbidden words
-            if(! q_out.empty()) {
-                string lowr = tolower((*it).first);
-                StringList::const_iterator oit = q_out.begin();
-                for(; oit != q_out.end(); ++oit)
-                    if(lowr.find(*oit) != string::npos)
-                        break;
-                if(oit != q_out.end())
-                    continue;
-            }
-
-            // If we arrive here, we can add the file to the results if it matches every keyword
-            vector<Folder* >::const_iterator ref = first;
-            for(; ref != q_in.end(); ++ref)
-                if((*ref)->find((*it).first) == (*ref)->end())
+            string lowr = tolower(path);
+            StringList::const_iterator oit = q_out.begin();
+            for(; oit != q_out.end(); ++oit)
+                if(lowr.find(*oit) != string::npos)
                     break;
+            if(oit != q_out.end())
+                continue;
 
-            if(ref == q_in.end()) {
-                // Ok, it matches every keyword, but does it match every phrase?
-                StringList::const_iterator partit = q_part.begin();
-                for(; partit != q_part.end(); ++partit)
-                    if (tolower((*it).first).find(tolower(*partit)) == std::string::npos)
-                        break;
+            // Ok, it matches every keyword, but does it match every phrase?
+            StringList::const_iterator partit = q_part.begin();
+            for(; partit != q_part.end(); ++partit)
+                if (lowr.find(tolower(*partit)) == std::string::npos)
+                    break;
 
-                if(partit == q_part.end()) {
-                    result[(*it).first] = (*it).second;
-                    ++results;
-                }
+            if(partit == q_part.end()) {
+                result[path] = *mFiles[*it].entry;
+                ++results;
             }
 
             // Don't send more than 500 results
@@ -331,10 +455,12 @@ void Museek::SharesDatabase::search(const string& _query, Folder& result) {
     }
     else {
         // We're only searching phrases (*foobar "foo bar"), search in flat list
-        Folder::iterator fit = mFlat.begin();
+        const PathTable* paths = mMuseekd->paths();
+        vector<SharedFile>::const_iterator fit = mFiles.begin();
         StringList::const_iterator wit;
-        for(; fit != mFlat.end(); ++fit) {
-            string entry = tolower(mMuseekd->codeset()->fromNet((*fit).first));
+        for(; fit != mFiles.end(); ++fit) {
+            string path = paths->str(fit->path);
+            string entry = tolower(mMuseekd->codeset()->fromNet(path));
             bool notFound = false;
 
             for (wit = q_part.begin(); wit != q_part.end(); wit++) {
@@ -346,7 +472,7 @@ void Museek::SharesDatabase::search(const string& _query, Folder& result) {
             }
 
             if (!notFound) {
-                result[(*fit).first] = (*fit).second;
+                result[path] = *fit->entry;
                 ++results;
             }
 
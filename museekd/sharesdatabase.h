@@ -26,6 +26,7 @@
 #include <string>
 #include <vector>
 #include <Muhelp/DirEntry.hh>
+#include "pathtable.h"
 
 namespace Museek
 {
@@ -33,6 +34,7 @@ class Museekd;
 class SharesDatabase : public NewNet::Object {
 public:
 	SharesDatabase(Museekd * museekd);
+	~SharesDatabase();
 
 	void load(const std::string& db, bool add = false);
 
@@ -46,26 +48,49 @@ public:
 	void search(const std::string& query, Folder& result);
 	Shares folder_contents(const std::string& _f);
 
+	/* Content fingerprints (hex SHA-1, see fingerprint.h) of the files we've
+	   uploaded entirely, by local path. Empty if unknown for this size. */
+	std::string fingerprint(const std::string& path, uint64 size) const;
+	void setFingerprint(const std::string& path, uint64 size, const std::string& digest);
+
 protected:
-	void update( bool add = false );
-	void recode( bool add = false );
+	void update( const DirEntry& shares, bool add = false );
+	void recode( const DirEntry& shares, bool add = false );
 	void update_flat();
 	void update_compressed();
 	void update_word_maps();
+	void load_fingerprints();
 
 private:
-	inline Folder fetch(const std::string& word) const;
+	/* A shared file: its path in network encoding and its entry in mRecoded. */
+	struct SharedFile {
+		PathTable::Path path;
+		const FileEntry * entry;
+	};
+	/* Orders the shared files by their whole path, like the search results. */
+	struct PathOrder {
+		PathOrder(const PathTable * p) : paths(p) {}
+		bool operator()(const SharedFile& a, const SharedFile& b) const { return paths->compare(a.path, b.path) < 0; }
+		const PathTable * paths;
+	};
+	/* Positions in mFiles, in increasing order. */
+	typedef std::vector<uint32> FileList;
+
+	void release_files();
 
 	NewNet::WeakRefPtr<Museekd> mMuseekd;
 
 	uint32 mNumFolders, mNumFiles;
 
-	DirEntry mShares, mRecoded;
-	Folder mFlat;
+	DirEntry mRecoded;
+	std::vector<SharedFile> mFiles; // Ordered by path (see PathOrder)
 
 	std::vector<unsigned char> mCompressed;
 
-	std::map<wchar_t, Shares> mCharMap;
+	std::map<std::string, FileList> mWords; // Files whose path contains the word
+
+	std::map<std::string, std::pair<uint64, std::string> > mFingerprints;
+	std::string mFingerprintsPath;
 };
 }
 #endif // MUSEEK_SHARESDATABASE_H
@@ -0,0 +1,611 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "swarm.h"
+#include "museekd.h"
+#include "downloadmanager.h"
+#include "diskio.h"
+#include <NewNet/nnlog.h>
+#include <string.h>
+
+Museek::Swarm::Swarm(Museekd * museekd, Download * primary) : m_Museekd(museekd), m_Primary(primary)
+{
+    m_Size = primary->size();
+    m_Idle = false;
+    m_Done = false;
+
+    museekd->downloads()->downloadUpdatedEvent.connect(this, &Swarm::onDownloadUpdated);
+    museekd->downloads()->downloadRemovedEvent.connect(this, &Swarm::onDownloadRemoved);
+}
+
+Museek::Swarm::~Swarm()
+{
+    NNLOG("museekd.down.debug", "Swarm destroyed.");
+}
+
+/**
+  * Split what's left to download in equal ranges: the primary keeps
+  * downloading the first one, each source gets one of the others.
+  */
+void
+Museek::Swarm::start(const std::vector<Download *> & sources)
+{
+    Download * primary = m_Primary;
+    uint64 from = primary->position();
+    uint64 length = (m_Size - from) / (sources.size() + 1);
+
+    m_Sources.push_back(primary);
+    for (uint i = 0; i <= sources.size(); ++i) {
+        Download * source = (i == 0) ? primary : sources[i - 1];
+        Range range;
+        range.start = from + i * length;
+        range.end = (i == sources.size()) ? m_Size : range.start + length;
+        range.position = range.start;
+        range.verified = false;
+        range.writing = false;
+        range.source = source;
+        range.user = source->user();
+        m_Ranges.push_back(range);
+        if (i > 0)
+            m_Sources.push_back(source);
+    }
+
+    NNLOG("museekd.down.debug", "Swarming %s from %u users, starting at %llu.", primary->remotePath().c_str(), m_Ranges.size(), from);
+}
+
+/**
+  * Index of the range fetched by the download, -1 if it has none
+  */
+int
+Museek::Swarm::find(Download * download) const
+{
+    for (uint i = 0; i < m_Ranges.size(); ++i) {
+        if (m_Ranges[i].source == download)
+            return i;
+    }
+    return -1;
+}
+
+/**
+  * Index of the range starting there, -1 if there's none
+  */
+int
+Museek::Swarm::findStart(uint64 start) const
+{
+    for (uint i = 0; i < m_Ranges.size(); ++i) {
+        if (m_Ranges[i].start == start)
+            return i;
+    }
+    return -1;
+}
+
+/**
+  * Is the download transferring or about to?
+  */
+bool
+Museek::Swarm::active(Download * download) const
+{
+    if (!download)
+        return false;
+
+    TrState state = download->state();
+    return state == TS_Transferring || state == TS_Negotiating || state == TS_Waiting
+        || state == TS_Establishing || state == TS_Initiating || state == TS_Connecting
+        || state == TS_QueuedRemotely;
+}
+
+bool
+Museek::Swarm::hasRange(Download * download) const
+{
+    return !m_Done && find(download) >= 0;
+}
+
+uint64
+Museek::Swarm::position(Download * download) const
+{
+    int i = find(download);
+    return (i < 0) ? m_Size : m_Ranges[i].position;
+}
+
+/**
+  * Account the data the download has received: what belongs to its range
+  * should be written, the first bytes of the range and what comes after
+  * its end are kept to check the boundaries with the neighbour ranges.
+  */
+size_t
+Museek::Swarm::received(Download * download, const unsigned char * data, size_t n, bool & done)
+{
+    done = false;
+    int i = find(download);
+    if (m_Done || i < 0) {
+        done = true;
+        return 0;
+    }
+
+    size_t written = 0;
+    Range & range = m_Ranges[i];
+    if (range.position < range.end) {
+        uint64 left = range.end - range.position;
+        written = (n < left) ? n : (size_t) left;
+        if (range.head.size() < SWARM_OVERLAP && range.head.size() == range.position - range.start) {
+            size_t head = SWARM_OVERLAP - range.head.size();
+            if (head > written)
+                head = written;
+            range.head.insert(range.head.end(), data, data + head);
+        }
+        range.position += written;
+    }
+    if (range.position >= range.end && range.end < m_Size && range.tail.size() < SWARM_OVERLAP) {
+        size_t tail = SWARM_OVERLAP - range.tail.size();
+        if (tail > n - written)
+            tail = n - written;
+        range.tail.insert(range.tail.end(), data + written, data + written + tail);
+    }
+
+    // Check the boundaries of the range, the download may be dropped
+    if (i > 0)
+        verify(i - 1);
+    i = find(download);
+    if (i >= 0)
+        verify(i);
+
+    i = find(download);
+    if (m_Done || i < 0) {
+        done = true;
+        return 0;
+    }
+
+    const Range & current = m_Ranges[i];
+    done = current.position >= current.end && (current.end >= m_Size || current.tail.size() >= SWARM_OVERLAP);
+    return written;
+}
+
+/**
+  * Compare the bytes fetched after the end of a range with the first
+  * bytes of the next one. If they differ, one of the two users sent us
+  * garbage: the primary is trusted. Otherwise we can't tell which one,
+  * the next range is fetched again by a third user who settles it.
+  */
+void
+Museek::Swarm::verify(uint i)
+{
+    if (i + 1 >= m_Ranges.size())
+        return;
+
+    Range & range = m_Ranges[i];
+    const Range & next = m_Ranges[i + 1];
+    if (range.verified || range.tail.size() < SWARM_OVERLAP || next.head.size() < SWARM_OVERLAP)
+        return;
+
+    bool match = memcmp(&range.tail[0], &next.head[0], SWARM_OVERLAP) == 0;
+
+    // The boundary was fetched again: whoever disagrees with two users was wrong
+    std::map<uint64, std::pair<std::string, std::string> >::iterator it = m_Disputes.find(next.start);
+    if (it != m_Disputes.end()) {
+        std::pair<std::string, std::string> users = it->second;
+        if (match) {
+            m_Disputes.erase(it);
+            range.verified = true;
+            if (range.user == users.first && next.user != users.second) {
+                NNLOG("museekd.down.warn", "Data from %s doesn't match the other sources at %llu.", users.second.c_str(), next.start);
+                ban(users.second);
+            }
+            return;
+        }
+        if (range.user == users.first && next.user != users.second) {
+            m_Disputes.erase(it);
+            NNLOG("museekd.down.warn", "Data from %s doesn't match the other sources at %llu, fetching it again.", users.first.c_str(), range.start);
+            reset(i);
+            ban(users.first);
+            return;
+        }
+    }
+    else if (match) {
+        range.verified = true;
+        return;
+    }
+
+    Download * primary = m_Primary;
+    if (primary && (range.user == primary->user() || next.user == primary->user())) {
+        uint bad = (next.user == primary->user()) ? i : i + 1;
+        std::string user = m_Ranges[bad].user;
+        NNLOG("museekd.down.warn", "Data from %s doesn't match the other sources at %llu, fetching it again.", user.c_str(), m_Ranges[bad].start);
+
+        reset(bad);
+        ban(user);
+        return;
+    }
+
+    NNLOG("museekd.down.warn", "Data from %s and %s doesn't match at %llu, fetching it from another user.", range.user.c_str(), next.user.c_str(), next.start);
+    // Its source gets another range once it has stopped
+    m_Disputes[next.start] = std::pair<std::string, std::string>(range.user, next.user);
+    reset(i + 1);
+}
+
+/**
+  * Is the range at a boundary the user disagreed on (someone else should fetch it)?
+  */
+bool
+Museek::Swarm::disputed(uint i, const std::string & user) const
+{
+    std::map<uint64, std::pair<std::string, std::string> >::const_iterator it = m_Disputes.find(m_Ranges[i].start);
+    return it != m_Disputes.end() && (it->second.first == user || it->second.second == user);
+}
+
+/**
+  * Forget what was downloaded in the range: it will be fetched again
+  */
+void
+Museek::Swarm::reset(uint i)
+{
+    Range & range = m_Ranges[i];
+    range.position = range.start;
+    range.head.clear();
+    range.tail.clear();
+    range.verified = false;
+    range.source = 0;
+    if (i > 0)
+        m_Ranges[i - 1].verified = false;
+
+    updateResumePosition();
+}
+
+/**
+  * Don't use this user anymore
+  */
+void
+Museek::Swarm::ban(const std::string & user)
+{
+    Download * primary = m_Primary;
+    if (primary && primary->user() == user)
+        return;
+
+    m_Banned.insert(user);
+
+    std::vector<NewNet::WeakRefPtr<Download> > sources = m_Sources;
+    std::vector<NewNet::WeakRefPtr<Download> >::iterator it;
+    for (it = sources.begin(); it != sources.end(); ++it) {
+        if (it->isValid() && (*it)->user() == user)
+            release(*it);
+    }
+
+    if (m_Idle)
+        assign(m_Primary);
+}
+
+/**
+  * Give the download something to fetch: a range nobody is fetching,
+  * or else the second half of the range that would take the longest.
+  */
+void
+Museek::Swarm::assign(Download * download)
+{
+    if (m_Done || !download)
+        return;
+
+    if (m_Banned.find(download->user()) != m_Banned.end()) {
+        release(download);
+        return;
+    }
+
+    // A range its source gave up
+    for (uint i = 0; i < m_Ranges.size(); ++i) {
+        Range & range = m_Ranges[i];
+        if (range.position >= range.end || range.writing || disputed(i, download->user()))
+            continue;
+        Download * source = range.source;
+        if (source == download || !active(source)) {
+            range.source = download;
+            if (range.user != download->user()) {
+                // Don't trust what the previous source sent beyond the range
+                range.tail.clear();
+                range.verified = false;
+            }
+            range.user = download->user();
+            if (source && source != download)
+                release(source);
+            request(download);
+            return;
+        }
+    }
+
+    // Half of the slowest range
+    int best = -1;
+    uint64 bestTime = 0;
+    for (uint i = 0; i < m_Ranges.size(); ++i) {
+        const Range & range = m_Ranges[i];
+        Download * source = range.source;
+        if (!source || source == download || range.position >= range.end)
+            continue;
+        uint64 remaining = range.end - range.position;
+        if (remaining < 2 * SWARM_MIN_RANGE)
+            continue;
+        uint64 time = remaining / (source->rate() + 1);
+        if (best < 0 || time > bestTime) {
+            best = i;
+            bestTime = time;
+        }
+    }
+
+    if (best >= 0) {
+        Range & range = m_Ranges[best];
+        Range half;
+        half.start = range.position + (range.end - range.position) / 2;
+        half.end = range.end;
+        half.position = half.start;
+        half.verified = false;
+        half.writing = false;
+        half.source = download;
+        half.user = download->user();
+        range.end = half.start;
+        range.tail.clear();
+        range.verified = false;
+        m_Ranges.insert(m_Ranges.begin() + best + 1, half);
+
+        NNLOG("museekd.down.debug", "%s takes over %s from %llu to %llu.", download->user().c_str(), download->remotePath().c_str(), half.start, half.end);
+        request(download);
+        return;
+    }
+
+    // Nothing left to share
+    release(download);
+}
+
+/**
+  * Ask the user to send the range of the download
+  */
+void
+Museek::Swarm::request(Download * download)
+{
+    if (download == m_Primary)
+        m_Idle = false;
+
+    download->setEnqueued(false);
+    download->setState(TS_QueuedRemotely);
+    museekd()->downloads()->checkDownloads();
+}
+
+/**
+  * The download has nothing left to do in the swarm
+  */
+void
+Museek::Swarm::release(Download * download)
+{
+    int i = find(download);
+    if (i >= 0)
+        m_Ranges[i].source = 0;
+
+    if (download == m_Primary) {
+        // It holds the file: wait for the others
+        m_Idle = true;
+        return;
+    }
+
+    std::vector<NewNet::WeakRefPtr<Download> >::iterator it;
+    for (it = m_Sources.begin(); it != m_Sources.end(); ++it) {
+        if (*it == download) {
+            m_Sources.erase(it);
+            break;
+        }
+    }
+
+    museekd()->downloads()->remove(download->user(), download->remotePath());
+}
+
+void
+Museek::Swarm::idle(Download * download)
+{
+    assign(download);
+}
+
+/**
+  * The download is closing its file: its data is being written. The file
+  * can't be moved before, even if the range will be completed by someone else.
+  */
+void
+Museek::Swarm::closing(Download * download, AsyncFile * file)
+{
+    if (m_Done)
+        return;
+
+    Closing closing;
+    closing.start = m_Size;
+    closing.complete = false;
+    closing.download = download;
+
+    int i = find(download);
+    if (i >= 0) {
+        Range & range = m_Ranges[i];
+        closing.start = range.start;
+        closing.complete = range.position >= range.end;
+        if (closing.complete) {
+            range.writing = true;
+            range.source = 0;
+        }
+    }
+
+    m_Closing[file] = closing;
+    file->closedEvent.connect(this, &Swarm::onFileClosed);
+}
+
+/**
+  * The data of a range has reached the disk (or not)
+  */
+void
+Museek::Swarm::onFileClosed(AsyncFile * file)
+{
+    std::map<AsyncFile *, Closing>::iterator it = m_Closing.find(file);
+    if (it == m_Closing.end())
+        return;
+
+    Closing closing = it->second;
+    m_Closing.erase(it);
+    if (m_Done)
+        return;
+
+    int i = findStart(closing.start);
+    if (i >= 0 && closing.complete)
+        m_Ranges[i].writing = false;
+
+    if (file->failed()) {
+        // The primary will report the error when it writes alone
+        NNLOG("museekd.down.warn", "Couldn't write a part of a swarmed download (error %i).", file->error());
+        dissolve();
+        return;
+    }
+
+    updateResumePosition();
+    checkComplete();
+    // Done with its range, or it was taken away: give it another one
+    if (!m_Done && closing.download.isValid() && (closing.complete || find(closing.download) < 0))
+        assign(closing.download);
+}
+
+/**
+  * The contiguous part of the file written since the beginning is safe:
+  * a restart (or the primary alone) can resume from there.
+  */
+void
+Museek::Swarm::updateResumePosition()
+{
+    Download * primary = m_Primary;
+    if (!primary || m_Ranges.empty())
+        return;
+
+    uint64 position = m_Ranges[0].start;
+    std::vector<Range>::const_iterator it;
+    for (it = m_Ranges.begin(); it != m_Ranges.end(); ++it) {
+        if (it->position < it->end || it->writing)
+            break;
+        position = it->end;
+    }
+
+    primary->setResumePosition(position);
+}
+
+/**
+  * Finish the primary when every range has been fetched, checked and written
+  */
+void
+Museek::Swarm::checkComplete()
+{
+    if (m_Done || !m_Closing.empty())
+        return;
+
+    for (uint i = 0; i < m_Ranges.size(); ++i) {
+        const Range & range = m_Ranges[i];
+        if (range.position < range.end || range.writing)
+            return;
+        if (i + 1 < m_Ranges.size() && !range.verified)
+            return;
+    }
+
+    NewNet::RefPtr<Swarm> self(this);
+    NewNet::RefPtr<Download> primary = (Download *) m_Primary;
+    NNLOG("museekd.down.debug", "Swarmed download of %s complete.", primary.isValid() ? primary->remotePath().c_str() : "");
+
+    m_Idle = false;
+    dissolve();
+    if (primary.isValid()) {
+        primary->setResumePosition(m_Size);
+        primary->setPosition(m_Size);
+        primary->finish();
+    }
+}
+
+/**
+  * Stop swarming: the transient downloads are removed, the primary resumes
+  * alone from the contiguous data we have.
+  */
+void
+Museek::Swarm::dissolve()
+{
+    if (m_Done)
+        return;
+
+    NewNet::RefPtr<Swarm> self(this);
+    updateResumePosition();
+    m_Done = true;
+
+    std::vector<NewNet::WeakRefPtr<Download> > sources = m_Sources;
+    m_Sources.clear();
+    std::vector<NewNet::WeakRefPtr<Download> >::iterator it;
+    for (it = sources.begin(); it != sources.end(); ++it) {
+        if (it->isValid() && *it != m_Primary)
+            museekd()->downloads()->remove((*it)->user(), (*it)->remotePath());
+    }
+
+    Download * primary = m_Primary;
+    if (primary) {
+        primary->setSwarm(0);
+        // It was waiting for the others: let it download the rest
+        if (m_Idle && primary->state() == TS_Transferring) {
+            primary->setPositionFromIncompleteFile();
+            primary->setEnqueued(false);
+            primary->setState(TS_QueuedRemotely);
+        }
+    }
+}
+
+/**
+  * One of our downloads has changed
+  */
+void
+Museek::Swarm::onDownloadUpdated(Download * download)
+{
+    if (m_Done)
+        return;
+
+    if (download == m_Primary) {
+        if (download->state() == TS_Aborted)
+            dissolve();
+        return;
+    }
+
+    // Its source has failed: the idle primary can take the range over
+    if (m_Idle && find(download) >= 0 && !active(download))
+        assign(m_Primary);
+}
+
+/**
+  * A download is being destroyed
+  */
+void
+Museek::Swarm::onDownloadRemoved(Download * download)
+{
+    if (m_Done)
+        return;
+
+    if (download == m_Primary) {
+        dissolve();
+        return;
+    }
+
+    int i = find(download);
+    if (i < 0)
+        return;
+
+    m_Ranges[i].source = 0;
+    if (m_Idle)
+        assign(m_Primary);
+}
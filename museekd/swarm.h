@@ -0,0 +1,137 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_SWARM_H
+#define MUSEEK_SWARM_H
+
+#include <NewNet/nnobject.h>
+#include <NewNet/nnweakrefptr.h>
+#include <NewNet/nnevent.h>
+#include "mutypes.h"
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+/* Smallest range given to a source. */
+#define SWARM_MIN_RANGE (4 * 1024 * 1024)
+/* Bytes downloaded twice at each range boundary to check that the sources agree. */
+#define SWARM_OVERLAP (64 * 1024)
+
+namespace Museek
+{
+  class Museekd;
+  class Download;
+  class AsyncFile;
+
+  /* Downloads a file from several users at once. The file is split into
+     ranges, each one fetched by a download from a different user: the
+     transfer starts at the beginning of the range (the position sent to
+     the uploader) and is stopped at its end. Every source downloads a bit
+     more than its range, which must match the beginning of the next range.
+     When a source is done, it takes over a range nobody is downloading, or
+     half of the range that would take the longest to finish.
+     The primary download is the one the user asked for: it holds the
+     incomplete file and is finished when every range is. The other
+     downloads are transient: they are neither stored nor journaled. */
+  class Swarm : public NewNet::Object
+  {
+  public:
+    Swarm(Museekd * museekd, Download * primary);
+    ~Swarm();
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
+    Download * primary() const { return m_Primary; }
+
+    /* Split what's left to download between the primary and these sources. */
+    void start(const std::vector<Download *> & sources);
+
+    /* Has the download a range to fetch? */
+    bool hasRange(Download * download) const;
+    /* Where should the download start? */
+    uint64 position(Download * download) const;
+    /* The download has received some data. Returns how much of it should be
+       written at its position. done is set when its range is complete. */
+    size_t received(Download * download, const unsigned char * data, size_t n, bool & done);
+    /* The file of the download is being closed (its range may be complete). */
+    void closing(Download * download, AsyncFile * file);
+    /* The download has nothing to do: give it another range (or let it go). */
+    void idle(Download * download);
+
+    /* Is the swarm over (completed or dissolved)? */
+    bool finished() const { return m_Done; }
+    /* Stop swarming: the primary will download the rest alone. */
+    void dissolve();
+
+  private:
+    struct Range
+    {
+      uint64 start;                               // Beginning of the range
+      uint64 end;                                 // End of the range (excluded)
+      uint64 position;                            // Where we are in the range
+      std::vector<char> head;                     // First bytes of the range, checked against the previous range
+      std::vector<char> tail;                     // Bytes after the end, checked against the next range
+      bool verified;                              // Does the tail match the head of the next range?
+      bool writing;                               // Is the file of its last source being closed?
+      NewNet::WeakRefPtr<Download> source;        // The download fetching it
+      std::string user;                           // User who sent its data
+    };
+
+    /* A file being closed. */
+    struct Closing
+    {
+      uint64 start;                               // Start of the range
+      bool complete;                              // Was the range complete?
+      NewNet::WeakRefPtr<Download> download;      // The download that fetched it
+    };
+
+    int find(Download * download) const;
+    int findStart(uint64 start) const;
+    bool active(Download * download) const;
+    void verify(uint i);
+    bool disputed(uint i, const std::string & user) const;
+    void reset(uint i);
+    void ban(const std::string & user);
+    void assign(Download * download);
+    void request(Download * download);
+    void release(Download * download);
+    void checkComplete();
+    void updateResumePosition();
+
+    void onFileClosed(AsyncFile * file);
+    void onDownloadUpdated(Download * download);
+    void onDownloadRemoved(Download * download);
+
+    NewNet::WeakRefPtr<Museekd>         m_Museekd;      // Ref to the museekd
+    NewNet::WeakRefPtr<Download>        m_Primary;      // The download the user asked for
+    uint64                              m_Size;         // Size of the file
+    std::vector<Range>                  m_Ranges;       // The ranges, ordered by start
+    std::vector<NewNet::WeakRefPtr<Download> > m_Sources; // Every download of the swarm (the primary first)
+    std::set<std::string>               m_Banned;       // Users whose data didn't match
+    std::map<uint64, std::pair<std::string, std::string> >
+                                        m_Disputes;     // Boundaries where two sources disagreed (users of the earlier and later ranges)
+    std::map<AsyncFile *, Closing>      m_Closing;      // Files being closed and their range
+    bool                                m_Idle;         // Is the primary waiting for the other sources?
+    bool                                m_Done;         // Has the swarm completed (or been dissolved)?
+  };
+}
+
+#endif // MUSEEK_SWARM_H
@@ -28,12 +28,17 @@
 #include "servermanager.h"
 #include "peermanager.h"
 #include "uploadsocket.h"
+#include "uploadscheduler.h"
+#include "uploadslotcontroller.h"
+#include "uploadquotas.h"
 #include "sharesdatabase.h"
 #include "ifacemanager.h"
+#include "diskio.h"
 #include <Muhelp/string_ext.hh>
 #include <NewNet/nnreactor.h>
 #include <NewNet/util.h>
 #include <NewNet/nnratelimiter.h>
+#include <NewNet/nnpath.h>
 
 /**
   * Constructor
@@ -52,11 +57,13 @@ Museek::Upload::Upload(Museek::Museekd * museekd, const std::string & user, cons
     m_TicketValid = false;
     m_State = TS_Offline;
     m_Collected = 0;
-    m_File = 0;
+    m_ReadOffset = 0;
+    m_Reading = false;
 
 	m_CollectStart.tv_sec = m_CollectStart.tv_usec = 0;
 
     m_LocalPath = localPath;
+    m_LocalKey = m_Museekd->paths()->acquire(localPath, NewNet::Path::separator());
 
     // We need to know the filesize. The only way is to open the file and look into it. But close it when we're done.
     openFile();
@@ -71,6 +78,7 @@ Museek::Upload::~Upload()
 
     NNLOG("museekd.up.debug", "Upload destroyed.");
     m_Museekd->uploads()->uploadRemovedEvent(this);
+    m_Museekd->paths()->release(m_LocalKey);
 }
 
 /**
@@ -200,13 +208,14 @@ Museek::Upload::setPosition(uint64 position)
 }
 
 /**
-  * Close the file. the ifstream object can only be used once so delete it. We'll create a new one later if needed.
+  * Close the file. The workers will close it when they're done with it. We'll open it again later if needed.
   */
 void Museek::Upload::closeFile() {
-    if (m_File) {
-        NNLOG("museekd.up.debug", "Closing %s", m_LocalPath.c_str());
-        delete m_File;
+    if (m_File.isValid()) {
+        NNLOG("museekd.up.debug", "Closing %s", localPath().c_str());
+        m_File->close();
         m_File = 0;
+        m_Reading = false;
     }
 }
 
@@ -217,21 +226,23 @@ bool Museek::Upload::openFile()
 {
     closeFile();
 
-	m_File = new std::ifstream(m_LocalPath.c_str(), std::fstream::in | std::fstream::binary);
+	std::string path = localPath();
+	m_File = new AsyncFile(m_Museekd->diskIO(), path, false);
 
-	if(m_File->fail() || !m_File->is_open()) {
-	    NNLOG("museekd.up.warn", "Error while opening %s", m_LocalPath.c_str());
+	if(!m_File->isOpen()) {
+	    NNLOG("museekd.up.warn", "Error while opening %s", path.c_str());
+	    m_File = 0;
 		return false;
 	}
 
-    // go to the end of the file
-    m_File->seekg( 0, std::ios_base::end );
-    // the position = size of the file
-    m_Size = m_File->tellg();
-    // go back to previous position
-    m_File->seekg( 0,  std::ios_base::beg ) ;
+    m_Size = m_File->size();
+    m_ReadOffset = 0;
+    m_File->readEvent.connect(this, &Upload::onFileRead);
+    // Hash the file while it's sent, if it's sent entirely
+    if (m_Museekd->shares()->fingerprint(path, m_Size).empty())
+        m_File->setFingerprint(Fingerprint());
 
-    NNLOG("museekd.up.debug", "Opening file %s (size: %i)", m_LocalPath.c_str(), size());
+    NNLOG("museekd.up.debug", "Opening file %s (size: %i)", path.c_str(), size());
 
 	return true;
 }
@@ -248,36 +259,61 @@ bool Museek::Upload::seek(uint64 pos) {
 	NNLOG("museekd.up.debug", "seeking to %u", pos);
 	setState(TS_Transferring);
 
-	m_File->seekg(pos, std::ios_base::beg);
-
-	if (!m_File)
+	if (!m_File.isValid())
 		return false;
 
 	m_Position = pos;
+	m_ReadOffset = pos;
 
 	return true;
 }
 
 /**
-  * Reads some data in the file and put it in the send buffer
+  * Reads some data in the file. It will be put in the send buffer when the workers are done (see onFileRead).
   */
 bool Museek::Upload::read(NewNet::Buffer & buffer) {
+    if(!m_Socket || !m_File.isValid())
+        return false;
+
+    // The data will soon be there
+    if(m_Reading || m_ReadOffset >= m_Size)
+        return true;
+
     NNLOG("museekd.up.debug", "Reading from file");
+    m_Reading = true;
+    m_File->read(m_ReadOffset, 1024 * 1024);
 
-    if(!m_Socket)
-        return false;
+	return true;
+}
 
-	char buf[1024 * 1024];
+/**
+  * Some data has been read from the file: send it
+  */
+void Museek::Upload::onFileRead(AsyncFile * file) {
+    // Closed meanwhile
+    if(file != m_File)
+        return;
 
-	m_File->read(buf, 1024 * 1024);
-	int64_t count = m_File->gcount();
-	if(count == -1)
-		return false;
+    m_Reading = false;
 
-    NNLOG("museekd.up.debug", "Appending %u bytes to the buffer", count);
-    m_Socket->send((const unsigned char *) &buf, count);
+    if(file->failed() || file->data().empty()) {
+        NNLOG("museekd.up.warn", "Couldn't read %s at %llu", localPath().c_str(), m_ReadOffset);
+        // This stops the socket too
+        if(m_Socket.isValid())
+            setLocalError("File error");
+        return;
+    }
 
-	return true;
+    m_ReadOffset += file->data().size();
+
+    if(m_ReadOffset >= m_Size && file->fingerprinting() && file->fingerprint().size() == m_Size)
+        m_Museekd->shares()->setFingerprint(localPath(), m_Size, file->fingerprint().digest());
+
+    if(!m_Socket)
+        return;
+
+    NNLOG("museekd.up.debug", "Appending %u bytes to the buffer", file->data().size());
+    m_Socket->send((const unsigned char *) &file->data()[0], file->data().size());
 }
 
 /**
@@ -285,6 +321,7 @@ bool Museek::Upload::read(NewNet::Buffer & buffer) {
   */
 void Museek::Upload::sent(uint count) {
 	m_Position += count;
+	m_Museekd->uploads()->quotas()->add(m_User, count);
 	collect(count);
 }
 
@@ -355,7 +392,7 @@ void Museek::Upload::initiate(PeerSocket * socket) {
 
     museekd()->uploads()->setTransferReplyCallback(socket->transferReplyReceivedEvent.connect(museekd()->uploads(), &UploadManager::onPeerTransferReplyReceived));
 
-	std::string path = museekd()->codeset()->fromFSToNet(m_LocalPath);
+	std::string path = museekd()->codeset()->fromFSToNet(localPath());
 	if (m_CaseProblem)
         path = tolower(path);
 	if(! path.empty()) {
@@ -385,11 +422,17 @@ Museek::UploadManager::UploadManager(Museekd * museekd) : m_Museekd(museekd)
     museekd->peers()->peerOfflineEvent.connect(this, &UploadManager::onPeerOffline);
     uploadAddedEvent.connect(this, &UploadManager::onUploadAdded);
     uploadUpdatedEvent.connect(this, &UploadManager::onUploadUpdated);
+    uploadRemovedEvent.connect(this, &UploadManager::onUploadRemoved);
     museekd->config()->keySetEvent.connect(this, &UploadManager::onConfigKeySet);
     museekd->config()->keyRemovedEvent.connect(this, &UploadManager::onConfigKeyRemoved);
 
     m_Limiter = new NewNet::RateLimiter();
     m_Limiter->setLimit(-1);
+
+    setScheduler(museekd->config()->get("transfers", "upload_queue_policy"));
+
+    m_SlotController = new UploadSlotController(museekd);
+    m_Quotas = new UploadQuotas(museekd);
 }
 
 Museek::UploadManager::~UploadManager()
@@ -416,6 +459,8 @@ void Museek::UploadManager::onUploadAdded(Upload * upload) {
             upload->state() == TS_Initiating ||
             upload->state() == TS_Connecting)
         addInitiating(upload);
+
+    m_Scheduler->update(upload);
 }
 
 /**
@@ -439,6 +484,44 @@ void Museek::UploadManager::onUploadUpdated(Upload * upload) {
         if (upload == isInitiatingTo(upload->user()))
             removeInitiating(upload->user());
     }
+
+    m_Scheduler->update(upload);
+}
+
+/**
+  * Called when an upload is destroyed.
+  * Make sure the scheduler forgets about it
+  */
+void Museek::UploadManager::onUploadRemoved(Upload * upload) {
+    m_Scheduler->remove(upload);
+}
+
+/**
+  * Use the given upload queue policy
+  */
+void Museek::UploadManager::setScheduler(const std::string & policy) {
+    NewNet::RefPtr<UploadScheduler> scheduler = UploadScheduler::create(museekd(), policy);
+    if (m_Scheduler.isValid() && (m_Scheduler->name() == scheduler->name()))
+        return;
+
+    NNLOG("museekd.up.debug", "Using the %s upload queue policy", scheduler->name().c_str());
+
+    // Tell the new scheduler about the existing uploads
+    std::vector<NewNet::RefPtr<Upload> >::iterator it;
+    for(it = m_Uploads.begin(); it != m_Uploads.end(); ++it)
+        scheduler->update(*it);
+
+    m_Scheduler = scheduler;
+}
+
+/**
+  * Privileges of the given user (or of every user) have changed: update his place in the queue
+  */
+void Museek::UploadManager::privilegesChanged(const std::string & user) {
+    if (user.empty())
+        m_Scheduler->refresh();
+    else
+        m_Scheduler->refresh(user);
 }
 
 /**
@@ -530,22 +613,10 @@ void Museek::UploadManager::checkUploads() {
 
     NNLOG("museekd.up.debug", "Checking if there are some uploads to start");
 
-	Upload* candidate = 0;
-	std::vector<NewNet::RefPtr<Upload> >::iterator it = m_Uploads.begin();
-	for(; it != m_Uploads.end(); ++it) {
-	    if ((*it)->state() == TS_QueuedLocally && museekd()->isBanned((*it)->user()))
-	        (*it)->setLocalError("Banned");
-		else if((*it)->state() == TS_QueuedLocally && !isUploadingTo((*it)->user())) {
-			if(museekd()->isPrivileged((*it)->user()) || (museekd()->privilegeBuddies() && museekd()->isBuddied((*it)->user()))) {
-				candidate = *it;
-				break;
-			}
-			if(! candidate)
-				candidate = *it;
-		}
-	}
+	Upload* candidate = m_Scheduler->next();
 	if(candidate) {
 	    NNLOG("museekd.up.debug", "Can start upload of %s to %s", candidate->localPath().c_str(), candidate->user().c_str());
+	    m_Scheduler->started(candidate);
         candidate->setState(TS_Initiating);
 	    museekd()->peers()->peerSocket(candidate->user());
 	    checkUploads();
@@ -635,11 +706,15 @@ Museek::UploadManager::addFolder(const std::string & user, const std::string & l
 Museek::Upload *
 Museek::UploadManager::findUpload(const std::string & user, const std::string & path)
 {
-    // Iterate over m_Uploads until we find a match.
-    std::vector<NewNet::RefPtr<Upload> >::iterator it, end = m_Uploads.end();
-    for(it = m_Uploads.begin(); it != end; ++it) {
-        if(((*it)->user() == user) && ((*it)->localPath() == path))
-            return *it;
+    // No upload has this path if its folder isn't known
+    PathTable::Path key;
+    if(museekd()->paths()->find(path, NewNet::Path::separator(), key)) {
+        // Iterate over m_Uploads until we find a match.
+        std::vector<NewNet::RefPtr<Upload> >::iterator it, end = m_Uploads.end();
+        for(it = m_Uploads.begin(); it != end; ++it) {
+            if(((*it)->localPathKey() == key) && ((*it)->user() == user))
+                return *it;
+        }
     }
 
     NNLOG("museekd.up.debug", "Upload %s not found", path.c_str());
@@ -717,22 +792,24 @@ Museek::UploadManager::update(const std::string & user, const std::string & path
   * The given path should be encoded with FS encoding. Separator should be the FS one.
   */
 uint Museek::UploadManager::queueLength(const std::string& user, const std::string& stopAt) {
-	bool priv = museekd()->isPrivileged(user) || (museekd()->privilegeBuddies() && museekd()->isBuddied(user));
+	bool priv = museekd()->hasPrivileges(user);
 
 	std::vector<NewNet::RefPtr<Upload> >::const_iterator it, end = m_Uploads.end();
 	uint uploads = 0;
 	bool found = false;
+	PathTable::Path key;
+	bool known = museekd()->paths()->find(stopAt, NewNet::Path::separator(), key);
 
 	for(it = m_Uploads.begin(); it != end; ++it) {
 	    // Count every upload that are before this one in the queue
-		if((*it)->state() == TS_QueuedLocally && (! priv || museekd()->isPrivileged((*it)->user()) || (museekd()->privilegeBuddies() && museekd()->isBuddied((*it)->user()))) && !found)
+		if((*it)->state() == TS_QueuedLocally && (! priv || museekd()->hasPrivileges((*it)->user())) && !found)
 			uploads++;
 
         // There might be some privileged uploads after this one. Count them if we're not privileged
-        if (found && (*it)->state() == TS_QueuedLocally && !priv && (museekd()->isPrivileged((*it)->user()) || (museekd()->privilegeBuddies() && museekd()->isBuddied((*it)->user()))))
+        if (found && (*it)->state() == TS_QueuedLocally && !priv && museekd()->hasPrivileges((*it)->user()))
 			uploads++;
 
-		if(((*it)->localPath() == stopAt) || ((*it)->hasCaseProblem() && (tolower((*it)->localPath()) == stopAt)))
+		if((known && ((*it)->localPathKey() == key)) || ((*it)->hasCaseProblem() && (tolower((*it)->localPath()) == stopAt)))
 			found = true;
 	}
 
@@ -888,10 +965,32 @@ Museek::UploadManager::onConfigKeySet(const Museek::ConfigManager::ChangeNotify
         checkUploads();
     if(data->domain == "transfers" && data->key == "upload_rate")
         updateRates();
+    if(data->domain == "transfers" && data->key == "upload_queue_policy")
+        setScheduler(data->value);
+    if(data->domain == "transfers" && data->key == "upload_slots_auto")
+        m_SlotController->setEnabled(data->value == "true");
+    if(data->domain == "transfers" && (data->key == "upload_slots_min" || data->key == "upload_slots_max"))
+        m_SlotController->configure();
+    if(data->domain == "transfers" && (data->key == "upload_quota" || data->key == "upload_quota_buddies")) {
+        m_Quotas->configure();
+        checkUploads();
+    }
+    if(data->domain == "transfers" && data->key == "privilege_buddies")
+        privilegesChanged();
+    if(data->domain == "buddies")
+        privilegesChanged(data->key);
     if(data->domain == "banned") {
         Upload * current = isUploadingTo(data->key);
         if (current)
             current->setLocalError("Banned");
+
+        // Banned users can't stay in the queue
+        std::vector<NewNet::RefPtr<Upload> > uploads = m_Uploads;
+        std::vector<NewNet::RefPtr<Upload> >::iterator it;
+        for(it = uploads.begin(); it != uploads.end(); ++it) {
+            if ((*it)->user() == data->key && (*it)->state() == TS_QueuedLocally)
+                (*it)->setLocalError("Banned");
+        }
         checkUploads();
     }
 }
@@ -906,6 +1005,20 @@ Museek::UploadManager::onConfigKeyRemoved(const Museek::ConfigManager::RemoveNot
         checkUploads();
     if(data->domain == "transfers" && data->key == "upload_rate")
         updateRates();
+    if(data->domain == "transfers" && data->key == "upload_queue_policy")
+        setScheduler("fifo");
+    if(data->domain == "transfers" && data->key == "upload_slots_auto")
+        m_SlotController->setEnabled(false);
+    if(data->domain == "transfers" && (data->key == "upload_slots_min" || data->key == "upload_slots_max"))
+        m_SlotController->configure();
+    if(data->domain == "transfers" && (data->key == "upload_quota" || data->key == "upload_quota_buddies")) {
+        m_Quotas->configure();
+        checkUploads();
+    }
+    if(data->domain == "transfers" && data->key == "privilege_buddies")
+        privilegesChanged();
+    if(data->domain == "buddies")
+        privilegesChanged(data->key);
 }
 
 /**
@@ -934,6 +1047,8 @@ bool Museek::UploadManager::isUploadable(const std::string & user, const std::st
         *error = "Sharing Only to List";
     else if(!normalShared && !buddyShared )
         *error = "File not shared";
+    else if(m_Quotas->exceeded(user))
+        *error = "Too many megabytes";
     else if(museekd()->haveBuddyShares() && buddyShared && !normalShared && ! museekd()->isBuddied(user))
         *error = "File not shared";
     else if( ! museekd()->haveBuddyShares()  && buddyShared  && !normalShared )
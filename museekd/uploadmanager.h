@@ -29,6 +29,7 @@
 #include "mutypes.h"
 #include "servermessages.h"
 #include "configmanager.h"
+#include "pathtable.h"
 
 /* Forward declarations. */
 class SGetStatus;
@@ -46,6 +47,10 @@ namespace Museek
   class PeerSocket;
   class TicketSocket;
   class UploadSocket;
+  class UploadScheduler;
+  class UploadSlotController;
+  class UploadQuotas;
+  class AsyncFile;
 
   /* Definition of the upload structure. */
   class UploadManager;
@@ -71,6 +76,8 @@ namespace Museek
 
     const std::string & user() const { return m_User; }
     const std::string & localPath() const { return m_LocalPath; }
+    /* The local path as stored in museekd's path table (cheap to compare). */
+    const PathTable::Path & localPathKey() const { return m_LocalKey; }
     uint64 size() const { return m_Size; }
     uint64 position() const { return m_Position; }
     void setPosition(uint64 position);
@@ -97,14 +104,18 @@ namespace Museek
 
   private:
     void replyTimeout(long);
+    void onFileRead(AsyncFile * file);
 
     NewNet::WeakRefPtr<Museekd>         m_Museekd; // Ref to the museekd
 
-    std::ifstream *                     m_File; // The file we need to send
+    NewNet::RefPtr<AsyncFile>           m_File; // The file we need to send, read by the disk I/O workers
+    uint64                              m_ReadOffset; // Where the next read starts
+    bool                                m_Reading; // Is a read in progress?
     NewNet::WeakRefPtr<UploadSocket>    m_Socket; // Ref to the socket associated
 
     std::string                         m_User; // Name of the user
     std::string                         m_LocalPath; // Path to the file we have to upload
+    PathTable::Path                     m_LocalKey; // The same, in museekd's path table
     uint64                               m_Size; // Size of this file
     uint64                               m_Position; // Current position of this file
 
@@ -184,6 +195,17 @@ namespace Museek
 
     NewNet::RateLimiter * limiter() {return m_Limiter;}
 
+    /* The policy choosing which queued upload is started next. */
+    UploadScheduler * scheduler() {return m_Scheduler;}
+    /* Adapts the number of upload slots to the bandwidth, when enabled. */
+    UploadSlotController * slotController() {return m_SlotController;}
+    /* Bytes uploaded to each user lately, and their quotas. */
+    UploadQuotas * quotas() {return m_Quotas;}
+    /* Users we're currently uploading to (or initiating an upload). */
+    const std::map<std::string, NewNet::WeakRefPtr<Upload> > & uploading() const { return m_Uploading; }
+    /* Privileges of the given user have changed (empty: of every user). */
+    void privilegesChanged(const std::string & user = std::string());
+
     /* A transfer connection was initiated by a remote peer. */
     NewNet::Event<TicketSocket *> transferTicketReceivedEvent;
 
@@ -198,6 +220,8 @@ namespace Museek
     void addUploading(Upload * upload);
     void removeUploading(const std::string& user);
 
+    void setScheduler(const std::string & policy);
+
     void addInitiating(Upload * upload);
     void removeInitiating(const std::string& user);
     Upload * isInitiatingTo(const std::string & user);
@@ -214,6 +238,9 @@ namespace Museek
     std::map<std::string, NewNet::WeakRefPtr<Upload> >      m_Initiating;   // List of all the uploads currently being initiated
     std::map<std::string, NewNet::WeakRefPtr<Upload> >      m_Uploading;    // List of user we're currently uploading
     NewNet::RefPtr<NewNet::RateLimiter>                     m_Limiter;      // Rate limiter shared between uploads
+    NewNet::RefPtr<UploadScheduler>                         m_Scheduler;    // Chooses the next upload to start
+    NewNet::RefPtr<UploadSlotController>                    m_SlotController; // Adaptive number of upload slots
+    NewNet::RefPtr<UploadQuotas>                            m_Quotas;       // Per user upload quotas
     NewNet::WeakRefPtr<NewNet::Event<const PTransferReply *>::Callback>
                                                             m_TransferReplyCallback; // Callback to the transferreply event
   };
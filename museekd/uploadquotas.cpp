@@ -0,0 +1,299 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "uploadquotas.h"
+#include "uploadmanager.h"
+#include "museekd.h"
+#include "configmanager.h"
+#include "util.h"
+#include <NewNet/nnreactor.h>
+#include <NewNet/nnlog.h>
+#include <time.h>
+
+/* Time between two cleanups of the counters (ms). */
+#define QUOTA_TICK 3600000
+
+Museek::UploadQuotas::UploadQuotas(Museekd * museekd) : m_Museekd(museekd)
+{
+    m_Limit = 0;
+    m_BuddyLimit = 0;
+    m_Dirty = false;
+}
+
+Museek::UploadQuotas::~UploadQuotas()
+{
+    if (m_Timeout.isValid() && m_Museekd.isValid())
+        museekd()->reactor()->removeTimeout(m_Timeout);
+}
+
+/**
+  * Read the limits (in MiB) from the configuration
+  */
+void
+Museek::UploadQuotas::configure()
+{
+    m_Limit = (uint64)museekd()->config()->getUint("transfers", "upload_quota", 0) * 1024 * 1024;
+    m_BuddyLimit = (uint64)museekd()->config()->getUint("transfers", "upload_quota_buddies", 0) * 1024 * 1024;
+}
+
+/**
+  * Where the counters are kept (configurations older than the quotas don't have the key)
+  */
+std::string
+Museek::UploadQuotas::databasePath()
+{
+    ConfigManager * config = museekd()->config();
+    if (config->hasKey("transfers", "upload_quota_db"))
+        return config->get("transfers", "upload_quota_db");
+    if (config->path().empty())
+        return std::string();
+    return config->path() + ".quotas";
+}
+
+uint32
+Museek::UploadQuotas::currentHour()
+{
+    return time(NULL) / 3600;
+}
+
+/**
+  * Move the window forward to the given hour, forgetting what is too old
+  */
+void
+Museek::UploadQuotas::rotate(Window & window, uint32 hour)
+{
+    if (hour <= window.hour)
+        return;
+
+    if (hour - window.hour >= QUOTA_BUCKETS) {
+        for (uint i = 0; i < QUOTA_BUCKETS; i++)
+            window.buckets[i] = 0;
+        window.total = 0;
+    }
+    else {
+        for (uint32 h = window.hour + 1; h <= hour; h++) {
+            window.total -= window.buckets[h % QUOTA_BUCKETS];
+            window.buckets[h % QUOTA_BUCKETS] = 0;
+        }
+    }
+
+    window.hour = hour;
+}
+
+/**
+  * We've sent some bytes to this user
+  */
+void
+Museek::UploadQuotas::add(const std::string & user, uint count)
+{
+    uint32 hour = currentHour();
+
+    Windows::iterator it = m_Windows.find(user);
+    if (it == m_Windows.end()) {
+        Window window;
+        for (uint i = 0; i < QUOTA_BUCKETS; i++)
+            window.buckets[i] = 0;
+        window.total = 0;
+        window.hour = hour;
+        it = m_Windows.insert(Windows::value_type(user, window)).first;
+    }
+    else
+        rotate(it->second, hour);
+
+    it->second.buckets[hour % QUOTA_BUCKETS] += count;
+    it->second.total += count;
+    m_Dirty = true;
+}
+
+/**
+  * Bytes sent to this user during the last 24 hours
+  */
+uint64
+Museek::UploadQuotas::used(const std::string & user)
+{
+    Windows::iterator it = m_Windows.find(user);
+    if (it == m_Windows.end())
+        return 0;
+
+    rotate(it->second, currentHour());
+    return it->second.total;
+}
+
+/**
+  * Quota of this user in bytes (0: no limit)
+  */
+uint64
+Museek::UploadQuotas::limit(const std::string & user)
+{
+    if (m_BuddyLimit > 0 && museekd()->isBuddied(user))
+        return m_BuddyLimit;
+
+    return m_Limit;
+}
+
+/**
+  * Has this user used up his quota?
+  */
+bool
+Museek::UploadQuotas::exceeded(const std::string & user)
+{
+    if (m_Limit == 0 && m_BuddyLimit == 0)
+        return false;
+
+    uint64 l = limit(user);
+    return (l > 0) && (used(user) >= l);
+}
+
+/**
+  * Forget the users which haven't downloaded anything lately, save the counters
+  * and see if some users are allowed to download again.
+  */
+void
+Museek::UploadQuotas::onTick(long)
+{
+    m_Timeout = museekd()->reactor()->addTimeout(QUOTA_TICK, this, &UploadQuotas::onTick);
+
+    uint32 hour = currentHour();
+    Windows::iterator it = m_Windows.begin();
+    while (it != m_Windows.end()) {
+        rotate(it->second, hour);
+        if (it->second.total == 0) {
+            m_Windows.erase(it++);
+            m_Dirty = true;
+        }
+        else
+            ++it;
+    }
+
+    save();
+
+    museekd()->uploads()->checkUploads();
+}
+
+/**
+  * Load the counters from their file
+  */
+void
+Museek::UploadQuotas::load()
+{
+    configure();
+
+    if (!m_Timeout.isValid())
+        m_Timeout = museekd()->reactor()->addTimeout(QUOTA_TICK, this, &UploadQuotas::onTick);
+
+    std::string path = databasePath();
+    if (path.empty())
+        return;
+
+    std::ifstream file(path.c_str(), std::fstream::in | std::fstream::binary);
+    if (file.fail() || !file.is_open()) {
+        NNLOG("museekd.config.warn", "Cannot load upload quotas (%s).", path.c_str());
+        return;
+    }
+
+    uint32 n;
+    if (read_int(&file, &n) == -1) {
+        NNLOG("museekd.up.warn", "Cannot load number of upload quotas.");
+        file.close();
+        return;
+    }
+
+    uint32 hour = currentHour();
+    while (n) {
+        std::string user;
+        Window window;
+        if (read_str(&file, user) == -1 || read_int(&file, &window.hour) == -1) {
+            NNLOG("museekd.config.warn", "Cannot load upload quotas. Bailing out");
+            break;
+        }
+
+        window.total = 0;
+        bool ok = true;
+        for (uint i = 0; ok && i < QUOTA_BUCKETS; i++) {
+            ok = (read_off(&file, &window.buckets[i]) != -1);
+            window.total += window.buckets[i];
+        }
+        if (!ok) {
+            NNLOG("museekd.config.warn", "Cannot load upload quotas. Bailing out");
+            break;
+        }
+
+        rotate(window, hour);
+        if (window.total > 0)
+            m_Windows[user] = window;
+
+        n--;
+    }
+    file.close();
+
+    NNLOG("museekd.up.debug", "Loaded upload quotas of %u users", m_Windows.size());
+    m_Dirty = false;
+}
+
+/**
+  * Save the counters in their file
+  */
+void
+Museek::UploadQuotas::save()
+{
+    if (!m_Dirty)
+        return;
+
+    std::string path = databasePath();
+    if (path.empty())
+        return;
+
+    std::string pathTemp(path + ".tmp");
+    std::remove(pathTemp.c_str());
+
+    std::ofstream file(pathTemp.c_str(), std::ofstream::binary);
+    if (file.fail() || !file.is_open()) {
+        NNLOG("museekd.config.warn", "Cannot save upload quotas (%s).", path.c_str());
+        return;
+    }
+
+    bool ok = (write_int(&file, m_Windows.size()) != -1);
+    Windows::const_iterator it;
+    for (it = m_Windows.begin(); ok && it != m_Windows.end(); ++it) {
+        ok = (write_str(&file, it->first) != -1) && (write_int(&file, it->second.hour) != -1);
+        for (uint i = 0; ok && i < QUOTA_BUCKETS; i++)
+            ok = (write_off(&file, it->second.buckets[i]) != -1);
+    }
+    file.close();
+
+    if (!ok) {
+        NNLOG("museekd.config.warn", "Cannot save upload quotas.");
+        return;
+    }
+
+#ifdef WIN32
+    // On Win32, rename doesn't overwrite an existing file automatically.
+    remove(path.c_str());
+#endif // WIN32
+    if (rename(pathTemp.c_str(), path.c_str()) == -1) {
+        NNLOG("museekd.config.warn", "Renaming upload quotas file failed.");
+        return;
+    }
+
+    m_Dirty = false;
+}
@@ -0,0 +1,95 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_UPLOADQUOTAS_H
+#define MUSEEK_UPLOADQUOTAS_H
+
+#include <NewNet/nnobject.h>
+#include <NewNet/nnweakrefptr.h>
+#include <NewNet/nnevent.h>
+#include "mutypes.h"
+#include <string>
+#include <tr1/unordered_map>
+
+/* Number of one hour buckets in the quota window. */
+#define QUOTA_BUCKETS 24
+
+namespace Museek
+{
+  class Museekd;
+
+  /* Counts the bytes uploaded to each user during the last 24 hours and
+     tells if a user has used up his quota (transfers/upload_quota, or
+     transfers/upload_quota_buddies for buddies, in MiB; 0 means no limit).
+     Each user has a fixed sliding window of hourly buckets and a running
+     total, so accounting and checks cost the same whatever the traffic.
+     The counters are kept in transfers/upload_quota_db (the configuration
+     file + ".quotas" if not set) across restarts. */
+  class UploadQuotas : public NewNet::Object
+  {
+  public:
+    UploadQuotas(Museekd * museekd);
+    ~UploadQuotas();
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
+
+    /* Read the limits from the configuration again. */
+    void configure();
+
+    /* We've sent some bytes to this user. */
+    void add(const std::string & user, uint count);
+    /* Bytes sent to this user during the last 24 hours. */
+    uint64 used(const std::string & user);
+    /* Quota of this user in bytes (0: no limit). */
+    uint64 limit(const std::string & user);
+    /* Has this user used up his quota? */
+    bool exceeded(const std::string & user);
+
+    /* Load and save the counters. */
+    void load();
+    void save();
+
+  private:
+    /* The last 24 hours of a user. */
+    struct Window
+    {
+      uint64 buckets[QUOTA_BUCKETS];
+      uint64 total;
+      uint32 hour; // Hour of the most recent bucket
+    };
+
+    typedef std::tr1::unordered_map<std::string, Window> Windows;
+
+    std::string databasePath();
+    static uint32 currentHour();
+    static void rotate(Window & window, uint32 hour);
+    void onTick(long);
+
+    NewNet::WeakRefPtr<Museekd>         m_Museekd;      // Ref to the museekd
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_Timeout; // Hourly cleanup
+    Windows                             m_Windows;      // Uploaded bytes of each user
+    uint64                              m_Limit;        // Quota of normal users (bytes)
+    uint64                              m_BuddyLimit;   // Quota of buddies (bytes)
+    bool                                m_Dirty;        // Have the counters changed since the last save?
+  };
+}
+
+#endif // MUSEEK_UPLOADQUOTAS_H
@@ -0,0 +1,389 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "uploadscheduler.h"
+#include "uploadmanager.h"
+#include "uploadquotas.h"
+#include "museekd.h"
+#include "configmanager.h"
+#include <NewNet/nnlog.h>
+
+Museek::UploadScheduler::UploadScheduler(Museekd * museekd) : m_Museekd(museekd)
+{
+    m_Seq = 0;
+    m_Queued = 0;
+}
+
+Museek::UploadScheduler::~UploadScheduler()
+{
+    NNLOG("museekd.up.debug", "Upload scheduler destroyed");
+}
+
+/**
+  * Create the scheduler corresponding to the given policy name
+  */
+Museek::UploadScheduler *
+Museek::UploadScheduler::create(Museekd * museekd, const std::string & policy)
+{
+    if (policy == "roundrobin")
+        return new RoundRobinUploadScheduler(museekd);
+    else if (policy == "weighted")
+        return new WeightedUploadScheduler(museekd);
+    else if (policy == "shortest")
+        return new ShortestFirstUploadScheduler(museekd);
+
+    if (!policy.empty() && policy != "fifo")
+        NNLOG("museekd.up.warn", "Unknown upload queue policy '%s', using fifo.", policy.c_str());
+
+    return new FifoUploadScheduler(museekd);
+}
+
+/**
+  * Is this user privileged (or a buddy and buddies are privileged)?
+  */
+bool
+Museek::UploadScheduler::isPrivileged(const std::string & user)
+{
+    return museekd()->hasPrivileges(user);
+}
+
+/**
+  * Queue, requeue or unqueue the upload depending on its state
+  */
+void
+Museek::UploadScheduler::update(Upload * upload)
+{
+    std::map<Upload *, Entry>::iterator it = m_Entries.find(upload);
+    if (it == m_Entries.end()) {
+        Entry entry;
+        entry.seq = ++m_Seq;
+        entry.key = 0;
+        entry.queued = false;
+        it = m_Entries.insert(std::pair<Upload *, Entry>(upload, entry)).first;
+    }
+
+    Entry & entry = it->second;
+    bool queued = (upload->state() == TS_QueuedLocally);
+
+    if (queued && entry.queued && (itemKey(upload, entry.seq) == entry.key))
+        return; // Nothing has changed
+    if (!queued && !entry.queued)
+        return;
+
+    if (entry.queued)
+        unqueue(upload, entry);
+    if (queued)
+        enqueue(upload, entry);
+}
+
+/**
+  * Forget everything about this upload
+  */
+void
+Museek::UploadScheduler::remove(Upload * upload)
+{
+    std::map<Upload *, Entry>::iterator it = m_Entries.find(upload);
+    if (it == m_Entries.end())
+        return;
+
+    if (it->second.queued)
+        unqueue(upload, it->second);
+
+    m_Entries.erase(it);
+}
+
+/**
+  * Rank every user again
+  */
+void
+Museek::UploadScheduler::refresh()
+{
+    m_Ranks.clear();
+
+    std::map<std::string, UserQueue>::iterator it;
+    for (it = m_Users.begin(); it != m_Users.end(); ++it)
+        rerank(it->first, it->second);
+}
+
+/**
+  * Rank this user again
+  */
+void
+Museek::UploadScheduler::refresh(const std::string & user)
+{
+    std::map<std::string, UserQueue>::iterator it = m_Users.find(user);
+    if (it == m_Users.end())
+        return;
+
+    unrank(it->first, it->second);
+    rerank(it->first, it->second);
+}
+
+/**
+  * Return the upload that should be started next
+  */
+Museek::Upload *
+Museek::UploadScheduler::next()
+{
+    std::set<Rank>::const_iterator it;
+    for (it = m_Ranks.begin(); it != m_Ranks.end(); ++it) {
+        if (museekd()->uploads()->isUploadingTo(it->user) || museekd()->isBanned(it->user) ||
+            museekd()->uploads()->quotas()->exceeded(it->user))
+            continue;
+
+        std::map<std::string, UserQueue>::const_iterator uit = m_Users.find(it->user);
+        if ((uit != m_Users.end()) && !uit->second.items.empty())
+            return uit->second.items.begin()->upload;
+    }
+
+    return 0;
+}
+
+/**
+  * The given upload is being started. Let the policy know.
+  */
+void
+Museek::UploadScheduler::started(Upload * upload)
+{
+    std::map<std::string, UserQueue>::iterator it = m_Users.find(upload->user());
+    if (it == m_Users.end())
+        return;
+
+    unrank(it->first, it->second);
+    served(it->first, it->second, upload);
+    rerank(it->first, it->second);
+}
+
+void
+Museek::UploadScheduler::enqueue(Upload * upload, Entry & entry)
+{
+    std::map<std::string, UserQueue>::iterator it = m_Users.find(upload->user());
+    if (it == m_Users.end()) {
+        UserQueue queue;
+        queue.primary = queue.secondary = queue.stamp = 0;
+        it = m_Users.insert(std::pair<std::string, UserQueue>(upload->user(), queue)).first;
+        activated(it->first, it->second);
+    }
+    else
+        unrank(it->first, it->second);
+
+    entry.key = itemKey(upload, entry.seq);
+    entry.queued = true;
+
+    Item item;
+    item.key = entry.key;
+    item.seq = entry.seq;
+    item.upload = upload;
+    it->second.items.insert(item);
+    m_Queued++;
+
+    rerank(it->first, it->second);
+}
+
+void
+Museek::UploadScheduler::unqueue(Upload * upload, Entry & entry)
+{
+    entry.queued = false;
+
+    std::map<std::string, UserQueue>::iterator it = m_Users.find(upload->user());
+    if (it == m_Users.end())
+        return;
+
+    unrank(it->first, it->second);
+
+    Item item;
+    item.key = entry.key;
+    item.seq = entry.seq;
+    item.upload = upload;
+    if (it->second.items.erase(item) > 0)
+        m_Queued--;
+
+    if (it->second.items.empty())
+        m_Users.erase(it);
+    else
+        rerank(it->first, it->second);
+}
+
+void
+Museek::UploadScheduler::unrank(const std::string & user, const UserQueue & queue)
+{
+    Rank r;
+    r.primary = queue.primary;
+    r.secondary = queue.secondary;
+    r.user = user;
+    m_Ranks.erase(r);
+}
+
+void
+Museek::UploadScheduler::rerank(const std::string & user, UserQueue & queue)
+{
+    if (queue.items.empty())
+        return;
+
+    rank(user, queue, queue.primary, queue.secondary);
+
+    Rank r;
+    r.primary = queue.primary;
+    r.secondary = queue.secondary;
+    r.user = user;
+    m_Ranks.insert(r);
+}
+
+
+/**
+  * Fifo: privileged users first, then the oldest upload
+  */
+void
+Museek::FifoUploadScheduler::rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary)
+{
+    primary = isPrivileged(user) ? 0 : 1;
+    secondary = queue.items.begin()->seq;
+}
+
+
+/**
+  * Round robin: privileged users first, then the user which has waited the longest
+  */
+void
+Museek::RoundRobinUploadScheduler::rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary)
+{
+    primary = isPrivileged(user) ? 0 : 1;
+    secondary = queue.stamp;
+}
+
+/**
+  * A new user joins the end of the round
+  */
+void
+Museek::RoundRobinUploadScheduler::activated(const std::string & user, UserQueue & queue)
+{
+    queue.stamp = ++m_Round;
+}
+
+/**
+  * This user has been served: go to the end of the round
+  */
+void
+Museek::RoundRobinUploadScheduler::served(const std::string & user, UserQueue & queue, Upload * upload)
+{
+    queue.stamp = ++m_Round;
+}
+
+
+Museek::WeightedUploadScheduler::WeightedUploadScheduler(Museekd * museekd) : UploadScheduler(museekd), m_VirtualTime(0)
+{
+    m_BuddyWeight.follow(museekd->config(), "transfers", "upload_weight_buddy", 2);
+    m_OtherWeight.follow(museekd->config(), "transfers", "upload_weight_other", 1);
+}
+
+/**
+  * Weight of the class of this user
+  */
+uint
+Museek::WeightedUploadScheduler::weight(const std::string & user)
+{
+    uint w;
+    if (museekd()->isBuddied(user))
+        w = m_BuddyWeight.value();
+    else
+        w = m_OtherWeight.value();
+
+    return w > 0 ? w : 1;
+}
+
+/**
+  * Weighted: privileged users first, then the user with the smallest virtual finish time
+  */
+void
+Museek::WeightedUploadScheduler::rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary)
+{
+    primary = isPrivileged(user) ? 0 : 1;
+    secondary = queue.stamp;
+}
+
+/**
+  * A user joins the queue: it can't start before the current virtual time,
+  * nor before what it has already been given.
+  */
+void
+Museek::WeightedUploadScheduler::activated(const std::string & user, UserQueue & queue)
+{
+    queue.stamp = m_VirtualTime;
+
+    std::map<std::string, uint64>::iterator it = m_Finish.find(user);
+    if (it != m_Finish.end() && it->second > queue.stamp)
+        queue.stamp = it->second;
+}
+
+/**
+  * Charge the user for the bytes it's going to receive
+  */
+void
+Museek::WeightedUploadScheduler::served(const std::string & user, UserQueue & queue, Upload * upload)
+{
+    uint64 remaining = (upload->size() > upload->position()) ? (upload->size() - upload->position()) : 0;
+
+    // Privileged users only share the slots with each other: they don't move the virtual time
+    if (isPrivileged(user)) {
+        queue.stamp += remaining / 1024 + 1;
+        return;
+    }
+
+    m_VirtualTime = queue.stamp;
+    queue.stamp += (remaining / 1024 + 1) / weight(user);
+
+    std::map<std::string, uint64>::iterator it = m_Finish.find(user);
+    if (it != m_Finish.end()) {
+        m_FinishOrder.erase(std::pair<uint64, std::string>(it->second, user));
+        it->second = queue.stamp;
+    }
+    else
+        m_Finish[user] = queue.stamp;
+    m_FinishOrder.insert(std::pair<uint64, std::string>(queue.stamp, user));
+
+    // Users behind the virtual time have no credit left: forget them.
+    while (! m_FinishOrder.empty() && m_FinishOrder.begin()->first <= m_VirtualTime) {
+        m_Finish.erase(m_FinishOrder.begin()->second);
+        m_FinishOrder.erase(m_FinishOrder.begin());
+    }
+}
+
+
+/**
+  * Shortest first: uploads are ordered by size
+  */
+uint64
+Museek::ShortestFirstUploadScheduler::itemKey(Upload * upload, uint64 seq) const
+{
+    return upload->size();
+}
+
+/**
+  * Shortest first: privileged users first, then the smallest file
+  */
+void
+Museek::ShortestFirstUploadScheduler::rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary)
+{
+    primary = isPrivileged(user) ? 0 : 1;
+    secondary = queue.items.begin()->key;
+}
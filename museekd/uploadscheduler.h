@@ -0,0 +1,214 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_UPLOADSCHEDULER_H
+#define MUSEEK_UPLOADSCHEDULER_H
+
+#include <NewNet/nnobject.h>
+#include <NewNet/nnweakrefptr.h>
+#include "mutypes.h"
+#include "configmanager.h"
+#include <set>
+
+namespace Museek
+{
+  class Museekd;
+  class Upload;
+
+  /* Base class of the upload queue policies.
+     The scheduler knows every upload in the TS_QueuedLocally state. Uploads are
+     grouped in one ordered queue per user and the users are ranked in a global
+     ordered set: finding the next upload to start and updating the queue are
+     both O(log n). Subclasses only decide how uploads and users are ordered. */
+  class UploadScheduler : public NewNet::Object
+  {
+  public:
+    UploadScheduler(Museekd * museekd);
+    virtual ~UploadScheduler();
+
+    /* Create the scheduler for the given policy name (fifo, roundrobin,
+       weighted or shortest). Unknown names fall back to fifo. */
+    static UploadScheduler * create(Museekd * museekd, const std::string & policy);
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
+
+    /* Name of the policy, as used in the configuration. */
+    virtual std::string name() const = 0;
+
+    /* Queue, requeue or unqueue the upload depending on its state. */
+    void update(Upload * upload);
+    /* Forget everything about this upload. */
+    void remove(Upload * upload);
+    /* Rank every user again (privileges or buddies have changed). */
+    void refresh();
+    /* Rank this user again. */
+    void refresh(const std::string & user);
+
+    /* Return the upload that should be started next, or 0. Users we're
+       already uploading to, banned users and users over quota are skipped. */
+    Upload * next();
+    /* The given upload (returned by next()) is being started. */
+    void started(Upload * upload);
+
+    /* Number of queued uploads. */
+    uint queued() const { return m_Queued; }
+
+  protected:
+    /* An upload in a user queue. */
+    struct Item
+    {
+      uint64 key;
+      uint64 seq;
+      Upload * upload;
+
+      bool operator<(const Item & other) const
+      {
+        if(key != other.key)
+          return key < other.key;
+        return seq < other.seq;
+      }
+    };
+
+    /* The queued uploads of one user and its current rank. */
+    struct UserQueue
+    {
+      std::set<Item> items;
+      uint64 primary, secondary;
+      uint64 stamp; // Free for the policy to use
+    };
+
+    /* Position of a user in the global queue. */
+    struct Rank
+    {
+      uint64 primary, secondary;
+      std::string user;
+
+      bool operator<(const Rank & other) const
+      {
+        if(primary != other.primary)
+          return primary < other.primary;
+        if(secondary != other.secondary)
+          return secondary < other.secondary;
+        return user < other.user;
+      }
+    };
+
+    /* Key ordering the uploads of a user. Lower is started first. Defaults
+       to the order in which the uploads were added. */
+    virtual uint64 itemKey(Upload * upload, uint64 seq) const { return seq; }
+    /* Compute the rank of a user from its queue. Lower is started first. */
+    virtual void rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary) = 0;
+    /* A user which had nothing queued now has something. */
+    virtual void activated(const std::string & user, UserQueue & queue) {}
+    /* An upload of this user is being started. */
+    virtual void served(const std::string & user, UserQueue & queue, Upload * upload) {}
+
+    /* Is this user privileged (or a buddy and buddies are privileged)? */
+    bool isPrivileged(const std::string & user);
+
+  private:
+    /* What we know about an upload. */
+    struct Entry
+    {
+      uint64 seq;
+      uint64 key;
+      bool queued;
+    };
+
+    void enqueue(Upload * upload, Entry & entry);
+    void unqueue(Upload * upload, Entry & entry);
+    void unrank(const std::string & user, const UserQueue & queue);
+    void rerank(const std::string & user, UserQueue & queue);
+
+    NewNet::WeakRefPtr<Museekd>             m_Museekd;  // Ref to the museekd
+    std::map<Upload *, Entry>               m_Entries;  // Every upload we've been told about
+    std::map<std::string, UserQueue>        m_Users;    // Queued uploads of each user
+    std::set<Rank>                          m_Ranks;    // Users with queued uploads, best first
+    uint64                                  m_Seq;      // Last sequence number given to an upload
+    uint                                    m_Queued;   // Number of queued uploads
+  };
+
+  /* First come, first served. Privileged users go first. This is the
+     historical museekd behaviour. */
+  class FifoUploadScheduler : public UploadScheduler
+  {
+  public:
+    FifoUploadScheduler(Museekd * museekd) : UploadScheduler(museekd) {}
+    std::string name() const { return "fifo"; }
+
+  protected:
+    void rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary);
+  };
+
+  /* Users take turns: the user which has waited the longest since it was
+     last served goes first. Privileged users go first. */
+  class RoundRobinUploadScheduler : public UploadScheduler
+  {
+  public:
+    RoundRobinUploadScheduler(Museekd * museekd) : UploadScheduler(museekd), m_Round(0) {}
+    std::string name() const { return "roundrobin"; }
+
+  protected:
+    void rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary);
+    void activated(const std::string & user, UserQueue & queue);
+    void served(const std::string & user, UserQueue & queue, Upload * upload);
+
+  private:
+    uint64 m_Round; // Incremented each time a user is served or joins the queue
+  };
+
+  /* Weighted fair queueing: privileged users go first, then each user gets
+     a share of the uploaded bytes proportional to the weight of its class
+     (buddy, other). */
+  class WeightedUploadScheduler : public UploadScheduler
+  {
+  public:
+    WeightedUploadScheduler(Museekd * museekd);
+    std::string name() const { return "weighted"; }
+
+  protected:
+    void rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary);
+    void activated(const std::string & user, UserQueue & queue);
+    void served(const std::string & user, UserQueue & queue, Upload * upload);
+
+  private:
+    uint weight(const std::string & user);
+
+    ConfigManager::Setting<uint>    m_BuddyWeight, m_OtherWeight; // Weight of each class of users
+    uint64                          m_VirtualTime;  // Virtual time of the last served user
+    std::map<std::string, uint64>   m_Finish;       // Virtual finish time of the users served lately
+    std::set<std::pair<uint64, std::string> > m_FinishOrder; // The same, by finish time
+  };
+
+  /* The smallest queued file goes first. Privileged users go first. */
+  class ShortestFirstUploadScheduler : public UploadScheduler
+  {
+  public:
+    ShortestFirstUploadScheduler(Museekd * museekd) : UploadScheduler(museekd) {}
+    std::string name() const { return "shortest"; }
+
+  protected:
+    uint64 itemKey(Upload * upload, uint64 seq) const;
+    void rank(const std::string & user, const UserQueue & queue, uint64 & primary, uint64 & secondary);
+  };
+}
+
+#endif // MUSEEK_UPLOADSCHEDULER_H
@@ -0,0 +1,181 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifdef HAVE_CONFIG_H
+# include "config.h"
+#endif // HAVE_CONFIG_H
+#include "uploadslotcontroller.h"
+#include "uploadmanager.h"
+#include "uploadscheduler.h"
+#include "museekd.h"
+#include "configmanager.h"
+#include <NewNet/nnreactor.h>
+#include <NewNet/nnratelimiter.h>
+
+/* Time between two evaluations (ms). Uploads need a few seconds to reach their speed. */
+#define SLOT_TICK 15000
+/* An opened slot is kept if the aggregate rate rose by more than 1/SLOT_GAIN. */
+#define SLOT_GAIN 20
+/* Ticks to wait after an unsuccessful probe. */
+#define SLOT_COOLDOWN 8
+
+Museek::UploadSlotController::UploadSlotController(Museekd * museekd) : m_Museekd(museekd)
+{
+    m_Enabled = false;
+    m_Slots = 0;
+    m_Min = 1;
+    m_Max = 1;
+    m_LastRate = 0;
+    m_Probing = false;
+    m_Cooldown = 0;
+}
+
+Museek::UploadSlotController::~UploadSlotController()
+{
+    if (m_Timeout.isValid() && m_Museekd.isValid())
+        museekd()->reactor()->removeTimeout(m_Timeout);
+}
+
+/**
+  * Start or stop managing the number of upload slots
+  */
+void
+Museek::UploadSlotController::setEnabled(bool enabled)
+{
+    if (enabled == m_Enabled)
+        return;
+
+    m_Enabled = enabled;
+
+    if (m_Timeout.isValid())
+        museekd()->reactor()->removeTimeout(m_Timeout);
+
+    if (m_Enabled) {
+        m_LastRate = 0;
+        m_Probing = false;
+        m_Cooldown = 0;
+        m_Slots = museekd()->config()->getUint("transfers", "upload_slots", 0);
+        configure();
+        m_Timeout = museekd()->reactor()->addTimeout(SLOT_TICK, this, &UploadSlotController::onTick);
+        NNLOG("museekd.up.debug", "Adaptive upload slots enabled, starting with %u slots.", m_Slots);
+    }
+    else
+        NNLOG("museekd.up.debug", "Adaptive upload slots disabled.");
+}
+
+/**
+  * Read the slot bounds from the configuration
+  */
+void
+Museek::UploadSlotController::configure()
+{
+    m_Min = museekd()->config()->getUint("transfers", "upload_slots_min", 1);
+    m_Max = museekd()->config()->getUint("transfers", "upload_slots_max", 20);
+    if (m_Min < 1)
+        m_Min = 1;
+    if (m_Max < m_Min)
+        m_Max = m_Min;
+
+    setSlots(m_Slots);
+}
+
+/**
+  * Change the number of slots, within the bounds
+  */
+void
+Museek::UploadSlotController::setSlots(uint slots)
+{
+    if (slots < m_Min)
+        slots = m_Min;
+    if (slots > m_Max)
+        slots = m_Max;
+
+    if (slots == m_Slots)
+        return;
+
+    NNLOG("museekd.up.debug", "Using %u upload slots (was %u).", slots, m_Slots);
+
+    bool more = slots > m_Slots;
+    m_Slots = slots;
+    if (more)
+        museekd()->uploads()->checkUploads();
+}
+
+/**
+  * Measure the upload rate and open or close a slot if needed
+  */
+void
+Museek::UploadSlotController::onTick(long)
+{
+    m_Timeout = museekd()->reactor()->addTimeout(SLOT_TICK, this, &UploadSlotController::onTick);
+
+    UploadManager * uploads = museekd()->uploads();
+    uint rate = uploads->limiter()->rate();
+
+    // Look at the uploads that are really sending something
+    uint active = 0, slowest = 0;
+    std::map<std::string, NewNet::WeakRefPtr<Upload> >::const_iterator it;
+    for (it = uploads->uploading().begin(); it != uploads->uploading().end(); ++it) {
+        if (!it->second.isValid() || it->second->state() != TS_Transferring)
+            continue;
+        if (active == 0 || it->second->rate() < slowest)
+            slowest = it->second->rate();
+        active++;
+    }
+
+    if (m_Cooldown > 0)
+        m_Cooldown--;
+
+    // We can only learn something when every slot is used and someone is waiting
+    bool saturated = (uploads->scheduler()->queued() > 0) && (uploads->uploading().size() >= m_Slots);
+
+    if (m_Probing) {
+        m_Probing = false;
+        if (saturated && rate > m_LastRate + m_LastRate / SLOT_GAIN) {
+            // The new slot was worth it, try another one
+            NNLOG("museekd.up.debug", "Upload rate rose from %u to %u B/s, keeping the new slot.", m_LastRate, rate);
+            if (m_Slots < m_Max) {
+                setSlots(m_Slots + 1);
+                m_Probing = true;
+            }
+        }
+        else {
+            NNLOG("museekd.up.debug", "Upload rate didn't rise (%u to %u B/s), closing the new slot.", m_LastRate, rate);
+            setSlots(m_Slots - 1);
+            m_Cooldown = SLOT_COOLDOWN;
+        }
+    }
+    else if (saturated && m_Cooldown == 0) {
+        ssize_t limit = uploads->limiter()->limit();
+        uint minRate = museekd()->config()->getUint("transfers", "upload_slot_min_rate", 4) * 1024;
+
+        if (limit > 0 && rate >= (uint)limit * 9 / 10) {
+            // The limit is reached: more slots would only split the bandwidth
+            if (active > 0 && slowest < minRate)
+                setSlots(m_Slots - 1);
+        }
+        else if (m_Slots < m_Max) {
+            setSlots(m_Slots + 1);
+            m_Probing = true;
+        }
+    }
+
+    m_LastRate = rate;
+}
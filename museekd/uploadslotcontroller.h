@@ -0,0 +1,72 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright (C) 2006-2007 Ingmar K. Steen (iksteen@gmail.com)
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+#ifndef MUSEEK_UPLOADSLOTCONTROLLER_H
+#define MUSEEK_UPLOADSLOTCONTROLLER_H
+
+#include <NewNet/nnobject.h>
+#include <NewNet/nnweakrefptr.h>
+#include <NewNet/nnevent.h>
+#include "mutypes.h"
+
+namespace Museek
+{
+  class Museekd;
+
+  /* Adapts the number of upload slots to the measured bandwidth.
+     While every slot is busy and uploads are waiting, a slot is opened from
+     time to time. If the aggregate upload rate rose, the slot is kept and
+     another one is tried. Otherwise it is closed again. The number of slots
+     stays between transfers/upload_slots_min and transfers/upload_slots_max. */
+  class UploadSlotController : public NewNet::Object
+  {
+  public:
+    UploadSlotController(Museekd * museekd);
+    ~UploadSlotController();
+
+    /* Return pointer to museekd instance. */
+    Museekd * museekd() const { return m_Museekd; }
+
+    /* Is the number of slots managed by the controller? */
+    bool enabled() const { return m_Enabled; }
+    /* Start or stop managing the number of slots. */
+    void setEnabled(bool enabled);
+    /* Read the slot bounds from the configuration again. */
+    void configure();
+
+    /* Current number of upload slots. */
+    uint slots() const { return m_Slots; }
+
+  private:
+    void onTick(long);
+    void setSlots(uint slots);
+
+    NewNet::WeakRefPtr<Museekd>         m_Museekd;      // Ref to the museekd
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_Timeout; // Periodic evaluation
+    bool                                m_Enabled;      // Are we managing slots?
+    uint                                m_Slots;        // Current number of slots
+    uint                                m_Min, m_Max;   // Bounds of m_Slots
+    uint                                m_LastRate;     // Aggregate upload rate at the previous tick (bytes/s)
+    bool                                m_Probing;      // Did we open a slot at the previous tick?
+    uint                                m_Cooldown;     // Ticks to wait before probing again
+  };
+}
+
+#endif // MUSEEK_UPLOADSLOTCONTROLLER_H
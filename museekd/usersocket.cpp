@@ -30,13 +30,13 @@
 #include "peermanager.h"
 #include <NewNet/nnreactor.h>
 
-Museek::UserSocket::UserSocket(Museek::Museekd * museekd, const std::string & type) : NewNet::TcpClientSocket(), m_Museekd(museekd), m_Type(type)
+Museek::UserSocket::UserSocket(Museek::Museekd * museekd, const std::string & type) : NewNet::TcpClientSocket(), m_Museekd(museekd), m_Direct(PathIdle), m_Passive(PathIdle), m_Type(type)
 {
   disconnectedEvent.connect(this, &UserSocket::onDisconnected);
   m_Museekd->server()->cannotConnectNotifyReceivedEvent.connect(this, &UserSocket::onCannotConnectNotify);
 }
 
-Museek::UserSocket::UserSocket(Museek::HandshakeSocket * that, const std::string & type) : NewNet::TcpClientSocket(), m_Museekd(that->museekd()), m_Type(type)
+Museek::UserSocket::UserSocket(Museek::HandshakeSocket * that, const std::string & type) : NewNet::TcpClientSocket(), m_Museekd(that->museekd()), m_Direct(PathIdle), m_Passive(PathIdle), m_Type(type)
 {
   disconnectedEvent.connect(this, &UserSocket::onDisconnected);
   m_Museekd->server()->cannotConnectNotifyReceivedEvent.connect(this, &UserSocket::onCannotConnectNotify);
@@ -53,6 +53,11 @@ Museek::UserSocket::~UserSocket()
 {
     if(m_PassiveConnectTimeout.isValid())
       m_Museekd->reactor()->removeTimeout(m_PassiveConnectTimeout);
+    if(m_RaceTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+    if(m_AddressTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_AddressTimeout);
+    dropProbe();
 }
 
 void
@@ -61,6 +66,12 @@ Museek::UserSocket::onDisconnected(NewNet::ClientSocket *)
   // Just in case this socket is still registered
   m_Museekd->peers()->removePassiveConnectionWaiting(m_Token);
 
+  if(m_RaceTimeout.isValid())
+    m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+  if(m_AddressTimeout.isValid())
+    m_Museekd->reactor()->removeTimeout(m_AddressTimeout);
+  dropProbe();
+
   if(reactor())
     reactor()->remove(this);
 }
@@ -71,10 +82,17 @@ Museek::UserSocket::initiate(const std::string & user)
   m_User = user;
   m_Token = m_Museekd->token();
 
-  if(m_Museekd->config()->get("clients", "connectmode", "active") == "passive")
+  // Start the way that worked last time, or the one we've been told to prefer
+  Route route = m_Museekd->peers()->reachability(m_User);
+  if(route == RouteUnknown)
+    route = (m_Museekd->config()->get("clients", "connectmode", "active") == "passive") ? RoutePassive : RouteDirect;
+
+  if(route == RoutePassive)
     initiatePassive();
   else
     initiateActive();
+
+  m_RaceTimeout = m_Museekd->reactor()->addTimeout(USER_RACE_DELAY, this, &UserSocket::onRaceTimeout);
 }
 
 void
@@ -82,19 +100,34 @@ Museek::UserSocket::initiateActive()
 {
   NNLOG("museekd.user.debug", "Initiating active user connection to %s (type %s).", m_User.c_str(), m_Type.c_str());
 
-  HInitiate handshake(m_Museekd->server()->username(), m_Type, m_Token);
-  sendMessage(handshake.make_network_packet());
-
+  // The handshake is sent when the direct connection is made (see onProbeConnected)
+  m_Direct = PathTrying;
   m_Museekd->server()->peerAddressReceivedEvent.connect(this, &UserSocket::onServerPeerAddressReceived);
+  m_AddressTimeout = m_Museekd->reactor()->addTimeout(USER_ADDRESS_TIMEOUT, this, &UserSocket::onAddressTimeout);
   SGetPeerAddress msg(m_User);
   m_Museekd->server()->sendMessage(msg.make_network_packet());
 }
 
+/**
+  * The server never told us the address of the user: the direct connection can't be made.
+  */
+void
+Museek::UserSocket::onAddressTimeout(long)
+{
+  m_AddressTimeout = 0;
+  if((socketState() != SocketUninitialized) || (m_Direct != PathTrying) || m_Probe)
+    return;
+
+  NNLOG("museekd.user.debug", "No address received for %s.", m_User.c_str());
+  directFailed();
+}
+
 void
 Museek::UserSocket::initiatePassive()
 {
   NNLOG("museekd.user.debug", "Initiating passive user connection to %s (type %s).", m_User.c_str(), m_Type.c_str());
 
+  m_Passive = PathTrying;
   m_PassiveConnectTimeout = m_Museekd->reactor()->addTimeout(60000, this, &UserSocket::onFirewallPierceTimedOut);
   m_Museekd->peers()->waitingPassiveConnection(this);
 
@@ -108,6 +141,14 @@ Museek::UserSocket::firewallPierced(Museek::HandshakeSocket * socket)
     NNLOG("museekd.user.debug", "%s's firewall successfully pierced.", m_User.c_str());
     if(m_PassiveConnectTimeout.isValid())
       m_Museekd->reactor()->removeTimeout(m_PassiveConnectTimeout);
+    if(m_RaceTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+    if(m_AddressTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_AddressTimeout);
+
+    // We won't need the direct connection
+    dropProbe();
+    m_Museekd->peers()->setReachability(m_User, RoutePassive);
 
     setSocketState(SocketConnected);
     setDescriptor(socket->descriptor());
@@ -125,17 +166,26 @@ Museek::UserSocket::onFirewallPierceTimedOut(long)
 
   if(socketState() == SocketUninitialized)
   {
-    NNLOG("museekd.user.debug", "Passive connection failed: pierce firewall timed out. Trying an active connection.");
-    initiateActive();
+    NNLOG("museekd.user.debug", "Passive connection failed: pierce firewall timed out.");
+    passiveFailed();
   }
 }
 
 void
 Museek::UserSocket::onCannotConnectNotify(const SCannotConnect * msg)
 {
+    if (msg->token != token())
+        return;
+
     m_Museekd->peers()->removePassiveConnectionWaiting(m_Token);
+    if(m_PassiveConnectTimeout.isValid())
+        m_Museekd->reactor()->removeTimeout(m_PassiveConnectTimeout);
 
-    if (msg->token == token()) {
+    if (socketState() == SocketUninitialized) {
+        NNLOG("museekd.user.debug", "Passive connection failed: the peer cannot connect to us.");
+        passiveFailed();
+    }
+    else {
         NNLOG("museekd.user.debug", "Cannot connect to the peer.");
         disconnect();
     }
@@ -144,15 +194,143 @@ Museek::UserSocket::onCannotConnectNotify(const SCannotConnect * msg)
 void
 Museek::UserSocket::onServerPeerAddressReceived(const SGetPeerAddress * message)
 {
-  if((message->user != m_User) || (socketState() != SocketUninitialized))
+  if((message->user != m_User) || (socketState() != SocketUninitialized) || (m_Direct != PathTrying) || m_Probe)
     return;
+  if(m_AddressTimeout.isValid())
+    m_Museekd->reactor()->removeTimeout(m_AddressTimeout);
   NNLOG("museekd.user.debug", "Received address of user %s: %s:%u", m_User.c_str(), message->ip.c_str(), message->port);
   if((message->ip == "0.0.0.0") || (message->port == 0))
   {
-    cannotConnectEvent(this);
+    directFailed();
+    return;
+  }
+
+  // Connect a separate socket: this one stays free for the passive connection until one of them wins
+  m_Probe = new NewNet::TcpClientSocket();
+  m_Probe->connectedEvent.connect(this, &UserSocket::onProbeConnected);
+  m_Probe->cannotConnectEvent.connect(this, &UserSocket::onProbeCannotConnect);
+  m_Museekd->reactor()->add(m_Probe);
+  m_Probe->connect(message->ip, message->port);
+}
+
+/**
+  * The direct connection has been made first: take its descriptor and give up on the passive one.
+  */
+void
+Museek::UserSocket::onProbeConnected(NewNet::ClientSocket *)
+{
+  NNLOG("museekd.user.debug", "Connected directly to %s.", m_User.c_str());
+
+  NewNet::RefPtr<NewNet::TcpClientSocket> probe = m_Probe;
+  m_Probe = 0;
+  int fd = probe->descriptor();
+  // Stop watching the descriptor before we start watching it
+  if(probe->reactor())
+    probe->reactor()->remove(probe);
+  probe->setDescriptor(-1);
+  probe->setReadyState(0);
+  probe->setSocketState(SocketDisconnected);
+
+  m_Museekd->peers()->removePassiveConnectionWaiting(m_Token);
+  if(m_PassiveConnectTimeout.isValid())
+    m_Museekd->reactor()->removeTimeout(m_PassiveConnectTimeout);
+  if(m_RaceTimeout.isValid())
+    m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+  m_Museekd->peers()->setReachability(m_User, RouteDirect);
+
+  // The handshake goes before what has been queued meanwhile
+  NewNet::Buffer queued(sendBuffer());
+  sendBuffer().clear();
+  HInitiate handshake(m_Museekd->server()->username(), m_Type, m_Token);
+  sendMessage(handshake.make_network_packet());
+  sendBuffer().append(queued.data(), queued.count());
+
+  setDescriptor(fd);
+  setSocketState(SocketConnected);
+  connectedEvent(this);
+}
+
+void
+Museek::UserSocket::onProbeCannotConnect(NewNet::ClientSocket *)
+{
+  NNLOG("museekd.user.debug", "Active connection to %s failed.", m_User.c_str());
+  directFailed();
+}
+
+/**
+  * Give up on the direct connection being made, if any.
+  */
+void
+Museek::UserSocket::dropProbe()
+{
+  if(! m_Probe)
     return;
+
+  NewNet::RefPtr<NewNet::TcpClientSocket> probe = m_Probe;
+  m_Probe = 0;
+  if(probe->socketState() != SocketDisconnected)
+    probe->disconnect(false);
+  if(probe->reactor())
+    probe->reactor()->remove(probe);
+}
+
+/**
+  * Start the other way of connecting now if it's still waiting for its turn.
+  */
+void
+Museek::UserSocket::onRaceTimeout(long)
+{
+  if(socketState() != SocketUninitialized)
+    return;
+
+  if(m_Passive == PathIdle) {
+    NNLOG("museekd.user.debug", "No direct connection to %s yet. Trying a passive one too.", m_User.c_str());
+    initiatePassive();
+  }
+  else if(m_Direct == PathIdle) {
+    NNLOG("museekd.user.debug", "No passive connection from %s yet. Trying an active one too.", m_User.c_str());
+    initiateActive();
+  }
+}
+
+void
+Museek::UserSocket::directFailed()
+{
+  dropProbe();
+  m_Direct = PathFailed;
+
+  if(m_Passive == PathIdle) {
+    if(m_RaceTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+    initiatePassive();
   }
-  connect(message->ip, message->port);
+  else if(m_Passive == PathFailed)
+    fail();
+}
+
+void
+Museek::UserSocket::passiveFailed()
+{
+  m_Passive = PathFailed;
+
+  if(m_Direct == PathIdle) {
+    if(m_RaceTimeout.isValid())
+      m_Museekd->reactor()->removeTimeout(m_RaceTimeout);
+    initiateActive();
+  }
+  else if(m_Direct == PathFailed)
+    fail();
+}
+
+/**
+  * Neither way worked.
+  */
+void
+Museek::UserSocket::fail()
+{
+  NNLOG("museekd.user.debug", "Cannot connect to %s in any way.", m_User.c_str());
+  m_Museekd->peers()->setReachability(m_User, RouteUnknown);
+  cannotConnectEvent(this);
 }
 
 /**
@@ -25,13 +25,31 @@
 #include "servermessages.h"
 #include "handshakesocket.h"
 
+/* Time (ms) given to the first way of connecting before the other one is tried too. */
+#define USER_RACE_DELAY 2000
+/* Time (ms) given to the server to tell us the address of the user. */
+#define USER_ADDRESS_TIMEOUT 30000
+
 namespace Museek
 {
   class Museekd;
 
+  /* Connects to a user both ways at once: directly to the address given
+     by the server, and by asking the peer (through the server) to connect
+     back to us. The way that worked last time for this user is tried first,
+     the other one after USER_RACE_DELAY or as soon as the first one fails.
+     The socket takes the first connection made and gives up on the other. */
   class UserSocket : public NewNet::TcpClientSocket
   {
   public:
+    /* How we could reach a user. */
+    typedef enum
+    {
+      RouteUnknown,
+      RouteDirect,      // We connected to him
+      RoutePassive      // He connected back to us
+    } Route;
+
     UserSocket(Museekd * museekd, const std::string & type);
     UserSocket(HandshakeSocket * that, const std::string & type);
     ~UserSocket();
@@ -64,8 +82,29 @@ namespace Museek
     void onCannotConnectNotify(const SCannotConnect * msg);
 
   private:
+    /* State of each way of connecting. */
+    typedef enum
+    {
+      PathIdle,
+      PathTrying,
+      PathFailed
+    } PathState;
+
+    void directFailed();
+    void passiveFailed();
+    void fail();
+    void dropProbe();
+    void onProbeConnected(NewNet::ClientSocket *);
+    void onProbeCannotConnect(NewNet::ClientSocket *);
+    void onRaceTimeout(long);
+    void onAddressTimeout(long);
+
     NewNet::WeakRefPtr<Museekd> m_Museekd;
     NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_PassiveConnectTimeout;
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_RaceTimeout;
+    NewNet::WeakRefPtr<NewNet::Event<long>::Callback> m_AddressTimeout;
+    NewNet::RefPtr<NewNet::TcpClientSocket> m_Probe;  // Direct connection being made
+    PathState m_Direct, m_Passive;
 
     std::string m_Type, m_User;
     uint m_Token;
@@ -95,8 +95,8 @@ std::string getConfigPath(const std::string & appName)
 
 #endif // WIN32
 
-static inline int write_int(std::ofstream * ofs, uint32 i) {
-	if(ofs->fail() || !ofs->is_open())
+static inline int write_int(std::ostream * ofs, uint32 i) {
+	if(ofs->fail())
 		return -1;
 
 	unsigned char d[4];
@@ -105,13 +105,13 @@ static inline int write_int(std::ofstream * ofs, uint32 i) {
 		i = i >> 8;
 	}
 	ofs->write((char *) d, 4);
-	if(ofs->fail() || !ofs->is_open())
+	if(ofs->fail())
 		return -1;
     return 4;
 }
 
-static inline int write_off(std::ofstream * ofs, uint64 i) {
-	if(ofs->fail() || !ofs->is_open())
+static inline int write_off(std::ostream * ofs, uint64 i) {
+	if(ofs->fail())
 		return -1;
 
 	unsigned char d[8];
@@ -120,18 +120,18 @@ static inline int write_off(std::ofstream * ofs, uint64 i) {
 		i = i >> 8;
 	}
 	ofs->write((char *) d, 8);
-	if(ofs->fail() || !ofs->is_open())
+	if(ofs->fail())
 		return -1;
     return 8;
 }
 
-static inline int write_str(std::ofstream * ofs, const std::string& str) {
+static inline int write_str(std::ostream * ofs, const std::string& str) {
 	if(!write_int(ofs, str.size()))
 		return -1;
 
 	const char* d = str.data();
 	ofs->write(d, str.size());
-	if(ofs->fail() || !ofs->is_open())
+	if(ofs->fail())
 		return -1;
     return str.size();
 }
@@ -171,6 +171,11 @@ void TransferListItem::update(const NTransfer& transfer, bool force) {
 			setBackground(2, QBrush(QColor(233,232,135)));
 			setForeground(2, QBrush(QColor(15,15,15)));
 			break;
+		case 17:
+			setText(2, TransferListView::tr("Finalizing"));
+			setBackground(2, QBrush(QColor(54,232,96)));
+			setForeground(2, QBrush(QColor(15,15,15)));
+			break;
         default:
 			setText(2, QString::null);
 			break;
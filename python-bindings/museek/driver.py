@@ -65,6 +65,9 @@ class Driver:
 		self.mask = None
 		self.cipher = None
 		self.sync_id = 0
+		# State we have, given at login with EM_SYNC (see cb_state_sync)
+		self.state_epoch = 0
+		self.state_seq = 0
 		self.callback = callback
 	# Connect to museekd, host in the form of "/tmp/museekd.user" for unix sockets
 	# or "somehostname:port" for TCP sockets. Mask is an event mask (see messages.py)
@@ -165,7 +168,7 @@ class Driver:
 			self.cb_ping()
 		elif message.__class__ is messages.Challenge:
 			chresp = sha256Block(message.challenge + self.password).hexdigest()
-			self.send(messages.Login("SHA256", chresp, self.mask))
+			self.send(messages.Login("SHA256", chresp, self.mask, self.state_epoch, self.state_seq))
 		elif message.__class__ is messages.Login:
 			self.logged_in = message.result
 			if not self.logged_in:
@@ -173,6 +176,8 @@ class Driver:
 			else:
 				self.cb_login_ok()
 				self.cipher = Cipher(self.password)
+		elif message.__class__ is messages.StateSync:
+			self.cb_state_sync(message.epoch, message.seq, message.whole)
 		elif message.__class__ is messages.ServerState:
 			self.cb_server_state(message.state, message.username)
 		elif message.__class__ is messages.CheckPrivileges:
@@ -265,6 +270,10 @@ class Driver:
 			self.cb_transfer_remove(message.transfer)
 		elif message.__class__ is messages.TransferAbort:
 			self.cb_transfer_abort(message.transfer)
+		elif message.__class__ is messages.TransferUpdateRate:
+			self.cb_transfer_update_rate(message.interval)
+		elif message.__class__ is messages.TransferDelta:
+			self.cb_transfer_delta(message.entries)
 		elif message.__class__ is messages.GetRecommendations:
 			self.cb_get_recommendations(message.recommendations)
 		elif message.__class__ is messages.GetGlobalRecommendations:
@@ -326,6 +335,10 @@ class Driver:
 #		print 'logged in'
 	
 	# Server state
+	# The login state has been sent (interfaces logged in with EM_SYNC)
+	def cb_state_sync(self, epoch, seq, whole):
+		pass
+
 	def cb_server_state(self, state, username):
 		pass
 	
@@ -543,3 +556,11 @@ class Driver:
 
 	def cb_transfer_abort(self, transfer):
 		pass
+
+	# Interval between transfer deltas (0: a transfer update for each change)
+	def cb_transfer_update_rate(self, interval):
+		pass
+
+	# Transfers changed: list of (id, dict of the changed fields)
+	def cb_transfer_delta(self, entries):
+		pass
@@ -27,6 +27,7 @@ EM_USERSHARES	= 1 << 4
 EM_INTERESTS	= 1 << 5
 EM_CONFIG	= 1 << 6
 EM_DEBUG	= 1 << 7
+EM_SYNC		= 1 << 8
 
 # Transfer state
 TS_Finished	= 0
@@ -46,6 +47,7 @@ TS_Aborted	= 13
 TS_RemoteError	= 14
 TS_LocalError	= 15
 TS_QueuedLocally	= 16
+TS_Finalizing	= 17
 
 class BaseMessage:
 	cipher = None
@@ -149,19 +151,24 @@ class Challenge(BaseMessage):
 class Login(BaseMessage):
 	code = 0x0002
 	
-	def __init__(self, algorithm = None, chresponse = None, mask = None):
+	def __init__(self, algorithm = None, chresponse = None, mask = None, epoch = 0, seq = 0):
 		self.algorithm = algorithm
 		self.chresponse = chresponse
 		self.mask = mask
+		self.epoch = epoch
+		self.seq = seq
 		self.result = None
 		self.msg = None
 		self.challenge = None
 	
 	def make(self):
-		return self.pack_uint(self.code) + \
+		data = self.pack_uint(self.code) + \
 			self.pack_string(self.algorithm) + \
 			self.pack_string(self.chresponse) + \
 			self.pack_uint(self.mask)
+		if self.mask & EM_SYNC:
+			data += self.pack_uint(self.epoch) + self.pack_uint(self.seq)
+		return data
 	
 	def parse(self, data):
 		self.result, data = ord(data[0]), data[1:]
@@ -169,6 +176,20 @@ class Login(BaseMessage):
 		self.challenge, data = self.unpack_string(data)
 		return self
 
+class StateSync(BaseMessage):
+	code = 0x0006
+
+	def __init__(self):
+		self.epoch = None
+		self.seq = None
+		self.whole = None
+
+	def parse(self, data):
+		self.epoch, data = self.unpack_uint(data)
+		self.seq, data = self.unpack_uint(data)
+		self.whole, data = ord(data[0]), data[1:]
+		return self
+
 class ServerState(BaseMessage):
 	code = 0x0003
 	
@@ -1259,6 +1280,61 @@ class UploadFolder(BaseMessage):
 			self.pack_string(self.user) + \
 			self.pack_string(self.path)
 
+
+class TransferUpdateRate(BaseMessage):
+	code = 0x050A
+
+	def __init__(self, interval = None):
+		self.interval = interval
+
+	def make(self):
+		return self.pack_uint(self.code) + \
+			self.pack_uint(self.interval)
+
+	def parse(self, data):
+		self.interval, data = self.unpack_uint(data)
+		return self
+
+# Fields of a TransferDelta entry
+TD_NEW = 1
+TD_PLACE = 2
+TD_STATE = 4
+TD_ERROR = 8
+TD_POSITION = 16
+TD_SIZE = 32
+TD_RATE = 64
+
+class TransferDelta(BaseMessage):
+	code = 0x050B
+
+	def __init__(self):
+		self.entries = None
+
+	def parse(self, data):
+		self.entries = []
+		n, data = self.unpack_uint(data)
+		for i in range(n):
+			id, data = self.unpack_uint(data)
+			fields, data = self.unpack_uint(data)
+			values = {}
+			if fields & TD_NEW:
+				values['is_upload'], data = ord(data[0]), data[1:]
+				values['user'], data = self.unpack_string(data)
+				values['path'], data = self.unpack_string(data)
+			if fields & TD_PLACE:
+				values['place'], data = self.unpack_uint(data)
+			if fields & TD_STATE:
+				values['state'], data = self.unpack_uint(data)
+			if fields & TD_ERROR:
+				values['error'], data = self.unpack_string(data)
+			if fields & TD_POSITION:
+				values['filepos'], data = self.unpack_off(data)
+			if fields & TD_SIZE:
+				values['filesize'], data = self.unpack_off(data)
+			if fields & TD_RATE:
+				values['rate'], data = self.unpack_uint(data)
+			self.entries.append((id, values))
+		return self
 	
 class GetRecommendations(BaseMessage):
 	code = 0x0600
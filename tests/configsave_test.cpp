@@ -0,0 +1,187 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Saving the configuration: in the background by the disk I/O workers
+   (written to config.xml.new, synced, then put in place), and at once by
+   flush(), including while a background save is still being written. */
+
+#include "museekd/museekd.h"
+#include "museekd/configmanager.h"
+#include <NewNet/nnreactor.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+static int failures = 0;
+
+static void expect(bool ok, const char * what)
+{
+    if(! ok)
+    {
+        printf("FAIL %s\n", what);
+        ++failures;
+    }
+}
+
+static std::string readFile(const std::string & path)
+{
+    std::ifstream file(path.c_str());
+    std::ostringstream data;
+    data << file.rdbuf();
+    return data.str();
+}
+
+static bool exists(const std::string & path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0;
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Runs the reactor until the configuration file holds a value, or gives up. */
+class Waiter : public NewNet::Object
+{
+public:
+    Waiter(Museek::Museekd * museekd, const std::string & path)
+      : m_Museekd(museekd), m_Path(path), m_Found(false)
+    {
+    }
+
+    bool waitFor(const std::string & text, long timeout)
+    {
+        m_Text = text;
+        m_Found = false;
+        m_Deadline = now() + timeout / 1000.0;
+        m_Museekd->reactor()->addTimeout(10, this, &Waiter::onPoll);
+        m_Museekd->reactor()->run();
+        return m_Found;
+    }
+
+    /* Just let the reactor (and whatever it has to do) run for a while. */
+    void runFor(long msec)
+    {
+        m_Museekd->reactor()->addTimeout(msec, this, &Waiter::onStop);
+        m_Museekd->reactor()->run();
+    }
+
+private:
+    void onPoll(long)
+    {
+        m_Found = readFile(m_Path).find(m_Text) != std::string::npos;
+        if(m_Found || now() > m_Deadline)
+            m_Museekd->reactor()->stop();
+        else
+            m_Museekd->reactor()->addTimeout(10, this, &Waiter::onPoll);
+    }
+
+    void onStop(long)
+    {
+        m_Museekd->reactor()->stop();
+    }
+
+    Museek::Museekd * m_Museekd;
+    std::string m_Path, m_Text;
+    bool m_Found;
+    double m_Deadline;
+};
+
+int main()
+{
+    char dir[] = "/tmp/museekd-configsave-XXXXXX";
+    if(! mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::string path = std::string(dir) + "/config.xml";
+    {
+        std::ofstream file(path.c_str());
+        file << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+                "<museekd><domain id=\"test\"><key id=\"first\">1</key></domain></museekd>\n";
+    }
+
+    NewNet::RefPtr<Museek::Museekd> museekd = new Museek::Museekd();
+    Museek::ConfigManager * config = museekd->config();
+    expect(config->load(path), "loading the configuration");
+    config->setAutoSave(true);
+    Waiter waiter(museekd, path);
+
+    // Saved in the background, a while after the change
+    double start = now();
+    config->set("test", "second", "background <&>");
+    expect(readFile(path).find("second") == std::string::npos, "saved before the delay");
+    expect(waiter.waitFor("background &lt;&amp;&gt;", CONFIG_SAVE_DELAY + 5000), "background save");
+    printf("background save after %.0f ms (delay %d ms)\n", (now() - start) * 1000, CONFIG_SAVE_DELAY);
+    waiter.runFor(100);
+    expect(! exists(path + ".new"), "config.xml.new left behind");
+    expect(readFile(path).find("first") != std::string::npos, "earlier key lost by the background save");
+
+    // Changes made during a save are saved by the next one
+    config->set("test", "third", "3");
+    waiter.runFor(CONFIG_SAVE_DELAY);
+    config->set("test", "fourth", "4");
+    expect(waiter.waitFor("<key id=\"fourth\">4</key>", 2 * CONFIG_SAVE_DELAY + 5000), "change made during a save");
+    expect(readFile(path).find("<key id=\"third\">3</key>") != std::string::npos, "third key");
+
+    // flush() saves at once, before the delay is over
+    config->set("test", "fifth", "5");
+    config->flush();
+    expect(readFile(path).find("<key id=\"fifth\">5</key>") != std::string::npos, "flush before the delay");
+    expect(! exists(path + ".tmp"), "config.xml.tmp left behind");
+
+    // flush() while the workers write the file: the abandoned save must
+    // not replace the flushed one when it completes
+    config->set("test", "sixth", "6");
+    waiter.runFor(CONFIG_SAVE_DELAY);
+    config->set("test", "seventh", "7");
+    config->flush();
+    waiter.runFor(500);
+    std::string data = readFile(path);
+    expect(data.find("<key id=\"sixth\">6</key>") != std::string::npos, "flush during a save (sixth)");
+    expect(data.find("<key id=\"seventh\">7</key>") != std::string::npos, "flush during a save (seventh)");
+
+    // What was saved loads back
+    NewNet::RefPtr<Museek::ConfigManager> reloaded = new Museek::ConfigManager(0);
+    expect(reloaded->load(path), "reloading the configuration");
+    expect(reloaded->get("test", "second") == "background <&>", "reloaded value");
+    expect(reloaded->get("test", "seventh") == "7", "reloaded flushed value");
+
+    unlink((path + ".new").c_str());
+    unlink((path + ".tmp").c_str());
+    unlink(path.c_str());
+    rmdir(dir);
+
+    if(failures)
+        printf("%d failure(s)\n", failures);
+    else
+        printf("configuration saves work\n");
+    return failures ? 1 : 0;
+}
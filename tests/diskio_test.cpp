@@ -0,0 +1,222 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Slow disk: every pwrite() and fsync() of this program sleeps first.
+   Downloads are simulated by appending a chunk to each file every 10 ms,
+   like data coming from the network, and the reactor must stay on time
+   while the disk I/O workers write.
+   Usage: diskio_test [delay ms (100)] [disk threads (2)]
+   With 0 threads the writes block the reactor: nothing is checked then,
+   the lateness is only printed for comparison. */
+
+#include "museekd/museekd.h"
+#include "museekd/configmanager.h"
+#include "museekd/diskio.h"
+#include <NewNet/nnreactor.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define FILES 4
+#define CHUNK (64 * 1024)
+#define FILE_SIZE (2 * 1024 * 1024)
+#define TICK 10
+
+static int delay = 100;
+
+static void slowDown()
+{
+    usleep(delay * 1000);
+}
+
+extern "C" ssize_t pwrite(int fd, const void * buf, size_t count, off_t offset)
+{
+    typedef ssize_t (*Function)(int, const void *, size_t, off_t);
+    static Function real = (Function)dlsym(RTLD_NEXT, "pwrite");
+    slowDown();
+    return real(fd, buf, count, offset);
+}
+
+// What museekd calls when built with large file support
+extern "C" ssize_t pwrite64(int fd, const void * buf, size_t count, off64_t offset)
+{
+    typedef ssize_t (*Function)(int, const void *, size_t, off64_t);
+    static Function real = (Function)dlsym(RTLD_NEXT, "pwrite64");
+    slowDown();
+    return real(fd, buf, count, offset);
+}
+
+extern "C" int fsync(int fd)
+{
+    typedef int (*Function)(int);
+    static Function real = (Function)dlsym(RTLD_NEXT, "fsync");
+    slowDown();
+    return real(fd);
+}
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned char content(int file, size_t offset)
+{
+    return (offset * 7 + file * 13 + offset / 4093) & 0xff;
+}
+
+class Downloads : public NewNet::Object
+{
+public:
+    Downloads(Museek::Museekd * museekd, const std::string & dir)
+      : m_Museekd(museekd), m_Sent(0), m_Closed(0), m_MaxLate(0), m_TotalLate(0), m_Ticks(0)
+    {
+        for(int i = 0; i < FILES; ++i)
+        {
+            char name[32];
+            snprintf(name, sizeof(name), "/file%d", i);
+            m_Paths.push_back(dir + name);
+            m_Files.push_back(new Museek::AsyncFile(museekd->diskIO(), m_Paths.back(), true));
+            m_Files.back()->closedEvent.connect(this, &Downloads::onClosed);
+        }
+    }
+
+    void run()
+    {
+        m_Start = now();
+        m_Expected = m_Start + TICK / 1000.0;
+        m_Museekd->reactor()->addTimeout(TICK, this, &Downloads::onTick);
+        m_Museekd->reactor()->run();
+        m_Elapsed = now() - m_Start;
+    }
+
+    bool check()
+    {
+        bool ok = true;
+        for(int i = 0; i < FILES; ++i)
+        {
+            if(m_Files[i]->failed())
+            {
+                printf("FAIL writing %s: error %d\n", m_Paths[i].c_str(), m_Files[i]->error());
+                ok = false;
+            }
+            std::ifstream file(m_Paths[i].c_str(), std::ios::binary);
+            std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            bool same = data.size() == FILE_SIZE;
+            for(size_t j = 0; same && j < data.size(); ++j)
+                same = (unsigned char)data[j] == content(i, j);
+            if(! same)
+            {
+                printf("FAIL content of %s (%u bytes)\n", m_Paths[i].c_str(), (unsigned)data.size());
+                ok = false;
+            }
+            unlink(m_Paths[i].c_str());
+        }
+        return ok;
+    }
+
+    double maxLate() const { return m_MaxLate; }
+    double averageLate() const { return m_Ticks ? m_TotalLate / m_Ticks : 0; }
+    double elapsed() const { return m_Elapsed; }
+
+private:
+    void onTick(long)
+    {
+        double tick = now();
+        double late = tick - m_Expected;
+        if(late < 0)
+            late = 0;
+        if(late > m_MaxLate)
+            m_MaxLate = late;
+        m_TotalLate += late;
+        ++m_Ticks;
+
+        if(m_Sent < FILE_SIZE)
+        {
+            std::vector<unsigned char> chunk(CHUNK);
+            for(int i = 0; i < FILES; ++i)
+            {
+                for(size_t j = 0; j < CHUNK; ++j)
+                    chunk[j] = content(i, m_Sent + j);
+                m_Files[i]->append(&chunk[0], CHUNK);
+                if(m_Sent + CHUNK >= FILE_SIZE)
+                    m_Files[i]->close();
+            }
+            m_Sent += CHUNK;
+        }
+        // Time spent here waiting for the disk counts as lateness too
+        m_Expected = tick + TICK / 1000.0;
+        m_Museekd->reactor()->addTimeout(TICK, this, &Downloads::onTick);
+    }
+
+    void onClosed(Museek::AsyncFile *)
+    {
+        if(++m_Closed == FILES)
+            m_Museekd->reactor()->stop();
+    }
+
+    Museek::Museekd * m_Museekd;
+    std::vector<std::string> m_Paths;
+    std::vector<NewNet::RefPtr<Museek::AsyncFile> > m_Files;
+    size_t m_Sent;
+    int m_Closed;
+    double m_Start, m_Expected, m_Elapsed, m_MaxLate, m_TotalLate;
+    int m_Ticks;
+};
+
+int main(int argc, char ** argv)
+{
+    if(argc > 1)
+        delay = atoi(argv[1]);
+    int threads = argc > 2 ? atoi(argv[2]) : 2;
+
+    char dir[] = "/tmp/museekd-diskio-XXXXXX";
+    if(! mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    NewNet::RefPtr<Museek::Museekd> museekd = new Museek::Museekd();
+    museekd->config()->setAutoSave(false);
+    museekd->config()->set("transfers", "disk_threads", threads);
+
+    Downloads downloads(museekd, dir);
+    downloads.run();
+    bool ok = downloads.check();
+    rmdir(dir);
+
+    printf("%d files of %d KiB, %d ms per write, %d disk threads: %.2f s, reactor late by %.1f ms at most (%.2f ms on average)\n",
+           FILES, FILE_SIZE / 1024, delay, threads, downloads.elapsed(), downloads.maxLate() * 1000, downloads.averageLate() * 1000);
+
+    // The reactor must never wait for the disk
+    if(threads > 0 && downloads.maxLate() * 1000 > delay / 2)
+    {
+        printf("FAIL the reactor waited for the disk\n");
+        ok = false;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,91 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Speed of the transfer fingerprints: the data is hashed in the chunks the
+   disk workers write or read, with the tail kept for resuming.
+   Usage: fingerprint_bench [megabytes (256)] [chunk KiB (64)]
+   Prints GB/s for the fingerprint and for a single SHA-1 of the whole
+   buffer, with the SHA-1 selected for this CPU and the generic one. */
+
+#include "museekd/fingerprint.h"
+#include "Mucipher/cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <string>
+#include <algorithm>
+#include <vector>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void measure(const std::vector<char> & data, size_t chunk, const char * backend)
+{
+    // Once to warm up
+    Museek::Fingerprint fingerprint;
+    fingerprint.update(&data[0], chunk);
+
+    fingerprint.reset();
+    double t = now();
+    for(size_t done = 0; done < data.size(); done += chunk)
+        fingerprint.update(&data[done], std::min(chunk, data.size() - done));
+    std::string digest = fingerprint.digest();
+    double fingerprinted = now() - t;
+
+    unsigned char whole[20];
+    t = now();
+    shaBlock((unsigned char *)&data[0], data.size(), whole);
+    double hashed = now() - t;
+
+    char hex[41];
+    hexDigest(whole, 20, hex);
+    printf("%-8s fingerprint %6.3f GB/s, sha1 %6.3f GB/s%s\n", backend,
+           data.size() / fingerprinted / 1e9, data.size() / hashed / 1e9,
+           digest == hex ? "" : " (DIGESTS DIFFER)");
+}
+
+int main(int argc, char ** argv)
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 256;
+    int kilobytes = argc > 2 ? atoi(argv[2]) : 64;
+    if(megabytes <= 0 || kilobytes <= 0)
+    {
+        fprintf(stderr, "usage: %s [megabytes] [chunk KiB]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<char> data((size_t)megabytes << 20);
+    for(size_t i = 0; i < data.size(); ++i)
+        data[i] = i * 2654435761u >> 24;
+
+    printf("%d MB in chunks of %d KiB\n", megabytes, kilobytes);
+    measure(data, (size_t)kilobytes << 10, sha1NiSelected() ? "sha-ni" : "generic");
+    if(sha1NiSelected())
+    {
+        cipherForceGeneric(1);
+        measure(data, (size_t)kilobytes << 10, "generic");
+        cipherForceGeneric(0);
+    }
+    return 0;
+}
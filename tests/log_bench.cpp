@@ -0,0 +1,120 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Cost of logging: a disabled NNLOG, a disabled message logged by domain
+   name, an enabled message (delivered to a callback that counts it), and
+   the CPU time of a turn of the reactor, which logs whenever it waits,
+   with its debug domains disabled and enabled.
+   Usage: log_bench [millions of messages (10)] */
+
+#include <NewNet/nnlog.h>
+#include <NewNet/nnreactor.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Counts the messages instead of printing them. */
+class Counter : public NewNet::Event<const NewNet::Log::LogNotify *>::Callback
+{
+public:
+    Counter() : count(0) {}
+    void operator()(const NewNet::Log::LogNotify *) { ++count; }
+    unsigned long count;
+};
+
+/* Turns the reactor a number of times, waiting 1 ms each time. */
+class Turns : public NewNet::Object
+{
+public:
+    Turns(NewNet::Reactor * reactor, int turns) : m_Reactor(reactor), m_Left(turns) {}
+
+    void run()
+    {
+        m_Reactor->addTimeout(1, this, &Turns::onTimeout);
+        m_Reactor->run();
+    }
+
+private:
+    void onTimeout(long)
+    {
+        if(--m_Left > 0)
+            m_Reactor->addTimeout(1, this, &Turns::onTimeout);
+        else
+            m_Reactor->stop();
+    }
+
+    NewNet::Reactor * m_Reactor;
+    int m_Left;
+};
+
+static double turnReactor(int turns)
+{
+    NewNet::Reactor reactor;
+    Turns t(&reactor, turns);
+    clock_t start = clock();
+    t.run();
+    return (double)(clock() - start) / CLOCKS_PER_SEC / turns;
+}
+
+int main(int argc, char ** argv)
+{
+    int millions = argc > 1 ? atoi(argv[1]) : 10;
+    if(millions <= 0)
+    {
+        fprintf(stderr, "usage: %s [millions of messages]\n", argv[0]);
+        return 1;
+    }
+    const int n = millions * 1000000;
+
+    NewNet::RefPtr<Counter> counter = new Counter;
+    NewNet::log.logEvent.connect(counter);
+
+    double t = now();
+    for(int i = 0; i < n; ++i)
+        NNLOG("bench.disabled", "message %i of %s", i, "the benchmark");
+    printf("disabled NNLOG          %7.2f ns\n", (now() - t) / n * 1e9);
+
+    const std::string domain("bench.disabled");
+    t = now();
+    for(int i = 0; i < n / 10; ++i)
+        NewNet::log(domain, "message %i of %s", i, "the benchmark");
+    printf("disabled, by name       %7.2f ns\n", (now() - t) / (n / 10) * 1e9);
+
+    NewNet::log.enable("bench.enabled");
+    t = now();
+    for(int i = 0; i < n / 10; ++i)
+        NNLOG("bench.enabled", "message %i of %s", i, "the benchmark");
+    printf("enabled NNLOG           %7.2f ns (%lu delivered)\n", (now() - t) / (n / 10) * 1e9, counter->count);
+
+    const int turns = 2000;
+    printf("reactor turn, quiet     %7.2f us\n", turnReactor(turns) * 1e6);
+    counter->count = 0;
+    NewNet::log.enable("newnet.net.debug");
+    double turn = turnReactor(turns);
+    printf("reactor turn, debug     %7.2f us (%lu messages)\n", turn * 1e6, counter->count);
+    return 0;
+}
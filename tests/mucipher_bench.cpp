@@ -0,0 +1,116 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Speed of the Mucipher hashes and cipher, with the implementations
+   selected for this CPU and with the generic ones.
+   Usage: mucipher_bench [megabytes] (64 by default). Prints cycles per
+   byte (x86 only, from the time stamp counter) and MB/s. */
+
+#include "Mucipher/mucipher.h"
+#include "Mucipher/cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#ifdef MUCIPHER_X86
+#include <x86intrin.h>
+#endif // MUCIPHER_X86
+
+static unsigned char * data;
+static unsigned char * out;
+static int size;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static unsigned long long cycles()
+{
+#ifdef MUCIPHER_X86
+    return __rdtsc();
+#else
+    return 0;
+#endif // MUCIPHER_X86
+}
+
+static void runSha1() { shaBlock(data, size, out); }
+static void runSha256() { sha256Block(data, size, out); }
+static void runMd5() { md5Block(data, size, out); }
+
+static CipherContext ctx;
+static void runCipher() { blockCipher(&ctx, data, size, out); }
+static void runDecipher() { blockDecipher(&ctx, data, size, out); }
+
+static void measure(const char * what, const char * backend, void (*run)())
+{
+    // Once to warm up the caches and the tables
+    run();
+    unsigned long long c = cycles();
+    double t = now();
+    run();
+    t = now() - t;
+    c = cycles() - c;
+#ifdef MUCIPHER_X86
+    printf("%-10s %-8s %6.2f cycles/byte %8.1f MB/s\n", what, backend, (double)c / size, size / t / 1e6);
+#else
+    printf("%-10s %-8s %8.1f MB/s\n", what, backend, size / t / 1e6);
+#endif // MUCIPHER_X86
+}
+
+static void measureAll()
+{
+    measure("sha1", sha1NiSelected() ? "sha-ni" : "generic", runSha1);
+    measure("sha256", sha256NiSelected() ? "sha-ni" : "generic", runSha256);
+    measure("md5", "generic", runMd5);
+    measure("aes", aesNiSelected() ? "aes-ni" : "generic", runCipher);
+    measure("aes (dec)", aesNiSelected() ? "aes-ni" : "generic", runDecipher);
+}
+
+int main(int argc, char ** argv)
+{
+    int megabytes = argc > 1 ? atoi(argv[1]) : 64;
+    if(megabytes <= 0)
+    {
+        fprintf(stderr, "usage: %s [megabytes]\n", argv[0]);
+        return 1;
+    }
+    size = megabytes << 20;
+    data = (unsigned char *)malloc(size);
+    out = (unsigned char *)malloc(size);
+    for(int i = 0; i < size; ++i)
+        data[i] = i * 2654435761u >> 24;
+
+    cipherKeySHA256(&ctx, (char *)"museek", 6);
+
+    printf("selected: cipher %s, hash %s, %d MB\n", cipherBackend(), hashBackend(), megabytes);
+    measureAll();
+    if(aesNiSelected() || sha1NiSelected() || sha256NiSelected())
+    {
+        cipherForceGeneric(1);
+        measureAll();
+        cipherForceGeneric(0);
+    }
+
+    free(data);
+    free(out);
+    return 0;
+}
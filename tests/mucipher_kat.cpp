@@ -0,0 +1,195 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Known answers for Mucipher: the FIPS 180 / RFC 1321 examples for the
+   hashes, and AES keys made the way museekd makes them (checked with
+   openssl). Each answer is checked with the implementations selected for
+   this CPU and with the generic ones, then both are compared on random
+   data of every length around the block sizes. */
+
+#include "Mucipher/mucipher.h"
+#include "Mucipher/cpu.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <algorithm>
+
+static int failures = 0;
+
+static void check(const char * what, unsigned char * digest, int length, const char * expected)
+{
+    char hex[2 * 32 + 1];
+    hexDigest(digest, length, hex);
+    if(strcmp(hex, expected))
+    {
+        printf("FAIL %s: %s, expected %s\n", what, hex, expected);
+        ++failures;
+    }
+}
+
+struct Vector
+{
+    const char * message;
+    int repeat;
+    const char * md5;
+    const char * sha1;
+    const char * sha256;
+};
+
+static const Vector vectors[] = {
+    { "", 1,
+      "d41d8cd98f00b204e9800998ecf8427e",
+      "da39a3ee5e6b4b0d3255bfef95601890afd80709",
+      "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+    { "abc", 1,
+      "900150983cd24fb0d6963f7d28e17f72",
+      "a9993e364706816aba3e25717850c26c9cd0d89d",
+      "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+    { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 1,
+      "8215ef0796a20bcaaae116d3876c664a",
+      "84983e441c3bd26ebaae4aa1f95129e5e54670f1",
+      "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+    { "a", 1000000,
+      "7707d6ae4e027c70eea2a935c2296f21",
+      "34aa973cd4c4daa4f61eeb2bdbad27316534016f",
+      "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+static void checkHashes(const char * backend)
+{
+    for(size_t i = 0; i < sizeof(vectors) / sizeof(vectors[0]); ++i)
+    {
+        const Vector & v = vectors[i];
+        std::string message;
+        for(int j = 0; j < v.repeat; ++j)
+            message += v.message;
+        unsigned char * data = (unsigned char *)message.data();
+        int length = message.size();
+        unsigned char digest[32];
+        std::string what = std::string(backend) + " \"" + v.message + "\"";
+
+        md5Block(data, length, digest);
+        check((what + " md5").c_str(), digest, 16, v.md5);
+        shaBlock(data, length, digest);
+        check((what + " sha1").c_str(), digest, 20, v.sha1);
+        sha256Block(data, length, digest);
+        check((what + " sha256").c_str(), digest, 32, v.sha256);
+
+        // Streaming SHA-1, fed in uneven pieces
+        SHA_CTX ctx;
+        shaInit(&ctx);
+        for(int done = 0, n = 1; done < length; done += n, n = n * 3 % 197 + 1)
+            shaUpdate(&ctx, data + done, std::min(n, length - done));
+        shaFinal(&ctx, digest);
+        check((what + " streaming sha1").c_str(), digest, 20, v.sha1);
+    }
+}
+
+static void checkCipher(const char * backend)
+{
+    unsigned char plain[32], out[32], back[32];
+    for(int i = 0; i < 32; ++i)
+        plain[i] = i;
+    std::string what = backend;
+
+    CipherContext ctx;
+    cipherKeySHA256(&ctx, (char *)"museek", 6);
+    blockCipher(&ctx, plain, 32, out);
+    check((what + " aes-256").c_str(), out, 32,
+          "ee247f4bb362fdcb404141fd9ae27fc9e11204506a397dd80844b34df9e6603b");
+    blockDecipher(&ctx, out, 32, back);
+    check((what + " aes-256 decipher").c_str(), back, 32,
+          "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+
+    cipherKeyMD5(&ctx, (char *)"museek", 6);
+    blockCipher(&ctx, plain, 32, out);
+    check((what + " aes-128").c_str(), out, 32,
+          "cc859349f556b4508e38e21869e2263f41b474a60946b0b1438dbe5ea2ca8ae8");
+    blockDecipher(&ctx, out, 32, back);
+    check((what + " aes-128 decipher").c_str(), back, 32,
+          "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f");
+}
+
+/* Selected and generic implementations must agree on every length
+   around the block boundaries. */
+static void compareBackends()
+{
+    const int size = 4 * 64 + 1;
+    unsigned char data[size];
+    srand(1);
+    for(int i = 0; i < size; ++i)
+        data[i] = rand();
+
+    for(int length = 0; length <= size; ++length)
+    {
+        unsigned char fast[3][32], generic[3][32];
+        cipherForceGeneric(0);
+        shaBlock(data, length, fast[0]);
+        sha256Block(data, length, fast[1]);
+        md5Block(data, length, fast[2]);
+        cipherForceGeneric(1);
+        shaBlock(data, length, generic[0]);
+        sha256Block(data, length, generic[1]);
+        md5Block(data, length, generic[2]);
+        if(memcmp(fast[0], generic[0], 20) || memcmp(fast[1], generic[1], 32) || memcmp(fast[2], generic[2], 16))
+        {
+            printf("FAIL hashes of %d bytes differ between the backends\n", length);
+            ++failures;
+        }
+    }
+
+    // Whole blocks only: the padding of the last partial block is random
+    CipherContext ctx;
+    cipherKeySHA256(&ctx, (char *)"compare", 7);
+    unsigned char fast[size], generic[size], back[size];
+    cipherForceGeneric(0);
+    blockCipher(&ctx, data, 256, fast);
+    cipherForceGeneric(1);
+    blockCipher(&ctx, data, 256, generic);
+    blockDecipher(&ctx, fast, 256, back);
+    if(memcmp(fast, generic, 256) || memcmp(back, data, 256))
+    {
+        printf("FAIL aes differs between the backends\n");
+        ++failures;
+    }
+    cipherForceGeneric(0);
+}
+
+int main()
+{
+    cipherSelectBackends();
+    printf("selected: cipher %s, hash %s\n", cipherBackend(), hashBackend());
+
+    checkHashes(hashBackend());
+    checkCipher(cipherBackend());
+
+    cipherForceGeneric(1);
+    checkHashes("generic");
+    checkCipher("generic");
+    cipherForceGeneric(0);
+
+    compareBackends();
+
+    if(failures)
+        printf("%d failure(s)\n", failures);
+    else
+        printf("all known answers match\n");
+    return failures ? 1 : 0;
+}
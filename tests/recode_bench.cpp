@@ -0,0 +1,91 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Recoding file names, as done when sharing a large collection: one in
+   ten names isn't plain ASCII.
+   Usage: recode_bench [thousands of files (1000)]
+   Prints the time taken by each kind of conversion for all the names. */
+
+#include "museekd/museekd.h"
+#include "museekd/configmanager.h"
+#include "museekd/codesetmanager.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <string>
+#include <vector>
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char ** argv)
+{
+    int thousands = argc > 1 ? atoi(argv[1]) : 1000;
+    if(thousands <= 0)
+    {
+        fprintf(stderr, "usage: %s [thousands of files]\n", argv[0]);
+        return 1;
+    }
+
+    NewNet::RefPtr<Museek::Museekd> museekd = new Museek::Museekd();
+    Museek::ConfigManager * config = museekd->config();
+    Museek::CodesetManager * codeset = museekd->codeset();
+    config->setAutoSave(false);
+    config->set("encoding", "network", "UTF-8");
+    config->set("encoding", "filesystem", "UTF-8");
+
+    // UTF-8 file names
+    std::vector<std::string> paths;
+    for(int i = 0; i < thousands * 1000; ++i)
+    {
+        char path[256];
+        if(i % 10)
+            snprintf(path, sizeof(path), "/home/user/Music/Artist %d/Album/%02d - Track name.mp3", i / 20, i % 20);
+        else
+            snprintf(path, sizeof(path), "/home/user/Musique/Cr\xc3\xa9" "ateur %d/\xc3\x89t\xc3\xa9/%02d - Chanson \xc3\xa0 moi.flac", i / 20, i % 20);
+        paths.push_back(path);
+    }
+
+    size_t total = 0;
+    double t = now();
+    for(size_t i = 0; i < paths.size(); ++i)
+        total += codeset->fromFSToNet(paths[i]).size();
+    double toNet = now() - t;
+
+    t = now();
+    for(size_t i = 0; i < paths.size(); ++i)
+        total += codeset->fromPeer("someone", paths[i]).size();
+    double fromPeer = now() - t;
+
+    config->set("encoding", "network", "ISO-8859-1");
+    t = now();
+    for(size_t i = 0; i < paths.size(); ++i)
+        total += codeset->fromFSToNet(paths[i]).size();
+    double toLatin1 = now() - t;
+
+    printf("%u file names (%lu bytes out)\n", (unsigned)paths.size(), (unsigned long)total);
+    printf("fromFSToNet, UTF-8 to UTF-8        %7.0f ms\n", toNet * 1000);
+    printf("fromPeer, default codeset          %7.0f ms\n", fromPeer * 1000);
+    printf("fromFSToNet, UTF-8 to ISO-8859-1   %7.0f ms\n", toLatin1 * 1000);
+    return 0;
+}
@@ -0,0 +1,193 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Swarmed downloads: the bytes fetched after the end of a range must match
+   the first bytes of the next one. The file is split between alice (the
+   primary), bob, carol and dave, each sending its range and the overlap
+   after it, one of them with a wrong byte. The test checks which range is
+   fetched again and which user is dropped. */
+
+#include "museekd/museekd.h"
+#include "museekd/configmanager.h"
+#include "museekd/downloadmanager.h"
+#include "museekd/swarm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#define RANGE SWARM_MIN_RANGE
+#define SIZE (4 * RANGE)
+#define NOWHERE ((uint64)-1)
+
+static const char * path = "share\\swarmed.bin";
+static int failures = 0;
+
+static void expect(bool ok, const char * scenario, const char * what)
+{
+    if(! ok)
+    {
+        printf("FAIL %s: %s\n", scenario, what);
+        ++failures;
+    }
+}
+
+static unsigned char byteAt(uint64 offset)
+{
+    return (offset * 2654435761u) >> 24;
+}
+
+/* Sends what the download asks for, from its position until its range
+   and the overlap after it are done, with a wrong byte at the given offset. */
+static void send(Museek::Swarm * swarm, Museek::Download * download, uint64 wrong = NOWHERE)
+{
+    uint64 offset = swarm->position(download);
+    std::vector<unsigned char> chunk(16 * 1024);
+    bool done = false;
+    while(! done && offset < SIZE)
+    {
+        size_t n = chunk.size();
+        if(offset + n > SIZE)
+            n = SIZE - offset;
+        for(size_t i = 0; i < n; ++i)
+            chunk[i] = byteAt(offset + i) ^ (offset + i == wrong ? 0xff : 0);
+        swarm->received(download, &chunk[0], n, done);
+        offset += n;
+    }
+}
+
+/* A fresh swarm of four users sharing the file. */
+class Fixture
+{
+public:
+    Fixture(const std::string & dir)
+    {
+        museekd = new Museek::Museekd();
+        Museek::ConfigManager * config = museekd->config();
+        config->setAutoSave(false);
+        config->set("transfers", "download-dir", dir);
+        config->set("transfers", "incomplete-dir", dir);
+        config->set("transfers", "swarm", true);
+        config->set("transfers", "swarm_sources", 4);
+
+        Folder files;
+        files[path].size = SIZE;
+        museekd->downloads()->addSources("bob", files);
+        museekd->downloads()->addSources("carol", files);
+        museekd->downloads()->addSources("dave", files);
+
+        museekd->downloads()->add("alice", path);
+        alice = museekd->downloads()->findDownload("alice", path);
+        alice->setSize(SIZE);
+        alice->setState(TS_Transferring);
+        museekd->downloads()->startSwarm(alice);
+        swarm = alice->swarm();
+    }
+
+    Museek::Download * find(const std::string & user)
+    {
+        return museekd->downloads()->findDownload(user, path);
+    }
+
+    NewNet::RefPtr<Museek::Museekd> museekd;
+    NewNet::RefPtr<Museek::Download> alice;
+    NewNet::RefPtr<Museek::Swarm> swarm;
+};
+
+int main(int argc, char ** argv)
+{
+    char dir[] = "/tmp/museekd-swarm-XXXXXX";
+    if(! mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+
+    {
+        const char * scenario = "sources agree";
+        Fixture f(dir);
+        expect(f.swarm.isValid(), scenario, "no swarm");
+        if(! f.swarm.isValid())
+            return 1;
+        expect(f.swarm->position(f.alice) == 0 && f.swarm->position(f.find("bob")) == RANGE
+               && f.swarm->position(f.find("carol")) == 2 * RANGE && f.swarm->position(f.find("dave")) == 3 * RANGE,
+               scenario, "ranges");
+        // A wrong byte just after the overlap isn't checked
+        send(f.swarm, f.alice);
+        send(f.swarm, f.find("bob"), 2 * RANGE + SWARM_OVERLAP);
+        send(f.swarm, f.find("carol"));
+        send(f.swarm, f.find("dave"));
+        expect(f.find("bob") && f.find("carol") && f.find("dave"), scenario, "a source was dropped");
+        expect(f.swarm->position(f.find("bob")) == 2 * RANGE && f.swarm->position(f.find("carol")) == 3 * RANGE,
+               scenario, "a range is fetched again");
+    }
+
+    {
+        const char * scenario = "primary and source disagree";
+        Fixture f(dir);
+        send(f.swarm, f.alice);
+        // The last byte of the overlap
+        send(f.swarm, f.find("bob"), RANGE + SWARM_OVERLAP - 1);
+        expect(! f.find("bob"), scenario, "bob wasn't dropped");
+        expect(f.find("carol") && f.find("dave"), scenario, "another source was dropped");
+        f.swarm->idle(f.alice);
+        expect(f.swarm->position(f.alice) == RANGE, scenario, "the primary doesn't fetch bob's range again");
+    }
+
+    {
+        const char * scenario = "earlier source wrong";
+        Fixture f(dir);
+        // The first byte of the overlap
+        send(f.swarm, f.find("bob"), 2 * RANGE);
+        send(f.swarm, f.find("carol"));
+        expect(f.find("bob") && f.swarm->hasRange(f.find("bob")), scenario, "bob was dropped before a third user checked");
+        expect(f.find("carol") && ! f.swarm->hasRange(f.find("carol")), scenario, "carol keeps her range");
+        // Carol may not settle it: dave does
+        f.swarm->idle(f.find("carol"));
+        expect(! f.find("carol") || f.swarm->position(f.find("carol")) != 2 * RANGE, scenario, "carol fetches her range again");
+        send(f.swarm, f.find("dave"));
+        f.swarm->idle(f.find("dave"));
+        expect(f.swarm->position(f.find("dave")) == 2 * RANGE, scenario, "dave doesn't fetch carol's range");
+        send(f.swarm, f.find("dave"));
+        expect(! f.find("bob"), scenario, "bob wasn't dropped");
+        f.swarm->idle(f.find("dave"));
+        expect(f.swarm->position(f.find("dave")) == RANGE, scenario, "bob's range isn't fetched again");
+    }
+
+    {
+        const char * scenario = "later source wrong";
+        Fixture f(dir);
+        send(f.swarm, f.find("bob"));
+        send(f.swarm, f.find("carol"), 2 * RANGE + SWARM_OVERLAP - 1);
+        expect(f.find("bob") && f.find("carol"), scenario, "a source was dropped before a third user checked");
+        send(f.swarm, f.find("dave"));
+        f.swarm->idle(f.find("dave"));
+        expect(f.swarm->position(f.find("dave")) == 2 * RANGE, scenario, "dave doesn't fetch carol's range");
+        send(f.swarm, f.find("dave"));
+        expect(f.find("bob") && f.swarm->position(f.find("bob")) == 2 * RANGE, scenario, "bob was dropped");
+        expect(! f.find("carol"), scenario, "carol wasn't dropped");
+    }
+
+    rmdir(dir);
+    if(failures)
+        return 1;
+    printf("swarm boundaries are checked\n");
+    return 0;
+}
@@ -0,0 +1,311 @@
+/*  Museek - A SoulSeek client written in C++
+    Copyright 2008 little blue poney <lbponey@users.sourceforge.net>
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+
+ */
+
+/* Replays an upload queue with every upload queue policy and prints how
+   long each class of users waited for its uploads to start.
+   Usage: uploadqueue_bench [-s slots (4)] [-r KiB/s per slot (200)] [trace]
+   A trace has one queued upload per line: "seconds user bytes", followed
+   by "privileged" or "buddy" for these users. Without a trace, one user
+   queues 3000 files at once while 300 others come and queue a few files
+   each over two hours.
+   The uploads are real museekd uploads queued in the daemon's scheduler;
+   the transfers are simulated, each slot sending at the given rate. */
+
+#include "museekd/museekd.h"
+#include "museekd/configmanager.h"
+#include "museekd/uploadmanager.h"
+#include "museekd/uploadscheduler.h"
+#include <NewNet/nnrefptr.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+struct Request
+{
+    double time;
+    std::string user;
+    uint64 size;
+    std::string flag;
+
+    bool operator<(const Request & other) const { return time < other.time; }
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::vector<Request> syntheticTrace()
+{
+    std::vector<Request> trace;
+    srand(1);
+    for(int i = 0; i < 3000; ++i)
+    {
+        Request r = { i * 0.01, "hoarder", 0, "" };
+        r.size = (uint64)(1048576 * exp((rand() % 1000) / 1000.0 * log(50.0)));
+        trace.push_back(r);
+    }
+    for(int u = 0; u < 300; ++u)
+    {
+        std::ostringstream user;
+        user << "user" << u;
+        double time = (rand() % 7200000) / 1000.0;
+        int files = 1 + rand() % 10;
+        for(int i = 0; i < files; ++i)
+        {
+            Request r = { time + i * 0.01, user.str(), 0, u < 10 ? "privileged" : (u < 30 ? "buddy" : "") };
+            r.size = (uint64)(1048576 * exp((rand() % 1000) / 1000.0 * log(50.0)));
+            trace.push_back(r);
+        }
+    }
+    std::stable_sort(trace.begin(), trace.end());
+    return trace;
+}
+
+static bool readTrace(const char * path, std::vector<Request> & trace)
+{
+    std::ifstream file(path);
+    if(! file)
+        return false;
+    std::string line;
+    while(std::getline(file, line))
+    {
+        if(line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        Request r;
+        if(! (fields >> r.time >> r.user >> r.size))
+            continue;
+        fields >> r.flag;
+        trace.push_back(r);
+    }
+    std::stable_sort(trace.begin(), trace.end());
+    return true;
+}
+
+/* Wait statistics of a class of users, in seconds. */
+struct Waits
+{
+    std::vector<double> waits;
+
+    void print(const char * name)
+    {
+        if(waits.empty())
+            return;
+        std::sort(waits.begin(), waits.end());
+        double total = 0;
+        for(size_t i = 0; i < waits.size(); ++i)
+            total += waits[i];
+        printf("  %-22s %6u  mean %7.1f min  median %7.1f min  p95 %7.1f min  max %7.1f min\n", name, (unsigned)waits.size(),
+               total / waits.size() / 60, waits[waits.size() / 2] / 60, waits[waits.size() * 95 / 100] / 60, waits.back() / 60);
+    }
+};
+
+/* A simulated transfer taking a slot. */
+struct Transfer
+{
+    double finish;
+    NewNet::RefPtr<Museek::Upload> upload;
+
+    bool operator<(const Transfer & other) const { return finish < other.finish; }
+};
+
+static void replay(const std::string & policy, const std::vector<Request> & trace, const std::string & dir, uint slots, double rate)
+{
+    NewNet::RefPtr<Museek::Museekd> museekd = new Museek::Museekd();
+    Museek::ConfigManager * config = museekd->config();
+    config->setAutoSave(false);
+    config->set("transfers", "upload_queue_policy", policy);
+    // One slot, always taken: museekd never starts an upload by itself
+    config->set("transfers", "upload_slots", 1);
+
+    std::map<std::string, uint> files;
+    std::set<std::string> seen;
+    for(std::vector<Request>::const_iterator it = trace.begin(); it != trace.end(); ++it)
+    {
+        if(! seen.insert(it->user).second)
+            continue;
+        if(it->flag == "privileged")
+            museekd->addPrivilegedUser(it->user);
+        else if(it->flag == "buddy")
+            config->set("buddies", it->user, "");
+    }
+    for(std::vector<Request>::const_iterator it = trace.begin(); it != trace.end(); ++it)
+        ++files[it->user];
+
+    std::ostringstream blockerPath;
+    blockerPath << dir << "/" << 0;
+    NewNet::RefPtr<Museek::Upload> blocker = new Museek::Upload(museekd, "(blocker)", blockerPath.str());
+    blocker->setState(TS_Transferring);
+
+    Museek::UploadScheduler * scheduler = museekd->uploads()->scheduler();
+    std::map<Museek::Upload *, double> queuedAt;
+    std::vector<NewNet::RefPtr<Museek::Upload> > uploads; // Keeps them alive, like the upload manager
+    std::multiset<Transfer> transfers;
+    Waits privileged, buddies, heavy, light;
+    double clock = 0, picking = 0;
+    uint picks = 0;
+    size_t next = 0;
+
+    while(next < trace.size() || ! transfers.empty() || scheduler->queued())
+    {
+        // Start uploads while there are free slots
+        while(transfers.size() < slots)
+        {
+            double t = now();
+            Museek::Upload * upload = scheduler->next();
+            picking += now() - t;
+            ++picks;
+            if(! upload)
+                break;
+            scheduler->started(upload);
+            upload->setState(TS_Transferring);
+
+            double wait = clock - queuedAt[upload];
+            queuedAt.erase(upload);
+            const std::string & user = upload->user();
+            if(museekd->isPrivileged(user))
+                privileged.waits.push_back(wait);
+            else if(museekd->isBuddied(user))
+                buddies.waits.push_back(wait);
+            else if(files[user] > 100)
+                heavy.waits.push_back(wait);
+            else
+                light.waits.push_back(wait);
+
+            Transfer transfer = { clock + upload->size() / rate, upload };
+            transfers.insert(transfer);
+        }
+
+        // Whatever comes first: a transfer is done or an upload is queued
+        double finish = transfers.empty() ? -1 : transfers.begin()->finish;
+        if(next < trace.size() && (finish < 0 || trace[next].time <= finish))
+        {
+            const Request & r = trace[next++];
+            clock = std::max(clock, r.time);
+            std::ostringstream path;
+            path << dir << "/" << r.size;
+            NewNet::RefPtr<Museek::Upload> upload = new Museek::Upload(museekd, r.user, path.str());
+            upload->setState(TS_QueuedLocally);
+            queuedAt[upload] = clock;
+            uploads.push_back(upload);
+        }
+        else if(finish >= 0)
+        {
+            clock = finish;
+            Transfer transfer = *transfers.begin();
+            transfers.erase(transfers.begin());
+            transfer.upload->setState(TS_Finished);
+        }
+        else
+        {
+            printf("  %u uploads can never start\n", scheduler->queued());
+            break;
+        }
+    }
+
+    printf("%s: %u uploads in %.1f hours, %.2f us to pick an upload\n", policy.c_str(), (unsigned)trace.size(),
+           clock / 3600, picks ? picking / picks * 1e6 : 0);
+    privileged.print("privileged");
+    buddies.print("buddies");
+    heavy.print("others (>100 files)");
+    light.print("others");
+}
+
+int main(int argc, char ** argv)
+{
+    uint slots = 4;
+    double rate = 200 * 1024;
+    const char * tracePath = 0;
+    for(int i = 1; i < argc; ++i)
+    {
+        if(! strcmp(argv[i], "-s") && i + 1 < argc)
+            slots = atoi(argv[++i]);
+        else if(! strcmp(argv[i], "-r") && i + 1 < argc)
+            rate = atof(argv[++i]) * 1024;
+        else
+            tracePath = argv[i];
+    }
+    if(slots == 0 || rate <= 0)
+    {
+        fprintf(stderr, "usage: %s [-s slots] [-r KiB/s per slot] [trace]\n", argv[0]);
+        return 1;
+    }
+
+    std::vector<Request> trace;
+    if(tracePath)
+    {
+        if(! readTrace(tracePath, trace))
+        {
+            perror(tracePath);
+            return 1;
+        }
+    }
+    else
+        trace = syntheticTrace();
+
+    // The uploads read the size of their file: one sparse file per size
+    char dir[] = "/tmp/museekd-uploadqueue-XXXXXX";
+    if(! mkdtemp(dir))
+    {
+        perror("mkdtemp");
+        return 1;
+    }
+    std::set<uint64> sizes;
+    sizes.insert(0);
+    for(std::vector<Request>::const_iterator it = trace.begin(); it != trace.end(); ++it)
+        sizes.insert(it->size);
+    for(std::set<uint64>::const_iterator it = sizes.begin(); it != sizes.end(); ++it)
+    {
+        std::ostringstream path;
+        path << dir << "/" << *it;
+        int fd = open(path.str().c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        if(fd == -1 || ftruncate(fd, *it) == -1)
+            perror(path.str().c_str());
+        if(fd != -1)
+            close(fd);
+    }
+
+    printf("%u slots of %.0f KiB/s\n", slots, rate / 1024);
+    const char * policies[] = { "fifo", "roundrobin", "weighted", "shortest" };
+    for(size_t i = 0; i < sizeof(policies) / sizeof(policies[0]); ++i)
+        replay(policies[i], trace, dir, slots, rate);
+
+    for(std::set<uint64>::const_iterator it = sizes.begin(); it != sizes.end(); ++it)
+    {
+        std::ostringstream path;
+        path << dir << "/" << *it;
+        unlink(path.str().c_str());
+    }
+    rmdir(dir);
+    return 0;
+}